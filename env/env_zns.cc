@@ -8,6 +8,7 @@
 #include <sys/time.h>
 #include <iostream>
 #include <memory>
+#include <sstream>
 // #include "util/crc32c.h"
 #include "env_zns.h"
 #include "rocksdb/options.h"
@@ -657,7 +658,7 @@ void ZNSEnv::ClearMetaData() {
   files.clear();
 }
 
-void ZNSEnv::SetNodesInfo() {
+Status ZNSEnv::SetNodesInfo() {
   std::map<std::string, ZNSFile*>::iterator iter;
   for (iter = files.begin(); iter != files.end(); ++iter) {
     ZNSFile* znsfile = iter->second;
@@ -666,11 +667,16 @@ void ZNSEnv::SetNodesInfo() {
     }
     for (uint32_t i = 0; i < znsfile->map.size(); i++) {
       struct zrocks_map& pInfo = znsfile->map[i];
-      zrocks_node_set(pInfo.g.node_id, znsfile->level, pInfo.g.num);
+      if (zrocks_node_set_map(&pInfo, znsfile->level)) {
+        std::cout << __func__ << " Cannot restore node "
+                  << pInfo.g.node_id << " of " << iter->first << std::endl;
+        return Status::Corruption("Cannot restore node of", iter->first);
+      }
       // std::cout << " nodeId: " << pInfo.g.node_id << " level: " <<
       // znsfile->level <<std::endl;
     }
   }
+  return Status::OK();
 }
 
 void ZNSEnv::PrintMetaData() {
@@ -701,6 +707,7 @@ Status ZNSEnv::LoadMetaData() {
   std::uint64_t metaSlbas[MAX_META_ZONE] = {0};
   zrocks_get_metadata_slbas(metaSlbas, &metaZoneNum);
   int                                    ret = 0;
+  Status                                 s;
   std::map<std::uint32_t, std::uint64_t> seqSlbaMap;
   for (std::uint8_t i = 0; i < metaZoneNum; i++) {
     ret = zrocks_read_metadata(metaSlbas[i], metaBuf, sizeof(MetaZoneHead));
@@ -790,7 +797,10 @@ Status ZNSEnv::LoadMetaData() {
   }
 
 LOAD_END:
-  SetNodesInfo();
+  s = SetNodesInfo();
+  if (!s.ok()) {
+    return s;
+  }
   if (ZNS_DEBUG_META) {
     PrintMetaData();
   }
@@ -805,6 +815,51 @@ LOAD_END:
   return Status::OK();
 }
 
+int ZNSEnv::ParseOptions(const std::string& uri, std::string* zrocks_dev) {
+  size_t sep = uri.find(ZNS_OPT_SEP);
+
+  *zrocks_dev = uri;
+  if (sep == std::string::npos) {
+    return 0;
+  }
+
+  std::string       others;
+  std::string       opt;
+  std::stringstream opts(uri.substr(sep + 1));
+  while (std::getline(opts, opt, ',')) {
+    size_t      eq   = opt.find('=');
+    std::string name = opt.substr(0, eq);
+    uint32_t*   field;
+
+    if (name == "gc_min") {
+      field = &gc_min_percent;
+    } else if (name == "gc_nodes") {
+      field = &gc_nodes_percent;
+    } else {
+      others += (others.empty() ? "" : ",") + opt;
+      continue;
+    }
+
+    char*         end;
+    const char*   val = opt.c_str() + eq + 1;
+    unsigned long num = strtoul(val, &end, 10);
+    if (eq == std::string::npos || end == val || *end != '\0' || num > 100) {
+      std::cout << __func__ << " invalid option: " << opt << std::endl;
+      return -1;
+    }
+    *field = num;
+  }
+
+  *zrocks_dev = uri.substr(0, sep);
+  if (!others.empty()) {
+    *zrocks_dev += ZNS_OPT_SEP + others;
+  }
+
+  std::cout << __func__ << " gc_min: " << gc_min_percent
+            << " gc_nodes: " << gc_nodes_percent << std::endl;
+  return 0;
+}
+
 void ZNSEnv::GCWorker() {
   uint32_t id;
 
@@ -826,13 +881,13 @@ void ZNSEnv::GCWorker() {
     }
 
     uint32_t* invalid_percent = new uint32_t[nr_nodes]();
-    zrocks_gc_get_full_nodes(invalid_percent);
+    zrocks_gc_get_full_nodes(invalid_percent, nr_nodes);
 
     /* Sort by descending invalid percent. */
     std::vector<std::pair<uint32_t, uint32_t>> invalid_nid_map;
     for (id = 0; id < nr_nodes; id++) {
       if (invalid_percent[id] == 100 ||
-          invalid_percent[id] < ZNS_GC_NODE_IVD_MIN_PERCENT)
+          invalid_percent[id] < gc_min_percent)
         continue;
       invalid_nid_map.push_back(std::make_pair(invalid_percent[id], id));
     }
@@ -883,7 +938,7 @@ void ZNSEnv::GCWorker() {
 /* Return OK if migration is successful. */
 void ZNSEnv::MigrateNodeFile(const std::uint32_t nid,
                              const std::string   file_name) {
-  struct zrocks_map               maps[2];
+  struct zrocks_map               maps[ZROCKS_MAX_PIECES];
   uint16_t                        pieces = 0;
   int                             ret;
   uint16_t                        i;
@@ -37,6 +37,10 @@
 #define ZNS_GC_NODE_IVD_MIN_PERCENT 85
 #define ZNS_GC_NODES_PERCENT        28
 
+/* Options follow the device list, e.g. xztl:/dev/ng0n1#gc_nodes=20,lanes=2.
+ * GC options are taken by the env, the others are passed to xztl_init */
+#define ZNS_OPT_SEP '#'
+
 #define ZNS_OBJ_STORE       0
 #define ZNS_PREFETCH        0
 #define ZNS_PREFETCH_BUF_SZ (1024 * 1024 * 1) /* 1MB */
@@ -217,14 +221,22 @@ class ZNSEnv : public Env {
       uuididx               = 0;
       sequence              = 0;
       metaBuf               = NULL;
+      gc_min_percent        = ZNS_GC_NODE_IVD_MIN_PERCENT;
+      gc_nodes_percent      = ZNS_GC_NODES_PERCENT;
 
       std::cout << "Initializing ZNS Environment" << std::endl;
-      if (zrocks_init(dev_name.data())) {
+      std::string zrocks_dev;
+      if (ParseOptions(dev_name, &zrocks_dev)) {
+        std::cout << "ZNS Environment invalid options." << std::endl;
+        exit(1);
+      }
+
+      if (zrocks_init(zrocks_dev.data())) {
         std::cout << "ZRocks failed to initialize." << std::endl;
         exit(1);
       }
 
-      gc_nodes_threshold = (zrocks_gc_get_nodes_num() * ZNS_GC_NODES_PERCENT) / 100;
+      gc_nodes_threshold = (zrocks_gc_get_nodes_num() * gc_nodes_percent) / 100;
 
       if (ZNS_GC_SWITCH) {
         run_gc_worker_ = true;
@@ -272,7 +284,7 @@ class ZNSEnv : public Env {
 
   void PrintMetaData();
 
-  void SetNodesInfo();
+  Status SetNodesInfo();
 
   /* ### Implemented at env_zns.cc ### */
 
@@ -458,8 +470,12 @@ class ZNSEnv : public Env {
                   // posix threads, etc.
   const std::string dev_name;
   uint32_t gc_nodes_threshold;
+  uint32_t gc_min_percent;   /* gc_min:   invalid percent of GC candidates */
+  uint32_t gc_nodes_percent; /* gc_nodes: free nodes percent starting GC */
   bool run_gc_worker_ = false;
 
+  int ParseOptions(const std::string& uri, std::string* zrocks_dev);
+
   void GCWorker();
 
   bool IsFilePosix(const std::string& fname) {
@@ -573,6 +589,8 @@ class ZNSRandomAccessFile : public RandomAccessFile {
   Status Read(std::uint64_t offset, size_t n, Slice* result,
               char* scratch) const override;
 
+  Status MultiRead(ReadRequest* reqs, size_t num_reqs) override;
+
   Status Prefetch(std::uint64_t offset, size_t n) override;
 
   size_t GetUniqueId(char* id, size_t max_size) const override;
@@ -585,6 +603,16 @@ class ZNSRandomAccessFile : public RandomAccessFile {
   virtual Status ReadOffset(std::uint64_t offset, size_t n, Slice* result,
                             char* scratch) const;
 
+  /* Serves reads from the prefetch buffer or the write cache. Returns true
+   * if no media read is needed, 'n' is trimmed to the file size */
+  bool ReadCached(std::uint64_t offset, size_t* n, Slice* result,
+                  char* scratch) const;
+
+  /* Translates a file range into one ZTL read per mapping piece */
+  Status ResolvePieces(const std::vector<struct zrocks_map>& maps,
+                       std::uint64_t offset, size_t n, char* scratch,
+                       std::vector<struct zrocks_read_req>* pieces) const;
+
   /* ### Implemented here ### */
 
   bool use_direct_io() const override {
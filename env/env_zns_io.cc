@@ -169,34 +169,18 @@ Status ZNSRandomAccessFile::ReadObj(uint64_t offset, size_t n, Slice* result,
   return Status::OK();
 }
 
-Status ZNSRandomAccessFile::ReadOffset(uint64_t offset, size_t n, Slice* result,
-                                       char* scratch) const {
-  struct zrocks_map* map;
-  size_t             piece_off = 0, left, msize;
-  int                ret;
-  unsigned           i;
-  uint64_t           off;
-
-  if (znsfile == NULL || offset >= znsfile->size) {
-    return Status::OK();
-  }
-
-  if (ZNS_DEBUG_R)
-    std::cout << __func__ << " name: " << filename_ << " offset: " << offset
-              << " size: " << n << " file_size:  " << znsfile->size
-              << std::endl;
-
-  if (offset + n > znsfile->size) {
-    n = znsfile->size - offset;
-  }
-
-  ZNSReadLock rl(znsfile);
-  std::vector<struct zrocks_map> temlist;
-  temlist.assign(znsfile->map.begin(), znsfile->map.end());
+Status ZNSRandomAccessFile::ResolvePieces(
+    const std::vector<struct zrocks_map>& maps, uint64_t offset, size_t n,
+    char* scratch, std::vector<struct zrocks_read_req>* pieces) const {
+  const struct zrocks_map* map;
+  struct zrocks_read_req   req;
+  size_t                   piece_off = 0, left, msize;
+  unsigned                 i;
+  uint64_t                 off;
 
   off = 0;
-  for (i = 0; i < temlist.size(); i++) {
-    map   = &temlist.at(i);
+  for (i = 0; i < maps.size(); i++) {
+    map   = &maps.at(i);
     msize = map->g.num * ZNS_ALIGMENT * ZTL_IO_SEC_MCMD - map->g.padding;
     if (off + msize > offset) {
       piece_off = msize - (off + msize - offset);
@@ -205,7 +189,7 @@ Status ZNSRandomAccessFile::ReadOffset(uint64_t offset, size_t n, Slice* result,
     off += msize;
   }
 
-  if (i == temlist.size()) {
+  if (i == maps.size()) {
     if (ZNS_DEBUG_R) {
       std::cout << __func__ << " name: " << filename_ << " error: No fit map! "
                 << std::endl;
@@ -217,7 +201,11 @@ Status ZNSRandomAccessFile::ReadOffset(uint64_t offset, size_t n, Slice* result,
   /* Create one read per piece */
   left = n;
   while (left) {
-    map          = &temlist.at(i);
+    if (i == maps.size()) {
+      return Status::IOError();
+    }
+
+    map          = &maps.at(i);
     msize        = map->g.num * ZNS_ALIGMENT * ZTL_IO_SEC_MCMD - map->g.padding;
     msize        = (msize - piece_off > left) ? left : msize - piece_off;
     uint64_t tmp = map->g.start;  // bug-fix
@@ -230,23 +218,65 @@ Status ZNSRandomAccessFile::ReadOffset(uint64_t offset, size_t n, Slice* result,
                 << " left " << left << " readoff: " << off
                 << " readsize: " << msize << std::endl;
 
-    off += piece_off;
-    ret = zrocks_read(map->g.node_id, off, scratch + (n - left), msize, false);
-    if (ret) {
-      return Status::IOError();
-    }
+    req.node_id = map->g.node_id;
+    req.offset  = off + piece_off;
+    req.buf     = scratch + (n - left);
+    req.size    = msize;
+    req.status  = 0;
+    pieces->push_back(req);
 
     left -= msize;
     piece_off = 0;
     i++;
   }
 
+  return Status::OK();
+}
+
+Status ZNSRandomAccessFile::ReadOffset(uint64_t offset, size_t n, Slice* result,
+                                       char* scratch) const {
+  std::vector<struct zrocks_read_req> pieces;
+  Status                              st;
+  int                                 ret;
+
+  if (znsfile == NULL || offset >= znsfile->size) {
+    return Status::OK();
+  }
+
+  if (ZNS_DEBUG_R)
+    std::cout << __func__ << " name: " << filename_ << " offset: " << offset
+              << " size: " << n << " file_size:  " << znsfile->size
+              << std::endl;
+
+  if (offset + n > znsfile->size) {
+    n = znsfile->size - offset;
+  }
+
+  ZNSReadLock rl(znsfile);
+  std::vector<struct zrocks_map> temlist;
+  temlist.assign(znsfile->map.begin(), znsfile->map.end());
+
+  st = ResolvePieces(temlist, offset, n, scratch, &pieces);
+  if (!st.ok()) {
+    return st;
+  }
+
+  if (pieces.size() == 1) {
+    ret = zrocks_read(pieces[0].node_id, pieces[0].offset, pieces[0].buf,
+                      pieces[0].size, false);
+  } else {
+    ret = zrocks_read_batch(pieces.data(), pieces.size(), false);
+  }
+  if (ret) {
+    return Status::IOError();
+  }
+
   *result = Slice(scratch, n);
   return Status::OK();
 }
 
-Status ZNSRandomAccessFile::Read(uint64_t offset, size_t n, Slice* result,
-                                 char* scratch) const {
+bool ZNSRandomAccessFile::ReadCached(uint64_t offset, size_t* n, Slice* result,
+                                     char* scratch) const {
 #if ZNS_PREFETCH
   std::atomic_flag* flag = const_cast<std::atomic_flag*>(&prefetch_lock);
 
@@ -254,33 +284,44 @@ Status ZNSRandomAccessFile::Read(uint64_t offset, size_t n, Slice* result,
   }
 
   if ((prefetch_sz > 0) && (offset >= prefetch_off) &&
-      (offset + n <= prefetch_off + prefetch_sz)) {
-    memcpy(scratch, prefetch + (offset - prefetch_off), n);
+      (offset + *n <= prefetch_off + prefetch_sz)) {
+    memcpy(scratch, prefetch + (offset - prefetch_off), *n);
     flag->clear(std::memory_order_release);
-    *result = Slice(scratch, n);
+    *result = Slice(scratch, *n);
 
-    return Status::OK();
+    return true;
   }
 
   flag->clear(std::memory_order_release);
-#endif
-
-#if ZNS_OBJ_STORE
-  return ReadObj(offset, n, result, scratch);
 #else
+  (void)scratch;
+#endif
 
   if (!znsfile || offset >= znsfile->size) {
-    return Status::OK();
+    *result = Slice();
+    return true;
   }
 
-  if (offset + n > znsfile->size) {
-    n = znsfile->size - offset;
+  if (offset + *n > znsfile->size) {
+    *n = znsfile->size - offset;
   }
 
   size_t cache_len = znsfile->cache_off - znsfile->wcache;
   size_t cache_pos = znsfile->size - cache_len;
   if (offset >= cache_pos) {
-    *result = Slice(znsfile->wcache + offset - cache_pos, n);
+    *result = Slice(znsfile->wcache + offset - cache_pos, *n);
+    return true;
+  }
+
+  return false;
+}
+
+Status ZNSRandomAccessFile::Read(uint64_t offset, size_t n, Slice* result,
+                                 char* scratch) const {
+#if ZNS_OBJ_STORE
+  return ReadObj(offset, n, result, scratch);
+#else
+  if (ReadCached(offset, &n, result, scratch)) {
     return Status::OK();
   }
 
@@ -288,6 +329,82 @@ Status ZNSRandomAccessFile::Read(uint64_t offset, size_t n, Slice* result,
 #endif
 }
 
+Status ZNSRandomAccessFile::MultiRead(ReadRequest* reqs, size_t num_reqs) {
+#if ZNS_OBJ_STORE
+  for (size_t r = 0; r < num_reqs; r++) {
+    reqs[r].status =
+        ReadObj(reqs[r].offset, reqs[r].len, &reqs[r].result, reqs[r].scratch);
+  }
+  return Status::OK();
+#else
+  std::vector<struct zrocks_read_req> pieces;
+  std::vector<size_t>                 first(num_reqs + 1, 0);
+  std::vector<size_t>                 len(num_reqs, 0);
+  std::vector<bool>                   media(num_reqs, false);
+
+  if (ZNS_DEBUG_R)
+    std::cout << __func__ << " name: " << filename_ << " reqs: " << num_reqs
+              << std::endl;
+
+  /* Resolve the pieces of all requests with a single map snapshot */
+  {
+    std::unique_ptr<ZNSReadLock>   rl;
+    std::vector<struct zrocks_map> temlist;
+
+    for (size_t r = 0; r < num_reqs; r++) {
+      first[r] = pieces.size();
+      len[r]   = reqs[r].len;
+
+      if (ReadCached(reqs[r].offset, &len[r], &reqs[r].result,
+                     reqs[r].scratch)) {
+        reqs[r].status = Status::OK();
+        continue;
+      }
+
+      if (!rl) {
+        rl.reset(new ZNSReadLock(znsfile));
+        temlist.assign(znsfile->map.begin(), znsfile->map.end());
+      }
+
+      reqs[r].status = ResolvePieces(temlist, reqs[r].offset, len[r],
+                                     reqs[r].scratch, &pieces);
+      if (!reqs[r].status.ok()) {
+        pieces.resize(first[r]);
+        continue;
+      }
+
+      media[r] = true;
+    }
+    first[num_reqs] = pieces.size();
+
+    /* All pieces are submitted together and completed by a single wait */
+    if (!pieces.empty()) {
+      zrocks_read_batch(pieces.data(), pieces.size(), false);
+    }
+  }
+
+  for (size_t r = 0; r < num_reqs; r++) {
+    if (!media[r]) {
+      continue;
+    }
+
+    reqs[r].status = Status::OK();
+    for (size_t p = first[r]; p < first[r + 1]; p++) {
+      if (pieces[p].status) {
+        reqs[r].status = Status::IOError();
+        break;
+      }
+    }
+
+    if (reqs[r].status.ok()) {
+      reqs[r].result = Slice(reqs[r].scratch, len[r]);
+    }
+  }
+
+  return Status::OK();
+#endif
+}
+
 Status ZNSRandomAccessFile::Prefetch(uint64_t offset, size_t n) {
   if (ZNS_DEBUG) {
     std::cout << __func__ << " offset: " << offset << " n: " << n << std::endl;
@@ -487,7 +604,7 @@ Status ZNSWritableFile::Flush() {
 }
 
 Status ZNSWritableFile::Sync() {
-  struct zrocks_map maps[2];
+  struct zrocks_map maps[ZROCKS_MAX_PIECES];
   uint16_t          pieces = 0;
   size_t            size;
   int               ret, i;
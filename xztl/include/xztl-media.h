@@ -26,7 +26,7 @@
 #include <xztl.h>
 
 /* Append Command support */
-#define XZTL_WRITE_APPEND 0
+#define XZTL_WRITE_APPEND 0 /* Default write mode, see ztl_io_set_append */
 
 /* Number of maximum addresses in a single command vector.
  * 	A single address is needed for zone append. We should
@@ -46,6 +46,12 @@
 #define  MAX_STR_LEN         64
 #define  MAX_BE_TYPE_NUM     50
 
+/* Device name prefix that selects the emulated media (ztl-media-emu.c) */
+#define XZTL_EMU_PREFIX "emu:"
+
+/* Separator of device names, "dev0;dev1" stacks both devices */
+#define XZTL_MEDIA_DEV_SEP ";"
+
 struct znd_media *get_znd_media(void);
 
 enum znd_device_type {
@@ -88,15 +94,17 @@ enum xztl_media_opcodes {
     XZTL_ZONE_MGMT_FINISH = 0x2,
     XZTL_ZONE_MGMT_OPEN   = 0x3,
     XZTL_ZONE_MGMT_RESET  = 0x4,
+    XZTL_ZONE_MGMT_RANGE  = 0xe, /* Report of 'nzones' zones from 'addr' */
     XZTL_ZONE_MGMT_REPORT = 0xf,
     XZTL_ZONE_ERASE_OCSSD = 0x90,
 
     /* Media other commands */
-    XZTL_MISC_ASYNCH_INIT = 0x1,
-    XZTL_MISC_ASYNCH_TERM = 0x2,
-    XZTL_MISC_ASYNCH_POKE = 0x3,
-    XZTL_MISC_ASYNCH_OUTS = 0x4,
-    XZTL_MISC_ASYNCH_WAIT = 0x5
+    XZTL_MISC_ASYNCH_INIT  = 0x1,
+    XZTL_MISC_ASYNCH_TERM  = 0x2,
+    XZTL_MISC_ASYNCH_POKE  = 0x3,
+    XZTL_MISC_ASYNCH_OUTS  = 0x4,
+    XZTL_MISC_ASYNCH_WAIT  = 0x5,
+    XZTL_MISC_ASYNCH_DRAIN = 0x6
 };
 
 enum znd_media_error {
@@ -123,15 +131,20 @@ struct znd_opt_info {
 struct xztl_mthread_ctx {
     pthread_spinlock_t  qpair_spin;
     struct xnvme_queue *queue;
+    void               *opaque; /* Queue of non-xnvme media */
+    uint16_t            dev;    /* Device of the queue */
 };
 
 struct xztl_mgeo {
-    uint32_t ngrps;      /* Groups */
-    uint32_t pu_grp;     /* PUs per group */
-    uint32_t zn_pu;      /* Zones per PU */
-    uint32_t sec_zn;     /* Sectors per zone */
-    uint32_t nbytes;     /* Per sector */
-    uint32_t nbytes_oob; /* Per sector */
+    uint32_t ngrps;       /* Groups */
+    uint32_t pu_grp;      /* PUs per group */
+    uint32_t zn_pu;       /* Zones per PU */
+    uint32_t sec_zn;      /* Sectors per zone */
+    uint32_t nbytes;      /* Per sector */
+    uint32_t nbytes_oob;  /* Per sector */
+    uint32_t nbytes_mdts; /* Max data transfer size */
+    uint32_t max_open;    /* Open zones limit, 0 is no limit */
+    uint32_t max_active;  /* Active zones limit, 0 is no limit */
 
     /* Calculated values */
     uint32_t zn_dev;     /* Total zones in device */
@@ -151,6 +164,7 @@ struct xztl_io_mcmd {
     uint8_t                  submitted;
     uint8_t                  synch;
     uint8_t                  callback_err_cnt;
+    uint8_t                  zcopy; /* Data is read into the user buffer */
     uint32_t                 sequence;
     uint32_t                 sequence_zn;
     uint64_t                 buf_off;
@@ -185,6 +199,11 @@ struct xztl_zn_mcmd {
     struct xztl_maddr addr;
     uint32_t          nzones;
     void             *opaque;
+
+    /* Asynchronous commands only, see xztl_media_submit_zn_async */
+    xztl_callback           *callback;
+    struct xztl_mthread_ctx *async_ctx;
+    struct xnvme_cmd_ctx    *media_ctx;
 };
 
 struct xztl_misc_cmd {
@@ -211,6 +230,7 @@ typedef int(xztl_media_io_fn)(struct xztl_io_mcmd *cmd);
 typedef int(xztl_media_zn_fn)(struct xztl_zn_mcmd *cmd);
 typedef void *(xztl_media_dma_alloc_fn)(size_t size);
 typedef void(xztl_media_dma_free_fn)(void *ptr);
+typedef int(xztl_media_dma_check_fn)(void *buf, size_t size);
 typedef int(xztl_media_cmd_fn)(struct xztl_misc_cmd *cmd);
 
 struct xztl_media {
@@ -219,18 +239,29 @@ struct xztl_media {
     xztl_exit_fn            *exit_fn;
     xztl_media_io_fn        *submit_io;
     xztl_media_zn_fn        *zone_fn;
+    xztl_media_zn_fn        *zone_async_fn; /* Optional, single zone */
     xztl_media_dma_alloc_fn *dma_alloc;
     xztl_media_dma_free_fn  *dma_free;
+    /* Buffer can be a DMA target. Kernel backends accept any sector aligned
+     * buffer, SPDK only memory from dma_alloc */
+    xztl_media_dma_check_fn *dma_check;
     xztl_media_cmd_fn       *cmd_exec;
+    uint32_t                 read_ctx_num; /* Read contexts */
+    uint32_t                 io_depth;     /* Per context queue depth */
+
+    /* Position in the device stack, set by xztl_media_set. Groups and
+     * sectors of a device follow the ones of the previous devices */
+    uint16_t dev;
+    uint16_t grp_base;
+    uint64_t sec_base;
 };
 
 struct znd_media {
     struct xnvme_dev       *dev;
     struct xnvme_dev       *dev_read;
     const struct xnvme_geo *devgeo;
+    int                     be; /* Backend, check OPT_BE_* */
     struct xztl_media       media;
-    uint32_t                read_ctx_num;
-    uint32_t                io_depth;
 };
 
 /* Registration function */
@@ -239,15 +270,27 @@ int znd_opt_parse(const char *dev_name, struct znd_opt_info *opt_info);
 void znd_opt_assign(struct xnvme_opts *opts, struct xnvme_opts *opts_read,
                     struct znd_opt_info *opt_info);
 int  znd_media_register(const char *dev_name);
+int  emu_media_register(const char *dev_name);
 
-/* Set the media abstraction */
+/* Set the media abstraction, every call stacks one more device */
 int xztl_media_set(struct xztl_media *media);
 
+/* Device stack */
+uint16_t           xztl_media_ndevs(void);
+struct xztl_media *xztl_media_get_dev(uint16_t dev);
+uint16_t           xztl_media_grp_dev(uint16_t grp);
+uint16_t           xztl_media_io_dev(struct xztl_io_mcmd *cmd);
+
 /* Media functions */
 void *xztl_media_dma_alloc(size_t bytes);
 void  xztl_media_dma_free(void *ptr);
+int   xztl_media_dma_check(void *buf, size_t size);
 int   xztl_media_submit_zn(struct xztl_zn_mcmd *cmd);
 int   xztl_media_submit_misc(struct xztl_misc_cmd *cmd);
 int   xztl_media_submit_io(struct xztl_io_mcmd *cmd);
 
+/* Single zone command completed by a poke of cmd->async_ctx, which must
+ * belong to the device of the zone. The callback receives the command */
+int xztl_media_submit_zn_async(struct xztl_zn_mcmd *cmd);
+
 #endif /* XZTL_MEDIA_H */
@@ -25,7 +25,7 @@
 #include <sys/queue.h>
 
 #define XZTLMP_THREADS    64
-#define XZTLMP_TYPES      5
+#define XZTLMP_TYPES      6
 #define XZTLMP_MAX_ENT    (65536 + 2)
 #define XZTLMP_MAX_ENT_SZ (1024 * 1024) /* 1 MB */
 
@@ -37,7 +37,8 @@ enum xztl_mp_types {
     XZTL_ZTL_PRO_CTX     = 0x1,
     ZROCKS_MEMORY        = 0x2,
     XZTL_PROMETHEUS_LAT  = 0x3,
-    XZTL_NODE_MGMT_ENTRY = 0x4
+    XZTL_NODE_MGMT_ENTRY = 0x4,
+    ZROCKS_READ_BATCH    = 0x5
 };
 
 enum xztl_mp_status {
@@ -34,6 +34,8 @@ extern "C" {
 #define MAX_READ_NLB_NUM  128
 #define MAX_WRITE_NLB_NUM 64  // 128 got errors ocassionally
 
+#define ZTL_METADATA_ZONES 2 /* File metadata zones of the first group */
+
 struct ztl_metadata {
     struct ztl_pro_zone *metadata_zone;
     int                  zone_num;
@@ -54,11 +56,16 @@ struct obj_meta_data_head {
 };
 
 struct ztl_metadata *get_ztl_metadata();
-uint64_t             zrocks_get_metadata_slba();
-void                 zrocks_get_metadata_slbas(uint64_t *slbas, uint8_t *num);
-void                 zrocks_set_metadata_slba(uint64_t slbas);
 int                  ztl_metadata_init(struct app_group *grp);
 int                  get_metadata_zone_num();
+int                  get_rsvd_zone_num(uint16_t grp_id);
+
+/* File metadata of the bound instance, see the zrocks_*metadata* functions */
+uint64_t ztl_metadata_get_slba(void);
+void     ztl_metadata_get_slbas(uint64_t *slbas, uint8_t *num);
+void     ztl_metadata_switch_zone(uint64_t slbas);
+int      ztl_metadata_read(uint64_t slba, unsigned char *buf, uint32_t length);
+int      ztl_metadata_write(const unsigned char *buf, uint32_t length);
 
 #ifdef __cplusplus
 };  // closing brace for extern "C"
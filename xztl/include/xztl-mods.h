@@ -31,33 +31,57 @@
 /* 32K/4K page for 4K/512b sec sz */
 #define ZTL_MPE_PG_SEC 8
 
-/* Small mapping always follows this granularity */
-#define ZTL_MPE_CPGS 256
-
-/* Set ZTL_WRITE_AFFINITY to 1 to enable thread affinity to a single core */
-#define ZTL_WRITE_AFFINITY 0
-#define ZTL_WRITE_CORE     0
+/* Persistent mapping log, see ztl-mpe.c. Its zones follow the zone metadata
+ * checkpoint, a full zone moves the live pages to the next */
+#define ZTL_MPE_ZONES    2
+#define ZTL_MPE_MAGIC    0x7a6d7065
+#define ZTL_MPE_LOG_RECS 1024 /* DELTA records that trigger a checkpoint */
 
 struct ztl_queue_pool {
     pthread_spinlock_t ucmd_spin;
     STAILQ_HEAD(, xztl_io_ucmd) ucmd_head;
+    volatile uint32_t nqueued; /* Queued and in-process user commands */
+    uint16_t          level;
+    uint16_t          lane;
+    uint32_t          stripe; /* Stripe unit of new nodes */
+    uint32_t          width;  /* Zones of new nodes */
 
-    /* Resource pre-alloc */
+    /* Resource pre-alloc, 'tctx' is the context of the node device */
     struct xztl_mthread_ctx *tctx;
+    struct xztl_mthread_ctx *dev_tctx[XZTL_MEDIA_MAX_DEV];
     struct xztl_io_mcmd     *mcmd[ZTL_IO_RC_NUM];
     void                    *prov;
     struct ztl_pro_node     *node;
     pthread_t                w_thread;
-    uint8_t                  flag_running;
+    volatile uint8_t         flag_running;
+    struct xztl_instance     *inst; /* Bound by the writer thread */
+
+    /* Per-zone FIFOs of pending media commands, see ztl_io_write_sched */
+    uint16_t zn_head[ZTL_IO_ZN_NUM];
+    uint16_t zn_tail[ZTL_IO_ZN_NUM];
+    uint16_t zn_ready[ZTL_IO_ZN_NUM];
+    uint16_t zn_next[ZTL_IO_RC_NUM];
+
+    /* Writer thread parking, see ztl_io_write_th */
+    pthread_mutex_t  wait_mutex;
+    pthread_cond_t   wait_cond;
+    volatile uint8_t sleeping;
+    uint64_t         spin_ns;
 };
 
 struct ztl_read_rs {
-    /* Resource pre-alloc */
-    struct xztl_mthread_ctx *tctx;
+    /* Resource pre-alloc, one context per device */
+    struct xztl_mthread_ctx *tctx[XZTL_MEDIA_MAX_DEV];
     struct xztl_io_mcmd     *mcmd[ZTL_IO_RC_NUM];
     char                    *prp[ZTL_IO_RC_NUM];
 
-    bool usedflag;
+    uint32_t          id;
+    volatile uint32_t next_free; /* Overflow stack link (id + 1) */
+    volatile uint8_t  busy;
+
+    /* Owner instance and generation, see _ztl_io_read_rs_release */
+    struct xztl_instance *inst;
+    uint32_t              gen;
 };
 
 enum xztl_mod_types {
@@ -116,12 +140,14 @@ enum xztl_zmd_node_status {
     XZTL_ZMD_NODE_FREE = 0,
     XZTL_ZMD_NODE_USED,
     XZTL_ZMD_NODE_FULL,
-    XZTL_ZMD_NODE_RESET
+    XZTL_ZMD_NODE_RESET,
+    XZTL_ZMD_NODE_OFF /* Zones belong to other nodes of the slot */
 };
 
 struct app_zmd_entry {
     uint16_t flags;
     uint16_t level; /* Used to define user level metadata to the zone */
+    uint16_t width; /* Zones of the node holding the zone, zero if unused */
     struct xztl_maddr addr;
     uint64_t          wptr;
     uint64_t wptr_inflight; /* In-flight writing LBAs (not completed yet) */
@@ -178,6 +204,7 @@ typedef int(app_zmd_create)(struct app_group *grp);
 typedef int(app_zmd_flush)(struct app_group *grp);
 typedef int(app_zmd_load)(struct app_group *grp);
 typedef void(app_zmd_mark)(struct app_group *lgrp, uint64_t index);
+typedef int(app_zmd_close)(void);
 typedef struct app_zmd_entry *(app_zmd_get)(struct app_group *grp,
                                             uint64_t zone, uint8_t by_offset);
 typedef void(app_zmd_invalidate)(struct app_group *grp, struct xztl_maddr *addr,
@@ -189,6 +216,8 @@ typedef int(app_pro_new)(uint32_t nsec, int32_t node_id,
                          struct app_pro_addr *ctx, uint32_t start);
 typedef void(app_pro_free)(struct app_pro_addr *ctx);
 typedef int(app_pro_get_node)(struct ztl_queue_pool *q);
+typedef struct ztl_pro_node *(app_pro_get_vnode)(uint32_t node_id);
+typedef void(app_pro_put_node)(struct ztl_pro_node *node);
 
 typedef int(app_grp_init)(void);
 typedef void(app_grp_exit)(void);
@@ -200,10 +229,18 @@ typedef int(app_mpe_load)(void);
 typedef int(app_mpe_flush)(void);
 typedef void(app_mpe_mark)(uint32_t index);
 typedef struct map_md_addr *(app_mpe_get)(uint32_t index);
+typedef int(app_mpe_write)(uint32_t index, const void *buf, uint64_t *addr);
+typedef int(app_mpe_read)(uint64_t addr, void *buf);
+typedef int(app_mpe_log)(uint64_t id, uint64_t val);
+typedef int(app_mpe_commit)(void);
+typedef int(app_mpe_switch)(void);
+typedef int(app_mpe_replay)(void);
+typedef void(app_mpe_close)(void);
 
 typedef int(app_map_init)(void);
 typedef void(app_map_exit)(void);
 typedef void(app_map_persist)(void);
+typedef int(app_map_commit)(void);
 typedef int(app_map_upsert)(uint64_t id, uint64_t addr, uint64_t *old,
                             uint64_t old_caller);
 typedef uint64_t(app_map_read)(uint64_t id);
@@ -214,7 +251,9 @@ typedef int(app_io_init)(void);
 typedef void(app_io_exit)(void);
 typedef void(app_io_submit)(struct xztl_io_ucmd *ucmd);
 typedef int(app_io_read)(struct xztl_io_ucmd *ucmd);
-typedef void(app_io_nodeset)(int32_t node_id, int32_t level, int32_t num);
+typedef int(app_io_read_batch)(struct xztl_io_ucmd *ucmds, uint32_t count);
+typedef int(app_io_nodeset)(int32_t node_id, int32_t level, int32_t num,
+                             uint32_t stripe);
 
 typedef int(app_mgmt_init)(void);
 typedef void(app_mgmt_exit)(void);
@@ -222,8 +261,11 @@ typedef int(app_mgmt_reset)(struct app_group *grp, struct ztl_pro_node *node,
                             int32_t op_code);
 typedef int(app_mgmt_finish)(struct app_group *grp, struct ztl_pro_node *node,
                              int32_t op_code);
+typedef int(app_mgmt_close)(struct app_group *grp, struct ztl_pro_node *node,
+                            int32_t op_code);
 
 typedef void(app_mgmt_clear_invalid_node)(struct app_group *grp);
+typedef int(app_mgmt_reclaim)(struct app_group *grp);
 
 struct app_zmd_mod {
     uint8_t             mod_id;
@@ -234,16 +276,19 @@ struct app_zmd_mod {
     app_zmd_get        *get_fn;
     app_zmd_invalidate *invalidate_fn;
     app_zmd_mark       *mark_fn;
+    app_zmd_close      *close_fn;
 };
 
 struct app_pro_mod {
-    uint8_t           mod_id;
-    char             *name;
-    app_pro_init     *init_fn;
-    app_pro_exit     *exit_fn;
-    app_pro_new      *new_fn;
-    app_pro_free     *free_fn;
-    app_pro_get_node *get_node_fn;
+    uint8_t            mod_id;
+    char              *name;
+    app_pro_init      *init_fn;
+    app_pro_exit      *exit_fn;
+    app_pro_new       *new_fn;
+    app_pro_free      *free_fn;
+    app_pro_get_node  *get_node_fn;
+    app_pro_get_vnode *get_vnode_fn;
+    app_pro_put_node  *put_node_fn; /* Writer is done with a piece */
 };
 
 struct app_mpe_mod {
@@ -254,6 +299,13 @@ struct app_mpe_mod {
     app_mpe_flush  *flush_fn;
     app_mpe_mark   *mark_fn;
     app_mpe_get    *get_fn;
+    app_mpe_write  *write_fn;  /* Appends a mapping page */
+    app_mpe_read   *read_fn;   /* Reads a page written by write_fn */
+    app_mpe_log    *log_fn;    /* Logs an upsert of a cached page */
+    app_mpe_commit *commit_fn; /* Writes the upserts logged so far */
+    app_mpe_switch *switch_fn; /* Moves the live pages to the next zone */
+    app_mpe_replay *replay_fn; /* Applies the upserts logged after the pages */
+    app_mpe_close  *close_fn;
 };
 
 struct app_map_mod {
@@ -262,19 +314,21 @@ struct app_map_mod {
     app_map_init      *init_fn;
     app_map_exit      *exit_fn;
     app_map_persist   *persist_fn;
+    app_map_commit    *commit_fn; /* Makes the upserts done so far durable */
     app_map_upsert    *upsert_fn;
     app_map_read      *read_fn;
     app_map_upsert_md *upsert_md_fn;
 };
 
 struct app_io_mod {
-    uint8_t         mod_id;
-    char           *name;
-    app_io_init    *init_fn;
-    app_io_exit    *exit_fn;
-    app_io_submit  *submit_fn;
-    app_io_read    *read_fn;
-    app_io_nodeset *nodeset_fn;
+    uint8_t            mod_id;
+    char              *name;
+    app_io_init       *init_fn;
+    app_io_exit       *exit_fn;
+    app_io_submit     *submit_fn;
+    app_io_read       *read_fn;
+    app_io_read_batch *read_batch_fn;
+    app_io_nodeset    *nodeset_fn;
 };
 
 struct app_mgmt_mod {
@@ -283,10 +337,11 @@ struct app_mgmt_mod {
     app_mgmt_init *init_fn;
     app_mgmt_exit *exit_fn;
     // app_mgmt_open*    open_fn;
-    // app_mgmt_close*   close_fn;
     app_mgmt_reset              *reset_fn;
     app_mgmt_finish             *finish_fn;
     app_mgmt_clear_invalid_node *clear_fn;
+    app_mgmt_reclaim            *reclaim_fn; /* Resets a dirty node now */
+    app_mgmt_close              *close_fn;   /* Closes or finishes now */
 };
 
 struct app_groups {
@@ -299,6 +354,9 @@ struct app_groups {
 struct app_global {
     struct app_groups groups;
     struct app_mpe    smap;
+    uint16_t          ngrps;
+
+    uint8_t              modset[APP_MOD_COUNT]; /* Registered module IDs */
 
     void                *mod_list[APP_MOD_COUNT][APP_FN_SLOTS];
     struct app_zmd_mod  *zmd;
@@ -325,6 +383,22 @@ void ztl_mpe_register(void);
 void ztl_map_register(void);
 void ztl_io_register(void);
 void ztl_pro_register(void);
+
+/* Number of writer lanes of a level, must be set before ztl_init */
+int ztl_io_set_lanes(int32_t level, uint32_t lanes);
+
+/* Stripe unit of a level in ZTL_IO_SEC_MCMD units, set before ztl_init */
+int ztl_io_set_stripe(int32_t level, uint32_t stripe);
+
+/* Zones per node of a level, a power of two from ZTL_PRO_NODE_WIDTH_MIN to
+ * ZTL_PRO_ZONE_NUM_INNODE. Set before ztl_init */
+int ztl_io_set_width(int32_t level, uint32_t width);
+
+/* Selects zone append (1) or regular writes (0) for new user writes */
+void ztl_io_set_append(uint8_t append);
 void ztl_mgmt_register(void);
 
+/* Mapping pages whose live copy fits the mapping log zones */
+uint32_t ztl_mpe_max_pages(void);
+
 #endif /* XZTL_MODS_H */
@@ -32,15 +32,29 @@
 /* Minimum number of bytes provisioned in a single piece in a zone */
 #define APP_PRO_MIN_PIECE_SZ 1
 
-#define ZTL_PRO_SEC_NUM_INZONE (ZONE_SIZE / 1024 / 4)
-#define ZTL_PRO_OPT_SEC_NUM_INNODE \
-    (ZTL_PRO_ZONE_NUM_INNODE * ZTL_PRO_SEC_NUM_INZONE / ZTL_IO_SEC_MCMD)
+/* A slot of ZTL_PRO_ZONE_NUM_INNODE zones is a single node or is split in
+ * narrower nodes of the same width. Slot nodes use ids [0, nslots), narrow
+ * nodes use nslots + slot * ZTL_PRO_NODE_SUBS + first 'min width' block */
+#define ZTL_PRO_NODE_SUBS (ZTL_PRO_ZONE_NUM_INNODE / ZTL_PRO_NODE_WIDTH_MIN)
+#define ZTL_PRO_NODE_ORDERS 4 /* Node widths from the minimum to the slot */
+#define ZTL_PRO_INIT_SLOTS  64 /* Slots loaded at once by a startup thread */
 
 enum ztl_pro_type_list { ZTL_PRO_TUSER = 0x0 };
 
 enum ztl_pro_mgmt_opcode {
     ZTL_MGMG_FULL_ZONE  = 0x0,
-    ZTL_MGMG_RESET_ZONE = 0x1
+    ZTL_MGMG_RESET_ZONE = 0x1,
+    ZTL_MGMG_CLOSE_ZONE = 0x2
+};
+
+/* Writer state of a node in the used list. An idle node may be closed or
+ * retired (finished) by another writer to free open and active zones */
+enum ztl_pro_node_wstate {
+    ZTL_PRO_NODE_IDLE = 0,
+    ZTL_PRO_NODE_WRITING,
+    ZTL_PRO_NODE_CLOSING,
+    ZTL_PRO_NODE_RETIRING,
+    ZTL_PRO_NODE_RETIRED
 };
 
 struct app_pro_addr {
@@ -65,12 +79,15 @@ struct ztl_pro_zone {
 };
 
 struct ztl_pro_node {
-    uint32_t             id;
+    uint32_t             id; /* Device wide, see ztl_pro_node_grp 'id_base' */
+    struct app_group    *grp;
     struct ztl_pro_zone *vzones[ZTL_PRO_ZONE_NUM_INNODE];
 
     TAILQ_ENTRY(ztl_pro_node) fentry;
+    TAILQ_ENTRY(ztl_pro_node) dentry; /* Dirty list, node is also full */
     uint64_t optimal_write_sec_left;
     uint64_t optimal_write_sec_used;
+    uint64_t capacity; /* Optimal sectors, see _ztl_pro_node_capacity */
     uint32_t nr_finish_err;
     uint32_t nr_reset_err;
 
@@ -78,6 +95,16 @@ struct ztl_pro_node {
 
     uint32_t status;
     int32_t  level;
+    uint32_t stripe; /* Stripe unit in ZTL_IO_SEC_MCMD units */
+    uint32_t nzones; /* Node width */
+    uint32_t slot;
+
+    /* Open and active zone budget, see ztl-pro.c */
+    volatile uint32_t      wstate;
+    struct ztl_queue_pool *owner;   /* Writer, NULL if restored in use */
+    uint64_t               wtime;   /* Last piece written, in us */
+    volatile uint8_t       zopen;   /* Zones counted as open */
+    volatile uint8_t       zactive; /* Zones counted as active */
 };
 
 struct ztl_pro_node_grp {
@@ -86,8 +113,15 @@ struct ztl_pro_node_grp {
     uint32_t             nfree;  /* # of free nodes */
     uint32_t             nzones; /* zone num */
     uint32_t             nnodes; /* node num */
+    uint32_t             nslots; /* slot num */
+    uint32_t             id_base; /* Node id of vnodes[0], see ztl_pro_init */
+    uint32_t             rsvd;    /* Zones before the first node */
 
+    /* Free slot nodes and free narrow nodes per width order */
     TAILQ_HEAD(free_list, ztl_pro_node) free_head;
+    TAILQ_HEAD(sfree_list, ztl_pro_node) sfree_head[ZTL_PRO_NODE_ORDERS];
+    uint8_t           *slot_width; /* Width of split slots, 0 if not split */
+    uint8_t           *slot_free;  /* Free narrow nodes of split slots */
     pthread_spinlock_t spin_free;
 
     TAILQ_HEAD(used_list, ztl_pro_node) used_head;
@@ -95,6 +129,12 @@ struct ztl_pro_node_grp {
 
     TAILQ_HEAD(full_list, ztl_pro_node) full_head;
     pthread_spinlock_t spin_full;
+
+    /* Full nodes without valid data waiting for a lazy reset, under
+     * spin_full. See ztl-mgmt-cmd.c */
+    TAILQ_HEAD(dirty_list, ztl_pro_node) dirty_head;
+    uint32_t ndirty;
+    uint32_t nreset; /* Dirty nodes queued for reset */
 };
 
 typedef int(app_pro_init)(void);
@@ -103,6 +143,8 @@ typedef int(app_pro_new)(uint32_t nsec, int32_t node_id,
                          struct app_pro_addr *ctx, uint32_t start);
 typedef void(app_pro_free)(struct app_pro_addr *ctx);
 typedef int(app_pro_get_node)(struct ztl_queue_pool *q);
+typedef struct ztl_pro_node *(app_pro_get_vnode)(uint32_t node_id);
+typedef void(app_pro_put_node)(struct ztl_pro_node *node);
 
 typedef int(app_grp_init)(void);
 typedef void(app_grp_exit)(void);
@@ -110,18 +152,27 @@ typedef struct app_group *(app_grp_get)(uint16_t gid);
 typedef int(app_grp_get_list)(struct app_group **lgrp, uint16_t ngrps);
 
 int  ztl_pro_grp_reset_all_zones(struct app_group *grp);
-int  ztl_pro_grp_node_init(struct app_group *grp);
+int  ztl_pro_grp_node_init(struct app_group *grp, uint32_t id_base);
 void ztl_pro_grp_exit(struct app_group *grp);
 int  ztl_pro_grp_get(struct app_group *grp, struct app_pro_addr *ctx,
                      uint32_t num, int32_t node_id, uint32_t start);
 
 int  ztl_pro_grp_get_node(struct ztl_queue_pool   *q,
-                          struct ztl_pro_node_grp *pro);
+                          struct ztl_pro_node_grp *pro, uint32_t width);
+void ztl_pro_grp_put_node(struct ztl_pro_node_grp *pro,
+                          struct ztl_pro_node     *node);
+void ztl_pro_grp_put_dirty(struct ztl_pro_node_grp *pro,
+                           struct ztl_pro_node     *node);
+struct ztl_pro_node *ztl_pro_grp_take_dirty(struct ztl_pro_node_grp *pro);
+int  ztl_pro_grp_node_restore(struct ztl_pro_node_grp *pro, uint32_t node_id);
 void ztl_pro_grp_free(struct app_group *grp, uint32_t zone_i, uint32_t nsec);
+void ztl_pro_grp_node_level(struct ztl_pro_node *node, int32_t level);
 int  ztl_pro_grp_node_reset(struct app_group *grp, struct ztl_pro_node *node);
 int  ztl_pro_grp_is_node_full(struct app_group *grp, uint32_t nodeid);
 int  ztl_pro_node_reset_zn(struct ztl_pro_zone *zone);
 int  ztl_pro_grp_node_finish(struct app_group *grp, struct ztl_pro_node *node);
+void ztl_pro_node_active(struct ztl_pro_node *node);
+void ztl_pro_node_inactive(struct ztl_pro_node *node);
 int  ztl_pro_grp_submit_mgmt(struct app_group *grp, struct ztl_pro_node *node,
                              int32_t op_code);
 /* Built-in group functions */
@@ -50,7 +50,10 @@ enum xztl_stats_io_types {
     XZTL_STATS_READ_CALLBACK_FAIL,
     XZTL_STATS_MGMT_FAIL,
     XZTL_STATS_META_WRITE_FAIL,
-    XZTL_STATS_META_READ_FAIL
+    XZTL_STATS_META_READ_FAIL,
+
+    XZTL_STATS_READ_ZCOPY_BYTES,
+    XZTL_STATS_APPEND_REORDER
 };
 
 enum xztl_stats_node_types {
@@ -60,13 +63,14 @@ enum xztl_stats_node_types {
 };
 
 /* Statistics */
-int  xztl_stats_init(void);
-void xztl_stats_exit(void);
-void xztl_stats_add_io(struct xztl_io_mcmd *cmd);
-void xztl_stats_inc(uint32_t type, uint64_t val);
-void xztl_stats_node_inc(int32_t level, uint32_t type, uint64_t val);
-void xztl_stats_print_io(void);
-void xztl_stats_print_io_simple(void);
+int      xztl_stats_init(void);
+void     xztl_stats_exit(void);
+void     xztl_stats_add_io(struct xztl_io_mcmd *cmd);
+void     xztl_stats_inc(uint32_t type, uint64_t val);
+uint64_t xztl_stats_get(uint32_t type);
+void     xztl_stats_node_inc(int32_t level, uint32_t type, uint64_t val);
+void     xztl_stats_print_io(void);
+void     xztl_stats_print_io_simple(void);
 
 /* Prometheus */
 int  xztl_prometheus_init(void);
@@ -99,33 +99,86 @@
 #define ZNS_MAX_M_BUF 32
 #define ZNS_MAX_BUF   (ZNS_MAX_M_BUF * ZNA_1M_BUF)
 
-/* Media minimum/maximum read/write size in sectors */
-#define ZONE_SIZE (96 * 1024 * 1024)
-
 #define ZTL_IO_SEC_MCMD 8
 
+/* Maximum stripe unit in ZTL_IO_SEC_MCMD units, see zrocks_map.g.stripe */
+#define ZTL_IO_STRIPE_MAX 8
+
 #define ZTL_PRO_ZONE_NUM_INNODE 64 /* Number of zones per node */
+#define ZTL_PRO_NODE_WIDTH_MIN  8  /* Narrowest node, see ztl_io_set_width */
+
+/* Open/active zone budget: a node not written for ZTL_PRO_IDLE_US may be
+ * closed or finished by another writer, which waits ZTL_PRO_WAIT_MS for
+ * budget before failing */
+#define ZTL_PRO_IDLE_US 100000
+#define ZTL_PRO_WAIT_MS 10000
 
 #define ZROCKS_LEVEL_NUM 5
 
+/* Writer lanes per level, each lane owns a thread, a queue and a node */
+#define ZTL_IO_LANE_NUM 1
+#define ZTL_IO_LANE_MAX 8
+
 #define ZTL_IO_RC_NUM (ZNS_MAX_BUF / (ZTL_IO_SEC_MCMD * ZNS_ALIGMENT))
 
+/* Zones addressed by a single write and in-flight appends per zone */
+#define ZTL_IO_ZN_NUM       (ZTL_PRO_ZONE_NUM_INNODE * 2)
+#define ZTL_IO_APPEND_DEPTH 4
+
 #define XZTL_IO_MAX_MCMD 65536 /* 4KB sectors : 16 GB user buffers */
                                /* 512b sectors: 2 GB user buffers */
 #define XZTL_WIO_MAX_MCMD 1024
 
+/* Mapping pieces of a write, see ZROCKS_MAX_PIECES */
+#define XZTL_WIO_MAX_PIECES 8
+
+/* Defaults of struct xztl_config, see xztl_config_default */
 #define XZTL_CTX_NVME_DEPTH 1024
 
 #define XZTL_CTX_NVME_LIBAIO_DEPTH 512
+#define XZTL_CTX_NVME_DEPTH_MAX    4096
 
 #define XZTL_READ_RS_NUM    256
 
+#define ZROCKS_BUF_ENTS 1024 /* Read buffers of libzrocks */
+
+#define XZTL_WRITE_CORE_NONE -1 /* Writer threads run on any core */
+
+#define ZTL_MGMT_WORKERS     2 /* Threads of node finish/reset commands */
+#define ZTL_MGMT_WORKERS_MAX 8
+
+#define ZTL_MGMT_RESET_TARGET 4 /* Pre-reset free nodes, 0 resets on trim */
+
+#define XZTL_INIT_THREADS     0 /* Startup threads, 0 is one per online core */
+#define XZTL_INIT_THREADS_MAX 64
+
+#define ZTL_ZMD_REPORT_ZONES 256 /* Zones of a report chunk at startup */
+
+#define ZTL_MAP_CACHE_PGS 1024 /* 32 MB of mapping pages with 32KB page */
+
+/* Zone metadata checkpoint, see ztl-zmd.c. Its zones follow the metadata
+ * zones of the first group, a full zone moves the checkpoint to the next */
+#define ZTL_ZMD_CKPT_ZONES 2
+#define ZTL_ZMD_CKPT_MAGIC 0x7a6d6463
+
+/* Layout of the reserved zones and the nodes. Records of the checkpoint and
+ * the mapping log carry it, a device of another layout is not mounted.
+ * Version 2 keeps the node width of each zone in the checkpoint, version 3
+ * keeps ZROCKS_MAX_PIECES mapping entries per object */
+#define ZTL_FORMAT_VERSION 3
+
+/* Runtime options follow the device list, e.g. "emu:nzone=64#qdepth=256" */
+#define XZTL_CONFIG_SEP "#"
+
+#define XZTL_MEDIA_MAX_DEV 4 /* Stacked devices, see xztl_init */
+
 typedef int(xztl_init_fn)(void);
 typedef int(xztl_exit_fn)(void);
 typedef int(xztl_register_fn)(void);
 typedef int(xztl_register_media_fn)(const char *dev_name);
 typedef void *(xztl_thread)(void *arg);
 typedef void(xztl_callback)(void *arg);
+typedef int(xztl_par_fn)(void *arg, uint64_t first, uint64_t last);
 
 struct xztl_maddr {
     union {
@@ -159,9 +212,10 @@ struct xztl_io_ucmd {
 
     struct app_pro_addr *prov;
     struct xztl_io_mcmd *mcmd[XZTL_WIO_MAX_MCMD];
-    uint64_t             node_id[2];
-    uint64_t             start[2];
-    uint64_t             num[2];
+    uint64_t             node_id[XZTL_WIO_MAX_PIECES];
+    uint64_t             start[XZTL_WIO_MAX_PIECES];
+    uint64_t             num[XZTL_WIO_MAX_PIECES];
+    uint32_t             stripe[XZTL_WIO_MAX_PIECES];
     uint16_t             pieces;
     uint32_t             unit_index;
     uint32_t             ret;
@@ -178,7 +232,28 @@ struct xztl_io_ucmd {
 };
 
 struct xztl_core {
-    struct xztl_media *media;
+    struct xztl_media *media; /* Geometry of all devices, see xztl_media_set */
+    struct xztl_media *devs[XZTL_MEDIA_MAX_DEV];
+    uint16_t           ndevs;
+};
+
+/* Runtime tuning of an instance. Options are given as a comma separated
+ * 'name=value' list, see xztl_config_parse */
+struct xztl_config {
+    uint32_t qdepth;       /* qdepth:     queue depth of media contexts */
+    uint32_t qdepth_aio;   /* qdepth_aio: queue depth with the libaio backend */
+    uint32_t read_ctx;     /* read_ctx:   read contexts, 0 lets media decide */
+    uint32_t levels;       /* levels:     write levels, others use the last */
+    uint32_t lanes;        /* lanes:      writer lanes per level */
+    uint32_t stripe;       /* stripe:     stripe in ZTL_IO_SEC_MCMD units */
+    uint32_t width;        /* width:      zones of new nodes */
+    uint32_t buf_ents;     /* buf_ents:   entries of the libzrocks read pool */
+    int32_t  write_core;   /* write_core: core of writer threads, -1 is none */
+    uint32_t mgmt_workers; /* mgmt_workers: nodes finished or reset at once */
+    uint32_t reset_target; /* reset_target: free nodes kept by lazy reset */
+    uint32_t init_threads; /* init_threads: threads of the zone state load */
+    uint32_t map_pages;    /* map_pages:  mapping pages cached in memory */
+    uint32_t map_table;    /* map_table:  mapping pages, 0 fills the log zones */
 };
 
 struct app_magic {
@@ -258,13 +333,49 @@ enum xztl_status {
     XZTL_ZTL_MD_RESET_ERR   = 0x1e,
     XZTL_ZTL_STATS_ERR      = 0x1f,
     XZTL_ZTL_PROMETHEUS_ERR = 0x20,
+    XZTL_CONFIG_ERR         = 0x21,
     XZTL_MEDIA_ERROR        = 0x100,
     XZTL_ZROCKS_INIT_ERR    = 0x101,
     XZTL_ZROCKS_WRITE_ERR   = 0x102,
     XZTL_ZROCKS_READ_ERR    = 0X103,
-    XZTL_ZTL_MGMT_ERR       = 0X104
+    XZTL_ZTL_MGMT_ERR       = 0X104,
+    XZTL_ZTL_ZMD_CKPT       = 0X105,
+    XZTL_ZTL_FORMAT_ERR     = 0X106
 };
 
+/* Module state kept per instance, see xztl_instance_state */
+enum xztl_state_id {
+    XZTL_STATE_ZTL = 0,
+    XZTL_STATE_MEMPOOL,
+    XZTL_STATE_STATS,
+    XZTL_STATE_ZND,
+    XZTL_STATE_EMU,
+    XZTL_STATE_GROUPS,
+    XZTL_STATE_PRO,
+    XZTL_STATE_MAP,
+    XZTL_STATE_IO,
+    XZTL_STATE_MGMT,
+    XZTL_STATE_METADATA,
+    XZTL_STATE_ZMD,
+    XZTL_STATE_MPE,
+    XZTL_STATE_COUNT
+};
+
+struct xztl_instance;
+
+/* Instances are independent xZTL stacks: devices, pools, queues and threads.
+ * Calls act on the instance bound to the calling thread, threads that never
+ * bound one use the default instance */
+struct xztl_instance *xztl_instance_new(void);
+void                  xztl_instance_free(struct xztl_instance *inst);
+
+/* Binds an instance to the calling thread, returns the previous one */
+struct xztl_instance *xztl_instance_bind(struct xztl_instance *inst);
+struct xztl_instance *xztl_instance_get(void);
+
+/* Returns the zeroed state of a module in the bound instance */
+void *xztl_instance_state(uint16_t id, size_t size);
+
 /* Return xzlt core */
 void get_xztl_core(struct xztl_core **tcore);
 
@@ -276,14 +387,46 @@ void get_xztl_core(struct xztl_core **tcore);
 /* Add media layer */
 void xztl_add_media(xztl_register_media_fn *fn);
 
-/* Initialize XApp instance */
+/* Configuration of the bound instance. Per level settings made through
+ * ztl_io_set_* take precedence over lanes, stripe and width */
+void                      xztl_config_default(struct xztl_config *cfg);
+int                       xztl_config_parse(struct xztl_config *cfg,
+                                            const char *opts);
+int                       xztl_config_check(const struct xztl_config *cfg);
+const struct xztl_config *xztl_config_get(void);
+
+/* Must be called before xztl_init */
+int xztl_config_set(const struct xztl_config *cfg);
+
+/* Initialize XApp instance. Options after XZTL_CONFIG_SEP are applied on top
+ * of the instance configuration */
 int xztl_init(const char *device_name);
 
 /* Safe shut down */
 int xztl_exit(void);
 
+/* Startup work split over the init_threads of the bound instance. Threads
+ * claim ranges of 'chunk' items of [0, n) and call fn for each range until
+ * the items are done or fn fails */
+struct xztl_par {
+    pthread_t             tid[XZTL_INIT_THREADS_MAX];
+    uint32_t              nthreads;
+    uint64_t              n;
+    uint64_t              chunk;
+    volatile uint64_t     next;
+    volatile int          ret;
+    xztl_par_fn          *fn;
+    void                 *arg;
+    struct xztl_instance *inst;
+};
+
+int xztl_par_start(struct xztl_par *par, uint64_t n, uint64_t chunk,
+                   xztl_par_fn *fn, void *arg);
+int xztl_par_join(struct xztl_par *par);
+
 /* Thread context functions */
 struct xztl_mthread_ctx *xztl_ctx_media_init(uint32_t depth);
+struct xztl_mthread_ctx *xztl_ctx_media_init_dev(uint16_t dev, uint32_t depth);
 int                      xztl_ctx_media_exit(struct xztl_mthread_ctx *tctx);
 
 /* Layer specific functions (for testing) */
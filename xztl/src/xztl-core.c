@@ -17,19 +17,334 @@
  * limitations under the License.
 */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <libxnvme_znd.h>
 #include <xztl.h>
 #include <xztl-mods.h>
 #include <xztl-media.h>
 #include <xztl-stats.h>
 
-static struct xztl_core core;
+struct xztl_instance {
+    struct xztl_core        core;
+    xztl_register_media_fn *media_fn;
+    struct xztl_config      cfg;
+    uint8_t                 cfg_set; /* Defaults are applied on first use */
+    void                   *state[XZTL_STATE_COUNT];
+};
+
+/* Threads that never bound an instance use the default one, which backs the
+ * single device API */
+static struct xztl_instance           xztl_default;
+static __thread struct xztl_instance *xztl_cur;
+
+struct xztl_instance *xztl_instance_new(void) {
+    struct xztl_instance *inst;
+
+    inst = calloc(1, sizeof(struct xztl_instance));
+    if (!inst)
+        log_err("xztl_instance_new: Memory allocation failed.");
+
+    return inst;
+}
+
+/* The instance must be closed, see xztl_exit */
+void xztl_instance_free(struct xztl_instance *inst) {
+    int id;
+
+    if (!inst || inst == &xztl_default)
+        return;
+
+    for (id = 0; id < XZTL_STATE_COUNT; id++)
+        free(inst->state[id]);
+    free(inst);
+}
+
+struct xztl_instance *xztl_instance_bind(struct xztl_instance *inst) {
+    struct xztl_instance *prev = xztl_instance_get();
+
+    xztl_cur = (inst == &xztl_default) ? NULL : inst;
+
+    return prev;
+}
+
+struct xztl_instance *xztl_instance_get(void) {
+    return (xztl_cur) ? xztl_cur : &xztl_default;
+}
+
+void *xztl_instance_state(uint16_t id, size_t size) {
+    struct xztl_instance *inst = xztl_instance_get();
+    void                 *st;
+
+    st = inst->state[id];
+    if (st)
+        return st;
+
+    /* Module state is zeroed as file-scope variables used to be */
+    st = calloc(1, size);
+    if (!st) {
+        log_erra("xztl_instance_state: Memory allocation failed. id [%u]\n",
+                 id);
+        return NULL;
+    }
+
+    if (!__sync_bool_compare_and_swap(&inst->state[id], NULL, st)) {
+        free(st);
+        st = inst->state[id];
+    }
+
+    return st;
+}
+
+static inline struct xztl_core *xztl_core_get(void) {
+    return &xztl_instance_get()->core;
+}
 
 void get_xztl_core(struct xztl_core **tcore) {
-    *tcore = &core;
+    *tcore = xztl_core_get();
+}
+
+struct xztl_config_opt {
+    const char *name;
+    size_t      off;
+};
+
+static const struct xztl_config_opt xztl_config_opts[] = {
+    {"qdepth", offsetof(struct xztl_config, qdepth)},
+    {"qdepth_aio", offsetof(struct xztl_config, qdepth_aio)},
+    {"read_ctx", offsetof(struct xztl_config, read_ctx)},
+    {"levels", offsetof(struct xztl_config, levels)},
+    {"lanes", offsetof(struct xztl_config, lanes)},
+    {"stripe", offsetof(struct xztl_config, stripe)},
+    {"width", offsetof(struct xztl_config, width)},
+    {"buf_ents", offsetof(struct xztl_config, buf_ents)},
+    {"write_core", offsetof(struct xztl_config, write_core)},
+    {"mgmt_workers", offsetof(struct xztl_config, mgmt_workers)},
+    {"reset_target", offsetof(struct xztl_config, reset_target)},
+    {"init_threads", offsetof(struct xztl_config, init_threads)},
+    {"map_pages", offsetof(struct xztl_config, map_pages)},
+    {"map_table", offsetof(struct xztl_config, map_table)}};
+
+#define XZTL_CONFIG_NOPTS \
+    (sizeof(xztl_config_opts) / sizeof(struct xztl_config_opt))
+
+void xztl_config_default(struct xztl_config *cfg) {
+    cfg->qdepth     = XZTL_CTX_NVME_DEPTH;
+    cfg->qdepth_aio = XZTL_CTX_NVME_LIBAIO_DEPTH;
+    cfg->read_ctx   = 0;
+    cfg->levels     = ZROCKS_LEVEL_NUM;
+    cfg->lanes      = ZTL_IO_LANE_NUM;
+    cfg->stripe     = 1;
+    cfg->width      = ZTL_PRO_ZONE_NUM_INNODE;
+    cfg->buf_ents   = ZROCKS_BUF_ENTS;
+    cfg->write_core = XZTL_WRITE_CORE_NONE;
+
+    cfg->mgmt_workers = ZTL_MGMT_WORKERS;
+    cfg->reset_target = ZTL_MGMT_RESET_TARGET;
+    cfg->init_threads = XZTL_INIT_THREADS;
+    cfg->map_pages    = ZTL_MAP_CACHE_PGS;
+    cfg->map_table    = 0;
+}
+
+static inline int xztl_config_pow2(uint32_t val, uint32_t min, uint32_t max) {
+    return val >= min && val <= max && !(val & (val - 1));
+}
+
+int xztl_config_check(const struct xztl_config *cfg) {
+    long ncores = sysconf(_SC_NPROCESSORS_CONF);
+
+    if (!xztl_config_pow2(cfg->qdepth, 1, XZTL_CTX_NVME_DEPTH_MAX) ||
+        !xztl_config_pow2(cfg->qdepth_aio, 1, XZTL_CTX_NVME_DEPTH_MAX)) {
+        log_erra("xztl_config: invalid qdepth [%u] qdepth_aio [%u]",
+                 cfg->qdepth, cfg->qdepth_aio);
+        return XZTL_CONFIG_ERR;
+    }
+
+    if (cfg->read_ctx > XZTL_READ_RS_NUM) {
+        log_erra("xztl_config: invalid read_ctx [%u]", cfg->read_ctx);
+        return XZTL_CONFIG_ERR;
+    }
+
+    if (!cfg->levels || cfg->levels > ZROCKS_LEVEL_NUM || !cfg->lanes ||
+        cfg->lanes > ZTL_IO_LANE_MAX) {
+        log_erra("xztl_config: invalid levels [%u] lanes [%u]", cfg->levels,
+                 cfg->lanes);
+        return XZTL_CONFIG_ERR;
+    }
+
+    if (!xztl_config_pow2(cfg->stripe, 1, ZTL_IO_STRIPE_MAX) ||
+        !xztl_config_pow2(cfg->width, ZTL_PRO_NODE_WIDTH_MIN,
+                          ZTL_PRO_ZONE_NUM_INNODE)) {
+        log_erra("xztl_config: invalid stripe [%u] width [%u]", cfg->stripe,
+                 cfg->width);
+        return XZTL_CONFIG_ERR;
+    }
+
+    if (!cfg->buf_ents || cfg->buf_ents > XZTLMP_MAX_ENT) {
+        log_erra("xztl_config: invalid buf_ents [%u]", cfg->buf_ents);
+        return XZTL_CONFIG_ERR;
+    }
+
+    if (cfg->write_core < XZTL_WRITE_CORE_NONE || cfg->write_core >= ncores) {
+        log_erra("xztl_config: invalid write_core [%d]", cfg->write_core);
+        return XZTL_CONFIG_ERR;
+    }
+
+    if (!cfg->mgmt_workers || cfg->mgmt_workers > ZTL_MGMT_WORKERS_MAX) {
+        log_erra("xztl_config: invalid mgmt_workers [%u]", cfg->mgmt_workers);
+        return XZTL_CONFIG_ERR;
+    }
+
+    if (cfg->init_threads > XZTL_INIT_THREADS_MAX) {
+        log_erra("xztl_config: invalid init_threads [%u]", cfg->init_threads);
+        return XZTL_CONFIG_ERR;
+    }
+
+    /* A table sized from the log zones is checked by the mapping startup */
+    if (!cfg->map_pages ||
+        (cfg->map_table && cfg->map_pages > cfg->map_table)) {
+        log_erra("xztl_config: invalid map_pages [%u] map_table [%u]",
+                 cfg->map_pages, cfg->map_table);
+        return XZTL_CONFIG_ERR;
+    }
+
+    return XZTL_OK;
+}
+
+/* Parses a comma separated 'name=value' list. Fields of options that are not
+ * in the list are not modified */
+int xztl_config_parse(struct xztl_config *cfg, const char *opts) {
+    char     buf[MAX_BUF_LEN];
+    char    *tok, *save, *val, *end;
+    long     num;
+    uint32_t opt_i;
+
+    if (strlen(opts) >= MAX_BUF_LEN)
+        return XZTL_CONFIG_ERR;
+
+    snprintf(buf, MAX_BUF_LEN, "%s", opts);
+
+    for (tok = strtok_r(buf, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (!val) {
+            log_erra("xztl_config: missing value of '%s'", tok);
+            return XZTL_CONFIG_ERR;
+        }
+        *val++ = '\0';
+
+        for (opt_i = 0; opt_i < XZTL_CONFIG_NOPTS; opt_i++) {
+            if (!strcmp(tok, xztl_config_opts[opt_i].name))
+                break;
+        }
+        if (opt_i == XZTL_CONFIG_NOPTS) {
+            log_erra("xztl_config: unknown option '%s'", tok);
+            return XZTL_CONFIG_ERR;
+        }
+
+        num = strtol(val, &end, 0);
+        if (end == val || *end != '\0' || num < INT32_MIN ||
+            num > UINT32_MAX) {
+            log_erra("xztl_config: invalid value '%s' of '%s'", val, tok);
+            return XZTL_CONFIG_ERR;
+        }
+
+        /* All options are 32-bit fields */
+        *(int32_t *)((char *)cfg + xztl_config_opts[opt_i].off) = (int32_t)num;
+    }
+
+    return XZTL_OK;
+}
+
+const struct xztl_config *xztl_config_get(void) {
+    struct xztl_instance *inst = xztl_instance_get();
+
+    if (!inst->cfg_set) {
+        xztl_config_default(&inst->cfg);
+        inst->cfg_set = 1;
+    }
+
+    return &inst->cfg;
+}
+
+int xztl_config_set(const struct xztl_config *cfg) {
+    struct xztl_instance *inst = xztl_instance_get();
+    int                   ret;
+
+    ret = xztl_config_check(cfg);
+    if (ret)
+        return ret;
+
+    memcpy(&inst->cfg, cfg, sizeof(struct xztl_config));
+    inst->cfg_set = 1;
+
+    return XZTL_OK;
+}
+
+static void *xztl_par_process(void *arg) {
+    struct xztl_par *par = (struct xztl_par *)arg;
+    uint64_t         first;
+    int              ret;
+
+    xztl_instance_bind(par->inst);
+
+    while (!par->ret) {
+        first = __sync_fetch_and_add(&par->next, par->chunk);
+        if (first >= par->n)
+            break;
+
+        ret = par->fn(par->arg, first, MIN(first + par->chunk, par->n));
+        if (ret)
+            __sync_bool_compare_and_swap(&par->ret, 0, ret);
+    }
+
+    return NULL;
+}
+
+int xztl_par_start(struct xztl_par *par, uint64_t n, uint64_t chunk,
+                   xztl_par_fn *fn, void *arg) {
+    uint32_t nthreads = xztl_config_get()->init_threads;
+
+    if (!nthreads)
+        nthreads = MIN(sysconf(_SC_NPROCESSORS_ONLN), XZTL_INIT_THREADS_MAX);
+    nthreads = MAX(MIN(nthreads, (n + chunk - 1) / chunk), 1);
+
+    par->n        = n;
+    par->chunk    = chunk;
+    par->next     = 0;
+    par->ret      = XZTL_OK;
+    par->fn       = fn;
+    par->arg      = arg;
+    par->inst     = xztl_instance_get();
+    par->nthreads = 0;
+
+    /* Fewer threads only take longer */
+    while (par->nthreads < nthreads) {
+        if (pthread_create(&par->tid[par->nthreads], NULL, xztl_par_process,
+                           par))
+            break;
+        par->nthreads++;
+    }
+
+    if (!par->nthreads) {
+        log_err("xztl_par_start: pthread_create failed\n");
+        return XZTL_MEM;
+    }
+
+    return XZTL_OK;
+}
+
+int xztl_par_join(struct xztl_par *par) {
+    uint32_t th_i;
+
+    for (th_i = 0; th_i < par->nthreads; th_i++)
+        pthread_join(par->tid[th_i], NULL);
+
+    return par->ret;
 }
 
 void xztl_print_mcmd(struct xztl_io_mcmd *cmd) {
@@ -48,53 +363,274 @@ void xztl_print_mcmd(struct xztl_io_mcmd *cmd) {
     printf("opaque : %p\n", cmd->opaque);
 }
 
-static xztl_register_media_fn *media_fn = NULL;
+uint16_t xztl_media_ndevs(void) {
+    return xztl_core_get()->ndevs;
+}
+
+struct xztl_media *xztl_media_get_dev(uint16_t dev) {
+    struct xztl_core *core = xztl_core_get();
+
+    return (dev < core->ndevs) ? core->devs[dev] : NULL;
+}
+
+/* All devices have the same geometry, see xztl_media_set */
+uint16_t xztl_media_grp_dev(uint16_t grp) {
+    return grp / xztl_core_get()->devs[0]->geo.ngrps;
+}
+
+/* Appends address a zone, reads and writes only a sector */
+uint16_t xztl_media_io_dev(struct xztl_io_mcmd *cmd) {
+    if (cmd->opcode == XZTL_ZONE_APPEND)
+        return xztl_media_grp_dev(cmd->addr[0].g.grp);
+
+    return cmd->addr[0].g.sect / xztl_core_get()->devs[0]->geo.sec_dev;
+}
 
 void *xztl_media_dma_alloc(size_t bytes) {
-    return core.media->dma_alloc(bytes);
+    return xztl_core_get()->devs[0]->dma_alloc(bytes);
 }
 
 void xztl_media_dma_free(void *ptr) {
-    core.media->dma_free(ptr);
+    xztl_core_get()->devs[0]->dma_free(ptr);
+}
+
+/* Nodes may span the device stack, the buffer must be a DMA target of
+ * every device */
+int xztl_media_dma_check(void *buf, size_t size) {
+    struct xztl_core *core = xztl_core_get();
+    uint16_t          dev;
+
+    for (dev = 0; dev < core->ndevs; dev++) {
+        if (!core->devs[dev]->dma_check ||
+            !core->devs[dev]->dma_check(buf, size))
+            return 0;
+    }
+
+    return 1;
 }
 
 int xztl_media_submit_io(struct xztl_io_mcmd *cmd) {
+    struct xztl_core *core = xztl_core_get();
+    uint16_t          dev;
+
     if (ZDEBUG_MEDIA_W && (cmd->opcode == XZTL_CMD_WRITE))
         xztl_print_mcmd(cmd);
     if (ZDEBUG_MEDIA_R && (cmd->opcode == XZTL_CMD_READ))
         xztl_print_mcmd(cmd);
 
-    return core.media->submit_io(cmd);
+    dev = xztl_media_io_dev(cmd);
+    if (dev >= core->ndevs)
+        return XZTL_MEDIA_NOIO;
+
+    return core->devs[dev]->submit_io(cmd);
+}
+
+/* Merges the reports of all devices. Descriptors are rebased to the stacked
+ * sector space, so a group finds its zones at 'grp * zn_grp + zone' */
+static int xztl_media_report_stack(struct xztl_zn_mcmd *cmd) {
+    struct xnvme_znd_report     *rep, *drep;
+    struct xnvme_spec_znd_descr *zinfo;
+    struct xztl_zn_mcmd          dcmd;
+    struct xztl_core            *core = xztl_core_get();
+    uint64_t                     entries_nbytes, zn_i;
+    uint32_t                     zn_dev = core->devs[0]->geo.zn_dev;
+    uint16_t                     dev;
+    int                          ret;
+
+    entries_nbytes = core->media->geo.zn_dev *
+                     sizeof(struct xnvme_spec_znd_descr);
+
+    rep = xnvme_buf_virt_alloc(4096,
+                               sizeof(struct xnvme_znd_report) + entries_nbytes);
+    if (!rep)
+        return XZTL_MEM;
+    memset(rep, 0x0, sizeof(struct xnvme_znd_report) + entries_nbytes);
+
+    rep->zslba          = 0;
+    rep->nzones         = core->media->geo.zn_dev;
+    rep->zelba          = (rep->nzones - 1) * core->media->geo.sec_zn;
+    rep->zd_nbytes      = sizeof(struct xnvme_spec_znd_descr);
+    rep->zrent_nbytes   = sizeof(struct xnvme_spec_znd_descr);
+    rep->report_nbytes  = sizeof(struct xnvme_znd_report) + entries_nbytes;
+    rep->entries_nbytes = entries_nbytes;
+
+    for (dev = 0; dev < core->ndevs; dev++) {
+        memcpy(&dcmd, cmd, sizeof(struct xztl_zn_mcmd));
+        dcmd.addr.addr  = 0;
+        dcmd.addr.g.grp = core->devs[dev]->grp_base;
+
+        ret = core->devs[dev]->zone_fn(&dcmd);
+        if (ret) {
+            xnvme_buf_virt_free(rep);
+            return ret;
+        }
+        drep = (struct xnvme_znd_report *)dcmd.opaque;
+
+        for (zn_i = 0; zn_i < zn_dev && zn_i < drep->nzones; zn_i++) {
+            zinfo = XNVME_ZND_REPORT_DESCR(rep, dev * zn_dev + zn_i);
+            memcpy(zinfo, XNVME_ZND_REPORT_DESCR(drep, zn_i),
+                   sizeof(struct xnvme_spec_znd_descr));
+            zinfo->zslba += core->devs[dev]->sec_base;
+            zinfo->wp += core->devs[dev]->sec_base;
+        }
+        xnvme_buf_virt_free(drep);
+    }
+
+    cmd->opaque = (void *)rep;  // NOLINT
+
+    return XZTL_OK;
+}
+
+/* Commands not bound to a zone go to every device, each one addressed by its
+ * first group */
+static int xztl_media_submit_zn_all(struct xztl_zn_mcmd *cmd) {
+    struct xztl_zn_mcmd dcmd;
+    struct xztl_core   *core = xztl_core_get();
+    uint16_t            dev;
+    int                 ret;
+
+    if (cmd->opcode == XZTL_ZONE_MGMT_REPORT && core->ndevs > 1)
+        return xztl_media_report_stack(cmd);
+
+    cmd->status = XZTL_OK;
+    for (dev = 0; dev < core->ndevs; dev++) {
+        memcpy(&dcmd, cmd, sizeof(struct xztl_zn_mcmd));
+        dcmd.addr.addr  = 0;
+        dcmd.addr.g.grp = core->devs[dev]->grp_base;
+
+        ret         = core->devs[dev]->zone_fn(&dcmd);
+        cmd->opaque = dcmd.opaque;
+        if (dcmd.status)
+            cmd->status = dcmd.status;
+        if (ret)
+            return ret;
+    }
+
+    return XZTL_OK;
+}
+
+/* Range reports come from the device of the group, descriptors are rebased
+ * to the stacked sector space like the full report */
+static int xztl_media_report_range(struct xztl_zn_mcmd *cmd) {
+    struct xnvme_znd_report     *rep;
+    struct xnvme_spec_znd_descr *zinfo;
+    struct xztl_core            *core = xztl_core_get();
+    uint64_t                     zn_i;
+    uint16_t                     dev;
+    int                          ret;
+
+    dev = xztl_media_grp_dev(cmd->addr.g.grp);
+    if (dev >= core->ndevs)
+        return XZTL_MEDIA_NOZONE;
+
+    ret = core->devs[dev]->zone_fn(cmd);
+    if (ret || !core->devs[dev]->sec_base)
+        return ret;
+
+    rep = (struct xnvme_znd_report *)cmd->opaque;
+    for (zn_i = 0; zn_i < rep->nzones; zn_i++) {
+        zinfo = XNVME_ZND_REPORT_DESCR(rep, zn_i);
+        zinfo->zslba += core->devs[dev]->sec_base;
+        zinfo->wp += core->devs[dev]->sec_base;
+    }
+
+    return XZTL_OK;
 }
 
 int xztl_media_submit_zn(struct xztl_zn_mcmd *cmd) {
-    return core.media->zone_fn(cmd);
+    struct xztl_core *core = xztl_core_get();
+    uint16_t          dev;
+
+    if (cmd->opcode == XZTL_ZONE_MGMT_RANGE)
+        return xztl_media_report_range(cmd);
+
+    /* More than one zone selects the whole namespace */
+    if (cmd->opcode == XZTL_ZONE_MGMT_REPORT || cmd->nzones > 1)
+        return xztl_media_submit_zn_all(cmd);
+
+    dev = xztl_media_grp_dev(cmd->addr.g.grp);
+    if (dev >= core->ndevs)
+        return XZTL_MEDIA_NOZONE;
+
+    return core->devs[dev]->zone_fn(cmd);
+}
+
+/* Media without asynchronous zone commands complete them in place */
+int xztl_media_submit_zn_async(struct xztl_zn_mcmd *cmd) {
+    struct xztl_core *core = xztl_core_get();
+    uint16_t          dev;
+    int               ret;
+
+    if (cmd->opcode == XZTL_ZONE_MGMT_REPORT ||
+        cmd->opcode == XZTL_ZONE_MGMT_RANGE || cmd->nzones > 1)
+        return XZTL_MEDIA_NOZONE;
+
+    dev = xztl_media_grp_dev(cmd->addr.g.grp);
+    if (dev >= core->ndevs || dev != cmd->async_ctx->dev)
+        return XZTL_MEDIA_NOZONE;
+
+    if (core->devs[dev]->zone_async_fn)
+        return core->devs[dev]->zone_async_fn(cmd);
+
+    ret = core->devs[dev]->zone_fn(cmd);
+    if (ret && !cmd->status)
+        cmd->status = XZTL_MEDIA_NOZONE;
+    cmd->callback(cmd);
+
+    return XZTL_OK;
 }
 
 int xztl_media_submit_misc(struct xztl_misc_cmd *cmd) {
-    return core.media->cmd_exec(cmd);
+    struct xztl_core *core = xztl_core_get();
+    uint16_t          dev  = cmd->asynch.ctx_ptr->dev;
+
+    if (dev >= core->ndevs)
+        return XZTL_MEDIA_ERROR;
+
+    return core->devs[dev]->cmd_exec(cmd);
 }
 
 int xztl_media_init(void) {
-    if (!core.media)
+    struct xztl_core *core = xztl_core_get();
+    uint16_t          dev;
+    int               ret;
+
+    if (!core->ndevs)
         return XZTL_NOMEDIA;
 
-    if (!core.media->init_fn)
-        return XZTL_NOINIT;
+    for (dev = 0; dev < core->ndevs; dev++) {
+        if (!core->devs[dev]->init_fn)
+            return XZTL_NOINIT;
+
+        ret = core->devs[dev]->init_fn();
+        if (ret)
+            return ret;
+    }
 
-    return core.media->init_fn();
+    return XZTL_OK;
 }
 
 int xztl_media_exit(void) {
-    if (!core.media)
+    struct xztl_core *core = xztl_core_get();
+    uint16_t          dev;
+    int               ret = XZTL_OK;
+
+    if (!core->ndevs)
         return XZTL_NOMEDIA;
 
-    if (!core.media->exit_fn)
-        return XZTL_NOEXIT;
+    for (dev = 0; dev < core->ndevs; dev++) {
+        if (!core->devs[dev]->exit_fn)
+            return XZTL_NOEXIT;
+
+        if (core->devs[dev]->exit_fn())
+            ret = XZTL_MEDIA_ERROR;
+    }
 
-    return core.media->exit_fn();
+    return ret;
 }
 
+static void xztl_media_geo_fill(struct xztl_mgeo *g);
+
 static int xztl_media_check(struct xztl_media *media) {
     struct xztl_mgeo *g;
 
@@ -127,7 +663,12 @@ static int xztl_media_check(struct xztl_media *media) {
         g->nbytes_oob > XZTL_MEDIA_MAX_OOBSZ)
         return XZTL_MEDIA_GEO;
 
-    /* Fill up geometry fields */
+    xztl_media_geo_fill(g);
+
+    return XZTL_OK;
+}
+
+static void xztl_media_geo_fill(struct xztl_mgeo *g) {
     g->zn_grp     = g->pu_grp * g->zn_pu;
     g->zn_dev     = g->zn_grp * g->ngrps;
     g->sec_grp    = g->zn_grp * g->sec_zn;
@@ -138,32 +679,61 @@ static int xztl_media_check(struct xztl_media *media) {
     g->oob_grp    = g->sec_grp * g->nbytes_oob;
     g->oob_pu     = g->sec_pu * g->nbytes_oob;
     g->oob_zn     = g->sec_zn * g->nbytes_oob;
-
-    return XZTL_OK;
 }
 
+/* Devices are stacked in registration order. The core media describes the
+ * whole stack: groups of all devices and the settings of the first one */
 int xztl_media_set(struct xztl_media *media) {
-    int ret;
+    struct xztl_core *core = xztl_core_get();
+    struct xztl_mgeo *g, *g0;
+    int               ret;
 
     ret = xztl_media_check(media);
     if (ret)
         return ret;
 
-    core.media = malloc(sizeof(struct xztl_media));
-    if (!core.media)
-        return XZTL_MEM;
+    if (core->ndevs == XZTL_MEDIA_MAX_DEV)
+        return XZTL_MEDIA_GEO;
 
-    memcpy(core.media, media, sizeof(struct xztl_media));
+    if (core->ndevs) {
+        g  = &media->geo;
+        g0 = &core->devs[0]->geo;
+        if (g->ngrps != g0->ngrps || g->pu_grp != g0->pu_grp ||
+            g->zn_pu != g0->zn_pu || g->sec_zn != g0->sec_zn ||
+            g->nbytes != g0->nbytes ||
+            g0->ngrps * (core->ndevs + 1) > XZTL_MEDIA_MAX_GRP) {
+            log_erra("xztl_media_set: device [%u] geometry does not match",
+                     core->ndevs);
+            return XZTL_MEDIA_GEO;
+        }
+    }
+
+    if (!core->media) {
+        core->media = malloc(sizeof(struct xztl_media));
+        if (!core->media)
+            return XZTL_MEM;
+    }
+
+    media->dev      = core->ndevs;
+    media->grp_base = media->geo.ngrps * core->ndevs;
+    media->sec_base = (uint64_t)media->geo.sec_dev * core->ndevs;
+
+    core->devs[core->ndevs++] = media;
+
+    memcpy(core->media, core->devs[0], sizeof(struct xztl_media));
+    core->media->geo.ngrps = core->devs[0]->geo.ngrps * core->ndevs;
+    xztl_media_geo_fill(&core->media->geo);
 
     return XZTL_OK;
 }
 
 void xztl_add_media(xztl_register_media_fn *fn) {
-    media_fn = fn;
+    xztl_instance_get()->media_fn = fn;
 }
 
 int xztl_exit(void) {
-    int ret;
+    struct xztl_core *core = xztl_core_get();
+    int               ret;
 
     xztl_stats_exit();
     ztl_exit();
@@ -174,10 +744,11 @@ int xztl_exit(void) {
 
     xztl_mempool_exit();
 
-    if (core.media) {
-        free(core.media);
-        core.media = NULL;
+    if (core->media) {
+        free(core->media);
+        core->media = NULL;
     }
+    core->ndevs = 0;
 
     log_info("xztl_exit: xZTL is closed succesfully.");
 
@@ -185,23 +756,110 @@ int xztl_exit(void) {
     return ret;
 }
 
+/* Registers every device of a XZTL_MEDIA_DEV_SEP separated list */
+static int xztl_media_register(const char *dev_name) {
+    struct xztl_instance *inst = xztl_instance_get();
+    char                  names[MAX_BUF_LEN];
+    char                 *tok, *save;
+    int                   ret;
+
+    if (strlen(dev_name) >= MAX_BUF_LEN)
+        return XZTL_NOMEDIA;
+
+    snprintf(names, MAX_BUF_LEN, "%s", dev_name);
+
+    for (tok = strtok_r(names, XZTL_MEDIA_DEV_SEP, &save); tok;
+         tok = strtok_r(NULL, XZTL_MEDIA_DEV_SEP, &save)) {
+        ret = inst->media_fn(tok);
+        if (ret) {
+            log_erra("xztl_init: err device '%s' ret [%d]", tok, ret);
+            return ret;
+        }
+    }
+
+    return (inst->core.ndevs) ? XZTL_OK : XZTL_NOMEDIA;
+}
+
+/* Closes the registered devices and empties the stack */
+static void xztl_media_unregister(void) {
+    struct xztl_core *core = xztl_core_get();
+
+    if (core->ndevs)
+        xztl_media_exit();
+
+    if (core->media) {
+        free(core->media);
+        core->media = NULL;
+    }
+    core->ndevs = 0;
+}
+
+/* Applies the options following XZTL_CONFIG_SEP and strips them from the
+ * device list */
+static int xztl_config_apply(const char *dev_name, char *names) {
+    struct xztl_config cfg;
+    char              *opts;
+    int                ret;
+
+    if (strlen(dev_name) >= MAX_BUF_LEN)
+        return XZTL_NOMEDIA;
+
+    snprintf(names, MAX_BUF_LEN, "%s", dev_name);
+
+    memcpy(&cfg, xztl_config_get(), sizeof(struct xztl_config));
+
+    opts = strstr(names, XZTL_CONFIG_SEP);
+    if (opts) {
+        *opts = '\0';
+        ret   = xztl_config_parse(&cfg, opts + strlen(XZTL_CONFIG_SEP));
+        if (ret)
+            return ret;
+    }
+
+    ret = xztl_config_set(&cfg);
+    if (ret)
+        return ret;
+
+    log_infoa("xztl_init: qdepth [%u/%u] read_ctx [%u] levels [%u] lanes [%u] "
+              "stripe [%u] width [%u] buf_ents [%u] write_core [%d] "
+              "mgmt_workers [%u] reset_target [%u] init_threads [%u] "
+              "map_pages [%u] map_table [%u]",
+              cfg.qdepth, cfg.qdepth_aio, cfg.read_ctx, cfg.levels, cfg.lanes,
+              cfg.stripe, cfg.width, cfg.buf_ents, cfg.write_core,
+              cfg.mgmt_workers, cfg.reset_target, cfg.init_threads,
+              cfg.map_pages, cfg.map_table);
+
+    return XZTL_OK;
+}
+
 int xztl_init(const char *dev_name) {
-    int ret;
+    struct xztl_core *core = xztl_core_get();
+    char              names[MAX_BUF_LEN];
+    int               ret;
 
     openlog("ztl", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL0);
 
     log_info("xztl_init: Starting xZTL...");
 
-    if (!media_fn)
+    if (!xztl_instance_get()->media_fn)
         return XZTL_NOMEDIA;
 
-    ret = media_fn(dev_name);
+    ret = xztl_config_apply(dev_name, names);
     if (ret)
-        return XZTL_MEDIA_ERROR | ret;
+        return ret;
+
+    ret = xztl_media_register(names);
+    if (ret) {
+        ret = XZTL_MEDIA_ERROR | ret;
+        goto DEVS;
+    }
+
+    log_infoa("xztl_init: devices [%u] groups [%u]", core->ndevs,
+              core->media->geo.ngrps);
 
     ret = xztl_mempool_init();
     if (ret)
-        return ret;
+        goto DEVS;
 
     ret = xztl_media_init();
     if (ret)
@@ -209,7 +867,7 @@ int xztl_init(const char *dev_name) {
 
     ret = ztl_init();
     if (ret)
-        goto MEDIA;
+        goto MP;
 
     ret = xztl_stats_init();
     if (ret)
@@ -220,10 +878,9 @@ int xztl_init(const char *dev_name) {
 
 ZTL:
     ztl_exit();
-MEDIA:
-
-    xztl_media_exit();
 MP:
     xztl_mempool_exit();
+DEVS:
+    xztl_media_unregister();
     return ret;
 }
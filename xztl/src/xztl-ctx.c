@@ -22,12 +22,13 @@
 #include <xztl-mempool.h>
 #include <xztl.h>
 
-struct xztl_mthread_ctx *xztl_ctx_media_init(uint32_t depth) {
+struct xztl_mthread_ctx *xztl_ctx_media_init_dev(uint16_t dev,
+                                                 uint32_t depth) {
     struct xztl_misc_cmd     cmd;
     struct xztl_mthread_ctx *tctx;
     int                      ret;
 
-    tctx = malloc(sizeof(struct xztl_mthread_ctx));
+    tctx = calloc(1, sizeof(struct xztl_mthread_ctx));
     if (!tctx) {
         log_err("xztl_ctx_media_init: tctx is NULL.\n");
         return NULL;
@@ -38,14 +39,15 @@ struct xztl_mthread_ctx *xztl_ctx_media_init(uint32_t depth) {
         free(tctx);
         return NULL;
     }
+    tctx->dev = dev;
 
-    /* Create asynchronous context via xnvme */
+    /* Create asynchronous context via the media layer */
     cmd.opcode         = XZTL_MISC_ASYNCH_INIT;
     cmd.asynch.depth   = depth;
     cmd.asynch.ctx_ptr = tctx;
 
     ret = xztl_media_submit_misc(&cmd);
-    if (ret || !tctx->queue) {
+    if (ret || (!tctx->queue && !tctx->opaque)) {
         log_erra(
             "xztl_ctx_media_init: xztl_media_submit_misc ret [%d] tctx->queue "
             "[%p]",
@@ -58,6 +60,10 @@ struct xztl_mthread_ctx *xztl_ctx_media_init(uint32_t depth) {
     return tctx;
 }
 
+struct xztl_mthread_ctx *xztl_ctx_media_init(uint32_t depth) {
+    return xztl_ctx_media_init_dev(0, depth);
+}
+
 int xztl_ctx_media_exit(struct xztl_mthread_ctx *tctx) {
     if (tctx == NULL) {
         return XZTL_OK;
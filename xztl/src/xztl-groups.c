@@ -29,13 +29,17 @@
 #include <xztl.h>
 #include <xztl-pro.h>
 
-static LIST_HEAD(app_grp,
-                 app_group) app_grp_head = LIST_HEAD_INITIALIZER(app_grp_head);
+LIST_HEAD(app_grp, app_group);
+
+/* An empty list head is zeroed, see LIST_HEAD_INITIALIZER */
+static struct app_grp *groups_head(void) {
+    return xztl_instance_state(XZTL_STATE_GROUPS, sizeof(struct app_grp));
+}
 
 static struct app_group *groups_get(uint16_t grp_id) {
     struct app_group *grp;
 
-    LIST_FOREACH(grp, &app_grp_head, entry) {
+    LIST_FOREACH(grp, groups_head(), entry) {
         if (grp->id == grp_id)
             return grp;
     }
@@ -48,7 +52,7 @@ static int groups_get_list(struct app_group **list, uint16_t ngrp) {
     int               i = ngrp - 1;
     struct app_group *grp;
 
-    LIST_FOREACH(grp, &app_grp_head, entry) {
+    LIST_FOREACH(grp, groups_head(), entry) {
         if (i < 0)
             break;
         list[i] = grp;
@@ -62,10 +66,18 @@ static int groups_get_list(struct app_group **list, uint16_t ngrp) {
 static void groups_zmd_exit(void) {
     struct app_group *grp;
 
-    LIST_FOREACH(grp, &app_grp_head, entry) {
+    /* The checkpoint is closed once all groups are flushed */
+    LIST_FOREACH(grp, groups_head(), entry) {
+        if (ztl()->zmd->flush_fn(grp))
+            log_erra("groups_zmd_exit: flush failed. Grp [%d]\n", grp->id);
+    }
+    ztl()->zmd->close_fn();
+
+    LIST_FOREACH(grp, groups_head(), entry) {
         log_infoa("groups_zmd_exit: Zone MD stopped. Grp [%d]", grp->id);
         xnvme_buf_virt_free(grp->zmd.report);
         free(grp->zmd.tbl);
+        free(grp->zmd.tiny.dirty);
     }
 }
 
@@ -78,9 +90,8 @@ static int groups_zmd_init(struct app_group *grp) {
     zmd = &grp->zmd;
     g   = &core->media->geo;
 
-    zmd->entry_sz   = sizeof(struct app_zmd_entry);
-    zmd->ent_per_pg = g->nbytes / zmd->entry_sz;
-    zmd->entries    = g->zn_grp;
+    zmd->entry_sz = sizeof(struct app_zmd_entry);
+    zmd->entries  = g->zn_grp;
 
     zmd->tbl = calloc(g->zn_grp, zmd->entry_sz);
     if (!zmd->tbl)
@@ -94,8 +105,8 @@ static int groups_zmd_init(struct app_group *grp) {
         goto FREE;
     }
 
-    /* Create and flush zmd table if it does not exist */
-    if (zmd->byte.magic == APP_MAGIC) {
+    /* Create and flush zmd table if it was not loaded */
+    if (zmd->byte.magic != APP_MAGIC) {
         ret = ztl()->zmd->create_fn(grp);
         if (ret) {
             log_erra("groups_zmd_init: create_fn err [%d]\n", ret);
@@ -103,7 +114,6 @@ static int groups_zmd_init(struct app_group *grp) {
         }
     }
 
-    /* TODO: Setup tiny table */
     log_infoa("groups_zmd_init: Zone MD started. Grp [%d]", grp->id);
 
     return XZTL_OK;
@@ -112,14 +122,15 @@ FREE_REP:
     xnvme_buf_virt_free(zmd->report);
 FREE:
     log_erra("groups_zmd_init: Zone MD startup failed. Grp [%d]", grp->id);
+    free(zmd->tiny.dirty);
     free(zmd->tbl);
     return XZTL_ZTL_GROUP_ERR;
 }
 
 static void groups_free(void) {
     struct app_group *grp;
-    while (!LIST_EMPTY(&app_grp_head)) {
-        grp = LIST_FIRST(&app_grp_head);
+    while (!LIST_EMPTY(groups_head())) {
+        grp = LIST_FIRST(groups_head());
         LIST_REMOVE(grp, entry);
         free(grp);
     }
@@ -156,7 +167,7 @@ static int groups_init(void) {
         /* Enable group */
         app_grp_switch_on(grp);
 
-        LIST_INSERT_HEAD(&app_grp_head, grp, entry);
+        LIST_INSERT_HEAD(groups_head(), grp, entry);
     }
 
     log_infoa("ztl-groups: [%d] groups started. ", grp_i);
@@ -174,5 +185,5 @@ void ztl_grp_register(void) {
     ztl()->groups.get_fn      = groups_get;
     ztl()->groups.get_list_fn = groups_get_list;
 
-    LIST_INIT(&app_grp_head);
+    LIST_INIT(groups_head());
 }
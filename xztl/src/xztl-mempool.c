@@ -27,7 +27,10 @@
 #include <xztl-mempool.h>
 #include <xztl.h>
 
-static struct xztl_mempool xztlmp;
+static struct xztl_mempool *xztl_mempool_st(void) {
+    return xztl_instance_state(XZTL_STATE_MEMPOOL,
+                               sizeof(struct xztl_mempool));
+}
 
 static void xztl_mempool_free(struct xztl_mp_pool_i *pool) {
     struct xztl_mp_entry *ent;
@@ -57,7 +60,7 @@ int xztl_mempool_destroy(uint32_t type, uint16_t tid) {
         return XZTL_MP_OUTBOUNDS;
     }
 
-    pool = &xztlmp.mp[type].pool[tid];
+    pool = &xztl_mempool_st()->mp[type].pool[tid];
 
     if (!pool->active)
         return XZTL_OK;
@@ -91,7 +94,7 @@ int xztl_mempool_create(uint32_t type, uint16_t tid, uint32_t entries,
         return XZTL_MP_INVALID;
     }
 
-    pool = &xztlmp.mp[type].pool[tid];
+    pool = &xztl_mempool_st()->mp[type].pool[tid];
 
     if (pool->active) {
         log_erra("xztl_mempool_create: err pool->active [%u]\n", pool->active);
@@ -153,7 +156,7 @@ MEMERR:
 int xztl_mempool_left(uint32_t type, uint16_t tid) {
     struct xztl_mp_pool_i *pool;
 
-    pool = &xztlmp.mp[type].pool[tid];
+    pool = &xztl_mempool_st()->mp[type].pool[tid];
 
     return pool->entries - pool->out_count + pool->in_count;
 }
@@ -164,7 +167,7 @@ struct xztl_mp_entry *xztl_mempool_get(uint32_t type, uint16_t tid) {
     struct xztl_mp_entry  *ent;
     ZDEBUG(ZDEBUG_MP, "xztl_mempool_get: type [%d], tid [%d]", type, tid);
 
-    pool = &xztlmp.mp[type].pool[tid];
+    pool = &xztl_mempool_st()->mp[type].pool[tid];
 #ifdef MP_LOCKFREE
     uint16_t tmp, old;
 
@@ -212,7 +215,7 @@ void xztl_mempool_put(struct xztl_mp_entry *ent, uint32_t type, uint16_t tid) {
 
     ZDEBUG(ZDEBUG_MP, "xztl_mempool_put: type [%d], tid [%d]", type, tid);
 
-    pool = &xztlmp.mp[type].pool[tid];
+    pool = &xztl_mempool_st()->mp[type].pool[tid];
 
 #ifndef MP_LOCKFREE
     pthread_spin_lock(&pool->spin);
@@ -243,6 +246,6 @@ int xztl_mempool_exit(void) {
 }
 
 int xztl_mempool_init(void) {
-    memset(&xztlmp, 0x0, sizeof(struct xztl_mempool));
+    memset(xztl_mempool_st(), 0x0, sizeof(struct xztl_mempool));
     return XZTL_OK;
 }
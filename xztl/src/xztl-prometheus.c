@@ -50,6 +50,10 @@ static pthread_t                    th_flush;
 static struct xztl_prometheus_stats pr_stats;
 static uint8_t                      xztl_flush_l_running, xztl_flush_running;
 
+/* The exporter files are process-wide, only the first instance started
+ * reports to them */
+static struct xztl_instance *pr_inst;
+
 /* Latency queue */
 
 #define MAX_LATENCY_ENTS 8192
@@ -117,6 +121,7 @@ static void xztl_prometheus_reset(void) {
 }
 
 void *xztl_prometheus_flush(void *arg) {
+    xztl_instance_bind((struct xztl_instance *)arg);
     GET_MICROSECONDS(pr_stats.us_s, pr_stats.ts_s);
 
     xztl_flush_running++;
@@ -140,6 +145,10 @@ void *xztl_prometheus_flush(void *arg) {
 void xztl_prometheus_add_io(struct xztl_io_mcmd *cmd) {
     uint32_t          nsec = 0, i;
     struct xztl_core *core;
+
+    if (xztl_instance_get() != pr_inst)
+        return;
+
     get_xztl_core(&core);
     for (i = 0; i < cmd->naddr; i++) nsec += cmd->nsec[i];
 
@@ -159,6 +168,9 @@ void xztl_prometheus_add_io(struct xztl_io_mcmd *cmd) {
 }
 
 void xztl_prometheus_add_wa(uint64_t user_writes, uint64_t zns_writes) {
+    if (xztl_instance_get() != pr_inst)
+        return;
+
     ATOMIC_SWAP(&pr_stats.user_write_bytes, pr_stats.user_write_bytes, user_writes);
     ATOMIC_SWAP(&pr_stats.zns_write_bytes, pr_stats.zns_write_bytes, zns_writes);
 }
@@ -195,6 +207,7 @@ static void xztl_prometheus_flush_latency(void) {
 }
 
 void *xztl_prometheus_latency_th(void *arg) {
+    xztl_instance_bind((struct xztl_instance *)arg);
     GET_MICROSECONDS(pr_stats.us_l_s, pr_stats.ts_l_s);
 
     xztl_flush_l_running++;
@@ -217,6 +230,9 @@ void xztl_prometheus_add_read_latency(uint64_t usec) {
     struct xztl_mp_entry *mp_ent;
     struct latency_entry *ent;
 
+    if (xztl_instance_get() != pr_inst)
+        return;
+
     pthread_spin_lock(&lat_spin);
 
     /* Discard latency if queue is full */
@@ -245,17 +261,24 @@ void xztl_prometheus_add_read_latency(uint64_t usec) {
 }
 
 void xztl_prometheus_exit(void) {
+    if (xztl_instance_get() != pr_inst)
+        return;
+
     xztl_flush_running   = 0;
     xztl_flush_l_running = 0;
     pthread_join(th_flush, NULL);
     pthread_join(latency_tid, NULL);
     xztl_mempool_destroy(XZTL_PROMETHEUS_LAT, 0);
     pthread_spin_destroy(&lat_spin);
+    pr_inst = NULL;
 }
 
 int xztl_prometheus_init(void) {
     int ret;
 
+    if (pr_inst)
+        return XZTL_OK;
+
     memset(&pr_stats, 0, sizeof(struct xztl_prometheus_stats));
 
     /* Create layency memory pool and queue */
@@ -272,19 +295,22 @@ int xztl_prometheus_init(void) {
     }
 
     xztl_flush_l_running = 0;
-    if (pthread_create(&latency_tid, NULL, xztl_prometheus_latency_th, NULL)) {
+    if (pthread_create(&latency_tid, NULL, xztl_prometheus_latency_th,
+                       xztl_instance_get())) {
         log_err("xztl_prometheus_init: Flushing latency thread not started.");
         goto MP;
     }
 
     xztl_flush_running = 0;
-    if (pthread_create(&th_flush, NULL, xztl_prometheus_flush, NULL)) {
+    if (pthread_create(&th_flush, NULL, xztl_prometheus_flush,
+                       xztl_instance_get())) {
         log_err("xztl_prometheus_init: Flushing thread not started.");
         goto LAT_TH;
     }
 
     while (!xztl_flush_running || !xztl_flush_l_running) {
     }
+    pr_inst = xztl_instance_get();
 
     return XZTL_OK;
 
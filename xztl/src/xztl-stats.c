@@ -24,50 +24,54 @@
 #include <xztl.h>
 #include <xztl-stats.h>
 
-#define XZTL_STATS_IO_TYPES 22
+#define XZTL_STATS_IO_TYPES 24
 
 struct xztl_stats_data {
     uint64_t io[XZTL_STATS_IO_TYPES];
+    uint64_t node[ZROCKS_LEVEL_NUM][XZTL_CMD_ENTRY_MAX];
 };
 
-struct xztl_node_stats_data {
-    uint64_t data[ZROCKS_LEVEL_NUM][XZTL_CMD_ENTRY_MAX];
-};
-
-static struct xztl_stats_data xztl_stats;
-static struct xztl_node_stats_data xztl_node_stats;
+static struct xztl_stats_data *xztl_stats_st(void) {
+    return xztl_instance_state(XZTL_STATE_STATS,
+                               sizeof(struct xztl_stats_data));
+}
 
 void xztl_stats_print_err(void) {
+    struct xztl_stats_data *xztl_stats = xztl_stats_st();
+
     log_infoa("write submit failed times [%lu]\n",
-              xztl_stats.io[XZTL_STATS_WRITE_SUBMIT_FAIL]);
+              xztl_stats->io[XZTL_STATS_WRITE_SUBMIT_FAIL]);
     log_infoa("read submit failed times [%lu]\n",
-              xztl_stats.io[XZTL_STATS_READ_SUBMIT_FAIL]);
+              xztl_stats->io[XZTL_STATS_READ_SUBMIT_FAIL]);
     log_infoa("write callback failed times [%lu]\n",
-              xztl_stats.io[XZTL_STATS_WRITE_CALLBACK_FAIL]);
+              xztl_stats->io[XZTL_STATS_WRITE_CALLBACK_FAIL]);
     log_infoa("read callback failed times [%lu]\n",
-              xztl_stats.io[XZTL_STATS_READ_CALLBACK_FAIL]);
-    log_infoa("mgmt failed times [%lu]\n", xztl_stats.io[XZTL_STATS_MGMT_FAIL]);
+              xztl_stats->io[XZTL_STATS_READ_CALLBACK_FAIL]);
+    log_infoa("mgmt failed times [%lu]\n", xztl_stats->io[XZTL_STATS_MGMT_FAIL]);
     log_infoa("write meta failed times [%lu]\n",
-              xztl_stats.io[XZTL_STATS_META_WRITE_FAIL]);
+              xztl_stats->io[XZTL_STATS_META_WRITE_FAIL]);
     log_infoa("read meta failed times [%lu]\n",
-              xztl_stats.io[XZTL_STATS_META_READ_FAIL]);
+              xztl_stats->io[XZTL_STATS_META_READ_FAIL]);
+    log_infoa("append reordered pieces [%lu]\n",
+              xztl_stats->io[XZTL_STATS_APPEND_REORDER]);
 }
 
 void xztl_stats_print_io(void) {
-    uint64_t tot_b, tot_b_w, tot_b_r, tot_gc_r, tot_gc_w;
-    double   wa;
+    struct xztl_stats_data *xztl_stats = xztl_stats_st();
+    uint64_t                tot_b, tot_b_w, tot_b_r, tot_gc_r, tot_gc_w;
+    double                  wa;
 
     printf("\n User I/O commands\n");
-    printf("   write  : %lu\n", xztl_stats.io[XZTL_STATS_APPEND_UCMD]);
-    printf("   read   : %lu\n", xztl_stats.io[XZTL_STATS_READ_UCMD]);
+    printf("   write  : %lu\n", xztl_stats->io[XZTL_STATS_APPEND_UCMD]);
+    printf("   read   : %lu\n", xztl_stats->io[XZTL_STATS_READ_UCMD]);
 
     printf("\n Media I/O commands\n");
-    printf("   append : %lu\n", xztl_stats.io[XZTL_STATS_APPEND_MCMD]);
-    printf("   read   : %lu\n", xztl_stats.io[XZTL_STATS_READ_MCMD]);
-    printf("   reset  : %lu\n", xztl_stats.io[XZTL_STATS_RESET_MCMD]);
+    printf("   append : %lu\n", xztl_stats->io[XZTL_STATS_APPEND_MCMD]);
+    printf("   read   : %lu\n", xztl_stats->io[XZTL_STATS_READ_MCMD]);
+    printf("   reset  : %lu\n", xztl_stats->io[XZTL_STATS_RESET_MCMD]);
 
-    tot_b_r = xztl_stats.io[XZTL_STATS_READ_BYTES_U];
-    tot_b_w = xztl_stats.io[XZTL_STATS_APPEND_BYTES_U];
+    tot_b_r = xztl_stats->io[XZTL_STATS_READ_BYTES_U];
+    tot_b_w = xztl_stats->io[XZTL_STATS_APPEND_BYTES_U];
     tot_b   = tot_b_w + tot_b_r;
 
     wa = tot_b_w;
@@ -79,16 +83,16 @@ void xztl_stats_print_io(void) {
     printf("   user read        : %10.2lf MB (%lu bytes)\n",
            (double)tot_b_r / (double)1048576, (uint64_t)tot_b_r);  // NOLINT
 
-    tot_gc_r = xztl_stats.io[XZTL_STATS_READ_BYTES_GC];
-    tot_gc_w = xztl_stats.io[XZTL_STATS_APPEND_BYTES_GC];
+    tot_gc_r = xztl_stats->io[XZTL_STATS_READ_BYTES_GC];
+    tot_gc_w = xztl_stats->io[XZTL_STATS_APPEND_BYTES_GC];
 
     printf("   gc written     : %10.2lf MB (%lu bytes)\n",
            (double)tot_gc_w / (double)1048576, (uint64_t)tot_gc_w);  // NOLINT
     printf("   gc read        : %10.2lf MB (%lu bytes)\n",
            (double)tot_gc_r / (double)1048576, (uint64_t)tot_gc_r);  // NOLINT
 
-    tot_b_r = xztl_stats.io[XZTL_STATS_READ_BYTES];
-    tot_b_w = xztl_stats.io[XZTL_STATS_APPEND_BYTES];
+    tot_b_r = xztl_stats->io[XZTL_STATS_READ_BYTES];
+    tot_b_w = xztl_stats->io[XZTL_STATS_APPEND_BYTES];
     tot_b   = tot_b_w + tot_b_r;
 
     wa = (double)tot_b_w / wa;  // NOLINT
@@ -99,17 +103,22 @@ void xztl_stats_print_io(void) {
            (double)tot_b_w / (double)1048576, (uint64_t)tot_b_w);  // NOLINT
     printf("   data read        : %10.2lf MB (%lu bytes)\n",
            (double)tot_b_r / (double)1048576, (uint64_t)tot_b_r);  // NOLINT
+    printf("   zero-copy read   : %10.2lf MB (%lu bytes)\n",
+           (double)xztl_stats->io[XZTL_STATS_READ_ZCOPY_BYTES] /
+               (double)1048576,
+           (uint64_t)xztl_stats->io[XZTL_STATS_READ_ZCOPY_BYTES]);  // NOLINT
 
     printf("\n Write Amplification: %.6lf\n", wa);
 }
 
 void xztl_stats_print_io_simple(void) {
-    uint64_t flush_w, app_w, padding_w, gc_w;
-    FILE    *fp;
+    struct xztl_stats_data *xztl_stats = xztl_stats_st();
+    uint64_t                flush_w, app_w, padding_w, gc_w;
+    FILE                   *fp;
 
-    flush_w   = xztl_stats.io[XZTL_STATS_APPEND_BYTES];
-    app_w     = xztl_stats.io[XZTL_STATS_APPEND_BYTES_U];
-    gc_w      = xztl_stats.io[XZTL_STATS_APPEND_BYTES_GC];
+    flush_w   = xztl_stats->io[XZTL_STATS_APPEND_BYTES];
+    app_w     = xztl_stats->io[XZTL_STATS_APPEND_BYTES_U];
+    gc_w      = xztl_stats->io[XZTL_STATS_APPEND_BYTES_GC];
     padding_w = flush_w - app_w - gc_w;
 
     printf("\nZTL Application Writes : %.2f MB (%lu bytes)\n",
@@ -125,14 +134,14 @@ void xztl_stats_print_io_simple(void) {
     uint64_t total_valid = 0;
     uint64_t total_used = 0;
     for (int level = 0; level < ZROCKS_LEVEL_NUM; level++) {
-        total_valid += xztl_node_stats.data[level][XZTL_CMD_ENTRY_VALID];
-        total_used += xztl_node_stats.data[level][XZTL_CMD_ENTRY_USED];
+        total_valid += xztl_stats->node[level][XZTL_CMD_ENTRY_VALID];
+        total_used += xztl_stats->node[level][XZTL_CMD_ENTRY_USED];
         printf("\nLevel %d Entry Valid: %-8lu Entry Used : %-8lu Space Used Ratio : %.6lf",
-            level, xztl_node_stats.data[level][XZTL_CMD_ENTRY_VALID],
-            xztl_node_stats.data[level][XZTL_CMD_ENTRY_USED],
-            xztl_node_stats.data[level][XZTL_CMD_ENTRY_USED] != 0 ?
-            (xztl_node_stats.data[level][XZTL_CMD_ENTRY_VALID] * 1.0 /
-            xztl_node_stats.data[level][XZTL_CMD_ENTRY_USED]) : 0.0);
+            level, xztl_stats->node[level][XZTL_CMD_ENTRY_VALID],
+            xztl_stats->node[level][XZTL_CMD_ENTRY_USED],
+            xztl_stats->node[level][XZTL_CMD_ENTRY_USED] != 0 ?
+            (xztl_stats->node[level][XZTL_CMD_ENTRY_VALID] * 1.0 /
+            xztl_stats->node[level][XZTL_CMD_ENTRY_USED]) : 0.0);
     }
     const uint64_t GB_L = 1000000000;
     printf("\nTotal Valid: %.2lf GB Total Used: %.2lf GB Used Ratio: %.6lf",
@@ -141,10 +150,10 @@ void xztl_stats_print_io_simple(void) {
             total_used !=0 ? (total_valid*1.0/total_used):0.0);
     printf(
         "\nRecycled Zones: %lu (%.2f MB, %lu bytes)\n",
-        xztl_stats.io[XZTL_STATS_RECYCLED_ZONES],
-        xztl_stats.io[XZTL_STATS_RECYCLED_BYTES] / (double)1048576,  // NOLINT
-        xztl_stats.io[XZTL_STATS_RECYCLED_BYTES]);
-    printf("Zone Resets   : %lu\n", xztl_stats.io[XZTL_STATS_RESET_MCMD]);
+        xztl_stats->io[XZTL_STATS_RECYCLED_ZONES],
+        xztl_stats->io[XZTL_STATS_RECYCLED_BYTES] / (double)1048576,  // NOLINT
+        xztl_stats->io[XZTL_STATS_RECYCLED_BYTES]);
+    printf("Zone Resets   : %lu\n", xztl_stats->io[XZTL_STATS_RESET_MCMD]);
     printf("\n");
 
     fp = fopen("/tmp/ztl_written_bytes", "w+");
@@ -160,8 +169,9 @@ void xztl_stats_print_io_simple(void) {
 }
 
 void xztl_stats_add_io(struct xztl_io_mcmd *cmd) {
-    uint32_t          nsec = 0, type_b, type_c, i;
-    struct xztl_core *core;
+    struct xztl_stats_data *xztl_stats = xztl_stats_st();
+    uint32_t                nsec = 0, type_b, type_c, i;
+    struct xztl_core       *core;
     get_xztl_core(&core);
     for (i = 0; i < cmd->naddr; i++) nsec += cmd->nsec[i];
 
@@ -179,8 +189,8 @@ void xztl_stats_add_io(struct xztl_io_mcmd *cmd) {
             return;
     }
 
-    ATOMIC_ADD(&xztl_stats.io[type_c], 1);
-    ATOMIC_ADD(&xztl_stats.io[type_b], nsec * core->media->geo.nbytes);
+    ATOMIC_ADD(&xztl_stats->io[type_c], 1);
+    ATOMIC_ADD(&xztl_stats->io[type_b], nsec * core->media->geo.nbytes);
 
 #if XZTL_PROMETHEUS
     /* Prometheus */
@@ -189,25 +199,32 @@ void xztl_stats_add_io(struct xztl_io_mcmd *cmd) {
 }
 
 void xztl_stats_inc(uint32_t type, uint64_t val) {
-    ATOMIC_ADD(&xztl_stats.io[type], val);
+    struct xztl_stats_data *xztl_stats = xztl_stats_st();
+
+    ATOMIC_ADD(&xztl_stats->io[type], val);
 
 #if XZTL_PROMETHEUS
     /* Prometheus */
     if (type == XZTL_STATS_APPEND_BYTES_U) {
-        xztl_prometheus_add_wa(xztl_stats.io[XZTL_STATS_APPEND_BYTES_U],
-                               xztl_stats.io[XZTL_STATS_APPEND_BYTES]);
+        xztl_prometheus_add_wa(xztl_stats->io[XZTL_STATS_APPEND_BYTES_U],
+                               xztl_stats->io[XZTL_STATS_APPEND_BYTES]);
     }
 #endif
 }
 
+uint64_t xztl_stats_get(uint32_t type) {
+    return xztl_stats_st()->io[type];
+}
+
 void xztl_stats_node_inc(int32_t level, uint32_t type, uint64_t val) {
-    ATOMIC_ADD(&xztl_node_stats.data[level][type], val);
+    ATOMIC_ADD(&xztl_stats_st()->node[level][type], val);
 }
 void xztl_stats_reset_io(void) {
-    uint32_t type_i;
+    struct xztl_stats_data *xztl_stats = xztl_stats_st();
+    uint32_t                type_i;
 
     for (type_i = 0; type_i < XZTL_STATS_IO_TYPES; type_i++)
-        ATOMIC_SWAP(&xztl_stats.io[type_i], xztl_stats.io[type_i], 0);
+        ATOMIC_SWAP(&xztl_stats->io[type_i], xztl_stats->io[type_i], 0);
 }
 
 void xztl_stats_exit(void) {
@@ -219,9 +236,11 @@ void xztl_stats_exit(void) {
 }
 
 int xztl_stats_init(void) {
-    memset(xztl_stats.io, 0x0, sizeof(uint64_t) * XZTL_STATS_IO_TYPES);
+    struct xztl_stats_data *xztl_stats = xztl_stats_st();
+
+    memset(xztl_stats->io, 0x0, sizeof(uint64_t) * XZTL_STATS_IO_TYPES);
     for (int i = 0; i < ZROCKS_LEVEL_NUM; i++) {
-        memset(xztl_node_stats.data[i], 0x0,
+        memset(xztl_stats->node[i], 0x0,
                sizeof(uint64_t) * XZTL_CMD_ENTRY_MAX);
     }
 
@@ -17,6 +17,11 @@
  * limitations under the License.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#endif
+
+#include <pthread.h>
 #include <sched.h>
 #include <unistd.h>
 #include <xztl-media.h>
@@ -29,35 +34,59 @@
 #define ZROCKS_DEBUG  0
 #define ZNS_ALIGMENT  4096
 
-extern struct app_group **glist;
-extern struct znd_media zndmedia;
+/* Writer threads spin for new commands before parking. The spin window
+ * grows when commands arrive while spinning and shrinks when it expires */
+#define ZTL_IO_SPIN_MIN_NS 1000   /* 1 us */
+#define ZTL_IO_SPIN_MAX_NS 200000 /* 200 us */
 
-struct ztl_queue_pool qp[ZROCKS_LEVEL_NUM];
-struct ztl_read_rs    read_resource[XZTL_READ_RS_NUM];
-pthread_mutex_t       rs_mutex;
+struct ztl_io_state {
+    struct ztl_queue_pool qp[ZROCKS_LEVEL_NUM][ZTL_IO_LANE_MAX];
 
-static int _ztl_io_get_read_rs(void) {
-    int id;
-    int ret = -1;
+    /* Writer lanes per level, zero means the configured lanes */
+    uint32_t lanes[ZROCKS_LEVEL_NUM];
+    uint32_t nlanes[ZROCKS_LEVEL_NUM];
+    uint32_t lane_rr[ZROCKS_LEVEL_NUM];
 
-    for (id = 0; id < zndmedia.read_ctx_num; id++) {
-        if (!read_resource[id].usedflag) {
-            read_resource[id].usedflag = true;
-            ret                        = id;
-            break;
-        }
-    }
-    return ret;
-}
+    /* Stripe unit of new nodes per level, zero means the configured one */
+    uint32_t stripe[ZROCKS_LEVEL_NUM];
+
+    /* Zones of new nodes per level, zero means the configured width */
+    uint32_t width[ZROCKS_LEVEL_NUM];
+
+    /* Write mode of new user writes, zero is XZTL_WRITE_APPEND */
+    volatile uint8_t append;
+
+    /* Read contexts are created lazily and cached by the reader threads.
+     * Contexts of exited threads go to a lock-free overflow stack, whose head
+     * holds an ABA tag in the upper 32 bits and the context id + 1 in the
+     * lower 32 bits */
+    struct ztl_read_rs *read_rs[XZTL_READ_RS_NUM];
+    volatile uint32_t   read_rs_count;
+    volatile uint64_t   read_rs_free;
+    pthread_key_t       read_rs_key;
+    uint32_t            read_rs_gen;
+};
+
+/* Generations are unique across instances, so the thread cache below also
+ * misses when the thread reads from another instance */
+static uint32_t read_rs_gen_seq;
+
+static __thread struct ztl_read_rs *read_rs_cache;
+static __thread uint32_t            read_rs_cache_gen;
 
-static void _ztl_io_put_read_rs(int id) {
-    read_resource[id].usedflag = false;
+static struct ztl_io_state *ztl_io_st(void) {
+    return xztl_instance_state(XZTL_STATE_IO, sizeof(struct ztl_io_state));
 }
 
 static void _ztl_io_write_rs_exit(struct ztl_queue_pool *q) {
-    int mcmd_id;
+    int      mcmd_id;
+    uint16_t dev;
 
-    xztl_ctx_media_exit(q->tctx);
+    for (dev = 0; dev < XZTL_MEDIA_MAX_DEV; dev++) {
+        xztl_ctx_media_exit(q->dev_tctx[dev]);
+        q->dev_tctx[dev] = NULL;
+    }
+    q->tctx = NULL;
     xztl_media_dma_free(q->prov);
 
     for (mcmd_id = 0; mcmd_id < ZTL_IO_RC_NUM; mcmd_id++)
@@ -65,7 +94,10 @@ static void _ztl_io_write_rs_exit(struct ztl_queue_pool *q) {
 }
 
 static int _ztl_io_write_rs_init(struct ztl_queue_pool *q) {
-    int mcmd_id;
+    struct xztl_core *core;
+    int               mcmd_id;
+    uint16_t          dev;
+    get_xztl_core(&core);
 
     for (mcmd_id = 0; mcmd_id < ZTL_IO_RC_NUM; mcmd_id++) {
         q->mcmd[mcmd_id] = aligned_alloc(64, sizeof(struct xztl_io_mcmd));
@@ -79,13 +111,18 @@ static int _ztl_io_write_rs_init(struct ztl_queue_pool *q) {
     }
 
     struct app_pro_addr *prov = (struct app_pro_addr *)q->prov;
-    prov->grp                 = glist[0];
-
-    q->tctx = xztl_ctx_media_init(zndmedia.io_depth);
-    if (!q->tctx) {
-        log_err("_ztl_thd_init: Thread resource (tctx) allocation error.");
-        return XZTL_ZTL_IO_ERR;
+    prov->grp                 = ztl()->groups.get_fn(0);
+
+    /* A lane writes to one node at a time, it switches to the context of
+     * the node device when it gets a new node */
+    for (dev = 0; dev < xztl_media_ndevs(); dev++) {
+        q->dev_tctx[dev] = xztl_ctx_media_init_dev(dev, core->media->io_depth);
+        if (!q->dev_tctx[dev]) {
+            log_err("_ztl_thd_init: Thread resource (tctx) allocation error.");
+            return XZTL_ZTL_IO_ERR;
+        }
     }
+    q->tctx = q->dev_tctx[0];
 
     q->node = NULL;
 
@@ -93,35 +130,178 @@ static int _ztl_io_write_rs_init(struct ztl_queue_pool *q) {
 }
 
 static void _ztl_io_read_rs_exit(struct ztl_read_rs *r) {
-    int mcmd_id;
+    int      mcmd_id;
+    uint16_t dev;
 
-    xztl_ctx_media_exit(r->tctx);
+    for (dev = 0; dev < XZTL_MEDIA_MAX_DEV; dev++) {
+        xztl_ctx_media_exit(r->tctx[dev]);
+        r->tctx[dev] = NULL;
+    }
     for (mcmd_id = 0; mcmd_id < ZTL_IO_RC_NUM; mcmd_id++) {
         free(r->mcmd[mcmd_id]);
-        xztl_media_dma_free(r->prp[mcmd_id]);
+        if (r->prp[mcmd_id])
+            xztl_media_dma_free(r->prp[mcmd_id]);
     }
 }
 
 static int _ztl_io_read_rs_init(struct ztl_read_rs *r) {
-    uint64_t base_align_bytes = ZNS_ALIGMENT * ZTL_IO_SEC_MCMD;
-    int      mcmd_id;
+    uint64_t          base_align_bytes = ZNS_ALIGMENT * ZTL_IO_SEC_MCMD;
+    int               mcmd_id;
+    uint16_t          dev;
+    struct xztl_core *core;
+    get_xztl_core(&core);
 
     for (mcmd_id = 0; mcmd_id < ZTL_IO_RC_NUM; mcmd_id++) {
         r->mcmd[mcmd_id] = aligned_alloc(64, sizeof(struct xztl_io_mcmd));
         r->prp[mcmd_id]  = xztl_media_dma_alloc(base_align_bytes);
+        if (!r->mcmd[mcmd_id] || !r->prp[mcmd_id]) {
+            log_err("_ztl_io_read_rs_init: Read buffer allocation error.");
+            return XZTL_ZTL_IO_ERR;
+        }
     }
 
-    r->tctx = xztl_ctx_media_init(zndmedia.io_depth);
-    if (!r->tctx) {
-        log_err("_ztl_thd_init: Thread resource (tctx) allocation error.");
-        return XZTL_ZTL_IO_ERR;
+    for (dev = 0; dev < xztl_media_ndevs(); dev++) {
+        r->tctx[dev] = xztl_ctx_media_init_dev(dev, core->media->io_depth);
+        if (!r->tctx[dev]) {
+            log_err("_ztl_thd_init: Thread resource (tctx) allocation error.");
+            return XZTL_ZTL_IO_ERR;
+        }
     }
 
-    r->usedflag = false;
+    r->next_free = 0;
+    r->busy      = 0;
 
     return XZTL_OK;
 }
 
+static void _ztl_io_read_rs_push(struct ztl_read_rs *r) {
+    struct ztl_io_state *st = ztl_io_st();
+    uint64_t             old, new;
+
+    do {
+        old          = st->read_rs_free;
+        r->next_free = (uint32_t)old;
+        new          = ((old >> 32) + 1) << 32 | (r->id + 1);
+    } while (!__sync_bool_compare_and_swap(&st->read_rs_free, old, new));
+}
+
+static struct ztl_read_rs *_ztl_io_read_rs_pop(void) {
+    struct ztl_io_state *st = ztl_io_st();
+    struct ztl_read_rs  *r;
+    uint64_t             old, new;
+
+    do {
+        old = st->read_rs_free;
+        if (!(uint32_t)old)
+            return NULL;
+        r   = st->read_rs[(uint32_t)old - 1];
+        new = ((old >> 32) + 1) << 32 | r->next_free;
+    } while (!__sync_bool_compare_and_swap(&st->read_rs_free, old, new));
+
+    return r;
+}
+
+/* Thread exit: the cached context goes back to the overflow stack */
+static void _ztl_io_read_rs_release(void *arg) {
+    struct ztl_read_rs   *r = (struct ztl_read_rs *)arg;
+    struct xztl_instance *prev;
+
+    if (!r)
+        return;
+
+    prev = xztl_instance_bind(r->inst);
+    if (r->gen == ztl_io_st()->read_rs_gen)
+        _ztl_io_read_rs_push(r);
+    xztl_instance_bind(prev);
+}
+
+static struct ztl_read_rs *_ztl_io_read_rs_create(void) {
+    struct ztl_io_state *st = ztl_io_st();
+    struct xztl_core    *core;
+    struct ztl_read_rs  *r;
+    uint32_t             id;
+    get_xztl_core(&core);
+
+    do {
+        id = st->read_rs_count;
+        if (id >= core->media->read_ctx_num)
+            return NULL;
+    } while (!__sync_bool_compare_and_swap(&st->read_rs_count, id, id + 1));
+
+    r = calloc(1, sizeof(struct ztl_read_rs));
+    if (r && _ztl_io_read_rs_init(r)) {
+        _ztl_io_read_rs_exit(r);
+        free(r);
+        r = NULL;
+    }
+
+    /* The slot is not reused, a concurrent creator may own the next one */
+    if (!r) {
+        log_err("_ztl_io_read_rs_create: Read context allocation error.");
+        return NULL;
+    }
+
+    r->id   = id;
+    r->inst = xztl_instance_get();
+    r->gen  = st->read_rs_gen;
+    __atomic_store_n(&st->read_rs[id], r, __ATOMIC_RELEASE);
+
+    return r;
+}
+
+static int _ztl_io_read_rs_try(struct ztl_read_rs *r) {
+    return r && !r->busy && __sync_bool_compare_and_swap(&r->busy, 0, 1);
+}
+
+/* Returns the read context cached by the calling thread. Threads without a
+ * context take one from the overflow stack or create one. If all contexts
+ * exist and none is cached, an idle context of another thread is borrowed
+ * for this read only */
+static struct ztl_read_rs *_ztl_io_get_read_rs(void) {
+    struct ztl_io_state *st = ztl_io_st();
+    struct ztl_read_rs  *r;
+    uint32_t             id, count;
+
+    /* The context of another instance stays with its key */
+    if (read_rs_cache_gen != st->read_rs_gen) {
+        read_rs_cache     = pthread_getspecific(st->read_rs_key);
+        read_rs_cache_gen = st->read_rs_gen;
+    }
+
+    if (!read_rs_cache) {
+        r = _ztl_io_read_rs_pop();
+        if (!r)
+            r = _ztl_io_read_rs_create();
+        if (r) {
+            read_rs_cache = r;
+            pthread_setspecific(st->read_rs_key, r);
+        }
+    }
+
+    if (_ztl_io_read_rs_try(read_rs_cache))
+        return read_rs_cache;
+
+    while (1) {
+        count = __atomic_load_n(&st->read_rs_count, __ATOMIC_ACQUIRE);
+        for (id = 0; id < count; id++) {
+            r = __atomic_load_n(&st->read_rs[id], __ATOMIC_ACQUIRE);
+            if (_ztl_io_read_rs_try(r))
+                return r;
+        }
+
+        if (!count) {
+            log_err("_ztl_io_get_read_rs err.\n");
+            return NULL;
+        }
+
+        sched_yield();
+    }
+}
+
+static void _ztl_io_put_read_rs(struct ztl_read_rs *r) {
+    __atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+}
+
 static void ztl_io_read_callback_mcmd(void *arg) {
     struct xztl_io_ucmd *ucmd;
     struct xztl_io_mcmd *mcmd;
@@ -153,7 +333,7 @@ static void ztl_io_read_callback_mcmd(void *arg) {
         }
 
         ucmd->status = mcmd->status;
-    } else {
+    } else if (!mcmd->zcopy) {
         /* If I/O succeeded, we copy the data from the correct offset to the
          * user */
         misalign = mcmd->sequence;  // temp
@@ -196,7 +376,7 @@ static void ztl_io_write_callback_mcmd(void *arg) {
         ucmd->moffset[mcmd->sequence] = mcmd->paddr[0];
     }
 
-    ucmd->minflight[mcmd->sequence_zn] = 0;
+    ucmd->minflight[mcmd->sequence_zn]--;
     ATOMIC_ADD(&ucmd->ncb, 1)
 
     if (ucmd->ncb == ucmd->nmcmd) {
@@ -204,6 +384,20 @@ static void ztl_io_write_callback_mcmd(void *arg) {
     }
 }
 
+/* Reaps all available completions, returns the number reaped */
+static uint32_t ztl_io_reap_ctx(struct xztl_mthread_ctx *tctx) {
+    struct xztl_misc_cmd misc;
+    misc.opcode         = XZTL_MISC_ASYNCH_POKE;
+    misc.asynch.ctx_ptr = tctx;
+    misc.asynch.limit   = 0;
+    misc.asynch.count   = 0;
+
+    if (xztl_media_submit_misc(&misc))
+        return 0;
+
+    return misc.asynch.count;
+}
+
 static void ztl_io_poke_ctx(struct xztl_mthread_ctx *tctx) {
     struct xztl_misc_cmd misc;
     misc.opcode         = XZTL_MISC_ASYNCH_POKE;
@@ -218,119 +412,149 @@ static void ztl_io_poke_ctx(struct xztl_mthread_ctx *tctx) {
     }
 }
 
-int ztl_io_read_ucmd(struct xztl_io_ucmd *ucmd, struct ztl_read_rs *r) {
+/* Builds the media commands of a user read starting at r->mcmd[first].
+ * Returns the number of media commands or -1 if they do not fit in the
+ * read resource */
+static int _ztl_io_read_prep(struct xztl_io_ucmd *ucmd, struct ztl_read_rs *r,
+                             int first) {
     struct xztl_io_mcmd *mcmd;
     uint32_t             node_id = ucmd->node_id[0];
 
-    struct app_group        *grp = glist[0];
-    struct ztl_pro_node_grp *pro = grp->pro;
-    struct ztl_pro_node *znode = (struct ztl_pro_node *)(&pro->vnodes[node_id]);
+    struct ztl_pro_node     *znode = ztl()->pro->get_vnode_fn(node_id);
+    struct xztl_mthread_ctx *tctx;
+    struct xztl_core        *core;
+    get_xztl_core(&core);
+
+    /* Narrow nodes of a slot that was not split have no zones */
+    if (!znode || !znode->nzones)
+        return -1;
+
+    /* Commands go to the context of the node device */
+    tctx = r->tctx[xztl_media_grp_dev(znode->grp->id)];
 
     size_t size = ucmd->size;
 
-    uint64_t misalign, sec_size, sec_start, zindex, zone_sec_off, read_num;
-    uint64_t sec_left, bytes_off, left;
-    int      nlevel, cmd_i, total_cmd, submitted;
-    int      ret = 0;
+    uint64_t misalign, sec_size, sec, unit, unit_secs, mdts_secs, read_num;
+    uint64_t sec_left, bytes_off, left, cpsize, zcopy_bytes;
+    int      total_cmd;
+    char    *dst;
 
     uint64_t offset = ucmd->offset;
     misalign        = offset % ZNS_ALIGMENT;
     sec_size        = (size + misalign) / ZNS_ALIGMENT +
                (((size + misalign) % ZNS_ALIGMENT) ? 1 : 0);
-    sec_start      = offset / ZNS_ALIGMENT;
-    int level_secs = ZTL_PRO_ZONE_NUM_INNODE * ZTL_IO_SEC_MCMD;
-
-    /* ??????(8 * 16=128) (0~127 0lun 128~255 1lun ...)*/
-    nlevel = sec_start / level_secs;
-
-    /* ?nlevel + 1?????16*/
-    zindex = (sec_start % level_secs) / ZTL_IO_SEC_MCMD;
+    sec             = offset / ZNS_ALIGMENT;
 
-    /* ?????zone offset???????(64KB) */
-    zone_sec_off =
-        (nlevel * ZTL_IO_SEC_MCMD) + (sec_start % level_secs) % ZTL_IO_SEC_MCMD;
-    read_num = ZTL_IO_SEC_MCMD - (sec_start % level_secs) % ZTL_IO_SEC_MCMD;
-    read_num = (sec_size > read_num) ? read_num : sec_size;
+    /* Stripe units are spread round-robin over the zones of the node */
+    unit_secs = znode->stripe * ZTL_IO_SEC_MCMD;
+    mdts_secs = core->media->geo.nbytes_mdts / ZNS_ALIGMENT;
+    mdts_secs = (mdts_secs < ZTL_IO_SEC_MCMD) ? ZTL_IO_SEC_MCMD : mdts_secs;
 
     if (ZROCKS_DEBUG)
         log_infoa("zrocks (__read): sec_size %lu\n", sec_size);
 
-    sec_left  = sec_size;
-    bytes_off = 0;
-    left      = size;
-    total_cmd = 0;
+    sec_left    = sec_size;
+    bytes_off   = 0;
+    left        = size;
+    total_cmd   = 0;
+    zcopy_bytes = 0;
 
     while (sec_left) {
-        mcmd = r->mcmd[total_cmd];
+        if (first + total_cmd >= ZTL_IO_RC_NUM)
+            return -1;
+
+        unit     = sec / unit_secs;
+        read_num = unit_secs - sec % unit_secs;
+        read_num = (read_num > sec_left) ? sec_left : read_num;
+        read_num = (read_num > mdts_secs) ? mdts_secs : read_num;
+
+        /* Whole sectors are read straight into the user buffer. Misaligned
+         * head and tail sectors go through the bounce buffer, which holds
+         * ZTL_IO_SEC_MCMD sectors */
+        dst    = (char *)ucmd->buf + bytes_off;
+        cpsize = read_num * ZNS_ALIGMENT - misalign;
+        cpsize = (cpsize > left) ? left : cpsize;
+        if (!misalign && cpsize > ZNS_ALIGMENT &&
+            cpsize < read_num * ZNS_ALIGMENT) {
+            read_num = cpsize / ZNS_ALIGMENT;
+            cpsize   = read_num * ZNS_ALIGMENT;
+        }
+        if (misalign || cpsize != read_num * ZNS_ALIGMENT ||
+            !xztl_media_dma_check(dst, cpsize)) {
+            if (read_num > ZTL_IO_SEC_MCMD - sec % ZTL_IO_SEC_MCMD) {
+                read_num = ZTL_IO_SEC_MCMD - sec % ZTL_IO_SEC_MCMD;
+                cpsize   = read_num * ZNS_ALIGMENT - misalign;
+                cpsize   = (cpsize > left) ? left : cpsize;
+            }
+            dst = NULL;
+        }
+
+        mcmd = r->mcmd[first + total_cmd];
         memset(mcmd, 0x0, sizeof(struct xztl_io_mcmd));
 
-        mcmd->opcode       = XZTL_CMD_READ;
-        mcmd->naddr        = 1;
-        mcmd->synch        = 0;
-        mcmd->async_ctx    = r->tctx;
-        mcmd->addr[0].addr = 0;
-        mcmd->nsec[0]      = read_num;
-        sec_left -= mcmd->nsec[0];
+        mcmd->opcode           = XZTL_CMD_READ;
+        mcmd->naddr            = 1;
+        mcmd->synch            = 0;
+        mcmd->async_ctx        = tctx;
+        mcmd->addr[0].addr     = 0;
+        mcmd->nsec[0]          = read_num;
         mcmd->callback_err_cnt = 0;
-        mcmd->prp[0]           = (uint64_t)r->prp[total_cmd];
 
         mcmd->addr[0].g.sect =
-            znode->vzones[zindex]->addr.g.sect + zone_sec_off;
+            znode->vzones[unit % znode->nzones]->addr.g.sect +
+            (unit / znode->nzones) * unit_secs + sec % unit_secs;
         mcmd->status   = 0;
         mcmd->callback = ztl_io_read_callback_mcmd;
 
         mcmd->sequence = misalign;   // tmp prp offset
         mcmd->buf_off  = bytes_off;  // temp
-        mcmd->cpsize =
-            (mcmd->nsec[0] * ZNS_ALIGMENT) - misalign > left
-                ? left
-                : ((mcmd->nsec[0] * ZNS_ALIGMENT) - misalign);  // copy size
-        left -= mcmd->cpsize;
+        mcmd->cpsize   = cpsize;     // copy size
+
+        if (dst) {
+            mcmd->zcopy  = 1;
+            mcmd->prp[0] = (uint64_t)dst;
+            zcopy_bytes += cpsize;
+        } else {
+            mcmd->prp[0] = (uint64_t)r->prp[first + total_cmd];
+        }
 
         mcmd->opaque          = ucmd;
         mcmd->submitted       = 0;
         ucmd->mcmd[total_cmd] = mcmd;
 
         total_cmd++;
-        if (sec_left == 0)
-            break;
-
-        zindex = (zindex + 1) % ZTL_PRO_ZONE_NUM_INNODE;
-        if (zindex == 0)
-            nlevel++;
-
-        zone_sec_off = nlevel * ZTL_IO_SEC_MCMD;
-        read_num = (sec_left > ZTL_IO_SEC_MCMD) ? ZTL_IO_SEC_MCMD : sec_left;
-        bytes_off += mcmd->cpsize;
+        sec += read_num;
+        sec_left -= read_num;
+        bytes_off += cpsize;
+        left -= cpsize;
         misalign = 0;
     }
 
-    if (ZROCKS_DEBUG)
-        log_infoa("ztl_io_read_ucmd: total mcmd [%u]\n", total_cmd);
+    ucmd->nmcmd = total_cmd;
+    ucmd->ncb   = 0;
 
     xztl_stats_inc(XZTL_STATS_READ_BYTES, sec_size * ZNS_ALIGMENT);
+    if (zcopy_bytes)
+        xztl_stats_inc(XZTL_STATS_READ_ZCOPY_BYTES, zcopy_bytes);
 
-    if (total_cmd == 1) {
-        ucmd->mcmd[0]->synch = 1;
-        ret                  = xztl_media_submit_io(ucmd->mcmd[0]);
-
-        misalign = ucmd->mcmd[0]->sequence;
-        memcpy(ucmd->buf,
-               (char *)(ucmd->mcmd[0]->prp[0] + misalign), /* NOLINT */
-               ucmd->mcmd[0]->cpsize);
+    return total_cmd;
+}
 
-        ucmd->completed = 1;
-        return ret;
-    }
+/* Submits r->mcmd[0..total_cmd - 1] to the read context and reaps all of
+ * them with a single drain. Data is copied to the users by the callback */
+static int _ztl_io_read_submit(struct ztl_read_rs *r, int total_cmd) {
+    int      cmd_i, submitted, err;
+    int      ret   = 0;
+    uint16_t ndevs = xztl_media_ndevs();
+    uint16_t dev;
 
-    submitted   = 0;
-    ucmd->nmcmd = total_cmd;
+    submitted = 0;
     while (submitted < total_cmd) {
         for (cmd_i = 0; cmd_i < total_cmd; cmd_i++) {
-            if (ucmd->mcmd[cmd_i]->submitted)
+            if (r->mcmd[cmd_i]->submitted)
                 continue;
 
-            ret = xztl_media_submit_io(ucmd->mcmd[cmd_i]);
+            ret = xztl_media_submit_io(r->mcmd[cmd_i]);
             if (ret) {
                 xztl_stats_inc(XZTL_STATS_READ_SUBMIT_FAIL, 1);
                 log_erra("ztl_wca_read_ucmd: xztl_media_submit_io err [%d]\n",
@@ -338,46 +562,257 @@ int ztl_io_read_ucmd(struct xztl_io_ucmd *ucmd, struct ztl_read_rs *r) {
                 continue;
             }
 
-            ucmd->mcmd[cmd_i]->submitted = 1;
+            r->mcmd[cmd_i]->submitted = 1;
             submitted++;
         }
+
+        /* Queue is full, reap completions before retrying */
+        if (submitted < total_cmd) {
+            for (dev = 0; dev < ndevs; dev++)
+                ztl_io_poke_ctx(r->tctx[dev]);
+        }
     }
 
-    int err = xnvme_queue_drain(r->tctx->queue);
-    if (err < 0) {
-        log_erra("ztl_io_read_ucmd: xnvme_queue_drain() returns error [%d]\n",
-                 err);
+    struct xztl_misc_cmd misc;
+    for (dev = 0; dev < ndevs; dev++) {
+        misc.opcode         = XZTL_MISC_ASYNCH_DRAIN;
+        misc.asynch.ctx_ptr = r->tctx[dev];
+        misc.asynch.count   = 0;
+
+        err = xztl_media_submit_misc(&misc);
+        if (err) {
+            log_erra("ztl_io_read_ucmd: drain returns error [%d]\n", err);
+        }
     }
 
+    return ret;
+}
+
+int ztl_io_read_ucmd(struct xztl_io_ucmd *ucmd, struct ztl_read_rs *r) {
+    uint64_t misalign;
+    int      total_cmd;
+    int      ret = 0;
+
+    total_cmd = _ztl_io_read_prep(ucmd, r, 0);
+    if (total_cmd < 0) {
+        log_erra("ztl_io_read_ucmd: read too large [%lu] bytes\n",
+                 ucmd->size);
+        return XZTL_ZTL_IO_ERR;
+    }
+
+    if (ZROCKS_DEBUG)
+        log_infoa("ztl_io_read_ucmd: total mcmd [%u]\n", total_cmd);
+
+    if (total_cmd == 1) {
+        ucmd->mcmd[0]->synch = 1;
+        ret                  = xztl_media_submit_io(ucmd->mcmd[0]);
+
+        if (!ucmd->mcmd[0]->zcopy) {
+            misalign = ucmd->mcmd[0]->sequence;
+            memcpy(ucmd->buf,
+                   (char *)(ucmd->mcmd[0]->prp[0] + misalign), /* NOLINT */
+                   ucmd->mcmd[0]->cpsize);
+        }
+
+        ucmd->completed = 1;
+        return ret;
+    }
+
+    ret = _ztl_io_read_submit(r, total_cmd);
+
     ucmd->completed = 1;
     return ret;
 }
 
 int ztl_io_read(struct xztl_io_ucmd *ucmd) {
-    int id, ret;
+    struct ztl_read_rs *r;
+    int                 ret;
+
+    r = _ztl_io_get_read_rs();
+    if (!r)
+        return XZTL_ZTL_IO_ERR;
+
+    ret = ztl_io_read_ucmd(ucmd, r);
+    _ztl_io_put_read_rs(r);
+    return ret;
+}
 
-    pthread_mutex_lock(&rs_mutex);
-    id = _ztl_io_get_read_rs();
-    if (id < 0) {
-        log_err("_ztl_io_get_read_rs err.\n");
-        pthread_mutex_unlock(&rs_mutex);
+/* Reads a vector of user commands, possibly in different nodes, with a
+ * single read resource. Media commands of as many user commands as the
+ * resource holds are submitted together and reaped by a single drain */
+int ztl_io_read_batch(struct xztl_io_ucmd *ucmds, uint32_t count) {
+    struct ztl_read_rs *r;
+    uint32_t            ucmd_i, first, i;
+    int                 ncmd, total_cmd;
+    int                 ret = XZTL_OK;
+
+    r = _ztl_io_get_read_rs();
+    if (!r)
         return XZTL_ZTL_IO_ERR;
+
+    ucmd_i = 0;
+
+    while (ucmd_i < count) {
+        first     = ucmd_i;
+        total_cmd = 0;
+
+        for (; ucmd_i < count; ucmd_i++) {
+            ncmd = _ztl_io_read_prep(&ucmds[ucmd_i], r, total_cmd);
+            if (ncmd < 0)
+                break;
+            total_cmd += ncmd;
+        }
+
+        /* A single command larger than the resource */
+        if (!total_cmd) {
+            log_erra("ztl_io_read_batch: read too large [%lu] bytes\n",
+                     ucmds[ucmd_i].size);
+            ucmds[ucmd_i].status    = XZTL_ZTL_IO_ERR;
+            ucmds[ucmd_i].completed = 1;
+            ret                     = XZTL_ZTL_IO_ERR;
+            ucmd_i++;
+            continue;
+        }
+
+        if (ZROCKS_DEBUG)
+            log_infoa("ztl_io_read_batch: ucmds [%u], total mcmd [%u]\n",
+                      ucmd_i - first, total_cmd);
+
+        if (_ztl_io_read_submit(r, total_cmd))
+            ret = XZTL_ZTL_IO_ERR;
+
+        for (i = first; i < ucmd_i; i++) {
+            if (ucmds[i].status)
+                ret = XZTL_ZTL_IO_ERR;
+            ucmds[i].completed = 1;
+        }
     }
-    pthread_mutex_unlock(&rs_mutex);
 
-    ret = ztl_io_read_ucmd(ucmd, &read_resource[id]);
-    _ztl_io_put_read_rs(id);
+    _ztl_io_put_read_rs(r);
     return ret;
 }
 
-int ztl_io_write_ucmd(struct xztl_io_ucmd *ucmd) {
-    struct ztl_queue_pool *q;
+/* Submits the media commands queued in the per-zone FIFOs of the lane. A zone
+ * has at most 'depth' commands in flight, 1 for regular writes. Blocked
+ * zones are left for the next pass and completions are reaped in between,
+ * returns when all commands have completed */
+static void ztl_io_write_sched(struct ztl_queue_pool *q,
+                               struct xztl_io_ucmd *ucmd, uint32_t naddr,
+                               uint32_t depth) {
+    uint32_t nready, i, zn_i;
+    uint16_t cmd_i;
+
+    nready = 0;
+    for (zn_i = 0; zn_i < naddr; zn_i++) {
+        ucmd->minflight[zn_i] = 0;
+        if (q->zn_head[zn_i] != UINT16_MAX)
+            q->zn_ready[nready++] = zn_i;
+    }
+
+    while (nready) {
+        for (i = 0; i < nready;) {
+            zn_i = q->zn_ready[i];
+
+            while (q->zn_head[zn_i] != UINT16_MAX &&
+                   ucmd->minflight[zn_i] < depth) {
+                cmd_i = q->zn_head[zn_i];
+                if (xztl_media_submit_io(ucmd->mcmd[cmd_i])) {
+                    ZDEBUG(ZDEBUG_IO, " XZTL_STATS_WRITE_SUBMIT_FAIL [%d]",
+                           zn_i);
+                    xztl_stats_inc(XZTL_STATS_WRITE_SUBMIT_FAIL, 1);
+                    break;
+                }
+
+                ucmd->mcmd[cmd_i]->submitted = 1;
+                ucmd->minflight[zn_i]++;
+                q->zn_head[zn_i] = q->zn_next[cmd_i];
+            }
+
+            /* Drained zones leave the ready set, order is not relevant */
+            if (q->zn_head[zn_i] == UINT16_MAX)
+                q->zn_ready[i] = q->zn_ready[--nready];
+            else
+                i++;
+        }
+
+        ztl_io_reap_ctx(q->tctx);
+    }
+
+    while (ucmd->ncb < ucmd->nmcmd) ztl_io_reap_ctx(q->tctx);
+}
+
+/* Appends of the same zone may complete out of order. The piece layout is
+ * only valid if every command landed at the planned address */
+static int ztl_io_write_reordered(struct xztl_io_ucmd *ucmd, int num) {
+    int cmd_i;
+
+    for (cmd_i = 0; cmd_i < num; cmd_i++) {
+        if (ucmd->moffset[cmd_i] != ucmd->mcmd[cmd_i]->addr[0].g.sect)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Maps the data of reordered appends where it completed. The last piece is
+ * split at each completion address that does not follow the data before it
+ * in the node. Returns 1 if more than 'max' pieces are needed */
+static int ztl_io_write_split(struct xztl_io_ucmd *ucmd,
+                              struct ztl_pro_node *node, uint16_t max) {
+    struct ztl_pro_zone *zone;
+    uint16_t             p = ucmd->pieces, n = p;
+    uint32_t             stripe = ucmd->stripe[p];
+    uint64_t             unit_secs = stripe * ZTL_IO_SEC_MCMD;
+    uint64_t             sect, nsec, rel, run, off;
+    uint32_t             zn_i;
+    int                  cmd_i;
+
+    for (cmd_i = 0; cmd_i < ucmd->nmcmd; cmd_i++) {
+        zn_i = (ucmd->start[p] / stripe + ucmd->mcmd[cmd_i]->sequence_zn) %
+               node->nzones;
+        zone = node->vzones[zn_i];
+        sect = ucmd->moffset[cmd_i];
+        nsec = ucmd->msec[cmd_i];
+
+        /* Stripe units are contiguous in the node, see ztl_pro_grp_get */
+        while (nsec) {
+            rel = sect - zone->addr.g.sect;
+            run = unit_secs - rel % unit_secs;
+            run = (run > nsec) ? nsec : run;
+            off = ((rel / unit_secs) * node->nzones + zn_i) * stripe +
+                  rel % unit_secs / ZTL_IO_SEC_MCMD;
+
+            if (n > p && off == ucmd->start[n - 1] + ucmd->num[n - 1]) {
+                ucmd->num[n - 1] += run / ZTL_IO_SEC_MCMD;
+            } else {
+                if (n == max)
+                    return 1;
+                ucmd->node_id[n] = node->id;
+                ucmd->start[n]   = off;
+                ucmd->num[n]     = run / ZTL_IO_SEC_MCMD;
+                ucmd->stripe[n]  = stripe;
+                n++;
+            }
+
+            sect += run;
+            nsec -= run;
+        }
+    }
+
+    ucmd->pieces = n - 1;
+    return 0;
+}
+
+static int ztl_io_write_ucmd(struct ztl_queue_pool *q,
+                             struct xztl_io_ucmd   *ucmd) {
     struct app_pro_addr   *prov;
     struct xztl_io_mcmd   *mcmd;
     struct xztl_core      *core;
     get_xztl_core(&core);
-    uint32_t nsec, ncmd, submitted, zn_i;
-    uint64_t boff;
+    uint32_t nsec, ncmd, zn_i, depth, stripe;
+    uint64_t boff, piece_off, off, end, run;
+    uint16_t max;
+    uint8_t  append;
     int      ret, num, left;
     int      i, cmd_i;
 
@@ -397,16 +832,15 @@ int ztl_io_write_ucmd(struct xztl_io_ucmd *ucmd) {
 
     /* First we check the number of commands based on ZTL_IO_SEC_MCMD */
     ncmd = nsec / ZTL_IO_SEC_MCMD;
-    if (ncmd > XZTL_IO_MAX_MCMD) {
+    if (ncmd > ZTL_IO_RC_NUM) {
         log_erra(
-            "ztl_io_write_ucmd: User command exceed XZTL_IO_MAX_MCMD. "
+            "ztl_io_write_ucmd: User command exceed ZTL_IO_RC_NUM. "
             "[%d] of [%d]",
-            ncmd, XZTL_IO_MAX_MCMD);
+            ncmd, ZTL_IO_RC_NUM);
         goto FAILURE;
     }
     ZDEBUG(ZDEBUG_IO, "ztl_io_write_ucmd: NMCMD [%d]", ncmd);
 
-    q           = &qp[ucmd->prov_type];
     prov        = q->prov;
     prov->naddr = 0;
 
@@ -415,20 +849,32 @@ int ztl_io_write_ucmd(struct xztl_io_ucmd *ucmd) {
     ucmd->completed = 0;
     ucmd->ncb       = 0;
 
-    boff = (uint64_t)ucmd->buf;
+    boff   = (uint64_t)ucmd->buf;
+    append = ztl_io_st()->append;
+    depth  = (append) ? ZTL_IO_APPEND_DEPTH : 1;
 
     left = ncmd;
 reget:
+    piece_off = boff;
+    if (ucmd->pieces >= sizeof(ucmd->node_id) / sizeof(ucmd->node_id[0])) {
+        log_erra("ztl_io_write_ucmd: Too many pieces. ID [%lu]", ucmd->id);
+        goto FAILURE;
+    }
+
     ret = ztl()->pro->get_node_fn(q);
     if (ret) {
         log_erra("_ztl_io_get_prov: Get node failed [%d].", ret);
         goto FAILURE;
     }
+
+    /* Pieces are written one at a time, all commands of the previous piece
+     * have completed in its context */
+    q->tctx = q->dev_tctx[xztl_media_grp_dev(q->node->grp->id)];
     num = (q->node->optimal_write_sec_left <= left)
               ? q->node->optimal_write_sec_left
               : left;
     if (q->node->level == -1) {
-        q->node->level = ucmd->prov_type;
+        ztl_pro_grp_node_level(q->node, ucmd->prov_type);
     }
 
     /* Record mapping tables */
@@ -444,130 +890,106 @@ reget:
         goto FAIL_NCMD;
     }
 
-    /* Populate media commands */
-    int zn_cmd_id[ZTL_PRO_ZONE_NUM_INNODE * 2][2000] = {{-1}};
-    int zn_cmd_id_num[ZTL_PRO_ZONE_NUM_INNODE * 2]   = {0};
-    int zn_cmd_id_index[ZTL_PRO_ZONE_NUM_INNODE * 2] = {0};
-    int zone_sector_num[ZTL_PRO_ZONE_NUM_INNODE * 2] = {0};
+    /* Populate media commands, one per stripe unit run. Zone entries of
+     * 'prov' start at the zone of the first stripe unit */
+    for (i = 0; i < prov->naddr; i++) q->zn_head[i] = UINT16_MAX;
+
+    stripe = q->node->stripe;
+    ucmd->stripe[ucmd->pieces] = stripe;
+    off    = q->node->optimal_write_sec_used;
+    end    = off + num;
+    cmd_i  = 0;
+    while (off < end) {
+        run  = stripe - off % stripe;
+        run  = (run > end - off) ? end - off : run;
+        zn_i = (off / stripe - ucmd->start[ucmd->pieces] / stripe) %
+               q->node->nzones;
+
+        mcmd = q->mcmd[cmd_i];
+        mcmd->opcode = (append) ? XZTL_ZONE_APPEND : XZTL_CMD_WRITE;
+        mcmd->synch            = 0;
+        mcmd->submitted        = 0;
+        mcmd->sequence         = cmd_i;
+        mcmd->sequence_zn      = zn_i;
+        mcmd->naddr            = 1;
+        mcmd->status           = 0;
+        mcmd->callback_err_cnt = 0;
+        mcmd->nsec[0]          = run * ZTL_IO_SEC_MCMD;
 
-    for (i = 0; i < prov->naddr; i++) {
-        zone_sector_num[i] = prov->nsec[i];
-    }
+        mcmd->addr[0].addr   = 0;
+        mcmd->addr[0].g.grp  = prov->addr[zn_i].g.grp;
+        mcmd->addr[0].g.zone = prov->addr[zn_i].g.zone;
 
-    cmd_i = 0;
-    while (cmd_i < num) {
-        for (zn_i = 0; zn_i < prov->naddr; zn_i++) {
-            if (zone_sector_num[zn_i] <= 0) {
-                continue;
-            }
+        /* Appends ignore the sector, it is checked at completion */
+        mcmd->addr[0].g.sect = (uint64_t)prov->addr[zn_i].g.sect;
+        prov->addr[zn_i].g.sect += mcmd->nsec[0];
 
-            mcmd = q->mcmd[cmd_i];
-            mcmd->opcode =
-                (XZTL_WRITE_APPEND) ? XZTL_ZONE_APPEND : XZTL_CMD_WRITE;
-            mcmd->synch            = 0;
-            mcmd->submitted        = 0;
-            mcmd->sequence         = cmd_i;
-            mcmd->sequence_zn      = zn_i;
-            mcmd->naddr            = 1;
-            mcmd->status           = 0;
-            mcmd->callback_err_cnt = 0;
-            mcmd->nsec[0]          = ZTL_IO_SEC_MCMD;
-
-            mcmd->addr[0].addr   = 0;
-            mcmd->addr[0].g.grp  = prov->addr[zn_i].g.grp;
-            mcmd->addr[0].g.zone = prov->addr[zn_i].g.zone;
-            if (!XZTL_WRITE_APPEND) {
-                mcmd->addr[0].g.sect = (uint64_t)prov->addr[zn_i].g.sect;
-            }
+        ucmd->msec[cmd_i] = mcmd->nsec[0];
+        mcmd->prp[0]      = boff;
+        boff += core->media->geo.nbytes * mcmd->nsec[0];
 
-            zone_sector_num[zn_i] -= mcmd->nsec[0];
-            prov->addr[zn_i].g.sect += mcmd->nsec[0];
+        mcmd->callback  = ztl_io_write_callback_mcmd;
+        mcmd->opaque    = ucmd;
+        mcmd->async_ctx = q->tctx;
 
-            ucmd->msec[cmd_i] = mcmd->nsec[0];
-            mcmd->prp[0]      = boff;
-            boff += core->media->geo.nbytes * mcmd->nsec[0];
+        ucmd->mcmd[cmd_i]            = mcmd;
+        ucmd->mcmd[cmd_i]->submitted = 0;
 
-            mcmd->callback  = ztl_io_write_callback_mcmd;
-            mcmd->opaque    = ucmd;
-            mcmd->async_ctx = q->tctx;
+        /* Append to the zone FIFO */
+        q->zn_next[cmd_i] = UINT16_MAX;
+        if (q->zn_head[zn_i] == UINT16_MAX)
+            q->zn_head[zn_i] = cmd_i;
+        else
+            q->zn_next[q->zn_tail[zn_i]] = cmd_i;
+        q->zn_tail[zn_i] = cmd_i;
 
-            ucmd->mcmd[cmd_i]                      = mcmd;
-            ucmd->mcmd[cmd_i]->submitted           = 0;
-            zn_cmd_id[zn_i][zn_cmd_id_num[zn_i]++] = cmd_i;
-            cmd_i++;
-        }
+        off += run;
+        cmd_i++;
     }
 
-    left = left - num;
-    ucmd->pieces++;
-
     ZDEBUG(ZDEBUG_IO, "ztl_io_write_ucmd: Populated: %d", cmd_i);
 
     /* Submit media commands */
-    for (cmd_i = 0; cmd_i < ZTL_PRO_ZONE_NUM_INNODE * 2; cmd_i++)
-        ucmd->minflight[cmd_i] = 0;
-
-    submitted   = 0;
-    ucmd->nmcmd = num;
+    ucmd->nmcmd = cmd_i;
     ucmd->ncb   = 0;
-
-    while (submitted < num) {
-        for (zn_i = 0; zn_i < prov->naddr; zn_i++) {
-            int index = zn_cmd_id_index[zn_i];
-            int cmd_id_num = zn_cmd_id_num[zn_i];
-
-            if (index >= cmd_id_num) {
-                continue;
-            }
-
-            /* Limit to 1 write per zone if append is not supported */
-            if (!XZTL_WRITE_APPEND) {
-                if (ucmd->minflight[zn_i]) {
-                    ztl_io_poke_ctx(q->tctx);
-                    continue;
-                }
-
-                ucmd->minflight[zn_i] = 1;
-            }
-
-            ret = xztl_media_submit_io(ucmd->mcmd[zn_cmd_id[zn_i][index]]);
-            if (ret) {
-                ZDEBUG(ZDEBUG_IO, " XZTL_STATS_WRITE_SUBMIT_FAIL [%d]", zn_i);
-                xztl_stats_inc(XZTL_STATS_WRITE_SUBMIT_FAIL, 1);
-                ztl_io_poke_ctx(q->tctx);
-                zn_i--;
-                continue;
-            }
-
-            ucmd->mcmd[zn_cmd_id[zn_i][index]]->submitted = 1;
-            submitted++;
-            zn_cmd_id_index[zn_i]++;
-
-            if (submitted % 8 == 0)
-                ztl_io_poke_ctx(q->tctx);
-        }
-        usleep(1);
-    }
-
-    /* Poke the context for completions */
-    while (ucmd->ncb < ucmd->nmcmd) {
-        ztl_io_poke_ctx(q->tctx);
-    }
+    ztl_io_write_sched(q, ucmd, prov->naddr, depth);
 
     q->node->optimal_write_sec_left -= num;
     q->node->optimal_write_sec_used += num;
-
-    ATOMIC_ADD(&q->node->nr_valid, num);
     if (q->node->optimal_write_sec_left == 0) {
         q->node->status = XZTL_ZMD_NODE_FULL;
     }
+    ztl()->pro->put_node_fn(q->node);
+
+    /* Reordered appends are mapped where they completed. If that needs
+     * too many pieces, the space is left invalid and the piece is written
+     * again with a single append in flight per zone. A following node
+     * keeps a piece of its own */
+    if (append && !ucmd->status && ztl_io_write_reordered(ucmd, ucmd->nmcmd)) {
+        xztl_stats_inc(XZTL_STATS_APPEND_REORDER, 1);
+        max = XZTL_WIO_MAX_PIECES - ((left > num) ? 1 : 0);
+        if (ztl_io_write_split(ucmd, q->node, max)) {
+            boff  = piece_off;
+            depth = 1;
+            goto reget;
+        }
+    }
+
+    ATOMIC_ADD(&q->node->nr_valid, num);
+    left = left - num;
+    ucmd->pieces++;
 
     if (left > 0) {
         goto reget;
     }
 
-    ZDEBUG(ZDEBUG_IO, " ztl_io_write_ucmd: Submitted [%d]", submitted);
+    ZDEBUG(ZDEBUG_IO, " ztl_io_write_ucmd: Submitted [%d]", ucmd->nmcmd);
     ucmd->completed = 1;
+
+    /* The user command may be released by the callback */
+    if (ucmd->callback)
+        ucmd->callback(ucmd);
+
     return XZTL_OK;
 
     /* If we get a submit failure but previous I/Os have been
@@ -575,6 +997,7 @@ reget:
      * performed by the callback function */
 
 FAIL_NCMD:
+    ztl()->pro->put_node_fn(q->node);
     for (i = 0; i < prov->naddr; i++) prov->nsec[i] = 0;
 
     ztl()->pro->free_fn(prov);
@@ -582,47 +1005,145 @@ FAIL_NCMD:
 FAILURE:
     ucmd->status    = XZTL_ZTL_IO_S_ERR;
     ucmd->completed = 1;
+
+    if (ucmd->callback)
+        ucmd->callback(ucmd);
+
     return XZTL_ZTL_IO_S_ERR;
 }
 
+/* Spins up to 'spin_ns' waiting for commands, then parks on the condition
+ * variable until ztl_io_submit or ztl_io_exit wakes the thread up */
+static void ztl_io_write_wait(struct ztl_queue_pool *q) {
+    struct timespec ts;
+    uint64_t        start, now;
+
+    GET_NANOSECONDS(start, ts);
+    do {
+        if (!STAILQ_EMPTY(&q->ucmd_head) || !q->flag_running) {
+            q->spin_ns = MIN(q->spin_ns * 2, ZTL_IO_SPIN_MAX_NS);
+            return;
+        }
+        GET_NANOSECONDS(now, ts);
+    } while (now - start < q->spin_ns);
+
+    q->spin_ns = MAX(q->spin_ns / 2, ZTL_IO_SPIN_MIN_NS);
+
+    pthread_mutex_lock(&q->wait_mutex);
+    q->sleeping = 1;
+    __sync_synchronize();
+    while (STAILQ_EMPTY(&q->ucmd_head) && q->flag_running)
+        pthread_cond_wait(&q->wait_cond, &q->wait_mutex);
+    q->sleeping = 0;
+    pthread_mutex_unlock(&q->wait_mutex);
+}
+
+/* All writer threads share the configured core */
+static void ztl_io_write_affinity(void) {
+    int32_t   core = xztl_config_get()->write_core;
+    cpu_set_t set;
+
+    if (core == XZTL_WRITE_CORE_NONE)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set))
+        log_erra("ztl_io_write_th: affinity to core [%d] failed\n", core);
+}
+
 static void *ztl_io_write_th(void *arg) {
     struct xztl_io_ucmd   *ucmd = NULL;
     struct ztl_queue_pool *q    = (struct ztl_queue_pool *)arg;
 
-    q->flag_running = 1;
+    STAILQ_HEAD(, xztl_io_ucmd) ucmds;
+    STAILQ_INIT(&ucmds);
+
+    xztl_instance_bind(q->inst);
+    ztl_io_write_affinity();
 
     while (q->flag_running) {
-    NEXT:
-        if (!STAILQ_EMPTY(&q->ucmd_head)) {
-            pthread_spin_lock(&q->ucmd_spin);
-            ucmd = STAILQ_FIRST(&q->ucmd_head);
-            if (ucmd == NULL) {
-                pthread_spin_unlock(&q->ucmd_spin);
-                goto NEXT;
-            }
-            STAILQ_REMOVE_HEAD(&q->ucmd_head, entry);
-            pthread_spin_unlock(&q->ucmd_spin);
+        if (STAILQ_EMPTY(&q->ucmd_head)) {
+            ztl_io_write_wait(q);
+            continue;
+        }
 
-            ztl_io_write_ucmd(ucmd);
+        /* Take all queued commands at once */
+        pthread_spin_lock(&q->ucmd_spin);
+        STAILQ_CONCAT(&ucmds, &q->ucmd_head);
+        pthread_spin_unlock(&q->ucmd_spin);
 
-            goto NEXT;
+        /* The command may be released by its callback */
+        while ((ucmd = STAILQ_FIRST(&ucmds)) != NULL) {
+            STAILQ_REMOVE_HEAD(&ucmds, entry);
+            ztl_io_write_ucmd(q, ucmd);
+            __sync_fetch_and_sub(&q->nqueued, 1);
         }
     }
 
     return NULL;
 }
 
+/* Picks the least loaded lane of the level, ties are broken round-robin */
+static struct ztl_queue_pool *ztl_io_get_lane(uint16_t level) {
+    struct ztl_io_state   *st = ztl_io_st();
+    struct ztl_queue_pool *q, *best;
+    uint32_t               lane, first, nlanes;
+
+    nlanes = st->nlanes[level];
+    if (nlanes == 1)
+        return &st->qp[level][0];
+
+    first = __sync_fetch_and_add(&st->lane_rr[level], 1) % nlanes;
+    best  = &st->qp[level][first];
+    for (lane = 1; lane < nlanes && best->nqueued; lane++) {
+        q = &st->qp[level][(first + lane) % nlanes];
+        if (q->nqueued < best->nqueued)
+            best = q;
+    }
+
+    return best;
+}
+
 static void ztl_io_submit(struct xztl_io_ucmd *ucmd) {
-    struct ztl_queue_pool *q = &qp[ucmd->prov_type];
+    int32_t                levels = xztl_config_get()->levels;
+    struct ztl_queue_pool *q;
+
+    /* Levels without lanes write to the last configured level */
+    if (ucmd->prov_type >= levels)
+        ucmd->prov_type = levels - 1;
+
+    q = ztl_io_get_lane(ucmd->prov_type);
+
+    __sync_fetch_and_add(&q->nqueued, 1);
     pthread_spin_lock(&q->ucmd_spin);
     STAILQ_INSERT_TAIL(&q->ucmd_head, ucmd, entry);
     pthread_spin_unlock(&q->ucmd_spin);
+
+    /* Pairs with the barrier in ztl_io_write_wait */
+    __sync_synchronize();
+    if (q->sleeping) {
+        pthread_mutex_lock(&q->wait_mutex);
+        pthread_cond_signal(&q->wait_cond);
+        pthread_mutex_unlock(&q->wait_mutex);
+    }
 }
 
-static int _ztl_io_w_queue_init(int level) {
-    struct ztl_queue_pool *q = &qp[level];
+static inline uint32_t ztl_io_width(int32_t level) {
+    uint32_t width = ztl_io_st()->width[level];
+
+    return (width) ? width : xztl_config_get()->width;
+}
+
+static int _ztl_io_w_queue_init(int level, int lane, uint32_t stripe) {
+    struct ztl_queue_pool *q = &ztl_io_st()->qp[level][lane];
 
     STAILQ_INIT(&q->ucmd_head);
+    q->nqueued = 0;
+    q->level   = level;
+    q->lane    = lane;
+    q->stripe  = stripe;
+    q->width   = ztl_io_width(level);
 
     /* Resource pre-alloc */
     if (_ztl_io_write_rs_init(q)) {
@@ -633,11 +1154,26 @@ static int _ztl_io_w_queue_init(int level) {
     if (pthread_spin_init(&q->ucmd_spin, 0))
         goto RC;
 
-    if (pthread_create(&q->w_thread, NULL, ztl_io_write_th, (void *)q))
+    if (pthread_mutex_init(&q->wait_mutex, NULL))
         goto SPIN;
 
+    if (pthread_cond_init(&q->wait_cond, NULL))
+        goto MUTEX;
+
+    q->sleeping     = 0;
+    q->spin_ns      = ZTL_IO_SPIN_MIN_NS;
+    q->flag_running = 1;
+    q->inst         = xztl_instance_get();
+
+    if (pthread_create(&q->w_thread, NULL, ztl_io_write_th, (void *)q))
+        goto COND;
+
     return XZTL_OK;
 
+COND:
+    pthread_cond_destroy(&q->wait_cond);
+MUTEX:
+    pthread_mutex_destroy(&q->wait_mutex);
 SPIN:
     pthread_spin_destroy(&q->ucmd_spin);
 RC:
@@ -646,82 +1182,183 @@ RC:
     return XZTL_ZTL_IO_ERR;
 }
 
-static void ztl_io_nodeset(int32_t node_id, int32_t level, int32_t nr_valid) {
-    struct app_group        *grp = glist[0];
-    struct ztl_pro_node_grp *pro = grp->pro;
-    struct ztl_pro_node *znode = (struct ztl_pro_node *)(&pro->vnodes[node_id]);
+/* A node that cannot be rebuilt fails, its data would be lost */
+static int ztl_io_nodeset(int32_t node_id, int32_t level, int32_t nr_valid,
+                          uint32_t stripe) {
+    struct ztl_pro_node *znode = ztl()->pro->get_vnode_fn(node_id);
+    struct ztl_io_state *st     = ztl_io_st();
+    int32_t              levels = xztl_config_get()->levels;
+    uint32_t             lane;
+    int                  ret;
+
+    if (!znode)
+        return XZTL_ZTL_PROV_ERR;
+
+    level = (level >= levels) ? (levels - 1) : level;
+
+    /* Narrow nodes split their slot on the first recovered mapping */
+    ret = ztl_pro_grp_node_restore(znode->grp->pro, node_id);
+    if (ret)
+        return ret;
+
+    /* Zero keeps the stripe unit of the node */
+    if (stripe)
+        znode->stripe = stripe;
+
     znode->nr_valid += nr_valid;
     if (znode->status == XZTL_ZMD_NODE_USED) {
-        level = (level >= ZROCKS_LEVEL_NUM) ? (ZROCKS_LEVEL_NUM - 1) : level;
-        qp[level].node = znode;
-        znode->level = level;
+        /* Recovered open nodes are spread over the lanes of the level */
+        for (lane = 0; lane < st->nlanes[level]; lane++) {
+            if (!st->qp[level][lane].node || st->qp[level][lane].node == znode)
+                break;
+        }
+        if (lane == st->nlanes[level])
+            lane = 0;
+
+        st->qp[level][lane].node = znode;
+        znode->level             = level;
     }
+
+    return XZTL_OK;
 }
-static void _ztl_io_w_queue_exit(int level) {
-    struct ztl_queue_pool *q = &qp[level];
 
+int ztl_io_set_stripe(int32_t level, uint32_t stripe) {
+    if (level < 0 || level >= ZROCKS_LEVEL_NUM || !stripe ||
+        stripe > ZTL_IO_STRIPE_MAX || (stripe & (stripe - 1))) {
+        log_erra("ztl_io_set_stripe: invalid level [%d] stripe [%u]\n", level,
+                 stripe);
+        return XZTL_ZTL_IO_ERR;
+    }
+
+    ztl_io_st()->stripe[level] = stripe;
+
+    return XZTL_OK;
+}
+
+int ztl_io_set_width(int32_t level, uint32_t width) {
+    if (level < 0 || level >= ZROCKS_LEVEL_NUM ||
+        width < ZTL_PRO_NODE_WIDTH_MIN || width > ZTL_PRO_ZONE_NUM_INNODE ||
+        (width & (width - 1))) {
+        log_erra("ztl_io_set_width: invalid level [%d] width [%u]\n", level,
+                 width);
+        return XZTL_ZTL_IO_ERR;
+    }
+
+    ztl_io_st()->width[level] = width;
+
+    return XZTL_OK;
+}
+
+void ztl_io_set_append(uint8_t append) {
+    ztl_io_st()->append = !!append;
+}
+
+int ztl_io_set_lanes(int32_t level, uint32_t lanes) {
+    if (level < 0 || level >= ZROCKS_LEVEL_NUM || !lanes ||
+        lanes > ZTL_IO_LANE_MAX) {
+        log_erra("ztl_io_set_lanes: invalid level [%d] lanes [%u]\n", level,
+                 lanes);
+        return XZTL_ZTL_IO_ERR;
+    }
+
+    ztl_io_st()->lanes[level] = lanes;
+
+    return XZTL_OK;
+}
+
+static void _ztl_io_w_queue_exit(int level, int lane) {
+    struct ztl_queue_pool *q = &ztl_io_st()->qp[level][lane];
+
+    pthread_mutex_lock(&q->wait_mutex);
     q->flag_running = 0;
+    pthread_cond_signal(&q->wait_cond);
+    pthread_mutex_unlock(&q->wait_mutex);
 
     pthread_join(q->w_thread, NULL);
+    pthread_cond_destroy(&q->wait_cond);
+    pthread_mutex_destroy(&q->wait_mutex);
     pthread_spin_destroy(&q->ucmd_spin);
     _ztl_io_write_rs_exit(q);
 }
 
 static void ztl_io_exit(void) {
-    int level, rn;
+    struct ztl_io_state *st = ztl_io_st();
+    uint32_t             rn, lane;
+    int                  level;
 
-    for (level = 0; level < ZROCKS_LEVEL_NUM; level++)
-        _ztl_io_w_queue_exit(level);
+    for (level = 0; level < ZROCKS_LEVEL_NUM; level++) {
+        for (lane = 0; lane < st->nlanes[level]; lane++)
+            _ztl_io_w_queue_exit(level, lane);
+        st->nlanes[level] = 0;
+    }
 
-    pthread_mutex_destroy(&rs_mutex);
-    for (rn = 0; rn < zndmedia.read_ctx_num; rn++)
-        _ztl_io_read_rs_exit(&read_resource[rn]);
+    /* Contexts cached by live threads are dropped by the generation check */
+    pthread_key_delete(st->read_rs_key);
+    for (rn = 0; rn < st->read_rs_count; rn++) {
+        if (!st->read_rs[rn])
+            continue;
+        _ztl_io_read_rs_exit(st->read_rs[rn]);
+        free(st->read_rs[rn]);
+        st->read_rs[rn] = NULL;
+    }
+    st->read_rs_count = 0;
+    st->read_rs_free  = 0;
 
     log_info("ztl-io: Write-read stopped.");
 }
 
 static int ztl_io_init(void) {
-    int level, rn, ret;
-
-    for (level = 0; level < ZROCKS_LEVEL_NUM; level++) {
-        ret = _ztl_io_w_queue_init(level);
-        if (ret != XZTL_OK) {
-            log_err("ztl_io_init: IO resource allocation error.");
-            return XZTL_ZTL_IO_ERR;
-        }
-    }
+    const struct xztl_config *cfg = xztl_config_get();
+    struct ztl_io_state      *st  = ztl_io_st();
+    struct xztl_core         *core;
+    uint32_t                  lanes, stripe, mdts;
+    int                       level, ret;
 
-    for (rn = 0; rn < zndmedia.read_ctx_num; rn++) {
-        ret = _ztl_io_read_rs_init(&read_resource[rn]);
-        if (ret != XZTL_OK) {
-            log_err("ztl_io_init: IO read resource allocation error.");
-            // goto RC;
-            return XZTL_ZTL_IO_ERR;
+    get_xztl_core(&core);
+    mdts = core->media->geo.nbytes_mdts / (ZNS_ALIGMENT * ZTL_IO_SEC_MCMD);
+
+    /* Levels above the configured ones have no lanes, see zrocks_write */
+    for (level = 0; level < cfg->levels; level++) {
+        /* A stripe unit is written by a single media command */
+        stripe = (st->stripe[level]) ? st->stripe[level] : cfg->stripe;
+        while (stripe > 1 && stripe > mdts) stripe >>= 1;
+        if (st->stripe[level] && stripe != st->stripe[level])
+            log_infoa("ztl_io_init: level [%d] stripe [%u] capped to [%u]\n",
+                      level, st->stripe[level], stripe);
+
+        lanes = (st->lanes[level]) ? st->lanes[level] : cfg->lanes;
+        for (st->nlanes[level] = 0; st->nlanes[level] < lanes;
+             st->nlanes[level]++) {
+            ret = _ztl_io_w_queue_init(level, st->nlanes[level], stripe);
+            if (ret != XZTL_OK) {
+                log_err("ztl_io_init: IO resource allocation error.");
+                return XZTL_ZTL_IO_ERR;
+            }
         }
+        st->lane_rr[level] = 0;
     }
 
-    if (pthread_mutex_init(&rs_mutex, 0))
+    /* Read contexts are created on the first read of each thread */
+    if (pthread_key_create(&st->read_rs_key, _ztl_io_read_rs_release))
         return XZTL_ZTL_IO_ERR;
-    log_info("ztl-io: Write-read module started.");
 
-    return XZTL_OK;
+    st->read_rs_count = 0;
+    st->read_rs_free  = 0;
+    st->read_rs_gen   = __sync_add_and_fetch(&read_rs_gen_seq, 1);
 
-    /*RC:
-        while (rn) {
-            rn--;
-            _ztl_io_read_rs_exit(&read_resource[rn]);
-        }
+    log_info("ztl-io: Write-read module started.");
 
-        return XZTL_ZTL_IO_ERR;*/
+    return XZTL_OK;
 }
 
-static struct app_io_mod libztl_io = {.mod_id     = LIBZTL_IO,
-                                      .name       = "LIBZTL-IO",
-                                      .init_fn    = ztl_io_init,
-                                      .exit_fn    = ztl_io_exit,
-                                      .submit_fn  = ztl_io_submit,
-                                      .read_fn    = ztl_io_read,
-                                      .nodeset_fn = ztl_io_nodeset};
+static struct app_io_mod libztl_io = {.mod_id        = LIBZTL_IO,
+                                      .name          = "LIBZTL-IO",
+                                      .init_fn       = ztl_io_init,
+                                      .exit_fn       = ztl_io_exit,
+                                      .submit_fn     = ztl_io_submit,
+                                      .read_fn       = ztl_io_read,
+                                      .read_batch_fn = ztl_io_read_batch,
+                                      .nodeset_fn    = ztl_io_nodeset};
 
 void ztl_io_register(void) {
     ztl_mod_register(ZTLMOD_IO, LIBZTL_IO, &libztl_io);
@@ -17,6 +17,7 @@
  * limitations under the License.
 */
 
+#include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,7 +27,6 @@
 #include <xztl.h>
 #include <xztl-mods.h>
 
-#define MAP_BUF_PGS  8192 /* 256 MB per cache with 32KB page */
 #define MAP_N_CACHES 1
 
 #define MAP_ADDR_FLAG ((1 & AND64) << 63)
@@ -43,7 +43,8 @@ struct map_cache_entry {
 };
 
 struct map_cache {
-    struct map_cache_entry *pg_buf;
+    struct map_cache_entry  *pg_buf;
+    struct map_cache_entry **flush; /* Dirty pages of a checkpoint */
     LIST_HEAD(mb_free_l, map_cache_entry) mbf_head;
     TAILQ_HEAD(mb_used_l, map_cache_entry) mbu_head;
     pthread_spinlock_t mb_spin;
@@ -53,37 +54,106 @@ struct map_cache {
     uint16_t           id;
 };
 
-static struct map_cache *map_caches;
-static volatile uint8_t  cp_running;
+struct map_state {
+    struct map_cache *caches;
+    volatile uint8_t  cp_running;
 
-/* The mapping strategy ensures the entry size matches with the NVM pg size */
-static uint32_t map_pg_sz;
-static uint64_t map_ent_per_pg;
+    /* The mapping strategy ensures the entry size matches with the NVM pg
+     * size */
+    uint32_t pg_sz;
+    uint64_t ent_per_pg;
+    uint32_t npgs; /* Cached pages per cache */
+};
+
+static struct map_state *map_st(void) {
+    return xztl_instance_state(XZTL_STATE_MAP, sizeof(struct map_state));
+}
+
+static int map_checkpoint(void);
 
 static int map_nvm_read(struct map_cache_entry *ent) {
+    int ret;
+
+    ret = ztl()->mpe->read_fn(ent->md_entry->addr, ent->buf);
+    if (ret)
+        return ret;
+
+    ent->addr.addr = ent->md_entry->addr;
+    ent->dirty     = 0;
+
     return XZTL_OK;
 }
 
+/* Appends the page to the mapping log, the cache entry keeps its address */
+static int map_nvm_write(struct map_cache_entry *ent) {
+    struct map_md_addr *tbl = (struct map_md_addr *)ztl()->smap.tbl;
+    uint64_t            addr;
+    int                 ret;
+
+    ret = ztl()->mpe->write_fn(ent->md_entry - tbl, ent->buf, &addr);
+    if (ret)
+        return ret;
+
+    ent->addr.addr = addr;
+
+    return XZTL_OK;
+}
+
+static pthread_mutex_t *map_pg_mutex(struct map_cache_entry *ent) {
+    struct map_md_addr *tbl = (struct map_md_addr *)ztl()->smap.tbl;
+
+    return &ztl()->smap.entry_mutex[ent->md_entry - tbl];
+}
+
+/* Evicts the coldest page that is not in use. The page mutex is held while
+ * the page is written out, returns -EBUSY if all cached pages are in use */
 static int map_evict_pg_cache(struct map_cache *cache, uint8_t is_checkpoint) {
     struct map_cache_entry *cache_ent;
+    pthread_mutex_t        *pg_mutex = NULL;
+    int                     ret;
 
     pthread_spin_lock(&cache->mb_spin);
-    cache_ent = TAILQ_FIRST(&cache->mbu_head);
-    if (!cache_ent) {
+    if (TAILQ_EMPTY(&cache->mbu_head)) {
         pthread_spin_unlock(&cache->mb_spin);
         log_err("map_evict_pg_cache: cache_entis NULL.\n");
         return XZTL_ZTL_MAP_ERR;
     }
 
+    /* The owner of a page mutex may be reading or updating the buffer */
+    TAILQ_FOREACH(cache_ent, &cache->mbu_head, u_entry) {
+        pg_mutex = map_pg_mutex(cache_ent);
+        if (!pthread_mutex_trylock(pg_mutex))
+            break;
+    }
+    if (!cache_ent) {
+        pthread_spin_unlock(&cache->mb_spin);
+        return -EBUSY;
+    }
+
     TAILQ_REMOVE(&cache->mbu_head, cache_ent, u_entry);
     cache->nused--;
     pthread_spin_unlock(&cache->mb_spin);
 
-    /* TODO: Evict the page if recovery is done at the ZTL */
+    if (cache_ent->dirty) {
+        cache_ent->dirty = 0;
+        ret              = map_nvm_write(cache_ent);
+        if (ret) {
+            cache_ent->dirty = 1;
+
+            pthread_spin_lock(&cache->mb_spin);
+            TAILQ_INSERT_HEAD(&cache->mbu_head, cache_ent, u_entry);
+            cache->nused++;
+            pthread_spin_unlock(&cache->mb_spin);
+            pthread_mutex_unlock(pg_mutex);
+
+            return ret;
+        }
+    }
 
     cache_ent->md_entry->addr = cache_ent->addr.addr;
     cache_ent->addr.addr      = 0;
     cache_ent->md_entry       = NULL;
+    pthread_mutex_unlock(pg_mutex);
 
     pthread_spin_lock(&cache->mb_spin);
     LIST_INSERT_HEAD(&cache->mbf_head, cache_ent, f_entry);
@@ -96,24 +166,40 @@ static int map_evict_pg_cache(struct map_cache *cache, uint8_t is_checkpoint) {
 static int map_load_pg_cache(struct map_cache   *cache,
                              struct map_md_addr *md_entry, uint64_t first_id,
                              uint32_t pg_off) {
+    struct map_state       *st = map_st();
     struct map_cache_entry *cache_ent;
     struct app_map_entry   *map_ent;
     uint64_t                ent_id;
+    int                     ret;
 
 WAIT:
     if (LIST_EMPTY(&cache->mbf_head)) {
-        if (cp_running) {
+        if (st->cp_running) {
             usleep(200);
             goto WAIT;
         }
 
         pthread_mutex_lock(&cache->mutex);
-        if (map_evict_pg_cache(cache, 0)) {
+        ret = (LIST_EMPTY(&cache->mbf_head)) ? map_evict_pg_cache(cache, 0)
+                                             : XZTL_OK;
+        pthread_mutex_unlock(&cache->mutex);
+
+        /* The mapping log is full, a checkpoint moves it to the next zone */
+        if (ret == XZTL_ZTL_MD_WRITE_FULL && !map_checkpoint())
+            goto WAIT;
+
+        /* Other threads hold all cached pages, they release them shortly */
+        if (ret == -EBUSY) {
+            usleep(200);
+            goto WAIT;
+        }
+
+        if (ret) {
             log_err("map_load_pg_cache: map_evict_pg_cache err.\n");
-            pthread_mutex_unlock(&cache->mutex);
             return XZTL_ZTL_MAP_ERR;
         }
-        pthread_mutex_unlock(&cache->mutex);
+
+        goto WAIT;
     }
 
     pthread_spin_lock(&cache->mb_spin);
@@ -132,7 +218,7 @@ WAIT:
 
     /* If metadata entry PPA is zero, mapping page does not exist yet */
     if (!md_entry->addr) {
-        for (ent_id = 0; ent_id < map_ent_per_pg; ent_id++) {
+        for (ent_id = 0; ent_id < st->ent_per_pg; ent_id++) {
             map_ent =
                 &((struct app_map_entry *)cache_ent->buf)[ent_id];  // NOLINT
             map_ent->addr = 0x0;
@@ -170,12 +256,14 @@ WAIT:
 }
 
 static int map_init_cache(struct map_cache *cache) {
-    uint32_t pg_i;
+    struct map_state *st = map_st();
+    uint32_t          pg_i;
 
-    cache->pg_buf = calloc(MAP_BUF_PGS, sizeof(struct map_cache_entry));
-    if (!cache->pg_buf) {
+    cache->pg_buf = calloc(st->npgs, sizeof(struct map_cache_entry));
+    cache->flush  = calloc(st->npgs, sizeof(struct map_cache_entry *));
+    if (!cache->pg_buf || !cache->flush) {
         log_err("map_init_cache: Map cache initialization failed.\n");
-        return XZTL_ZTL_MAP_ERR;
+        goto FREE_BUF;
     }
 
     if (pthread_spin_init(&cache->mb_spin, 0)) {
@@ -192,14 +280,14 @@ static int map_init_cache(struct map_cache *cache) {
     cache->nfree = 0;
     cache->nused = 0;
 
-    for (pg_i = 0; pg_i < MAP_BUF_PGS; pg_i++) {
+    for (pg_i = 0; pg_i < st->npgs; pg_i++) {
         cache->pg_buf[pg_i].dirty     = 0;
-        cache->pg_buf[pg_i].buf_sz    = map_pg_sz;
+        cache->pg_buf[pg_i].buf_sz    = st->pg_sz;
         cache->pg_buf[pg_i].addr.addr = 0x0;
         cache->pg_buf[pg_i].md_entry  = NULL;
         cache->pg_buf[pg_i].cache     = cache;
 
-        cache->pg_buf[pg_i].buf = calloc(1, map_pg_sz);
+        cache->pg_buf[pg_i].buf = calloc(1, st->pg_sz);
         if (!cache->pg_buf[pg_i].buf) {
             log_erra("map_init_cache: pg_buf pg_i [%u] buf is null.\n", pg_i);
             goto FREE_PGS;
@@ -222,95 +310,174 @@ FREE_PGS:
 SPIN:
     pthread_spin_destroy(&cache->mb_spin);
 FREE_BUF:
+    free(cache->flush);
     free(cache->pg_buf);
     return XZTL_ZTL_MAP_ERR;
 }
 
-static void map_flush_cache(struct map_cache *cache, uint8_t full) {
-    /* TODO: Persist all pages */
-}
+/* Writes the dirty pages of the cache, pages are not evicted meanwhile. The
+ * page mutex keeps upserts out of the buffer while it is written */
+static int map_flush_cache(struct map_cache *cache) {
+    struct map_cache_entry *ent;
+    uint32_t                nents = 0, ent_i;
+    int                     ret   = XZTL_OK;
 
-static void map_flush_all_caches(void) {
-    uint32_t cache_i = MAP_N_CACHES;
+    pthread_mutex_lock(&cache->mutex);
 
-    while (cache_i) {
-        cache_i--;
-        map_flush_cache(&map_caches[cache_i], 0);
+    pthread_spin_lock(&cache->mb_spin);
+    TAILQ_FOREACH(ent, &cache->mbu_head, u_entry) {
+        if (ent->dirty)
+            cache->flush[nents++] = ent;
+    }
+    pthread_spin_unlock(&cache->mb_spin);
+
+    for (ent_i = 0; ent_i < nents; ent_i++) {
+        ent = cache->flush[ent_i];
+
+        pthread_mutex_lock(map_pg_mutex(ent));
+        ent->dirty = 0;
+        ret        = map_nvm_write(ent);
+        if (ret)
+            ent->dirty = 1;
+        pthread_mutex_unlock(map_pg_mutex(ent));
+
+        if (ret)
+            break;
     }
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    return ret;
 }
 
-static void map_exit_cache(struct map_cache *cache) {
-    struct map_cache_entry *ent;
+/* Writes the dirty pages and the page table. A full mapping log moves the
+ * live pages to the next zone, and the checkpoint is written there */
+static int map_checkpoint(void) {
+    struct map_state *st = map_st();
+    uint32_t          cache_i, retry;
+    int               ret = XZTL_OK;
 
-    map_flush_cache(cache, 1);
+    if (!__sync_bool_compare_and_swap(&st->cp_running, 0, 1)) {
+        while (st->cp_running) usleep(200);
+        return XZTL_OK;
+    }
 
-    while (!(LIST_EMPTY(&cache->mbf_head))) {
-        ent = LIST_FIRST(&cache->mbf_head);
-        if (ent != NULL) {
-            LIST_REMOVE(ent, f_entry);
-            cache->nfree--;
-            free(ent->buf);
+    for (retry = 0; retry < 2; retry++) {
+        for (cache_i = 0; cache_i < MAP_N_CACHES; cache_i++) {
+            ret = map_flush_cache(&st->caches[cache_i]);
+            if (ret)
+                break;
         }
+
+        if (!ret)
+            ret = ztl()->mpe->flush_fn();
+
+        if (ret != XZTL_ZTL_MD_WRITE_FULL)
+            break;
+
+        ret = ztl()->mpe->switch_fn();
+        if (ret)
+            break;
     }
 
+    st->cp_running = 0;
+
+    if (ret)
+        log_erra("map_checkpoint: err [%d]\n", ret);
+
+    return ret;
+}
+
+static void map_flush_all_caches(void) {
+    map_checkpoint();
+}
+
+static void map_exit_cache(struct map_cache *cache) {
+    struct map_state *st = map_st();
+    uint32_t          pg_i;
+
+    /* Cached pages are in the used list */
+    for (pg_i = 0; pg_i < st->npgs; pg_i++) free(cache->pg_buf[pg_i].buf);
+
     pthread_spin_destroy(&cache->mb_spin);
     pthread_mutex_destroy(&cache->mutex);
+    free(cache->flush);
     free(cache->pg_buf);
 }
 
 static void map_exit_all_caches(void) {
-    uint32_t cache_i = MAP_N_CACHES;
+    struct map_state *st = map_st();
+    uint32_t          cache_i = MAP_N_CACHES;
 
     while (cache_i) {
         cache_i--;
-        map_exit_cache(&map_caches[cache_i]);
+        map_exit_cache(&st->caches[cache_i]);
     }
 }
 
 static int map_init(void) {
+    struct map_state *st = map_st();
     struct xztl_core *core;
     get_xztl_core(&core);
     uint32_t cache_i;
-    map_caches = calloc(MAP_N_CACHES, sizeof(struct map_cache));
-    if (!map_caches) {
-        log_err("map_init: map_caches is NULL.\n");
+    st->caches = calloc(MAP_N_CACHES, sizeof(struct map_cache));
+    if (!st->caches) {
+        log_err("map_init: caches is NULL.\n");
         return XZTL_ZTL_MAP_ERR;
     }
 
-    map_pg_sz      = (ZTL_MPE_PG_SEC * core->media->geo.nbytes);
-    map_ent_per_pg = map_pg_sz / sizeof(struct app_map_entry);
+    st->pg_sz      = (ZTL_MPE_PG_SEC * core->media->geo.nbytes);
+    st->ent_per_pg = st->pg_sz / sizeof(struct app_map_entry);
+    st->npgs       = xztl_config_get()->map_pages;
 
     for (cache_i = 0; cache_i < MAP_N_CACHES; cache_i++) {
-        if (map_init_cache(&map_caches[cache_i])) {
+        if (map_init_cache(&st->caches[cache_i])) {
             log_erra("map_init_cache: cache_i cache_i [%u] buf is null.\n",
                      cache_i);
             goto EXIT_CACHES;
         }
 
-        map_caches[cache_i].id = cache_i;
+        st->caches[cache_i].id = cache_i;
     }
 
-    cp_running = 0;
+    st->cp_running = 0;
+
+    /* Upserts logged after the last copy of their page */
+    if (ztl()->mpe->replay_fn()) {
+        log_err("map_init: Mapping log replay failed.\n");
+        cache_i = MAP_N_CACHES;
+        goto EXIT_CACHES;
+    }
 
     log_info("map_init: Global Mapping started.\n");
 
     return XZTL_OK;
 
 EXIT_CACHES:
-    free(map_caches);
+    while (cache_i) {
+        cache_i--;
+        map_exit_cache(&st->caches[cache_i]);
+    }
+    free(st->caches);
 
     return XZTL_ZTL_MAP_ERR;
 }
 
 static void map_exit(void) {
+    struct map_state *st = map_st();
+
+    map_checkpoint();
     map_exit_all_caches();
 
-    free(map_caches);
+    free(st->caches);
 
     log_info("map_exit: Global Mapping stopped.");
 }
 
+/* Returns with the page mutex held, the caller releases it with
+ * map_put_cache_entry once it is done with the buffer */
 static struct map_cache_entry *map_get_cache_entry(uint64_t id) {
+    struct map_state       *st = map_st();
     uint32_t                cache_id, pg_off;
     uint64_t                first_pg_lba;
     struct map_md_addr     *md_ent;
@@ -318,7 +485,7 @@ static struct map_cache_entry *map_get_cache_entry(uint64_t id) {
     struct map_md_addr     *addr;
 
     cache_id = id % MAP_N_CACHES;
-    pg_off   = id / map_ent_per_pg;
+    pg_off   = id / st->ent_per_pg;
 
     ZDEBUG(ZDEBUG_MAP, "map_get_cache_entry: get cache. ID: [%lu], off [%d].",
            id, pg_off);
@@ -338,9 +505,9 @@ static struct map_cache_entry *map_get_cache_entry(uint64_t id) {
     /* There is a mutex per metadata page */
     pthread_mutex_lock(&ztl()->smap.entry_mutex[pg_off]);
     if (!addr->g.flag) {
-        first_pg_lba = (id / map_ent_per_pg) * map_ent_per_pg;
+        first_pg_lba = (id / st->ent_per_pg) * st->ent_per_pg;
 
-        if (map_load_pg_cache(&map_caches[cache_id], md_ent, first_pg_lba,
+        if (map_load_pg_cache(&st->caches[cache_id], md_ent, first_pg_lba,
                               pg_off)) {
             log_erra(
                 "map_get_cache_entry: Mapping page not loaded cache [%d], "
@@ -355,15 +522,14 @@ static struct map_cache_entry *map_get_cache_entry(uint64_t id) {
         cache_ent = (struct map_cache_entry *)((uint64_t)addr->g.addr);
 
         /* Keep cache entry as hot, in the tail of the queue */
-        if (!cp_running) {
-            pthread_spin_lock(&map_caches[cache_id].mb_spin);
-            TAILQ_REMOVE(&map_caches[cache_id].mbu_head, cache_ent, u_entry);
-            TAILQ_INSERT_TAIL(&map_caches[cache_id].mbu_head, cache_ent,
+        if (!st->cp_running) {
+            pthread_spin_lock(&st->caches[cache_id].mb_spin);
+            TAILQ_REMOVE(&st->caches[cache_id].mbu_head, cache_ent, u_entry);
+            TAILQ_INSERT_TAIL(&st->caches[cache_id].mbu_head, cache_ent,
                               u_entry);
-            pthread_spin_unlock(&map_caches[cache_id].mb_spin);
+            pthread_spin_unlock(&st->caches[cache_id].mb_spin);
         }
     }
-    pthread_mutex_unlock(&ztl()->smap.entry_mutex[pg_off]);
 
     /* At this point, the ADDR only points to the cache */
     if (cache_ent == NULL)
@@ -372,18 +538,24 @@ static struct map_cache_entry *map_get_cache_entry(uint64_t id) {
     return cache_ent;
 }
 
+static void map_put_cache_entry(struct map_cache_entry *cache_ent) {
+    pthread_mutex_unlock(map_pg_mutex(cache_ent));
+}
+
 static int map_upsert_md(uint64_t index, uint64_t new_addr, uint64_t old_addr) {
     return XZTL_OK;
 }
 
 static int map_upsert(uint64_t id, uint64_t val, uint64_t *old,
                       uint64_t old_caller) {
+    struct map_state       *st = map_st();
     uint32_t                ent_off;
     struct app_map_entry   *map_ent;
     struct map_cache_entry *cache_ent;
+    int                     ret;
 
-    ent_off = id % map_ent_per_pg;
-    if (ent_off >= map_ent_per_pg) {
+    ent_off = id % st->ent_per_pg;
+    if (ent_off >= st->ent_per_pg) {
         log_erra("map_upsert. Entry offset out of bounds. ID [%lu], off [%d]\n",
                  id, ent_off);
         return XZTL_ZTL_MAP_ERR;
@@ -407,26 +579,54 @@ static int map_upsert(uint64_t id, uint64_t val, uint64_t *old,
     if (old_caller && map_ent->addr != old_caller) {
         log_erra("map_upsert: map_ent->addr [%p] != old_caller [%p].\n",
                  (void *)map_ent->addr, (void *)old_caller);
+        map_put_cache_entry(cache_ent);
         return XZTL_ZTL_MAP_ERR;
     }
 
     ATOMIC_SWAP(&map_ent->addr, map_ent->addr, val);
+    cache_ent->dirty = 1;
+
+    /* Logged under the page mutex, a page copy is either older than the
+     * record or already holds the new value */
+    ret = ztl()->mpe->log_fn(id, val);
 
     ZDEBUG(ZDEBUG_MAP,
            "map_upsert: upsert succeed, ID: [%lu], val: [0x%lx/%d/%d]\n", id,
            (uint64_t)map_ent->g.offset, map_ent->g.nsec, map_ent->g.multi);
 
-    return XZTL_OK;
+    map_put_cache_entry(cache_ent);
+
+    /* The log is full or due for a checkpoint */
+    if (ret == XZTL_ZTL_MD_WRITE_FULL)
+        ret = map_checkpoint();
+    if (ret)
+        log_erra("map_upsert: mapping log err [%d] ID [%lu]\n", ret, id);
+
+    return ret;
+}
+
+/* A checkpoint also covers the upserts a full log could not take */
+static int map_commit(void) {
+    int ret;
+
+    ret = ztl()->mpe->commit_fn();
+    if (ret == XZTL_ZTL_MD_WRITE_FULL)
+        ret = map_checkpoint();
+    if (ret)
+        log_erra("map_commit: mapping log err [%d]\n", ret);
+
+    return ret;
 }
 
 static uint64_t map_read(uint64_t id) {
+    struct map_state       *st = map_st();
     struct map_cache_entry *cache_ent;
     struct app_map_entry   *map_ent;
     uint32_t                ent_off;
     uint64_t                ret;
 
-    ent_off = id % map_ent_per_pg;
-    if (ent_off >= map_ent_per_pg) {
+    ent_off = id % st->ent_per_pg;
+    if (ent_off >= st->ent_per_pg) {
         log_erra("ztl-map: read. Entry offset out of bounds. ID [%lu]", id);
         return AND64;
     }
@@ -440,11 +640,14 @@ static uint64_t map_read(uint64_t id) {
     }
     map_ent = &((struct app_map_entry *)cache_ent->buf)[ent_off];  // NOLINT
 
-    ret = map_ent->g.offset;
+    /* The whole entry, callers may keep their own layout in the 8 bytes */
+    ret = map_ent->addr;
 
     ZDEBUG(ZDEBUG_MAP, "  map_read: ID: [%lu], val [0x%lx/%d/%d]", id,
            (uint64_t)map_ent->g.offset, map_ent->g.nsec, map_ent->g.multi);
 
+    map_put_cache_entry(cache_ent);
+
     return ret;
 }
 
@@ -453,6 +656,7 @@ static struct app_map_mod libztl_map = {.mod_id       = ZTLMOD_MAP,
                                         .init_fn      = map_init,
                                         .exit_fn      = map_exit,
                                         .persist_fn   = map_flush_all_caches,
+                                        .commit_fn    = map_commit,
                                         .upsert_md_fn = map_upsert_md,
                                         .upsert_fn    = map_upsert,
                                         .read_fn      = map_read};
@@ -0,0 +1,1118 @@
+/* xZTL: Zone Translation Layer User-space Library
+ *
+ * Copyright 2019 Samsung Electronics
+ *
+ * Written by Ivan L. Picoli <i.picoli@samsung.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+/* Emulated ZNS media. Zones are kept in RAM (allocated on first write) or in
+ * a sparse file. The zone state machine, write pointers and zone append
+ * follow the ZNS command set closely enough to run the full ZTL on top of it
+ * without a device. Device name format:
+ *
+ *   emu:[nzone=N][,ngrp=N][,zcap=SECTORS][,zsze=SECTORS][,lat=US]
+ *       [,rlat=US][,wlat=US][,mlat=US][,file=PATH][,data=0][,mor=N][,mar=N]
+ *       [,swap=N]
+ *
+ * 'mor' and 'mar' limit the open and active zones, reported in the geometry.
+ * Unlike a device, implicitly opened zones are not closed to make room: a
+ * command needing a zone resource over the limit fails.
+ *
+ * 'swap' runs every Nth asynchronous zone append after the next one of its
+ * queue, appends of a zone then complete out of order as on a device.
+ *
+ * 'ngrp' splits the zones in groups of nzone / ngrp zones. Emulated devices
+ * with the same geometry can be stacked, as "emu:nzone=N;emu:nzone=N".
+ *
+ * Zone state is volatile: a sparse file only moves the data out of RAM. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* fallocate */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libxnvme.h>
+#include <libxnvme_spec.h>
+#include <libxnvme_znd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+#include <unistd.h>
+#include <xztl-media.h>
+#include <xztl.h>
+#include <xztl-stats.h>
+
+#define EMU_SECT_SZ    4096
+#define EMU_CHUNK_SEC  256 /* 1 MB of data per RAM chunk */
+#define EMU_DEF_NZONE  1024
+#define EMU_DEF_ZSZE   32768
+#define EMU_DEF_ZCAP   24576 /* 96 MB */
+#define EMU_OPT_LEN    1024
+#define EMU_READ_CTX   16
+#define EMU_ZONE_TYPE  0x2 /* Sequential write required */
+
+/* NVMe zoned namespace status codes (SCT 0x1) */
+#define EMU_SC_BOUNDARY 0x1b8
+#define EMU_SC_FULL     0x1b9
+#define EMU_SC_RONLY    0x1ba
+#define EMU_SC_INV_WR   0x1bc
+#define EMU_SC_INV_TRS  0x1bf
+#define EMU_SC_ACTIVE   0x1bd /* Too many active zones */
+#define EMU_SC_OPEN     0x1be /* Too many open zones */
+#define EMU_SC_LBA_OUT  0x80
+
+enum emu_store_type {
+    EMU_STORE_RAM  = 0,
+    EMU_STORE_FILE = 1,
+    EMU_STORE_NONE = 2
+};
+
+struct emu_zone {
+    pthread_spinlock_t spin;
+    uint64_t           slba;
+    uint64_t           wp;
+    uint64_t           zcap;
+    uint8_t            zs;
+    uint8_t          **chunk; /* EMU_STORE_RAM only */
+};
+
+struct emu_cpl {
+    struct xztl_io_mcmd *cmd;
+    struct xztl_zn_mcmd *zcmd; /* Zone commands, cmd is NULL */
+    uint64_t             due_ns;
+    uint64_t             paddr;
+    uint16_t             status;
+    TAILQ_ENTRY(emu_cpl) entry;
+};
+
+struct emu_queue {
+    pthread_spinlock_t spin;
+    uint32_t           depth;
+    uint32_t           outs;
+    uint32_t           nappend; /* Appends submitted, see 'swap' */
+    struct emu_cpl    *held;    /* Append run after the next one */
+    struct emu_cpl    *cpls;
+    TAILQ_HEAD(, emu_cpl) free_head;
+    TAILQ_HEAD(, emu_cpl) cpl_head;
+};
+
+struct emu_media {
+    struct xztl_media media;
+    struct emu_zone  *zones;
+    uint32_t          nzone;
+    uint32_t          ngrp;
+    uint64_t          zsze;
+    uint64_t          zcap;
+    uint32_t          nchunk;
+    uint32_t          rlat_us;
+    uint32_t          wlat_us;
+    uint32_t          mlat_us;
+    uint32_t          mor; /* Open zones limit, 0 is no limit */
+    uint32_t          mar; /* Active zones limit, 0 is no limit */
+    uint32_t          swap; /* Appends held behind the next one, 0 is none */
+    volatile uint32_t nopen;
+    volatile uint32_t nactive;
+    int               store;
+    int               fd;
+    char              path[EMU_OPT_LEN];
+};
+
+/* One emulated media per stacked device, see xztl_media_set */
+struct emu_state {
+    struct emu_media dev[XZTL_MEDIA_MAX_DEV];
+    uint16_t         ndev;
+};
+
+static struct emu_state *emu_st(void) {
+    return xztl_instance_state(XZTL_STATE_EMU, sizeof(struct emu_state));
+}
+
+static inline struct emu_media *emu_get(uint16_t dev) {
+    struct xztl_media *m = xztl_media_get_dev(dev);
+
+    return (struct emu_media *)((char *)m - offsetof(struct emu_media, media));
+}
+
+static inline uint64_t emu_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void emu_delay(uint32_t us) {
+    struct timespec ts;
+
+    if (!us)
+        return;
+
+    ts.tv_sec  = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+static inline int emu_zs_open(uint8_t zs) {
+    return zs == XNVME_SPEC_ZND_STATE_IOPEN || zs == XNVME_SPEC_ZND_STATE_EOPEN;
+}
+
+static inline int emu_zs_active(uint8_t zs) {
+    return emu_zs_open(zs) || zs == XNVME_SPEC_ZND_STATE_CLOSED;
+}
+
+static int emu_res_get(volatile uint32_t *cnt, uint32_t max) {
+    uint32_t old;
+
+    do {
+        old = *cnt;
+        if (max && old >= max)
+            return 0;
+    } while (!__sync_bool_compare_and_swap(cnt, old, old + 1));
+
+    return 1;
+}
+
+/* Moves the zone to 'zs', zone spin must be held. Open and active zone
+ * resources follow the state */
+static uint16_t emu_zone_set(struct emu_media *e, struct emu_zone *zone,
+                             uint8_t zs) {
+    int open   = emu_zs_open(zs) - emu_zs_open(zone->zs);
+    int active = emu_zs_active(zs) - emu_zs_active(zone->zs);
+
+    if (active > 0 && !emu_res_get(&e->nactive, e->mar))
+        return EMU_SC_ACTIVE;
+
+    if (open > 0 && !emu_res_get(&e->nopen, e->mor)) {
+        if (active > 0)
+            ATOMIC_SUB(&e->nactive, 1);
+        return EMU_SC_OPEN;
+    }
+
+    if (active < 0)
+        ATOMIC_SUB(&e->nactive, 1);
+    if (open < 0)
+        ATOMIC_SUB(&e->nopen, 1);
+
+    zone->zs = zs;
+    return XZTL_OK;
+}
+
+static void emu_zone_drop_data(struct emu_media *e, struct emu_zone *zone) {
+    uint32_t c_i;
+
+    if (e->store == EMU_STORE_RAM && zone->chunk) {
+        for (c_i = 0; c_i < e->nchunk; c_i++) {
+            free(zone->chunk[c_i]);
+            zone->chunk[c_i] = NULL;
+        }
+    }
+
+    if (e->store == EMU_STORE_FILE) {
+        if (fallocate(e->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      zone->slba * EMU_SECT_SZ, e->zcap * EMU_SECT_SZ))
+            log_erra("emu_zone_drop_data: punch hole failed. zone [%lu]\n",
+                     zone->slba / e->zsze);
+    }
+}
+
+/* Zone spin must be held. Chunks are allocated on first write. */
+static int emu_zone_copy_in(struct emu_media *e, struct emu_zone *zone,
+                            uint64_t lba, uint32_t nsec, const char *buf) {
+    uint64_t off, c_off, len;
+    uint32_t c_i;
+
+    if (e->store == EMU_STORE_NONE)
+        return XZTL_OK;
+
+    if (e->store == EMU_STORE_FILE) {
+        len = (uint64_t)nsec * EMU_SECT_SZ;
+        if (pwrite(e->fd, buf, len, lba * EMU_SECT_SZ) != len)
+            return EMU_SC_INV_WR;
+        return XZTL_OK;
+    }
+
+    if (!zone->chunk) {
+        zone->chunk = calloc(e->nchunk, sizeof(uint8_t *));
+        if (!zone->chunk)
+            return EMU_SC_INV_WR;
+    }
+
+    off = lba - zone->slba;
+    while (nsec) {
+        c_i   = off / EMU_CHUNK_SEC;
+        c_off = off % EMU_CHUNK_SEC;
+        len   = MIN(nsec, EMU_CHUNK_SEC - c_off);
+
+        if (!zone->chunk[c_i]) {
+            zone->chunk[c_i] = malloc(EMU_CHUNK_SEC * EMU_SECT_SZ);
+            if (!zone->chunk[c_i])
+                return EMU_SC_INV_WR;
+        }
+
+        memcpy(zone->chunk[c_i] + c_off * EMU_SECT_SZ, buf, len * EMU_SECT_SZ);
+
+        buf += len * EMU_SECT_SZ;
+        off += len;
+        nsec -= len;
+    }
+
+    return XZTL_OK;
+}
+
+/* Zone spin must be held. Sectors above the write pointer read as zeroes. */
+static void emu_zone_copy_out(struct emu_media *e, struct emu_zone *zone,
+                              uint64_t lba, uint32_t nsec, char *buf) {
+    uint64_t off, c_off, len, valid;
+    uint32_t c_i;
+
+    valid = (lba < zone->wp) ? MIN(nsec, zone->wp - lba) : 0;
+    memset(buf + valid * EMU_SECT_SZ, 0x0, (nsec - valid) * EMU_SECT_SZ);
+
+    if (e->store == EMU_STORE_NONE) {
+        memset(buf, 0x0, valid * EMU_SECT_SZ);
+        return;
+    }
+
+    if (e->store == EMU_STORE_FILE) {
+        len = valid * EMU_SECT_SZ;
+        if (len && pread(e->fd, buf, len, lba * EMU_SECT_SZ) != len)
+            memset(buf, 0x0, len);
+        return;
+    }
+
+    off = lba - zone->slba;
+    while (valid) {
+        c_i   = off / EMU_CHUNK_SEC;
+        c_off = off % EMU_CHUNK_SEC;
+        len   = MIN(valid, EMU_CHUNK_SEC - c_off);
+
+        if (zone->chunk && zone->chunk[c_i])
+            memcpy(buf, zone->chunk[c_i] + c_off * EMU_SECT_SZ,
+                   len * EMU_SECT_SZ);
+        else
+            memset(buf, 0x0, len * EMU_SECT_SZ);
+
+        buf += len * EMU_SECT_SZ;
+        off += len;
+        valid -= len;
+    }
+}
+
+static inline struct emu_zone *emu_get_zone(struct emu_media *e,
+                                            uint64_t lba) {
+    uint64_t zn = lba / e->zsze;
+
+    return (zn < e->nzone) ? &e->zones[zn] : NULL;
+}
+
+/* Commands carry stacked addresses, zones are addressed by the device
+ * local group and sector */
+static uint16_t emu_exec_read(struct emu_media *e, struct xztl_io_mcmd *cmd) {
+    struct emu_zone *zone;
+    uint64_t         lba  = cmd->addr[0].g.sect - e->media.sec_base;
+    uint32_t         nsec = cmd->nsec[0];
+
+    zone = emu_get_zone(e, lba);
+    if (!zone || lba + nsec > zone->slba + e->zsze)
+        return EMU_SC_LBA_OUT;
+
+    pthread_spin_lock(&zone->spin);
+    emu_zone_copy_out(e, zone, lba, nsec, (char *)cmd->prp[0]);  // NOLINT
+    pthread_spin_unlock(&zone->spin);
+
+    return XZTL_OK;
+}
+
+static uint16_t emu_exec_write(struct emu_media *e, struct xztl_io_mcmd *cmd,
+                               uint64_t *paddr) {
+    struct emu_zone *zone;
+    uint64_t         lba;
+    uint32_t         nsec = cmd->nsec[0];
+    uint16_t         status;
+
+    if (cmd->opcode == XZTL_ZONE_APPEND)
+        lba = (e->media.geo.zn_grp * (cmd->addr[0].g.grp - e->media.grp_base) +
+               cmd->addr[0].g.zone) *
+              e->zsze;
+    else
+        lba = cmd->addr[0].g.sect - e->media.sec_base;
+
+    zone = emu_get_zone(e, lba);
+    if (!zone)
+        return EMU_SC_LBA_OUT;
+
+    pthread_spin_lock(&zone->spin);
+
+    switch (zone->zs) {
+        case XNVME_SPEC_ZND_STATE_FULL:
+            status = EMU_SC_FULL;
+            goto UNLOCK;
+        case XNVME_SPEC_ZND_STATE_RONLY:
+        case XNVME_SPEC_ZND_STATE_OFFLINE:
+            status = EMU_SC_RONLY;
+            goto UNLOCK;
+    }
+
+    if (cmd->opcode == XZTL_ZONE_APPEND) {
+        if (lba != zone->slba) {
+            status = EMU_SC_INV_WR;
+            goto UNLOCK;
+        }
+        lba = zone->wp;
+    } else if (lba != zone->wp) {
+        status = EMU_SC_INV_WR;
+        goto UNLOCK;
+    }
+
+    if (lba + nsec > zone->slba + zone->zcap) {
+        status = EMU_SC_BOUNDARY;
+        goto UNLOCK;
+    }
+
+    /* Data above the write pointer is never read back, a failed copy or
+     * state change leaves the zone as it was */
+    status = emu_zone_copy_in(e, zone, lba, nsec,
+                              (const char *)cmd->prp[0]);  // NOLINT
+    if (status)
+        goto UNLOCK;
+
+    status = emu_zone_set(e, zone,
+                          (lba + nsec == zone->slba + zone->zcap)
+                              ? XNVME_SPEC_ZND_STATE_FULL
+                          : (zone->zs == XNVME_SPEC_ZND_STATE_EOPEN)
+                              ? XNVME_SPEC_ZND_STATE_EOPEN
+                              : XNVME_SPEC_ZND_STATE_IOPEN);
+    if (status)
+        goto UNLOCK;
+
+    zone->wp += nsec;
+    *paddr = lba + e->media.sec_base;
+
+UNLOCK:
+    pthread_spin_unlock(&zone->spin);
+    return status;
+}
+
+static uint16_t emu_exec_io(struct xztl_io_mcmd *cmd, uint64_t *paddr,
+                            uint32_t *lat) {
+    struct emu_media *e = emu_get(xztl_media_io_dev(cmd));
+
+    switch (cmd->opcode) {
+        case XZTL_CMD_READ:
+            *lat = e->rlat_us;
+            return emu_exec_read(e, cmd);
+        case XZTL_CMD_WRITE:
+        case XZTL_ZONE_APPEND:
+            *lat = e->wlat_us;
+            return emu_exec_write(e, cmd, paddr);
+        default:
+            *lat = 0;
+            return ZND_INVALID_OPCODE;
+    }
+}
+
+static int emu_media_submit_synch(struct xztl_io_mcmd *cmd) {
+    struct timespec ts_s, ts_e;
+    uint64_t        paddr = 0;
+    uint32_t        lat;
+
+    GET_MICROSECONDS(cmd->us_start, ts_s);
+
+    cmd->status = emu_exec_io(cmd, &paddr, &lat);
+    emu_delay(lat);
+
+    GET_MICROSECONDS(cmd->us_end, ts_e);
+
+    if (cmd->status) {
+        log_erra("emu_media_submit_synch: err status [%x] opaque [%p]\n",
+                 cmd->status, cmd->opaque);
+        return cmd->status;
+    }
+
+    if (cmd->opcode != XZTL_CMD_READ)
+        cmd->paddr[0] = paddr;
+
+    return XZTL_OK;
+}
+
+static struct emu_cpl *emu_queue_get(struct emu_queue *q) {
+    struct emu_cpl *cpl;
+
+    pthread_spin_lock(&q->spin);
+    cpl = TAILQ_FIRST(&q->free_head);
+    if (cpl) {
+        TAILQ_REMOVE(&q->free_head, cpl, entry);
+        q->outs++;
+    }
+    pthread_spin_unlock(&q->spin);
+
+    return cpl;
+}
+
+static void emu_queue_post(struct emu_queue *q, struct emu_cpl *cpl,
+                           uint32_t lat) {
+    cpl->due_ns = (lat) ? emu_now_ns() + lat * 1000UL : 0;
+
+    pthread_spin_lock(&q->spin);
+    TAILQ_INSERT_TAIL(&q->cpl_head, cpl, entry);
+    pthread_spin_unlock(&q->spin);
+}
+
+static void emu_queue_exec(struct emu_queue *q, struct emu_cpl *cpl) {
+    uint32_t lat;
+
+    cpl->status = emu_exec_io(cpl->cmd, &cpl->paddr, &lat);
+    emu_queue_post(q, cpl, lat);
+}
+
+/* Runs the append held by 'swap', if any */
+static void emu_queue_release(struct emu_queue *q) {
+    struct emu_cpl *held;
+
+    pthread_spin_lock(&q->spin);
+    held    = q->held;
+    q->held = NULL;
+    pthread_spin_unlock(&q->spin);
+
+    if (held)
+        emu_queue_exec(q, held);
+}
+
+/* Commands are executed at submission time. Completion is posted to the
+ * queue and only delivered by a poke after the configured latency. An
+ * append held by 'swap' is executed after the next append, or by a poke */
+static int emu_media_submit_asynch(struct xztl_io_mcmd *cmd) {
+    struct emu_queue *q = (struct emu_queue *)cmd->async_ctx->opaque;
+    struct emu_media *e = emu_get(xztl_media_io_dev(cmd));
+    struct emu_cpl   *cpl;
+
+    cpl = emu_queue_get(q);
+    if (!cpl)
+        return -EBUSY;
+
+    cpl->cmd   = cmd;
+    cpl->zcmd  = NULL;
+    cpl->paddr = 0;
+
+    if (cmd->opcode == XZTL_ZONE_APPEND && e->swap) {
+        pthread_spin_lock(&q->spin);
+        if (!q->held && ++q->nappend % e->swap == 0) {
+            q->held = cpl;
+            pthread_spin_unlock(&q->spin);
+            return XZTL_OK;
+        }
+        pthread_spin_unlock(&q->spin);
+    }
+
+    emu_queue_exec(q, cpl);
+    emu_queue_release(q);
+
+    return XZTL_OK;
+}
+
+static int emu_media_submit_io(struct xztl_io_mcmd *cmd) {
+    switch (cmd->opcode) {
+        case XZTL_ZONE_APPEND:
+        case XZTL_CMD_READ:
+        case XZTL_CMD_WRITE:
+            return (cmd->synch) ? emu_media_submit_synch(cmd)
+                                : emu_media_submit_asynch(cmd);
+        default:
+            return ZND_INVALID_OPCODE;
+    }
+}
+
+static uint16_t emu_zone_action(struct emu_media *e, struct emu_zone *zone,
+                                uint8_t op) {
+    uint16_t status = XZTL_OK;
+
+    pthread_spin_lock(&zone->spin);
+
+    if (zone->zs == XNVME_SPEC_ZND_STATE_RONLY ||
+        zone->zs == XNVME_SPEC_ZND_STATE_OFFLINE) {
+        pthread_spin_unlock(&zone->spin);
+        return EMU_SC_INV_TRS;
+    }
+
+    switch (op) {
+        case XZTL_ZONE_MGMT_RESET:
+            if (zone->zs != XNVME_SPEC_ZND_STATE_EMPTY)
+                emu_zone_drop_data(e, zone);
+            zone->wp = zone->slba;
+            emu_zone_set(e, zone, XNVME_SPEC_ZND_STATE_EMPTY);
+            break;
+
+        case XZTL_ZONE_MGMT_FINISH:
+            zone->wp = zone->slba + zone->zcap;
+            emu_zone_set(e, zone, XNVME_SPEC_ZND_STATE_FULL);
+            break;
+
+        case XZTL_ZONE_MGMT_OPEN:
+            if (zone->zs == XNVME_SPEC_ZND_STATE_FULL)
+                status = EMU_SC_INV_TRS;
+            else
+                status = emu_zone_set(e, zone, XNVME_SPEC_ZND_STATE_EOPEN);
+            break;
+
+        case XZTL_ZONE_MGMT_CLOSE:
+            if (emu_zs_open(zone->zs))
+                emu_zone_set(e, zone,
+                             (zone->wp == zone->slba)
+                                 ? XNVME_SPEC_ZND_STATE_EMPTY
+                                 : XNVME_SPEC_ZND_STATE_CLOSED);
+            else if (zone->zs != XNVME_SPEC_ZND_STATE_CLOSED)
+                status = EMU_SC_INV_TRS;
+            break;
+
+        default:
+            status = ZND_INVALID_OPCODE;
+    }
+
+    pthread_spin_unlock(&zone->spin);
+    return status;
+}
+
+static int emu_media_zone_manage(struct xztl_zn_mcmd *cmd) {
+    struct emu_media *e = emu_get(xztl_media_grp_dev(cmd->addr.g.grp));
+    uint64_t          zn;
+    uint16_t          status;
+
+    /* Like the device, more than one zone selects the whole namespace */
+    if (cmd->nzones > 1) {
+        cmd->status = XZTL_OK;
+        for (zn = 0; zn < e->nzone; zn++) {
+            if (cmd->opcode == XZTL_ZONE_MGMT_RESET &&
+                e->zones[zn].zs == XNVME_SPEC_ZND_STATE_EMPTY)
+                continue;
+            status = emu_zone_action(e, &e->zones[zn], cmd->opcode);
+            if (status && cmd->opcode == XZTL_ZONE_MGMT_RESET)
+                cmd->status = status;
+        }
+        emu_delay(e->mlat_us);
+        return cmd->status;
+    }
+
+    zn = e->media.geo.zn_grp * (cmd->addr.g.grp - e->media.grp_base) +
+         cmd->addr.g.zone;
+    if (zn >= e->nzone) {
+        cmd->status = EMU_SC_LBA_OUT;
+        return cmd->status;
+    }
+
+    cmd->status = emu_zone_action(e, &e->zones[zn], cmd->opcode);
+    emu_delay(e->mlat_us);
+
+    if (cmd->status)
+        log_erra("emu_media_zone_manage: err op [%u] zone [%lu] status [%x]\n",
+                 cmd->opcode, zn, cmd->status);
+
+    return cmd->status;
+}
+
+static int emu_media_zone_report(struct xztl_zn_mcmd *cmd) {
+    struct emu_media            *e;
+    struct xnvme_znd_report     *rep;
+    struct xnvme_spec_znd_descr *zinfo;
+    struct emu_zone             *zone;
+    uint64_t                     entries_nbytes, zn, first, nzones;
+
+    /* Reports are device local, see xztl_media_submit_zn */
+    e = emu_get(xztl_media_grp_dev(cmd->addr.g.grp));
+
+    first  = 0;
+    nzones = e->nzone;
+    if (cmd->opcode == XZTL_ZONE_MGMT_RANGE) {
+        first = e->media.geo.zn_grp * (cmd->addr.g.grp - e->media.grp_base) +
+                cmd->addr.g.zone;
+        if (first >= e->nzone || !cmd->nzones) {
+            cmd->status = EMU_SC_LBA_OUT;
+            return ZND_MEDIA_REPORT_ERR;
+        }
+        nzones = MIN(cmd->nzones, e->nzone - first);
+    }
+
+    entries_nbytes = nzones * sizeof(struct xnvme_spec_znd_descr);
+
+    rep = xnvme_buf_virt_alloc(EMU_SECT_SZ,
+                               sizeof(struct xnvme_znd_report) + entries_nbytes);
+    if (!rep) {
+        log_err("emu_media_zone_report: rep is NULL\n");
+        return ZND_MEDIA_REPORT_ERR;
+    }
+    memset(rep, 0x0, sizeof(struct xnvme_znd_report) + entries_nbytes);
+
+    rep->zslba          = first * e->zsze;
+    rep->zelba          = (first + nzones - 1) * e->zsze;
+    rep->nzones         = nzones;
+    rep->zd_nbytes      = sizeof(struct xnvme_spec_znd_descr);
+    rep->zrent_nbytes   = sizeof(struct xnvme_spec_znd_descr);
+    rep->report_nbytes  = sizeof(struct xnvme_znd_report) + entries_nbytes;
+    rep->entries_nbytes = entries_nbytes;
+
+    for (zn = 0; zn < nzones; zn++) {
+        zone  = &e->zones[first + zn];
+        zinfo = XNVME_ZND_REPORT_DESCR(rep, zn);
+
+        pthread_spin_lock(&zone->spin);
+        zinfo->zt    = EMU_ZONE_TYPE;
+        zinfo->zs    = zone->zs;
+        zinfo->zcap  = zone->zcap;
+        zinfo->zslba = zone->slba;
+        zinfo->wp    = zone->wp;
+        pthread_spin_unlock(&zone->spin);
+    }
+
+    cmd->opaque = (void *)rep;  // NOLINT
+
+    return XZTL_OK;
+}
+
+static int emu_media_zone_mgmt(struct xztl_zn_mcmd *cmd) {
+    switch (cmd->opcode) {
+        case XZTL_ZONE_MGMT_RESET:
+            xztl_stats_inc(XZTL_STATS_RESET_MCMD, 1);
+            /* fall through */
+        case XZTL_ZONE_MGMT_CLOSE:
+        case XZTL_ZONE_MGMT_FINISH:
+        case XZTL_ZONE_MGMT_OPEN:
+            return emu_media_zone_manage(cmd);
+        case XZTL_ZONE_MGMT_RANGE:
+        case XZTL_ZONE_MGMT_REPORT:
+            return emu_media_zone_report(cmd);
+        default:
+            return ZND_INVALID_OPCODE;
+    }
+}
+
+/* Single zone commands complete through the queue like IO commands */
+static int emu_media_zone_async(struct xztl_zn_mcmd *cmd) {
+    struct emu_media *e = emu_get(cmd->async_ctx->dev);
+    struct emu_queue *q = (struct emu_queue *)cmd->async_ctx->opaque;
+    struct emu_cpl   *cpl;
+    uint64_t          zn;
+
+    if (cmd->opcode == XZTL_ZONE_MGMT_REPORT ||
+        cmd->opcode == XZTL_ZONE_MGMT_RANGE)
+        return ZND_INVALID_OPCODE;
+
+    zn = e->media.geo.zn_grp * (cmd->addr.g.grp - e->media.grp_base) +
+         cmd->addr.g.zone;
+    if (zn >= e->nzone)
+        return EMU_SC_LBA_OUT;
+
+    cpl = emu_queue_get(q);
+    if (!cpl)
+        return -EBUSY;
+
+    if (cmd->opcode == XZTL_ZONE_MGMT_RESET)
+        xztl_stats_inc(XZTL_STATS_RESET_MCMD, 1);
+
+    cpl->cmd    = NULL;
+    cpl->zcmd   = cmd;
+    cpl->status = emu_zone_action(e, &e->zones[zn], cmd->opcode);
+
+    emu_queue_post(q, cpl, e->mlat_us);
+
+    return XZTL_OK;
+}
+
+static void *emu_media_dma_alloc(size_t size) {
+    size_t bytes = (size + EMU_SECT_SZ - 1) / EMU_SECT_SZ * EMU_SECT_SZ;
+
+    return aligned_alloc(EMU_SECT_SZ, (bytes) ? bytes : EMU_SECT_SZ);
+}
+
+static void emu_media_dma_free(void *ptr) {
+    free(ptr);
+}
+
+/* Data is copied by the CPU, any buffer is valid */
+static int emu_media_dma_check(void *buf, size_t size) {
+    return buf && size;
+}
+
+static int emu_media_async_poke(struct emu_queue *q, uint32_t *c,
+                                uint32_t max) {
+    TAILQ_HEAD(, emu_cpl) done;
+    struct emu_cpl      *cpl, *next;
+    struct xztl_io_mcmd *cmd;
+    struct xztl_zn_mcmd *zcmd;
+    uint64_t             now = 0;
+    uint32_t             count = 0;
+
+    TAILQ_INIT(&done);
+
+    emu_queue_release(q);
+
+    pthread_spin_lock(&q->spin);
+    for (cpl = TAILQ_FIRST(&q->cpl_head); cpl; cpl = next) {
+        next = TAILQ_NEXT(cpl, entry);
+        if (max && count == max)
+            break;
+        if (cpl->due_ns) {
+            if (!now)
+                now = emu_now_ns();
+            if (cpl->due_ns > now)
+                continue;
+        }
+        TAILQ_REMOVE(&q->cpl_head, cpl, entry);
+        TAILQ_INSERT_TAIL(&done, cpl, entry);
+        count++;
+    }
+    pthread_spin_unlock(&q->spin);
+
+    /* The entry is released before the callback, it may resubmit */
+    while (!TAILQ_EMPTY(&done)) {
+        cpl = TAILQ_FIRST(&done);
+        TAILQ_REMOVE(&done, cpl, entry);
+
+        cmd  = cpl->cmd;
+        zcmd = cpl->zcmd;
+        if (zcmd)
+            zcmd->status = cpl->status;
+        else
+            cmd->status = cpl->status;
+        if (cmd && !cmd->status && cmd->opcode != XZTL_CMD_READ)
+            cmd->paddr[0] = cpl->paddr;
+
+        pthread_spin_lock(&q->spin);
+        TAILQ_INSERT_TAIL(&q->free_head, cpl, entry);
+        q->outs--;
+        pthread_spin_unlock(&q->spin);
+
+        if (zcmd) {
+            if (zcmd->status)
+                log_erra("emu_media_async_poke: err op [%u] zone [%u] "
+                         "status [%x]\n",
+                         zcmd->opcode, zcmd->addr.g.zone, zcmd->status);
+            zcmd->callback(zcmd);
+            continue;
+        }
+
+        if (cmd->status) {
+            log_erra("emu_media_async_poke: err status [%x] opaque [%p]\n",
+                     cmd->status, cmd->opaque);
+            xztl_print_mcmd(cmd);
+        }
+
+        cmd->callback(cmd);
+    }
+
+    *c = count;
+
+    return XZTL_OK;
+}
+
+static int emu_media_asynch_init(struct xztl_misc_cmd *cmd) {
+    struct emu_queue *q;
+    uint32_t          c_i;
+
+    q = calloc(1, sizeof(struct emu_queue));
+    if (!q)
+        return ZND_MEDIA_ASYNCH_MEM;
+
+    q->cpls = calloc(cmd->asynch.depth, sizeof(struct emu_cpl));
+    if (!q->cpls)
+        goto FREE;
+
+    if (pthread_spin_init(&q->spin, 0))
+        goto CPLS;
+
+    TAILQ_INIT(&q->free_head);
+    TAILQ_INIT(&q->cpl_head);
+    for (c_i = 0; c_i < cmd->asynch.depth; c_i++)
+        TAILQ_INSERT_TAIL(&q->free_head, &q->cpls[c_i], entry);
+
+    q->depth = cmd->asynch.depth;
+    q->outs  = 0;
+
+    cmd->asynch.ctx_ptr->opaque = q;
+
+    return XZTL_OK;
+
+CPLS:
+    free(q->cpls);
+FREE:
+    free(q);
+    log_erra("emu_media_asynch_init: error depth [%u]\n", cmd->asynch.depth);
+    return ZND_MEDIA_ASYNCH_MEM;
+}
+
+static int emu_media_asynch_term(struct xztl_misc_cmd *cmd) {
+    struct emu_queue *q = (struct emu_queue *)cmd->asynch.ctx_ptr->opaque;
+
+    if (q->outs)
+        log_erra("emu_media_asynch_term: outstanding commands [%u]\n",
+                 q->outs);
+
+    pthread_spin_destroy(&q->spin);
+    free(q->cpls);
+    free(q);
+
+    cmd->asynch.ctx_ptr->opaque = NULL;
+
+    return XZTL_OK;
+}
+
+static int emu_media_cmd_exec(struct xztl_misc_cmd *cmd) {
+    struct emu_queue *q;
+    uint32_t          c;
+
+    switch (cmd->opcode) {
+        case XZTL_MISC_ASYNCH_INIT:
+            return emu_media_asynch_init(cmd);
+
+        case XZTL_MISC_ASYNCH_TERM:
+            return emu_media_asynch_term(cmd);
+
+        case XZTL_MISC_ASYNCH_POKE:
+            q = (struct emu_queue *)cmd->asynch.ctx_ptr->opaque;
+            return emu_media_async_poke(q, &cmd->asynch.count,
+                                        cmd->asynch.limit);
+
+        case XZTL_MISC_ASYNCH_OUTS:
+            q                 = (struct emu_queue *)cmd->asynch.ctx_ptr->opaque;
+            cmd->asynch.count = q->outs;
+            return XZTL_OK;
+
+        case XZTL_MISC_ASYNCH_WAIT:
+            q                 = (struct emu_queue *)cmd->asynch.ctx_ptr->opaque;
+            cmd->asynch.count = q->outs;
+            return (q->outs) ? ZND_MEDIA_WAIT_ERR : XZTL_OK;
+
+        case XZTL_MISC_ASYNCH_DRAIN:
+            q                 = (struct emu_queue *)cmd->asynch.ctx_ptr->opaque;
+            cmd->asynch.count = 0;
+            while (q->outs) {
+                emu_media_async_poke(q, &c, 0);
+                cmd->asynch.count += c;
+                if (!c)
+                    sched_yield();
+            }
+            return XZTL_OK;
+
+        default:
+            return ZND_INVALID_OPCODE;
+    }
+}
+
+static int emu_media_init(void) {
+    return XZTL_OK;
+}
+
+/* Called once per stacked device, the first call releases all of them */
+static int emu_media_exit(void) {
+    struct emu_state *st = emu_st();
+    struct emu_media *e;
+    uint32_t          zn;
+    uint16_t          dev_i;
+
+    for (dev_i = 0; dev_i < st->ndev; dev_i++) {
+        e = &st->dev[dev_i];
+        if (!e->zones)
+            continue;
+
+        for (zn = 0; zn < e->nzone; zn++) {
+            if (e->store == EMU_STORE_RAM)
+                emu_zone_drop_data(e, &e->zones[zn]);
+            free(e->zones[zn].chunk);
+            pthread_spin_destroy(&e->zones[zn].spin);
+        }
+        free(e->zones);
+        e->zones = NULL;
+
+        if (e->store == EMU_STORE_FILE)
+            close(e->fd);
+    }
+    st->ndev = 0;
+
+    return XZTL_OK;
+}
+
+static int emu_opt_parse(struct emu_media *e, const char *dev_name) {
+    char     opts[EMU_OPT_LEN];
+    char    *tok, *save, *val;
+    uint32_t lat;
+
+    e->nzone   = EMU_DEF_NZONE;
+    e->ngrp    = 1;
+    e->zsze    = EMU_DEF_ZSZE;
+    e->zcap    = EMU_DEF_ZCAP;
+    e->rlat_us = e->wlat_us = e->mlat_us = 0;
+    e->mor     = e->mar = 0;
+    e->swap    = 0;
+    e->nopen   = e->nactive = 0;
+    e->store   = EMU_STORE_RAM;
+    e->path[0] = '\0';
+
+    if (strncmp(dev_name, XZTL_EMU_PREFIX, strlen(XZTL_EMU_PREFIX)) ||
+        strlen(dev_name) >= EMU_OPT_LEN) {
+        log_erra("emu_opt_parse: err param '%s'\n", dev_name);
+        return ZND_MEDIA_NODEVICE;
+    }
+
+    snprintf(opts, EMU_OPT_LEN, "%s", dev_name + strlen(XZTL_EMU_PREFIX));
+
+    for (tok = strtok_r(opts, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (!val) {
+            log_erra("emu_opt_parse: err option '%s'\n", tok);
+            return ZND_MEDIA_NODEVICE;
+        }
+        *val++ = '\0';
+
+        if (!strcmp(tok, "nzone")) {
+            e->nzone = strtoul(val, NULL, 0);
+        } else if (!strcmp(tok, "ngrp")) {
+            e->ngrp = strtoul(val, NULL, 0);
+        } else if (!strcmp(tok, "zcap")) {
+            e->zcap = strtoull(val, NULL, 0);
+        } else if (!strcmp(tok, "zsze")) {
+            e->zsze = strtoull(val, NULL, 0);
+        } else if (!strcmp(tok, "lat")) {
+            lat        = strtoul(val, NULL, 0);
+            e->rlat_us = e->wlat_us = e->mlat_us = lat;
+        } else if (!strcmp(tok, "rlat")) {
+            e->rlat_us = strtoul(val, NULL, 0);
+        } else if (!strcmp(tok, "wlat")) {
+            e->wlat_us = strtoul(val, NULL, 0);
+        } else if (!strcmp(tok, "mlat")) {
+            e->mlat_us = strtoul(val, NULL, 0);
+        } else if (!strcmp(tok, "file")) {
+            snprintf(e->path, EMU_OPT_LEN, "%s", val);
+            e->store = EMU_STORE_FILE;
+        } else if (!strcmp(tok, "data")) {
+            if (!strtoul(val, NULL, 0))
+                e->store = EMU_STORE_NONE;
+        } else if (!strcmp(tok, "mor")) {
+            e->mor = strtoul(val, NULL, 0);
+        } else if (!strcmp(tok, "mar")) {
+            e->mar = strtoul(val, NULL, 0);
+        } else if (!strcmp(tok, "swap")) {
+            e->swap = strtoul(val, NULL, 0);
+        } else {
+            log_erra("emu_opt_parse: unknown option '%s'\n", tok);
+            return ZND_MEDIA_NODEVICE;
+        }
+    }
+
+    if (!e->ngrp || e->ngrp > XZTL_MEDIA_MAX_GRP || e->nzone % e->ngrp) {
+        log_erra("emu_opt_parse: err nzone [%u] in [%u] groups", e->nzone,
+                 e->ngrp);
+        return ZND_MEDIA_NOGEO;
+    }
+
+    if (!e->nzone || !e->zcap || e->zcap > e->zsze) {
+        log_erra("emu_opt_parse: err geometry nzone [%u] zcap [%lu] zsze [%lu]",
+                 e->nzone, e->zcap, e->zsze);
+        return ZND_MEDIA_NOGEO;
+    }
+
+    log_infoa("emu_opt_parse: nzone [%u] ngrp [%u] zcap [%lu] zsze [%lu] "
+              "lat r/w/m [%u/%u/%u] store [%d] mor/mar [%u/%u] swap [%u]",
+              e->nzone, e->ngrp, e->zcap, e->zsze, e->rlat_us, e->wlat_us,
+              e->mlat_us, e->store, e->mor, e->mar, e->swap);
+
+    return XZTL_OK;
+}
+
+int emu_media_register(const char *dev_name) {
+    struct emu_state  *st = emu_st();
+    struct emu_media  *e;
+    struct xztl_media *m;
+    uint32_t           zn, cpu_num;
+    int                ret;
+
+    if (st->ndev == XZTL_MEDIA_MAX_DEV)
+        return ZND_MEDIA_NODEVICE;
+    e = &st->dev[st->ndev];
+
+    ret = emu_opt_parse(e, dev_name);
+    if (ret)
+        return ret;
+
+    if (e->store == EMU_STORE_FILE) {
+        e->fd = open(e->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (e->fd < 0 ||
+            ftruncate(e->fd, e->nzone * e->zsze * EMU_SECT_SZ)) {
+            log_erra("emu_media_register: err file '%s'\n", e->path);
+            if (e->fd >= 0)
+                close(e->fd);
+            return ZND_MEDIA_OPEN_ERR;
+        }
+    }
+
+    e->nchunk = (e->zcap + EMU_CHUNK_SEC - 1) / EMU_CHUNK_SEC;
+    e->zones  = calloc(e->nzone, sizeof(struct emu_zone));
+    if (!e->zones) {
+        if (e->store == EMU_STORE_FILE)
+            close(e->fd);
+        return ZND_MEDIA_NODEVICE;
+    }
+
+    for (zn = 0; zn < e->nzone; zn++) {
+        pthread_spin_init(&e->zones[zn].spin, 0);
+        e->zones[zn].slba = zn * e->zsze;
+        e->zones[zn].wp   = e->zones[zn].slba;
+        e->zones[zn].zcap = e->zcap;
+        e->zones[zn].zs   = XNVME_SPEC_ZND_STATE_EMPTY;
+    }
+
+    m = &e->media;
+
+    m->geo.ngrps       = e->ngrp;
+    m->geo.pu_grp      = 1;
+    m->geo.zn_pu       = e->nzone / e->ngrp;
+    m->geo.sec_zn      = e->zsze;
+    m->geo.nbytes      = EMU_SECT_SZ;
+    m->geo.nbytes_oob  = 0;
+    m->geo.nbytes_mdts = ZNA_1M_BUF;
+    m->geo.max_open    = e->mor;
+    m->geo.max_active  = e->mar;
+
+    cpu_num         = sysconf(_SC_NPROCESSORS_CONF);
+    m->read_ctx_num = MIN(MAX(cpu_num, EMU_READ_CTX), XZTL_READ_RS_NUM);
+    m->io_depth     = xztl_config_get()->qdepth;
+    if (xztl_config_get()->read_ctx)
+        m->read_ctx_num = xztl_config_get()->read_ctx;
+
+    m->init_fn       = emu_media_init;
+    m->exit_fn       = emu_media_exit;
+    m->submit_io     = emu_media_submit_io;
+    m->zone_fn       = emu_media_zone_mgmt;
+    m->zone_async_fn = emu_media_zone_async;
+    m->dma_alloc     = emu_media_dma_alloc;
+    m->dma_free      = emu_media_dma_free;
+    m->dma_check     = emu_media_dma_check;
+    m->cmd_exec      = emu_media_cmd_exec;
+
+    ret = xztl_media_set(m);
+    if (ret) {
+        for (zn = 0; zn < e->nzone; zn++)
+            pthread_spin_destroy(&e->zones[zn].spin);
+        free(e->zones);
+        e->zones = NULL;
+        if (e->store == EMU_STORE_FILE)
+            close(e->fd);
+        return ret;
+    }
+    st->ndev++;
+
+    return XZTL_OK;
+}
@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/queue.h>
 #include <time.h>
 #include <unistd.h>
@@ -37,7 +38,11 @@
 #define BE_PARAM                    "spdk"
 #define MIN_OPT_PARAM_LEN         10
 
-struct znd_media zndmedia;
+/* One media per stacked device, see xztl_media_set */
+struct znd_state {
+    struct znd_media dev[XZTL_MEDIA_MAX_DEV];
+    uint16_t         ndev;
+};
 
 const char* be_str[20] = {
     "",
@@ -56,8 +61,22 @@ static inline int is_blk_thrpool(struct znd_opt_info *opt_info) {
     return 0;
 }
 
+static struct znd_state *znd_st(void) {
+    return xztl_instance_state(XZTL_STATE_ZND, sizeof(struct znd_state));
+}
+
 inline struct znd_media *get_znd_media(void) {
-    return &zndmedia;
+    return &znd_st()->dev[0];
+}
+
+static inline struct znd_media *znd_get(uint16_t dev) {
+    struct xztl_media *m = xztl_media_get_dev(dev);
+
+    return (struct znd_media *)((char *)m - offsetof(struct znd_media, media));
+}
+
+static inline struct xnvme_dev *znd_read_dev(struct znd_media *znd) {
+    return (znd->dev_read) ? znd->dev_read : znd->dev;
 }
 
 extern char *dev_name;
@@ -69,8 +88,10 @@ static void znd_media_async_cb(struct xnvme_cmd_ctx *ctx, void *cb_arg) {
     cmd         = (struct xztl_io_mcmd *)cb_arg;
     cmd->status = xnvme_cmd_ctx_cpl_status(ctx);
 
+    /* The device completes with a local LBA */
     if (!cmd->status && cmd->opcode == XZTL_ZONE_APPEND)
-        cmd->paddr[sec_i] = *(uint64_t *)&ctx->cpl.cdw0;  // NOLINT
+        cmd->paddr[sec_i] = *(uint64_t *)&ctx->cpl.cdw0 +  // NOLINT
+                            znd_get(xztl_media_io_dev(cmd))->media.sec_base;
 
     if (cmd->opcode == XZTL_CMD_WRITE)
         cmd->paddr[sec_i] = cmd->addr[sec_i].g.sect;
@@ -92,13 +113,13 @@ static int znd_media_submit_read_synch(struct xztl_io_mcmd *cmd) {
     uint64_t          slba;
     uint16_t          sec_i = 0;
     struct timespec   ts_s, ts_e;
-    struct xnvme_dev *p_dev =
-        (zndmedia.dev_read) ? zndmedia.dev_read : zndmedia.dev;
+    struct znd_media *znd   = znd_get(xztl_media_io_dev(cmd));
+    struct xnvme_dev *p_dev = znd_read_dev(znd);
 
     struct xnvme_cmd_ctx ctx = xnvme_cmd_ctx_from_dev(p_dev);
 
     /* The read path is not group based. It uses only sectors */
-    slba = cmd->addr[sec_i].g.sect;
+    slba = cmd->addr[sec_i].g.sect - znd->media.sec_base;
 
     int ret;
 
@@ -129,16 +150,16 @@ static int znd_media_submit_read_asynch(struct xztl_io_mcmd *cmd) {
     struct xztl_mthread_ctx *tctx;
     struct xnvme_cmd_ctx    *xnvme_ctx;
     int                      ret;
-    struct xnvme_dev        *p_dev =
-        (zndmedia.dev_read) ? zndmedia.dev_read : zndmedia.dev;
+    struct znd_media        *znd   = znd_get(xztl_media_io_dev(cmd));
+    struct xnvme_dev        *p_dev = znd_read_dev(znd);
 
     tctx      = cmd->async_ctx;
     xnvme_ctx = xnvme_queue_get_cmd_ctx(tctx->queue);
 
     dbuf = (void *)cmd->prp[sec_i];  // NOLINT
 
-    /* The write path is not group based. It uses only sectors */
-    slba = cmd->addr[sec_i].g.sect;
+    /* The read path is not group based. It uses only sectors */
+    slba = cmd->addr[sec_i].g.sect - znd->media.sec_base;
 
     xnvme_ctx->async.cb     = znd_media_async_cb;
     xnvme_ctx->async.cb_arg = (void *)cmd;
@@ -160,7 +181,35 @@ static int znd_media_submit_read_asynch(struct xztl_io_mcmd *cmd) {
 }
 
 static int znd_media_submit_write_synch(struct xztl_io_mcmd *cmd) {
-    return ZND_INVALID_OPCODE;
+    uint64_t             slba;
+    uint16_t             sec_i = 0;
+    struct timespec      ts_s, ts_e;
+    struct znd_media    *znd = znd_get(xztl_media_io_dev(cmd));
+    struct xnvme_cmd_ctx ctx = xnvme_cmd_ctx_from_dev(znd->dev);
+    int                  ret;
+
+    slba = cmd->addr[sec_i].g.sect - znd->media.sec_base;
+
+    GET_MICROSECONDS(cmd->us_start, ts_s);
+
+    ret = xnvme_nvm_write(&ctx, xnvme_dev_get_nsid(znd->dev), slba,
+                          (uint16_t)cmd->nsec[sec_i] - 1,
+                          (const void *)cmd->prp[sec_i], NULL);
+
+    GET_MICROSECONDS(cmd->us_end, ts_e);
+
+    cmd->status = (ret) ? ret : xnvme_cmd_ctx_cpl_status(&ctx);
+    if (cmd->status) {
+        log_erra("znd_media_submit_write_synch: err ret [%d] opaque [%p]\n",
+                 ret, cmd->opaque);
+        xnvme_cmd_ctx_pr(&ctx, XNVME_PR_DEF);
+        xztl_print_mcmd(cmd);
+        return (ret) ? ret : cmd->status;
+    }
+
+    cmd->paddr[sec_i] = cmd->addr[sec_i].g.sect;
+
+    return XZTL_OK;
 }
 
 static int znd_media_submit_write_asynch(struct xztl_io_mcmd *cmd) {
@@ -169,6 +218,7 @@ static int znd_media_submit_write_asynch(struct xztl_io_mcmd *cmd) {
     void                    *dbuf;
     struct xztl_mthread_ctx *tctx;
     struct xnvme_cmd_ctx    *xnvme_ctx;
+    struct znd_media        *znd = znd_get(xztl_media_io_dev(cmd));
     int                      ret;
 
     tctx      = cmd->async_ctx;
@@ -177,14 +227,14 @@ static int znd_media_submit_write_asynch(struct xztl_io_mcmd *cmd) {
     dbuf = (void *)cmd->prp[sec_i];  // NOLINT
 
     /* The write path is not group based. It uses only sectors */
-    slba = cmd->addr[sec_i].g.sect;
+    slba = cmd->addr[sec_i].g.sect - znd->media.sec_base;
 
     xnvme_ctx->async.cb     = znd_media_async_cb;
     xnvme_ctx->async.cb_arg = (void *)cmd;  // NOLINT
-    xnvme_ctx->dev          = zndmedia.dev;
+    xnvme_ctx->dev          = znd->dev;
     cmd->media_ctx          = xnvme_ctx;
 
-    ret = xnvme_nvm_write(xnvme_ctx, xnvme_dev_get_nsid(zndmedia.dev), slba,
+    ret = xnvme_nvm_write(xnvme_ctx, xnvme_dev_get_nsid(znd->dev), slba,
                           (uint16_t)cmd->nsec[sec_i] - 1, dbuf, NULL);
 
     if (ret) {
@@ -209,6 +259,7 @@ static int znd_media_submit_append_asynch(struct xztl_io_mcmd *cmd) {
     const void              *dbuf;
     struct xztl_mthread_ctx *tctx;
     struct xnvme_cmd_ctx    *xnvme_ctx;
+    struct znd_media        *znd = znd_get(xztl_media_io_dev(cmd));
     int                      ret;
 
     tctx      = cmd->async_ctx;
@@ -217,24 +268,25 @@ static int znd_media_submit_append_asynch(struct xztl_io_mcmd *cmd) {
     dbuf = (const void *)cmd->prp[zone_i];
 
     /* The write path separates zones into groups */
-    zlba = (zndmedia.media.geo.zn_grp * cmd->addr[zone_i].g.grp +
+    zlba = (znd->media.geo.zn_grp *
+                (cmd->addr[zone_i].g.grp - znd->media.grp_base) +
             cmd->addr[zone_i].g.zone) *
-           zndmedia.devgeo->nsect;
+           znd->devgeo->nsect;
 
     xnvme_ctx->async.cb     = znd_media_async_cb;
     xnvme_ctx->async.cb_arg = (void *)cmd;  // NOLINT
+    xnvme_ctx->dev          = znd->dev;
     cmd->media_ctx          = xnvme_ctx;
 
-    ret = (!XZTL_WRITE_APPEND)
-              ? xnvme_znd_append(xnvme_ctx, xnvme_dev_get_nsid(zndmedia.dev),
-                                 zlba, (uint16_t)cmd->nsec[zone_i] - 1, dbuf,
-                                 NULL)
-              : -1;
+    /* The completion LBA is stored in paddr by znd_media_async_cb */
+    ret = xnvme_znd_append(xnvme_ctx, xnvme_dev_get_nsid(znd->dev), zlba,
+                           (uint16_t)cmd->nsec[zone_i] - 1, dbuf, NULL);
     if (ret) {
         log_erra(
             "znd_media_submit_append_asynch: xnvme_znd_append err ret [%d] "
             "opaque [%p]\n",
             ret, cmd->opaque);
+        xnvme_queue_put_cmd_ctx(tctx->queue, xnvme_ctx);
         xztl_print_mcmd(cmd);
     }
 
@@ -261,12 +313,14 @@ static int znd_media_submit_io(struct xztl_io_mcmd *cmd) {
 
 static inline int znd_media_zone_manage(struct xztl_zn_mcmd *cmd, uint8_t op) {
     uint32_t             lba;
-    struct xnvme_cmd_ctx xnvme_ctx = xnvme_cmd_ctx_from_dev(zndmedia.dev);
+    struct znd_media    *znd = znd_get(xztl_media_grp_dev(cmd->addr.g.grp));
+    struct xnvme_cmd_ctx xnvme_ctx = xnvme_cmd_ctx_from_dev(znd->dev);
     int                  ret;
     bool                 select_all = false;
 
-    lba = ((zndmedia.devgeo->nzone * cmd->addr.g.grp) + cmd->addr.g.zone) *
-          zndmedia.devgeo->nsect;
+    lba = ((znd->devgeo->nzone * (cmd->addr.g.grp - znd->media.grp_base)) +
+           cmd->addr.g.zone) *
+          znd->devgeo->nsect;
 
     /* If this bit is set to '1', then the SLBA field shall be ignored.  */
     if (cmd->nzones > 1) {
@@ -274,7 +328,7 @@ static inline int znd_media_zone_manage(struct xztl_zn_mcmd *cmd, uint8_t op) {
     }
     xnvme_ctx.async.queue  = NULL;
     xnvme_ctx.async.cb_arg = NULL;
-    ret = xnvme_znd_mgmt_send(&xnvme_ctx, xnvme_dev_get_nsid(zndmedia.dev), lba,
+    ret = xnvme_znd_mgmt_send(&xnvme_ctx, xnvme_dev_get_nsid(znd->dev), lba,
                               select_all, op, 0x0, NULL);
     cmd->status = (ret) ? xnvme_cmd_ctx_cpl_status(&xnvme_ctx) : XZTL_OK;
     if (ret) {
@@ -285,19 +339,90 @@ static inline int znd_media_zone_manage(struct xztl_zn_mcmd *cmd, uint8_t op) {
     return ret;
 }
 
+static void znd_media_zone_async_cb(struct xnvme_cmd_ctx *ctx, void *cb_arg) {
+    struct xztl_zn_mcmd *cmd = (struct xztl_zn_mcmd *)cb_arg;
+
+    cmd->status = xnvme_cmd_ctx_cpl_status(ctx);
+    if (cmd->status) {
+        log_erra("znd_media_zone_async_cb: err status [%u] zone [%u]\n",
+                 cmd->status, cmd->addr.g.zone);
+        xnvme_cmd_ctx_pr(ctx, XNVME_PR_DEF);
+    }
+
+    cmd->callback(cmd);
+
+    xnvme_queue_put_cmd_ctx(cmd->async_ctx->queue, ctx);
+}
+
+static int znd_media_zone_manage_async(struct xztl_zn_mcmd *cmd, uint8_t op) {
+    uint32_t              lba;
+    struct znd_media     *znd = znd_get(cmd->async_ctx->dev);
+    struct xnvme_cmd_ctx *xnvme_ctx;
+    int                   ret;
+
+    lba = ((znd->devgeo->nzone * (cmd->addr.g.grp - znd->media.grp_base)) +
+           cmd->addr.g.zone) *
+          znd->devgeo->nsect;
+
+    xnvme_ctx               = xnvme_queue_get_cmd_ctx(cmd->async_ctx->queue);
+    xnvme_ctx->async.cb     = znd_media_zone_async_cb;
+    xnvme_ctx->async.cb_arg = (void *)cmd;  // NOLINT
+    xnvme_ctx->dev          = znd->dev;
+    cmd->media_ctx          = xnvme_ctx;
+
+    ret = xnvme_znd_mgmt_send(xnvme_ctx, xnvme_dev_get_nsid(znd->dev), lba,
+                              false, op, 0x0, NULL);
+    if (ret) {
+        log_erra("znd_media_zone_manage_async: err ret [%d] zone [%u]\n", ret,
+                 cmd->addr.g.zone);
+        xnvme_queue_put_cmd_ctx(cmd->async_ctx->queue, xnvme_ctx);
+    }
+
+    return ret;
+}
+
+static int znd_media_zone_async(struct xztl_zn_mcmd *cmd) {
+    switch (cmd->opcode) {
+        case XZTL_ZONE_MGMT_CLOSE:
+            return znd_media_zone_manage_async(
+                cmd, XNVME_SPEC_ZND_CMD_MGMT_SEND_CLOSE);
+        case XZTL_ZONE_MGMT_FINISH:
+            return znd_media_zone_manage_async(
+                cmd, XNVME_SPEC_ZND_CMD_MGMT_SEND_FINISH);
+        case XZTL_ZONE_MGMT_OPEN:
+            return znd_media_zone_manage_async(
+                cmd, XNVME_SPEC_ZND_CMD_MGMT_SEND_OPEN);
+        case XZTL_ZONE_MGMT_RESET:
+            xztl_stats_inc(XZTL_STATS_RESET_MCMD, 1);
+            return znd_media_zone_manage_async(
+                cmd, XNVME_SPEC_ZND_CMD_MGMT_SEND_RESET);
+        default:
+            return ZND_INVALID_OPCODE;
+    }
+}
+
 static int znd_media_zone_report(struct xztl_zn_mcmd *cmd) {
     struct xnvme_znd_report *rep;
     size_t                   limit;
-    uint32_t                 lba;
-    struct xnvme_dev        *p_dev =
-        (zndmedia.dev_read) ? zndmedia.dev_read : zndmedia.dev;
-
-    // Reading everything until not necessary anymore
-    lba = 0;  // ((zndmedia.devgeo->nzone * cmd->addr.g.grp) + cmd->addr.g.zone)
-              // * zndmedia.devgeo->nsect;
-    limit = 0;  // cmd->nzones;
+    uint64_t                 lba;
+    struct znd_media        *znd;
+    struct xnvme_dev        *p_dev;
+
+    znd   = znd_get(xztl_media_grp_dev(cmd->addr.g.grp));
+    p_dev = znd_read_dev(znd);
+
+    /* A full report starts at the first zone, limit 0 is all zones */
+    lba   = 0;
+    limit = 0;
+    if (cmd->opcode == XZTL_ZONE_MGMT_RANGE) {
+        lba = (uint64_t)znd->devgeo->nzone *
+                  (cmd->addr.g.grp - znd->media.grp_base) +
+              cmd->addr.g.zone;
+        lba *= znd->devgeo->nsect;
+        limit = cmd->nzones;
+    }
 
-	rep   = xnvme_znd_report_from_dev(p_dev, lba, limit, 0);
+    rep = xnvme_znd_report_from_dev(p_dev, lba, limit, 0);
 
     if (!rep) {
         log_err("znd_media_zone_report: rep is NULL \n");
@@ -324,6 +449,7 @@ static int znd_media_zone_mgmt(struct xztl_zn_mcmd *cmd) {
             xztl_stats_inc(XZTL_STATS_RESET_MCMD, 1);
             return znd_media_zone_manage(cmd,
                                          XNVME_SPEC_ZND_CMD_MGMT_SEND_RESET);
+        case XZTL_ZONE_MGMT_RANGE:
         case XZTL_ZONE_MGMT_REPORT:
             return znd_media_zone_report(cmd);
         default:
@@ -333,12 +459,32 @@ static int znd_media_zone_mgmt(struct xztl_zn_mcmd *cmd) {
     return XZTL_OK;
 }
 
+/* Buffers are allocated by the first device and shared by the others */
 static void *znd_media_dma_alloc(size_t size) {
-    return xnvme_buf_alloc(zndmedia.dev, size);
+    return xnvme_buf_alloc(get_znd_media()->dev, size);
 }
 
 static void znd_media_dma_free(void *ptr) {
-    xnvme_buf_free(zndmedia.dev, ptr);
+    xnvme_buf_free(get_znd_media()->dev, ptr);
+}
+
+/* Kernel backends pin any sector aligned user page. SPDK only transfers to
+ * memory it registered, as the buffers allocated by 'znd_media_dma_alloc' */
+static int znd_media_dma_check(void *buf, size_t size) {
+    struct znd_media *znd    = get_znd_media();
+    uint32_t          nbytes = znd->media.geo.nbytes;
+    uint64_t          phys;
+
+    if (!size || (uint64_t)buf % nbytes || size % nbytes)
+        return 0;
+
+    if (znd->be == OPT_BE_SPDK) {
+        if (xnvme_buf_vtophys(znd->dev, buf, &phys) ||
+            xnvme_buf_vtophys(znd->dev, (char *)buf + size - nbytes, &phys))
+            return 0;
+    }
+
+    return 1;
 }
 
 static int znd_media_async_poke(struct xnvme_queue *queue, uint32_t *c,
@@ -382,13 +528,28 @@ static int znd_media_async_wait(struct xnvme_queue *queue, uint32_t *c) {
     return XZTL_OK;
 }
 
+static int znd_media_async_drain(struct xnvme_queue *queue, uint32_t *c) {
+    int ret;
+
+    ret = xnvme_queue_drain(queue);
+    if (ret < 0) {
+        log_erra("znd_media_async_drain: err ret [%d]\n", ret);
+        return ZND_MEDIA_POKE_ERR;
+    }
+
+    *c = ret;
+
+    return XZTL_OK;
+}
+
 static int znd_media_asynch_init(struct xztl_misc_cmd *cmd) {
     struct xztl_mthread_ctx *tctx;
     int                      ret;
 
     tctx = cmd->asynch.ctx_ptr;
 
-    ret = xnvme_queue_init(zndmedia.dev, cmd->asynch.depth, 0, &tctx->queue);
+    ret = xnvme_queue_init(znd_get(tctx->dev)->dev, cmd->asynch.depth, 0,
+                           &tctx->queue);
     if (ret) {
         log_erra("znd_media_asynch_init: error depth [%u]\n",
                  cmd->asynch.depth);
@@ -429,6 +590,10 @@ static int znd_media_cmd_exec(struct xztl_misc_cmd *cmd) {
             return znd_media_async_wait(cmd->asynch.ctx_ptr->queue,
                                         &cmd->asynch.count);
 
+        case XZTL_MISC_ASYNCH_DRAIN:
+            return znd_media_async_drain(cmd->asynch.ctx_ptr->queue,
+                                         &cmd->asynch.count);
+
         default:
             return ZND_INVALID_OPCODE;
     }
@@ -438,11 +603,20 @@ static int znd_media_init(void) {
     return XZTL_OK;
 }
 
+/* Called once per stacked device, the first call closes all of them */
 static int znd_media_exit(void) {
-    if (zndmedia.dev)
-        xnvme_dev_close(zndmedia.dev);
-    if (zndmedia.dev_read)
-        xnvme_dev_close(zndmedia.dev_read);
+    struct znd_state *st = znd_st();
+    uint16_t          dev_i;
+
+    for (dev_i = 0; dev_i < st->ndev; dev_i++) {
+        if (st->dev[dev_i].dev)
+            xnvme_dev_close(st->dev[dev_i].dev);
+        if (st->dev[dev_i].dev_read)
+            xnvme_dev_close(st->dev[dev_i].dev_read);
+        st->dev[dev_i].dev      = NULL;
+        st->dev[dev_i].dev_read = NULL;
+    }
+    st->ndev = 0;
 
     return XZTL_OK;
 }
@@ -528,29 +702,42 @@ void znd_opt_assign(struct xnvme_opts *opts, struct xnvme_opts *opts_read,
 }
 
 void znd_media_set_ctx_iodepth(struct znd_opt_info* opt_info, struct znd_media* zndmedia) {
-    zndmedia->read_ctx_num = XZTL_READ_RS_NUM;
-    zndmedia->io_depth = XZTL_CTX_NVME_DEPTH;
+    const struct xztl_config *cfg = xztl_config_get();
+    struct xztl_media        *m   = &zndmedia->media;
+
+    m->read_ctx_num = XZTL_READ_RS_NUM;
+    m->io_depth = cfg->qdepth;
 
     if (opt_info->opt_async == OPT_BE_SPDK || opt_info->opt_async == OPT_BE_LIBAIO) {
         uint32_t cpu_num = sysconf(_SC_NPROCESSORS_CONF);
-        zndmedia->read_ctx_num = cpu_num - 2 > 0 ? (cpu_num - 2) : 1;
+        m->read_ctx_num = cpu_num - 2 > 0 ? (cpu_num - 2) : 1;
         if (opt_info->opt_async == OPT_BE_LIBAIO) {
-            zndmedia->io_depth = XZTL_CTX_NVME_LIBAIO_DEPTH;
+            m->io_depth = cfg->qdepth_aio;
         }
     }
 
+    if (cfg->read_ctx)
+        m->read_ctx_num = cfg->read_ctx;
+
     log_infoa("znd_media_set_ctx_iodepth opt[%d] read_ctx_num[%u] io_depth[%u]",
-        opt_info->opt_async, zndmedia->read_ctx_num, zndmedia->io_depth);
+        opt_info->opt_async, m->read_ctx_num, m->io_depth);
 }
 
 int znd_media_register(const char *dev_name) {
-    const struct xnvme_geo *devgeo;
-    struct xnvme_dev       *dev      = NULL;
-    struct xnvme_dev       *dev_read = NULL;
-    struct xztl_media      *m;
-    struct xnvme_opts       opts      = xnvme_opts_default();
-    struct xnvme_opts       opts_read = xnvme_opts_default();
-    int                     ret       = 0;
+    const struct xnvme_geo              *devgeo;
+    const struct xnvme_spec_znd_idfy_ns *zns;
+    struct xnvme_dev                    *dev      = NULL;
+    struct xnvme_dev                    *dev_read = NULL;
+    struct znd_media                    *znd;
+    struct xztl_media                   *m;
+    struct xnvme_opts                    opts      = xnvme_opts_default();
+    struct xnvme_opts                    opts_read = xnvme_opts_default();
+    struct znd_state                    *st        = znd_st();
+    int                                  ret       = 0;
+
+    if (st->ndev == XZTL_MEDIA_MAX_DEV)
+        return ZND_MEDIA_NODEVICE;
+    znd = &st->dev[st->ndev];
 
     struct znd_opt_info opt_info;
     memset(&opt_info, 0, sizeof(struct znd_opt_info));
@@ -585,27 +772,47 @@ int znd_media_register(const char *dev_name) {
         return ZND_MEDIA_NOGEO;
     }
 
-    znd_media_set_ctx_iodepth(&opt_info, &zndmedia);
-    zndmedia.dev      = dev;
-    zndmedia.dev_read = dev_read;
-    zndmedia.devgeo   = devgeo;
-    m                 = &zndmedia.media;
-
-    m->geo.ngrps      = devgeo->npugrp;
-    m->geo.pu_grp     = devgeo->npunit;
-    m->geo.zn_pu      = devgeo->nzone;
-    m->geo.sec_zn     = devgeo->nsect;
-    m->geo.nbytes     = devgeo->nbytes;
-    m->geo.nbytes_oob = devgeo->nbytes_oob;
-
-    m->init_fn   = znd_media_init;
-    m->exit_fn   = znd_media_exit;
-    m->submit_io = znd_media_submit_io;
-    m->zone_fn   = znd_media_zone_mgmt;
-    m->dma_alloc = znd_media_dma_alloc;
-    m->dma_free  = znd_media_dma_free;
-    m->cmd_exec  = znd_media_cmd_exec;
-
-    return xztl_media_set(m);
+    znd_media_set_ctx_iodepth(&opt_info, znd);
+    znd->dev      = dev;
+    znd->dev_read = dev_read;
+    znd->devgeo   = devgeo;
+    znd->be       = opt_info.opt_async;
+    m             = &znd->media;
+
+    m->geo.ngrps       = devgeo->npugrp;
+    m->geo.pu_grp      = devgeo->npunit;
+    m->geo.zn_pu       = devgeo->nzone;
+    m->geo.sec_zn      = devgeo->nsect;
+    m->geo.nbytes      = devgeo->nbytes;
+    m->geo.nbytes_oob  = devgeo->nbytes_oob;
+    m->geo.nbytes_mdts = devgeo->mdts_nbytes;
+
+    /* MOR and MAR are 0's based, all ones is no limit */
+    zns = xnvme_znd_dev_get_ns(dev);
+    m->geo.max_open   = (zns && zns->mor != UINT32_MAX) ? zns->mor + 1 : 0;
+    m->geo.max_active = (zns && zns->mar != UINT32_MAX) ? zns->mar + 1 : 0;
+
+    m->init_fn       = znd_media_init;
+    m->exit_fn       = znd_media_exit;
+    m->submit_io     = znd_media_submit_io;
+    m->zone_fn       = znd_media_zone_mgmt;
+    m->zone_async_fn = znd_media_zone_async;
+    m->dma_alloc     = znd_media_dma_alloc;
+    m->dma_free      = znd_media_dma_free;
+    m->dma_check     = znd_media_dma_check;
+    m->cmd_exec      = znd_media_cmd_exec;
+
+    ret = xztl_media_set(m);
+    if (ret) {
+        xnvme_dev_close(dev);
+        if (dev_read)
+            xnvme_dev_close(dev_read);
+        znd->dev      = NULL;
+        znd->dev_read = NULL;
+        return ret;
+    }
+    st->ndev++;
+
+    return XZTL_OK;
 }
 
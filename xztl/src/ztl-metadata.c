@@ -18,45 +18,50 @@
 */
 
 #include <libxnvme.h>
-#include <libxnvme_nvm.h>
 #include <libxnvme_znd.h>
-#include <libxnvmec.h>
 #include <libzrocks.h>
 #include <xztl.h>
 #include <xztl-metadata.h>
 #include <xztl-stats.h>
 #include <xztl-pro.h>
 
-static struct znd_media   *_zndmedia;
-static struct ztl_metadata metadata;
-
 #define META_READ_MAX_RETRY  3
 #define META_WRITE_MAX_RETRY 3
 
-uint64_t zrocks_get_metadata_slba() {
+uint64_t ztl_metadata_get_slba(void) {
     return XZTL_OK;
 }
 
-void zrocks_get_metadata_slbas(uint64_t *slbas, uint8_t *num) {
+void ztl_metadata_get_slbas(uint64_t *slbas, uint8_t *num) {
+    struct ztl_metadata *metadata = get_ztl_metadata();
     int                  zone_id;
     struct ztl_pro_zone *zone;
-    for (zone_id = 0; zone_id < metadata.zone_num; zone_id++) {
-        zone           = &metadata.metadata_zone[zone_id];
+    for (zone_id = 0; zone_id < metadata->zone_num; zone_id++) {
+        zone           = &metadata->metadata_zone[zone_id];
         slbas[zone_id] = zone->addr.g.sect;
     }
 
-    *num = metadata.zone_num;
+    *num = metadata->zone_num;
+}
+
+/* Write pointers of the metadata zones are kept by the zmd checkpoint */
+static inline void ztl_metadata_mark(struct ztl_pro_zone *zone) {
+    struct app_group *grp = ztl()->groups.get_fn(zone->addr.g.grp);
+
+    if (grp)
+        ztl()->zmd->mark_fn(grp, zone->addr.g.zone);
 }
 
-static inline int zrocks_reset_file_md(uint64_t addr) {
-    struct xnvme_cmd_ctx xnvme_ctx = xnvme_cmd_ctx_from_dev(_zndmedia->dev);
-    int                  err       = 0;
-    xnvme_ctx.async.queue          = NULL;
-    xnvme_ctx.async.cb_arg         = NULL;
-    err = xnvme_znd_mgmt_send(&xnvme_ctx, xnvme_dev_get_nsid(_zndmedia->dev),
-                              addr, false, XNVME_SPEC_ZND_CMD_MGMT_SEND_RESET,
-                              0, NULL);
+static inline int zrocks_reset_file_md(struct ztl_pro_zone *zone) {
+    struct xztl_zn_mcmd cmd;
+    int                 err = 0;
 
+    cmd.opcode    = XZTL_ZONE_MGMT_RESET;
+    cmd.addr.addr = zone->addr.addr;
+    cmd.nzones    = 1;
+    cmd.status    = 0;
+
+    err = xztl_media_submit_zn(&cmd);
     if (err) {
         log_erra("zrocks_reset_file_md: znd_cmd_mgmt_send. err [%d]\n", err);
         return XZTL_ZTL_MD_RESET_ERR;
@@ -65,33 +70,45 @@ static inline int zrocks_reset_file_md(uint64_t addr) {
     return XZTL_OK;
 }
 
-void zrocks_switch_zone(uint64_t slbas) {
+void ztl_metadata_switch_zone(uint64_t slbas) {
+    struct ztl_metadata *metadata = get_ztl_metadata();
     int                  zone_id;
     struct ztl_pro_zone *zone;
-    for (zone_id = 0; zone_id < metadata.zone_num; zone_id++) {
-        zone = &metadata.metadata_zone[zone_id];
+    for (zone_id = 0; zone_id < metadata->zone_num; zone_id++) {
+        zone = &metadata->metadata_zone[zone_id];
         if (zone->addr.g.sect != slbas) {
-            metadata.curr_zone_index = zone_id;
-            zrocks_reset_file_md(zone->addr.g.sect);
+            metadata->curr_zone_index = zone_id;
+            zrocks_reset_file_md(zone);
             zone->zmd_entry->wptr = zone->addr.g.sect;
+            ztl_metadata_mark(zone);
             break;
         }
     }
 }
 
 int get_metadata_zone_num() {
-    return metadata.zone_num;
+    return get_ztl_metadata()->zone_num;
+}
+
+/* Zones before the first node of a group, only group 0 keeps metadata */
+int get_rsvd_zone_num(uint16_t grp_id) {
+    if (grp_id)
+        return 0;
+
+    return get_metadata_zone_num() + ZTL_ZMD_CKPT_ZONES + ZTL_MPE_ZONES;
 }
 
 struct ztl_metadata *get_ztl_metadata() {
-    return &metadata;
+    return xztl_instance_state(XZTL_STATE_METADATA,
+                               sizeof(struct ztl_metadata));
 }
 
 static int get_curr_metadata_zone(int start, int end) {
+    struct ztl_metadata *metadata = get_ztl_metadata();
     int                  zone_id;
     struct ztl_pro_zone *zone;
     for (zone_id = start; zone_id < end; zone_id++) {
-        zone = &metadata.metadata_zone[zone_id];
+        zone = &metadata->metadata_zone[zone_id];
         if (zone->zmd_entry->wptr < zone->addr.g.sect + zone->capacity) {
             return zone_id;
         }
@@ -100,33 +117,32 @@ static int get_curr_metadata_zone(int start, int end) {
 }
 
 int ztl_metadata_init(struct app_group *grp) {
+    struct ztl_metadata         *metadata = get_ztl_metadata();
     struct xnvme_spec_znd_descr *zinfo;
     struct ztl_pro_zone         *zone;
     struct app_zmd_entry        *zmde;
     struct xztl_core            *core;
     int                          zone_i;
     get_xztl_core(&core);
-    _zndmedia         = get_znd_media();
-    metadata.zone_num = 2;
-    metadata.nlb_max = _zndmedia->devgeo->mdts_nbytes / core->media->geo.nbytes;
-    metadata.metadata_zone = (struct ztl_pro_zone *)calloc(
-        metadata.zone_num, sizeof(struct ztl_pro_zone));
-    if (!metadata.metadata_zone) {
+    metadata->zone_num = ZTL_METADATA_ZONES;
+    metadata->nlb_max = core->media->geo.nbytes_mdts / core->media->geo.nbytes;
+    metadata->metadata_zone = (struct ztl_pro_zone *)calloc(
+        metadata->zone_num, sizeof(struct ztl_pro_zone));
+    if (!metadata->metadata_zone) {
         log_err("ztl_metadata_init failed:metadata.metadata_zone is NULL\n");
         return XZTL_ZTL_MD_INIT_ERR;
     }
 
-    if (pthread_mutex_init(&metadata.page_spin, 0)) {
+    if (pthread_mutex_init(&metadata->page_spin, 0)) {
         log_err("ztl_metadata_init failed: pthread_mutex_init failed\n");
         return XZTL_ZTL_MD_INIT_ERR;
     }
 
-    for (zone_i = 0; zone_i < metadata.zone_num; zone_i++) {
-        /* We are getting the full report here */
-        zinfo = XNVME_ZND_REPORT_DESCR(
-            grp->zmd.report, grp->id * core->media->geo.zn_grp + zone_i);
+    for (zone_i = 0; zone_i < metadata->zone_num; zone_i++) {
+        /* The group report is indexed by zone of the group */
+        zinfo = XNVME_ZND_REPORT_DESCR(grp->zmd.report, zone_i);
 
-        zone = &metadata.metadata_zone[zone_i];
+        zone = &metadata->metadata_zone[zone_i];
 
         zmde = ztl()->zmd->get_fn(grp, zone_i, 0);
 
@@ -154,16 +170,18 @@ int ztl_metadata_init(struct app_group *grp) {
         zone->lock      = 0;
         zmde->wptr = zmde->wptr_inflight = zinfo->wp;
     }
-    metadata.curr_zone_index = get_curr_metadata_zone(0, metadata.zone_num);
+    metadata->curr_zone_index = get_curr_metadata_zone(0, metadata->zone_num);
     log_infoa("ztl_metadata_init: metadata.current_zone [%ull]\n",
-              metadata.curr_zone_index);
+              metadata->curr_zone_index);
 
     return XZTL_OK;
 }
 
-int zrocks_read_metadata(uint64_t slba, unsigned char *buf, uint32_t length) {
+int ztl_metadata_read(uint64_t slba, unsigned char *buf, uint32_t length) {
     struct xztl_mp_entry *mp_entry = NULL;
-    uint16_t              nlb      = length / _zndmedia->devgeo->nbytes;
+    struct xztl_core     *core;
+    get_xztl_core(&core);
+    uint16_t              nlb      = length / core->media->geo.nbytes;
     int                   ret      = 0;
     uint16_t              left_nlb = nlb;
     while (left_nlb > 0) {
@@ -171,7 +189,7 @@ int zrocks_read_metadata(uint64_t slba, unsigned char *buf, uint32_t length) {
             left_nlb > MAX_READ_NLB_NUM ? MAX_READ_NLB_NUM : left_nlb;
         mp_entry = xztl_mempool_get(ZROCKS_MEMORY, 0);
         if (!mp_entry) {
-            log_err("zrocks_read_metadata: xztl_mempool_get memory failed\n");
+            log_err("ztl_metadata_read: xztl_mempool_get memory failed\n");
             return XZTL_ZTL_MD_READ_ERR;
         }
 
@@ -190,7 +208,7 @@ int zrocks_read_metadata(uint64_t slba, unsigned char *buf, uint32_t length) {
         ret = xztl_media_submit_io(&cmd);
         if (ret) {
             xztl_stats_inc(XZTL_STATS_META_READ_FAIL, 1);
-            log_erra("zrocks_read_metadata error: [%d]\n", ret);
+            log_erra("ztl_metadata_read error: [%d]\n", ret);
 
             retry++;
             if (retry < META_READ_MAX_RETRY) {
@@ -211,25 +229,26 @@ int zrocks_read_metadata(uint64_t slba, unsigned char *buf, uint32_t length) {
     return XZTL_OK;
 }
 
-int zrocks_write_file_metadata(const unsigned char *buf, uint32_t length) {
-    uint16_t          nlb;
-    uint32_t          max_len, remain_len, write_len;
-    struct xztl_core *core;
-    int               err = 0;
+int ztl_metadata_write(const unsigned char *buf, uint32_t length) {
+    struct ztl_metadata *metadata = get_ztl_metadata();
+    uint16_t             nlb;
+    uint32_t             max_len, remain_len, write_len;
+    struct xztl_core    *core;
+    int                  err = 0;
 
-    struct xnvme_cmd_ctx xnvme_ctx = xnvme_cmd_ctx_from_dev(_zndmedia->dev);
+    struct xztl_io_mcmd cmd;
     get_xztl_core(&core);
     max_len                   = MAX_WRITE_NLB_NUM * ZNS_ALIGMENT;
     remain_len                = length;
     const unsigned char *data = buf;
 
-    pthread_mutex_lock(&metadata.page_spin);
+    pthread_mutex_lock(&metadata->page_spin);
     struct ztl_pro_zone *zone =
-        &metadata.metadata_zone[metadata.curr_zone_index];
+        &metadata->metadata_zone[metadata->curr_zone_index];
     if (zone->zmd_entry->wptr + length / core->media->geo.nbytes >=
         zone->addr.g.sect + zone->capacity) {
-        zrocks_switch_zone(zone->addr.g.sect);
-        pthread_mutex_unlock(&metadata.page_spin);
+        ztl_metadata_switch_zone(zone->addr.g.sect);
+        pthread_mutex_unlock(&metadata->page_spin);
         return XZTL_ZTL_MD_WRITE_FULL;
     }
 
@@ -238,14 +257,21 @@ int zrocks_write_file_metadata(const unsigned char *buf, uint32_t length) {
         nlb       = write_len / core->media->geo.nbytes;
         int retry = 0;
 
+        cmd.opcode         = XZTL_CMD_WRITE;
+        cmd.naddr          = 1;
+        cmd.synch          = 1;
+        cmd.addr[0].addr   = 0;
+        cmd.addr[0].g.sect = zone->zmd_entry->wptr;
+        cmd.nsec[0]        = nlb;
+        cmd.prp[0]         = (uint64_t)data;
+        cmd.opaque         = NULL;
+
     META_WRITE_FAIL:
-        err = xnvme_nvm_write(&xnvme_ctx, xnvme_dev_get_nsid(_zndmedia->dev),
-                              zone->zmd_entry->wptr, nlb - 1, data, NULL);
+        cmd.status = 0;
+        err        = xztl_media_submit_io(&cmd);
 
-        if (err || xnvme_cmd_ctx_cpl_status(&xnvme_ctx)) {
-            xnvmec_perr("xnvme_nvm_write()", err);
-            xnvme_cmd_ctx_pr(&xnvme_ctx, XNVME_PR_DEF);
-            err = err ? err : -XZTL_ZTL_MD_WRITE_ERR;
+        if (err) {
+            log_erra("ztl_metadata_write: write err [%d]\n", err);
             xztl_stats_inc(XZTL_STATS_META_WRITE_FAIL, 1);
             retry++;
             if (retry < META_WRITE_MAX_RETRY) {
@@ -256,15 +282,16 @@ int zrocks_write_file_metadata(const unsigned char *buf, uint32_t length) {
         }
 
         zone->zmd_entry->wptr += nlb;
+        ztl_metadata_mark(zone);
         data += write_len;
         remain_len -= write_len;
     }
 
-    pthread_mutex_unlock(&metadata.page_spin);
+    pthread_mutex_unlock(&metadata->page_spin);
     if (err) {
         log_erra(
-            "zrocks_write_file_metadata. file_slb [%lu] sec [%u] err [%d]\n",
-            metadata.file_slba, nlb, err);
+            "ztl_metadata_write. file_slb [%lu] sec [%u] err [%d]\n",
+            metadata->file_slba, nlb, err);
         return XZTL_ZTL_MD_WRITE_ERR;
     }
 
@@ -21,6 +21,7 @@
 #include <libxnvme_znd.h>
 #include <stdlib.h>
 #include <sys/queue.h>
+#include <time.h>
 #include <xztl.h>
 #include <xztl-mods.h>
 #include <xztl-stats.h>
@@ -29,17 +30,80 @@
 #define MGMT_MAX_RETRY   3
 #define ZTL_NODE_MGMT_SZ 384
 
-struct xztl_mthread_info mthread;
+/* All zones of a node are in flight at once, see ztl_mgmt_node_zones */
+#define ZTL_MGMT_QDEPTH (ZTL_PRO_ZONE_NUM_INNODE * 2)
+
+#define ZTL_MGMT_RESET_TICK_US 10000 /* Period of the lazy resetter */
+
+/* Lazy reset: nodes trimmed to no valid data are not reset right away. They
+ * wait in the dirty list of the group and the resetter keeps 'reset_target'
+ * reset nodes in the free list. While there is foreground I/O it resets a
+ * node per tick, unless free nodes drop below half of the target. Writers
+ * that find no free node reset a dirty node themselves, see reclaim_fn */
+
 struct xnvme_node_mgmt_entry {
     struct app_group     *grp;
     struct ztl_pro_node  *node;
     struct xztl_mp_entry *mp_entry;
     int32_t               op_code;
+    uint8_t               lazy; /* Taken from the dirty list */
     STAILQ_ENTRY(xnvme_node_mgmt_entry) entry;
 };
 
-static pthread_spinlock_t xnvme_mgmt_spin;
-static STAILQ_HEAD(xnvme_emu_head, xnvme_node_mgmt_entry) submit_head;
+/* Resets return nodes to the free pool writers wait for, so they are served
+ * before finishes */
+enum ztl_mgmt_class {
+    ZTL_MGMT_CLASS_RESET = 0,
+    ZTL_MGMT_CLASS_FINISH,
+    ZTL_MGMT_CLASS_NUM
+};
+
+struct ztl_mgmt_zcmd {
+    struct xztl_zn_mcmd    cmd;
+    struct ztl_pro_zone   *zone;
+    struct ztl_mgmt_batch *batch;
+};
+
+struct ztl_mgmt_batch {
+    struct ztl_mgmt_zcmd zcmd[ZTL_PRO_ZONE_NUM_INNODE];
+    volatile uint32_t    pending;
+    uint32_t             nerr;
+};
+
+struct ztl_mgmt_worker {
+    pthread_t             tid;
+    struct xztl_instance *inst;
+    struct ztl_pro_node  *node; /* In progress, under queue_mutex */
+
+    /* Zone command queues per device */
+    struct xztl_mthread_ctx *tctx[XZTL_MEDIA_MAX_DEV];
+};
+
+struct ztl_mgmt_state {
+    STAILQ_HEAD(xnvme_emu_head, xnvme_node_mgmt_entry)
+    submit_head[ZTL_MGMT_CLASS_NUM];
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t  queue_cond;
+    int             running;
+
+    struct ztl_mgmt_worker workers[ZTL_MGMT_WORKERS_MAX];
+    uint32_t               nworkers;
+
+    /* Queues of ztl_mgmt_clear_invalid_node and reclaim_fn, called by the
+     * application and writers */
+    struct ztl_mgmt_worker caller;
+    pthread_mutex_t        caller_mutex;
+
+    /* Lazy resetter, sleeps on reset_cond under queue_mutex */
+    pthread_t      reset_tid;
+    pthread_cond_t reset_cond;
+    uint32_t       reset_target;
+    uint64_t       fg_bytes; /* Foreground I/O seen at the last tick */
+};
+
+static struct ztl_mgmt_state *ztl_mgmt_st(void) {
+    return xztl_instance_state(XZTL_STATE_MGMT, sizeof(struct ztl_mgmt_state));
+}
 
 int ztl_pro_grp_reset_all_zones(struct app_group *grp) {
     struct xztl_zn_mcmd cmd;
@@ -57,112 +121,184 @@ int ztl_pro_grp_reset_all_zones(struct app_group *grp) {
     return XZTL_OK;
 }
 
-static int ztl_mgmt_node_reset_zn(struct ztl_pro_zone *zone) {
-    struct xztl_zn_mcmd   cmd;
-    struct app_zmd_entry *zmde;
-    int                   ret = 0;
+/* Completion of a zone command, write pointers follow the new zone state */
+static void ztl_mgmt_zn_callback(void *arg) {
+    struct ztl_mgmt_zcmd *zc   = (struct ztl_mgmt_zcmd *)arg;
+    struct ztl_pro_zone  *zone = zc->zone;
+    struct app_zmd_entry *zmde = zone->zmd_entry;
+
+    if (zc->cmd.status) {
+        log_erra("ztl_mgmt_zn_callback: Zone [%u] op [%u] failure. status "
+                 "[%d]\n",
+                 zone->addr.g.zone, zc->cmd.opcode, zc->cmd.status);
+        zc->batch->nerr++;
+    } else if (zc->cmd.opcode == XZTL_ZONE_MGMT_RESET) {
+        ATOMIC_SWAP(&zmde->wptr, zmde->wptr, zone->addr.g.sect);
+        ATOMIC_SWAP(&zmde->wptr_inflight, zmde->wptr_inflight,
+                    zone->addr.g.sect);
+    } else if (zc->cmd.opcode == XZTL_ZONE_MGMT_FINISH) {
+        zmde->wptr = zone->addr.g.sect + zone->capacity;
+    }
 
-    zmde          = zone->zmd_entry;
-    cmd.opcode    = XZTL_ZONE_MGMT_RESET;
-    cmd.addr.addr = zone->addr.addr;
-    cmd.nzones    = 1;
-    ret           = xztl_media_submit_zn(&cmd);
+    /* Write pointers are kept by the zone metadata checkpoint */
+    if (!zc->cmd.status && zc->cmd.opcode != XZTL_ZONE_MGMT_CLOSE)
+        ztl()->zmd->mark_fn(ztl()->groups.get_fn(zone->addr.g.grp),
+                            zone->addr.g.zone);
 
-    if (ret || cmd.status) {
-        log_erra(
-            "ztl_pro_node_reset_zn: Zone: [%u] reset failure. status [%d]\n",
-            zone->addr.g.zone, cmd.status);
-        goto ERR;
+    zc->batch->pending--;
+}
+
+/* Submits the command to every zone of the node and reaps the completions,
+ * so the node costs a single device round trip */
+static int ztl_mgmt_node_zones(struct ztl_mgmt_worker *wk,
+                               struct ztl_pro_node *node, uint8_t opcode) {
+    struct ztl_mgmt_batch batch;
+    struct ztl_mgmt_zcmd *zc;
+    struct xztl_misc_cmd  misc;
+    uint16_t              dev, ndevs = xztl_media_ndevs();
+    int                   zn_i, ret;
+
+    batch.pending = 0;
+    batch.nerr    = 0;
+
+    for (zn_i = 0; zn_i < node->nzones; zn_i++) {
+        zc        = &batch.zcmd[zn_i];
+        zc->zone  = node->vzones[zn_i];
+        zc->batch = &batch;
+
+        /* Only open zones can be closed */
+        if (opcode == XZTL_ZONE_MGMT_CLOSE &&
+            (zc->zone->zmd_entry->wptr == zc->zone->addr.g.sect ||
+             zc->zone->zmd_entry->wptr >=
+                 zc->zone->addr.g.sect + zc->zone->capacity))
+            continue;
+
+        zc->cmd.opcode    = opcode;
+        zc->cmd.status    = 0;
+        zc->cmd.addr.addr = zc->zone->addr.addr;
+        zc->cmd.nzones    = 1;
+        zc->cmd.opaque    = NULL;
+        zc->cmd.callback  = ztl_mgmt_zn_callback;
+        zc->cmd.async_ctx = wk->tctx[xztl_media_grp_dev(zc->zone->addr.g.grp)];
+
+        /* Media without a queue may complete the command in place */
+        batch.pending++;
+        ret = xztl_media_submit_zn_async(&zc->cmd);
+        if (ret) {
+            log_erra("ztl_mgmt_node_zones: Zone [%u] submit failure. ret "
+                     "[%d]\n",
+                     zc->zone->addr.g.zone, ret);
+            batch.pending--;
+            batch.nerr++;
+        }
     }
 
-    ATOMIC_SWAP(&zmde->wptr, zmde->wptr, zone->addr.g.sect);
-    ATOMIC_SWAP(&zmde->wptr_inflight, zmde->wptr_inflight, zone->addr.g.sect);
-ERR:
-    return ret;
+    while (batch.pending) {
+        for (dev = 0; dev < ndevs; dev++) {
+            misc.opcode         = XZTL_MISC_ASYNCH_POKE;
+            misc.asynch.ctx_ptr = wk->tctx[dev];
+            misc.asynch.limit   = 0;
+            misc.asynch.count   = 0;
+            xztl_media_submit_misc(&misc);
+        }
+    }
+
+    return (batch.nerr) ? XZTL_ZTL_MGMT_ERR : XZTL_OK;
 }
 
-static int ztl_mgmt_node_reset(struct app_group    *grp,
-                               struct ztl_pro_node *node) {
-    struct ztl_pro_zone     *zone;
+static int ztl_mgmt_node_reset(struct ztl_mgmt_worker *wk,
+                               struct app_group       *grp,
+                               struct ztl_pro_node    *node) {
     struct ztl_pro_node_grp *node_grp = grp->pro;
     int                      ret;
 
-    for (int i = 0; i < ZTL_PRO_ZONE_NUM_INNODE; i++) {
-        zone = node->vzones[i];
-        ret  = ztl_mgmt_node_reset_zn(zone);
-        if (ret) {
-            log_erra("ztl_pro_grp_node_reset: Zone [%u] reset failure\n",
-                     zone->addr.g.zone);
-            ATOMIC_ADD(&node->nr_reset_err, 1);
-            goto ERR;
-        }
+    ret = ztl_mgmt_node_zones(wk, node, XZTL_ZONE_MGMT_RESET);
+    if (ret) {
+        log_erra("ztl_pro_grp_node_reset: Node [%u] reset failure\n",
+                 node->id);
+        ATOMIC_ADD(&node->nr_reset_err, 1);
+        goto ERR;
     }
 
+    ztl_pro_node_inactive(node);
+
     node->status                 = XZTL_ZMD_NODE_FREE;
-    node->optimal_write_sec_left = ZTL_PRO_OPT_SEC_NUM_INNODE;
+    node->optimal_write_sec_left = node->capacity;
     node->optimal_write_sec_used = 0;
     node->nr_valid               = 0;
-    node->level                  = -1;
+    ztl_pro_grp_node_level(node, -1);
 
     pthread_spin_lock(&node_grp->spin_full);
     TAILQ_REMOVE(&node_grp->full_head, node, fentry);
     pthread_spin_unlock(&node_grp->spin_full);
 
-    pthread_spin_lock(&node_grp->spin_free);
-    TAILQ_INSERT_TAIL(&node_grp->free_head, node, fentry);
-    pthread_spin_unlock(&node_grp->spin_free);
-
-    ATOMIC_ADD(&node_grp->nfree, 1);
+    ztl_pro_grp_put_node(node_grp, node);
 
 ERR:
     return ret;
 }
 
 void ztl_mgmt_clear_invalid_node(struct app_group *grp) {
+    struct ztl_mgmt_state   *st  = ztl_mgmt_st();
     struct ztl_pro_node_grp *pro = (struct ztl_pro_node_grp *)grp->pro;
+
+    pthread_mutex_lock(&st->caller_mutex);
     for (int node_id = 0; node_id < pro->nnodes; node_id++) {
         struct ztl_pro_node *node = &pro->vnodes[node_id];
-        if (node->nr_valid == 0 && node->status != XZTL_ZMD_NODE_FREE) {
-            ztl_mgmt_node_reset(grp, node);
+        /* Nodes in XZTL_ZMD_NODE_RESET are queued or dirty already */
+        if (node->nr_valid == 0 && node->status != XZTL_ZMD_NODE_FREE &&
+            node->status != XZTL_ZMD_NODE_OFF &&
+            node->status != XZTL_ZMD_NODE_RESET) {
+            ztl_mgmt_node_reset(&st->caller, grp, node);
             log_infoa("clear node[%d] optimal_write_sec_used[%lu]\n", node_id,
                       node->optimal_write_sec_used);
         }
     }
+    pthread_mutex_unlock(&st->caller_mutex);
 }
 
-static int ztl_mgmt_node_finish(struct app_group    *grp,
-                                struct ztl_pro_node *node) {
-    struct ztl_pro_zone *zone;
-    struct xztl_zn_mcmd  cmd;
-    int                  ret;
-
-    for (int i = 0; i < ZTL_PRO_ZONE_NUM_INNODE; i++) {
-        /* Explicit closes the zone */
-        zone          = node->vzones[i];
-        cmd.opcode    = XZTL_ZONE_MGMT_FINISH;
-        cmd.addr.addr = zone->addr.addr;
-        cmd.nzones    = 1;
-        ret           = xztl_media_submit_zn(&cmd);
-
-        if (ret || cmd.status) {
-            log_erra(
-                "ztl_pro_grp_node_finish: Zone finish failure [%u] status "
-                "[%d]\n",
-                zone->addr.g.zone, cmd.status);
-            ATOMIC_ADD(&node->nr_finish_err, 1);
-            goto ERR;
-        }
-        zone->zmd_entry->wptr = zone->addr.g.sect + zone->capacity;
+static int ztl_mgmt_node_finish(struct ztl_mgmt_worker *wk,
+                                struct app_group       *grp,
+                                struct ztl_pro_node    *node) {
+    int ret;
+
+    /* Explicit closes the zones */
+    ret = ztl_mgmt_node_zones(wk, node, XZTL_ZONE_MGMT_FINISH);
+    if (ret) {
+        log_erra("ztl_pro_grp_node_finish: Node [%u] finish failure\n",
+                 node->id);
+        ATOMIC_ADD(&node->nr_finish_err, 1);
+    } else {
+        ztl_pro_node_inactive(node);
     }
 
-ERR:
     return ret;
 }
 
-static int ztl_mgmt_submit_reset_finish(struct app_group    *grp,
-                                        struct ztl_pro_node *node,
-                                        int32_t              op_code) {
+/* A reset makes a queued finish of the same node useless, the finish would
+ * also run after the reset and close zones of a free node. Called under
+ * queue_mutex */
+static void ztl_mgmt_drop_finish(struct ztl_mgmt_state *st,
+                                 struct ztl_pro_node   *node) {
+    struct xnvme_node_mgmt_entry *et;
+
+    STAILQ_FOREACH(et, &st->submit_head[ZTL_MGMT_CLASS_FINISH], entry) {
+        if (et->node == node) {
+            STAILQ_REMOVE(&st->submit_head[ZTL_MGMT_CLASS_FINISH], et,
+                          xnvme_node_mgmt_entry, entry);
+            xztl_mempool_put(et->mp_entry, XZTL_NODE_MGMT_ENTRY, 0);
+            return;
+        }
+    }
+}
+
+/* Called under queue_mutex */
+static int ztl_mgmt_queue(struct ztl_mgmt_state *st, struct app_group *grp,
+                          struct ztl_pro_node *node, int32_t op_code,
+                          uint8_t lazy) {
     struct xztl_mp_entry *mp_cmd;
+    enum ztl_mgmt_class   cls;
+
     mp_cmd = xztl_mempool_get(XZTL_NODE_MGMT_ENTRY, 0);
     if (!mp_cmd) {
         log_err("ztl_pro_grp_submit_mgmt: Mempool failed.\n");
@@ -174,82 +310,376 @@ static int ztl_mgmt_submit_reset_finish(struct app_group    *grp,
     et->grp      = grp;
     et->node     = node;
     et->op_code  = op_code;
+    et->lazy     = lazy;
     et->mp_entry = mp_cmd;
 
-    pthread_spin_lock(&xnvme_mgmt_spin);
-    STAILQ_INSERT_TAIL(&submit_head, et, entry);
-    pthread_spin_unlock(&xnvme_mgmt_spin);
+    cls = (op_code == ZTL_MGMG_FULL_ZONE) ? ZTL_MGMT_CLASS_FINISH
+                                          : ZTL_MGMT_CLASS_RESET;
+
+    if (cls == ZTL_MGMT_CLASS_RESET)
+        ztl_mgmt_drop_finish(st, node);
+    STAILQ_INSERT_TAIL(&st->submit_head[cls], et, entry);
+    pthread_cond_signal(&st->queue_cond);
+
     return XZTL_OK;
 }
 
-static void *ztl_mgmt_thd_process(void *args) {
-    mthread.comp_active = 1;
+static int ztl_mgmt_submit_reset_finish(struct app_group    *grp,
+                                        struct ztl_pro_node *node,
+                                        int32_t              op_code) {
+    struct ztl_mgmt_state   *st  = ztl_mgmt_st();
+    struct ztl_pro_node_grp *pro = grp->pro;
+    int                      ret = XZTL_OK;
+
+    pthread_mutex_lock(&st->queue_mutex);
+    if (op_code == ZTL_MGMG_FULL_ZONE || !st->reset_target) {
+        ret = ztl_mgmt_queue(st, grp, node, op_code, 0);
+        goto UNLOCK;
+    }
+
+    ztl_mgmt_drop_finish(st, node);
+    ztl_pro_grp_put_dirty(pro, node);
+    if (pro->nfree + pro->nreset <= st->reset_target / 2)
+        pthread_cond_signal(&st->reset_cond);
+
+UNLOCK:
+    pthread_mutex_unlock(&st->queue_mutex);
+    return ret;
+}
+
+static int ztl_mgmt_node_busy(struct ztl_mgmt_state *st,
+                              struct ztl_pro_node   *node) {
+    uint32_t wk_i;
+
+    for (wk_i = 0; wk_i < st->nworkers; wk_i++) {
+        if (st->workers[wk_i].node == node)
+            return 1;
+    }
+    return 0;
+}
+
+/* Takes the first command of the highest priority class. Commands of a node
+ * in progress in another worker stay queued, so a node is never finished and
+ * reset at the same time. Called under queue_mutex */
+static struct xnvme_node_mgmt_entry *
+ztl_mgmt_next(struct ztl_mgmt_state *st) {
     struct xnvme_node_mgmt_entry *et;
-    int                           ret;
-    while (mthread.comp_active) {
-        usleep(1);
-
-    NEXT:
-        if (!STAILQ_EMPTY(&submit_head)) {
-            pthread_spin_lock(&xnvme_mgmt_spin);
-            et = STAILQ_FIRST(&submit_head);
-            if (!et) {
-                pthread_spin_unlock(&xnvme_mgmt_spin);
-                continue;
+    int                           cls;
+
+    for (cls = 0; cls < ZTL_MGMT_CLASS_NUM; cls++) {
+        STAILQ_FOREACH(et, &st->submit_head[cls], entry) {
+            if (!ztl_mgmt_node_busy(st, et->node)) {
+                STAILQ_REMOVE(&st->submit_head[cls], et,
+                              xnvme_node_mgmt_entry, entry);
+                return et;
             }
+        }
+    }
+    return NULL;
+}
+
+static int ztl_mgmt_queued(struct ztl_mgmt_state *st) {
+    int cls;
+
+    for (cls = 0; cls < ZTL_MGMT_CLASS_NUM; cls++) {
+        if (!STAILQ_EMPTY(&st->submit_head[cls]))
+            return 1;
+    }
+    return 0;
+}
+
+static void *ztl_mgmt_thd_process(void *args) {
+    struct ztl_mgmt_worker       *wk = (struct ztl_mgmt_worker *)args;
+    struct ztl_mgmt_state        *st;
+    struct xnvme_node_mgmt_entry *et;
+    int                           ret, retry;
+
+    xztl_instance_bind(wk->inst);
+    st = ztl_mgmt_st();
+
+    pthread_mutex_lock(&st->queue_mutex);
+    while (1) {
+        et = ztl_mgmt_next(st);
+        if (!et) {
+            /* Pending commands are completed before the workers leave */
+            if (!st->running && !ztl_mgmt_queued(st))
+                break;
+            pthread_cond_wait(&st->queue_cond, &st->queue_mutex);
+            continue;
+        }
+
+        wk->node = et->node;
+        pthread_mutex_unlock(&st->queue_mutex);
+
+        retry = 0;
+    MGMT_FAIL:
+        if (et->op_code == ZTL_MGMG_FULL_ZONE) {
+            ret = ztl_mgmt_node_finish(wk, et->grp, et->node);
+        } else {
+            ret = ztl_mgmt_node_reset(wk, et->grp, et->node);
+        }
 
-            STAILQ_REMOVE_HEAD(&submit_head, entry);
-            pthread_spin_unlock(&xnvme_mgmt_spin);
-            int retry = 0;
-        MGMT_FAIL:
-            if (et->op_code == ZTL_MGMG_FULL_ZONE) {
-                ret = ztl_mgmt_node_finish(et->grp, et->node);
-            } else {
-                ret = ztl_mgmt_node_reset(et->grp, et->node);
+        if (ret) {
+            xztl_stats_inc(XZTL_STATS_MGMT_FAIL, 1);
+            log_erra("znd_pro_grp_process_mgmt: ret [%d]\n", ret);
+            retry++;
+            if (retry < MGMT_MAX_RETRY) {
+                goto MGMT_FAIL;
             }
+        }
+
+        pthread_mutex_lock(&st->queue_mutex);
+        if (et->lazy)
+            ((struct ztl_pro_node_grp *)et->grp->pro)->nreset--;
+        xztl_mempool_put(et->mp_entry, XZTL_NODE_MGMT_ENTRY, 0);
+        wk->node = NULL;
+
+        /* Commands held back for this node may be taken by others now */
+        pthread_cond_broadcast(&st->queue_cond);
+    }
+    pthread_mutex_unlock(&st->queue_mutex);
 
-            if (ret) {
-                xztl_stats_inc(XZTL_STATS_MGMT_FAIL, 1);
-                log_erra("znd_pro_grp_process_mgmt: ret [%d]\n", ret);
-                retry++;
-                if (retry < MGMT_MAX_RETRY) {
-                    goto MGMT_FAIL;
-                }
+    return XZTL_OK;
+}
+
+/* Queues the resets of a tick. Called under queue_mutex */
+static void ztl_mgmt_lazy_reset(struct ztl_mgmt_state *st, int busy) {
+    struct ztl_pro_node_grp *pro;
+    struct ztl_pro_node     *node;
+    struct app_group        *grp;
+    uint32_t                 nfree, want;
+    uint16_t                 grp_i;
+
+    for (grp_i = 0; (grp = ztl()->groups.get_fn(grp_i)); grp_i++) {
+        pro   = grp->pro;
+        nfree = pro->nfree + pro->nreset;
+        if (nfree >= st->reset_target)
+            continue;
+
+        want = st->reset_target - nfree;
+        if (busy && nfree >= st->reset_target / 2)
+            want = 1;
+
+        while (want-- && (node = ztl_pro_grp_take_dirty(pro))) {
+            if (ztl_mgmt_queue(st, grp, node, ZTL_MGMG_RESET_ZONE, 1)) {
+                ztl_pro_grp_put_dirty(pro, node);
+                break;
             }
+            pro->nreset++;
+        }
+    }
+}
 
-            xztl_mempool_put(et->mp_entry, XZTL_NODE_MGMT_ENTRY, 0);
-            goto NEXT;
+static void *ztl_mgmt_reset_process(void *args) {
+    struct ztl_mgmt_state *st;
+    struct timespec        ts;
+    uint64_t               bytes;
+    int                    busy;
+
+    xztl_instance_bind((struct xztl_instance *)args);
+    st = ztl_mgmt_st();
+
+    pthread_mutex_lock(&st->queue_mutex);
+    while (st->running) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += ZTL_MGMT_RESET_TICK_US * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
         }
+        pthread_cond_timedwait(&st->reset_cond, &st->queue_mutex, &ts);
+        if (!st->running)
+            break;
+
+        /* Reads and writes since the last tick, GC included */
+        bytes = xztl_stats_get(XZTL_STATS_READ_BYTES) +
+                xztl_stats_get(XZTL_STATS_APPEND_BYTES);
+        busy  = (bytes != st->fg_bytes);
+        st->fg_bytes = bytes;
+
+        ztl_mgmt_lazy_reset(st, busy);
     }
+    pthread_mutex_unlock(&st->queue_mutex);
 
     return XZTL_OK;
 }
 
-static int ztl_mgmt_init() {
-    STAILQ_INIT(&submit_head);
-    if (pthread_spin_init(&xnvme_mgmt_spin, 0)) {
-        return XZTL_ZTL_PROV_GRP_ERR;
+/* Closes or finishes an idle node now, for a writer short of open or active
+ * zones. See ztl_pro_budget_get */
+static int ztl_mgmt_close(struct app_group *grp, struct ztl_pro_node *node,
+                          int32_t op_code) {
+    struct ztl_mgmt_state *st = ztl_mgmt_st();
+    int                    ret;
+
+    pthread_mutex_lock(&st->caller_mutex);
+    if (op_code == ZTL_MGMG_FULL_ZONE) {
+        ret = ztl_mgmt_node_finish(&st->caller, grp, node);
+    } else {
+        ret = ztl_mgmt_node_zones(&st->caller, node, XZTL_ZONE_MGMT_CLOSE);
+        if (ret)
+            log_erra("ztl_mgmt_close: Node [%u] close failure\n", node->id);
     }
+    pthread_mutex_unlock(&st->caller_mutex);
 
-    int ret =
-        xztl_mempool_create(XZTL_NODE_MGMT_ENTRY, 0, ZTL_NODE_MGMT_SZ,
-                            sizeof(struct xnvme_node_mgmt_entry), NULL, NULL);
-    if (ret) {
-        log_err("create node_entry failed\n");
+    return ret;
+}
+
+/* A writer found no free node, it resets a dirty node of the group */
+static int ztl_mgmt_reclaim(struct app_group *grp) {
+    struct ztl_mgmt_state   *st  = ztl_mgmt_st();
+    struct ztl_pro_node_grp *pro = grp->pro;
+    struct ztl_pro_node     *node;
+    int                      ret;
+
+    pthread_mutex_lock(&st->queue_mutex);
+    node = ztl_pro_grp_take_dirty(pro);
+    if (node && ztl_mgmt_node_busy(st, node)) {
+        ztl_pro_grp_put_dirty(pro, node);
+        node = NULL;
     }
+    pthread_mutex_unlock(&st->queue_mutex);
+
+    if (!node)
+        return XZTL_ZTL_MGMT_ERR;
+
+    pthread_mutex_lock(&st->caller_mutex);
+    ret = ztl_mgmt_node_reset(&st->caller, grp, node);
+    pthread_mutex_unlock(&st->caller_mutex);
+
+    if (ret)
+        ztl_pro_grp_put_dirty(pro, node);
 
-    pthread_create(&mthread.comp_tid, NULL, ztl_mgmt_thd_process, NULL);
     return ret;
 }
 
-static void ztl_mgmt_exit() {
-    while (!STAILQ_EMPTY(&submit_head)) {
-        usleep(1);
+static void ztl_mgmt_worker_exit(struct ztl_mgmt_worker *wk) {
+    uint16_t dev;
+
+    for (dev = 0; dev < XZTL_MEDIA_MAX_DEV; dev++) {
+        xztl_ctx_media_exit(wk->tctx[dev]);
+        wk->tctx[dev] = NULL;
+    }
+}
+
+static int ztl_mgmt_worker_init(struct ztl_mgmt_worker *wk) {
+    uint16_t dev;
+
+    wk->inst = xztl_instance_get();
+    wk->node = NULL;
+
+    for (dev = 0; dev < xztl_media_ndevs(); dev++) {
+        wk->tctx[dev] = xztl_ctx_media_init_dev(dev, ZTL_MGMT_QDEPTH);
+        if (!wk->tctx[dev]) {
+            log_erra("ztl_mgmt_init: device [%u] context failed\n", dev);
+            ztl_mgmt_worker_exit(wk);
+            return XZTL_ZTL_MGMT_ERR;
+        }
+    }
+
+    return XZTL_OK;
+}
+
+static void ztl_mgmt_stop(struct ztl_mgmt_state *st) {
+    uint32_t wk_i;
+
+    pthread_mutex_lock(&st->queue_mutex);
+    st->running = 0;
+    pthread_cond_broadcast(&st->queue_cond);
+    pthread_cond_signal(&st->reset_cond);
+    pthread_mutex_unlock(&st->queue_mutex);
+
+    if (st->reset_target)
+        pthread_join(st->reset_tid, NULL);
+
+    for (wk_i = 0; wk_i < st->nworkers; wk_i++) {
+        pthread_join(st->workers[wk_i].tid, NULL);
+        ztl_mgmt_worker_exit(&st->workers[wk_i]);
     }
+    st->nworkers = 0;
+}
 
-    mthread.comp_active = 0;
-    pthread_join(mthread.comp_tid, NULL);
-    pthread_spin_destroy(&xnvme_mgmt_spin);
+static int ztl_mgmt_init() {
+    struct ztl_mgmt_state    *st  = ztl_mgmt_st();
+    const struct xztl_config *cfg = xztl_config_get();
+    int                       cls, ret;
+
+    for (cls = 0; cls < ZTL_MGMT_CLASS_NUM; cls++)
+        STAILQ_INIT(&st->submit_head[cls]);
+
+    if (pthread_mutex_init(&st->queue_mutex, NULL))
+        return XZTL_ZTL_MGMT_ERR;
+    if (pthread_cond_init(&st->queue_cond, NULL))
+        goto MUTEX;
+    if (pthread_cond_init(&st->reset_cond, NULL))
+        goto COND;
+    if (pthread_mutex_init(&st->caller_mutex, NULL))
+        goto RCOND;
+
+    ret = xztl_mempool_create(XZTL_NODE_MGMT_ENTRY, 0, ZTL_NODE_MGMT_SZ,
+                              sizeof(struct xnvme_node_mgmt_entry), NULL, NULL);
+    if (ret) {
+        log_err("create node_entry failed\n");
+        goto CALLER;
+    }
+
+    if (ztl_mgmt_worker_init(&st->caller))
+        goto MP;
+
+    st->running      = 1;
+    st->nworkers     = 0;
+    st->reset_target = 0;
+    while (st->nworkers < cfg->mgmt_workers) {
+        struct ztl_mgmt_worker *wk = &st->workers[st->nworkers];
+
+        if (ztl_mgmt_worker_init(wk))
+            goto STOP;
+        if (pthread_create(&wk->tid, NULL, ztl_mgmt_thd_process, wk)) {
+            ztl_mgmt_worker_exit(wk);
+            goto STOP;
+        }
+        st->nworkers++;
+    }
+
+    if (cfg->reset_target) {
+        st->fg_bytes     = 0;
+        st->reset_target = cfg->reset_target;
+        if (pthread_create(&st->reset_tid, NULL, ztl_mgmt_reset_process,
+                           xztl_instance_get())) {
+            st->reset_target = 0;
+            goto STOP;
+        }
+    }
+
+    log_infoa("ztl_mgmt_init: [%u] workers started, reset target [%u]\n",
+              st->nworkers, st->reset_target);
+
+    return XZTL_OK;
+
+STOP:
+    ztl_mgmt_stop(st);
+    ztl_mgmt_worker_exit(&st->caller);
+MP:
+    xztl_mempool_destroy(XZTL_NODE_MGMT_ENTRY, 0);
+CALLER:
+    pthread_mutex_destroy(&st->caller_mutex);
+RCOND:
+    pthread_cond_destroy(&st->reset_cond);
+COND:
+    pthread_cond_destroy(&st->queue_cond);
+MUTEX:
+    pthread_mutex_destroy(&st->queue_mutex);
+    return XZTL_ZTL_MGMT_ERR;
+}
+
+static void ztl_mgmt_exit() {
+    struct ztl_mgmt_state *st = ztl_mgmt_st();
+
+    ztl_mgmt_stop(st);
+    ztl_mgmt_worker_exit(&st->caller);
+    pthread_mutex_destroy(&st->caller_mutex);
+    pthread_cond_destroy(&st->reset_cond);
+    pthread_cond_destroy(&st->queue_cond);
+    pthread_mutex_destroy(&st->queue_mutex);
 }
 
 static struct app_mgmt_mod ztl_mgmt = {
@@ -258,10 +688,11 @@ static struct app_mgmt_mod ztl_mgmt = {
     .init_fn = ztl_mgmt_init,
     .exit_fn = ztl_mgmt_exit,
     // .open_fn        = ztl_mgmt_open,
-    // .close_fn       = ztl_mgmt_close,
-    .reset_fn  = ztl_mgmt_submit_reset_finish,
-    .finish_fn = ztl_mgmt_submit_reset_finish,
-    .clear_fn  = ztl_mgmt_clear_invalid_node};
+    .reset_fn   = ztl_mgmt_submit_reset_finish,
+    .finish_fn  = ztl_mgmt_submit_reset_finish,
+    .clear_fn   = ztl_mgmt_clear_invalid_node,
+    .reclaim_fn = ztl_mgmt_reclaim,
+    .close_fn   = ztl_mgmt_close};
 
 void ztl_mgmt_register(void) {
     ztl_mod_register(ZTLMOD_MGMT, LIBZTL_MGMT, &ztl_mgmt);
@@ -17,19 +17,249 @@
  * limitations under the License.
 */
 
+#include <libxnvme.h>
+#include <libxnvme_znd.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <xztl.h>
+#include <xztl-media.h>
+#include <xztl-metadata.h>
 #include <xztl-mods.h>
 #define DATA_LEN 512 * 256 * 8
 
-// extern uint16_t app_ngrps;
-static uint8_t         app_map_new;
-static struct app_mpe *smap;
+/* Persistent mapping log
+ *
+ * Mapping pages evicted from the cache or written by a checkpoint are
+ * appended as PAGE records to the mapping zones of the first group, and the
+ * page keeps the sector of its last copy. Upserts of cached pages are logged
+ * in DELTA records, one sector of entries each. A CKPT record holds the sector
+ * of every page once the dirty pages are written. A full zone moves the live
+ * pages to the next zone, which replaces the previous one with its first CKPT.
+ * Startup replays the newest zone with a CKPT: PAGE records move the pages,
+ * and DELTA entries newer than the last copy of their page are applied by
+ * replay_fn once the cache is up. A written zone that does not start with a
+ * SNAP of ZTL_FORMAT_VERSION fails the load. */
+
+enum ztl_mpe_type {
+    ZTL_MPE_SNAP = 1, /* First record of a zone */
+    ZTL_MPE_PAGE,
+    ZTL_MPE_DELTA,
+    ZTL_MPE_CKPT
+};
+
+struct ztl_mpe_delta {
+    uint64_t id;
+    uint64_t val;
+} __attribute__((packed));
+
+struct ztl_mpe_head {
+    uint32_t             magic;
+    uint32_t             type;
+    uint64_t             seq;
+    uint32_t             nbytes;
+    uint32_t             zcap;
+    uint32_t             npgs;
+    uint32_t             pg_sec;
+    uint32_t             index; /* Page of a PAGE record */
+    uint32_t             count; /* Entries of a DELTA record */
+    uint32_t             nsec;  /* Sectors after the header */
+    uint32_t             format;
+    struct ztl_mpe_delta delta[];
+} __attribute__((packed));
+
+struct ztl_mpe_replay {
+    uint64_t id;
+    uint64_t val;
+    uint64_t rec; /* Record of the entry */
+};
+
+struct ztl_mpe_state {
+    pthread_mutex_t        mutex; /* Log appends and the DMA buffer */
+    uint8_t               *buf;   /* DMA buffer, MAX_WRITE_NLB_NUM sectors */
+    uint8_t               *page;
+    struct ztl_mpe_head   *delta;   /* DELTA record being filled */
+    uint64_t              *pg_addr; /* Payload sector of the last copy */
+    uint64_t              *pg_rec;  /* Record of the last copy */
+    struct ztl_mpe_replay *replay;
+    uint64_t               nreplay;
+    uint64_t               replay_sz;
+    uint64_t               seq;
+    uint64_t               seq_max;
+    uint64_t               wptr;
+    uint64_t               zend; /* Zero if records cannot be appended */
+    uint64_t               nrec;
+    uint32_t               ndelta; /* DELTA records since the last CKPT */
+    uint32_t               max_delta;
+    uint32_t               zone;
+    uint8_t                valid;   /* The previous zone may be reset */
+    uint8_t                changed; /* Written since the last CKPT */
+    volatile uint8_t       replaying;
+};
+
+static struct ztl_mpe_state *ztl_mpe_st(void) {
+    return xztl_instance_state(XZTL_STATE_MPE, sizeof(struct ztl_mpe_state));
+}
+
+static uint64_t ztl_mpe_sect(uint32_t zone) {
+    struct xztl_core *core;
+    get_xztl_core(&core);
+
+    return (uint64_t)(ZTL_METADATA_ZONES + ZTL_ZMD_CKPT_ZONES + zone) *
+           core->media->geo.sec_zn;
+}
+
+static uint32_t ztl_mpe_npgs(void) {
+    return ztl()->smap.entries;
+}
+
+static uint32_t ztl_mpe_ckpt_sec(void) {
+    struct xztl_core *core;
+    get_xztl_core(&core);
+
+    return (ztl_mpe_npgs() * sizeof(uint64_t) + core->media->geo.nbytes - 1) /
+           core->media->geo.nbytes;
+}
+
+/* The live copy of the table takes at most half of a zone, the other half
+ * takes the records written until the next switch. A CKPT record is written
+ * by a single command of the DMA buffer */
+uint32_t ztl_mpe_max_pages(void) {
+    struct xnvme_spec_znd_descr *zinfo;
+    struct app_group            *grp;
+    struct xztl_core            *core;
+    uint64_t                     zcap = 0, half, pgs, max_sec;
+    uint32_t                     zn, nbytes;
+    get_xztl_core(&core);
+    nbytes = core->media->geo.nbytes;
+
+    grp = ztl()->groups.get_fn(0);
+    if (!grp || !grp->zmd.report)
+        return 0;
+
+    for (zn = 0; zn < ZTL_MPE_ZONES; zn++) {
+        zinfo = XNVME_ZND_REPORT_DESCR(
+            grp->zmd.report, ZTL_METADATA_ZONES + ZTL_ZMD_CKPT_ZONES + zn);
+        zcap = (!zn) ? zinfo->zcap : MIN(zcap, zinfo->zcap);
+    }
+
+    /* SNAP and CKPT headers, then a PAGE record per page */
+    half = zcap / 2;
+    if (half < 2)
+        return 0;
+    pgs = ((half - 2) * nbytes) /
+          ((1 + ZTL_MPE_PG_SEC) * nbytes + sizeof(uint64_t));
+
+    max_sec = MAX_WRITE_NLB_NUM;
+    if (core->media->geo.nbytes_mdts &&
+        core->media->geo.nbytes_mdts / nbytes < max_sec)
+        max_sec = core->media->geo.nbytes_mdts / nbytes;
+    pgs = MIN(pgs, (max_sec - 1) * nbytes / sizeof(uint64_t));
+
+    return (uint32_t)pgs;
+}
+
+/* Synchronous I/O of the DMA buffer */
+static int ztl_mpe_io(struct ztl_mpe_state *st, uint8_t opcode, uint64_t sect,
+                      uint32_t nsec) {
+    struct xztl_io_mcmd cmd;
+    int                 ret;
+
+    memset(&cmd, 0x0, sizeof(struct xztl_io_mcmd));
+    cmd.opcode         = opcode;
+    cmd.naddr          = 1;
+    cmd.synch          = 1;
+    cmd.addr[0].g.sect = sect;
+    cmd.nsec[0]        = nsec;
+    cmd.prp[0]         = (uint64_t)st->buf;
+
+    ret = xztl_media_submit_io(&cmd);
+    if (ret) {
+        log_erra("ztl_mpe_io: opcode [%d] sect [%lu] err [%d]\n", opcode, sect,
+                 ret);
+        return XZTL_ZTL_MPE_ERR;
+    }
+
+    return XZTL_OK;
+}
+
+/* Appends a record, the header is followed by nsec sectors of data. The
+ * caller holds the mutex */
+static int ztl_mpe_put(struct ztl_mpe_state *st, struct ztl_mpe_head *head,
+                       size_t head_sz, const void *data, uint64_t *sect) {
+    struct xztl_core *core;
+    uint32_t          nbytes;
+    int               ret;
+    get_xztl_core(&core);
+    nbytes = core->media->geo.nbytes;
+
+    if (!st->zend || head->nsec >= st->zend - st->wptr)
+        return XZTL_ZTL_MD_WRITE_FULL;
+
+    head->magic  = ZTL_MPE_MAGIC;
+    head->seq    = st->seq;
+    head->nbytes = nbytes;
+    head->zcap   = st->zend - ztl_mpe_sect(st->zone);
+    head->npgs   = ztl_mpe_npgs();
+    head->pg_sec = ZTL_MPE_PG_SEC;
+    head->format = ZTL_FORMAT_VERSION;
+
+    memset(st->buf, 0x0, nbytes);
+    memcpy(st->buf, head, head_sz);
+    if (head->nsec)
+        memcpy(st->buf + nbytes, data, (uint64_t)head->nsec * nbytes);
+
+    ret = ztl_mpe_io(st, XZTL_CMD_WRITE, st->wptr, 1 + head->nsec);
+    if (ret) {
+        /* The zone write pointer is unknown, the next write switches zones */
+        st->zend = 0;
+        return ret;
+    }
+
+    if (sect)
+        *sect = st->wptr;
+    st->wptr += 1 + head->nsec;
+    st->nrec++;
+
+    return XZTL_OK;
+}
+
+static int ztl_mpe_put_delta(struct ztl_mpe_state *st) {
+    struct xztl_core *core;
+    int               ret;
+    get_xztl_core(&core);
+
+    if (!st->delta->count)
+        return XZTL_OK;
+
+    st->delta->type = ZTL_MPE_DELTA;
+    st->delta->nsec = 0;
+    ret = ztl_mpe_put(st, st->delta, core->media->geo.nbytes, NULL, NULL);
+    if (ret)
+        return ret;
+
+    st->delta->count = 0;
+    st->ndelta++;
+
+    return XZTL_OK;
+}
+
+static void ztl_mpe_set_md(uint32_t index, uint64_t sect) {
+    struct app_map_entry ent;
+
+    /* A zero address is a page not written yet */
+    ent.addr = 0;
+    if (sect) {
+        ent.g.offset = sect;
+        ent.g.nsec   = ZTL_MPE_PG_SEC;
+    }
+
+    ztl()->mpe->get_fn(index)->addr = ent.addr;
+}
 
 static int ztl_mpe_create(void) {
-    smap = &ztl()->smap;
+    struct app_mpe       *smap = &ztl()->smap;
     int                   i;
     struct app_map_entry *ent;
 
@@ -38,24 +268,546 @@ static int ztl_mpe_create(void) {
         memset(ent, 0x0, sizeof(struct app_map_entry));
     }
 
-    app_map_new = 1;
+    return XZTL_OK;
+}
+
+static int ztl_mpe_head_ok(struct ztl_mpe_head *head, uint64_t seq,
+                           uint64_t left) {
+    struct xztl_core *core;
+    get_xztl_core(&core);
+
+    if (head->magic != ZTL_MPE_MAGIC || head->format != ZTL_FORMAT_VERSION ||
+        head->seq != seq || head->nbytes != core->media->geo.nbytes ||
+        head->npgs != ztl_mpe_npgs() || head->pg_sec != ZTL_MPE_PG_SEC ||
+        head->nsec >= left)
+        return 0;
+
+    switch (head->type) {
+        case ZTL_MPE_PAGE:
+            return head->index < ztl_mpe_npgs() &&
+                   head->nsec == ZTL_MPE_PG_SEC;
+        case ZTL_MPE_DELTA:
+            return head->count <= ztl_mpe_st()->max_delta;
+        case ZTL_MPE_CKPT:
+            return head->nsec == ztl_mpe_ckpt_sec();
+        default:
+            return head->type == ZTL_MPE_SNAP;
+    }
+}
+
+static int ztl_mpe_add_replay(struct ztl_mpe_state *st,
+                              struct ztl_mpe_head  *head) {
+    struct ztl_mpe_replay *replay;
+    uint32_t               ent_i;
+
+    if (st->nreplay + head->count > st->replay_sz) {
+        replay = realloc(st->replay, (st->replay_sz + st->max_delta * 64) *
+                                         sizeof(struct ztl_mpe_replay));
+        if (!replay)
+            return XZTL_MEM;
+        st->replay = replay;
+        st->replay_sz += st->max_delta * 64;
+    }
+
+    for (ent_i = 0; ent_i < head->count; ent_i++) {
+        st->replay[st->nreplay].id  = head->delta[ent_i].id;
+        st->replay[st->nreplay].val = head->delta[ent_i].val;
+        st->replay[st->nreplay].rec = st->nrec;
+        st->nreplay++;
+    }
 
     return XZTL_OK;
 }
 
+/* Replays the headers of a zone. It is valid if it holds a CKPT record */
+static int ztl_mpe_scan(struct ztl_mpe_state *st, uint32_t zone, uint64_t seq,
+                        uint64_t end) {
+    struct ztl_mpe_head *head = (struct ztl_mpe_head *)st->buf;
+    struct xztl_core    *core;
+    uint64_t             sect;
+    uint8_t              ckpt = 0;
+    int                  ret;
+    get_xztl_core(&core);
+
+    memset(st->pg_addr, 0x0, ztl_mpe_npgs() * sizeof(uint64_t));
+    memset(st->pg_rec, 0x0, ztl_mpe_npgs() * sizeof(uint64_t));
+    st->nreplay = 0;
+    st->nrec    = 0;
+
+    for (sect = ztl_mpe_sect(zone); sect < end; sect += 1 + head->nsec) {
+        /* A read error is the end of the written records */
+        if (ztl_mpe_io(st, XZTL_CMD_READ, sect, 1))
+            break;
+        if (!ztl_mpe_head_ok(head, seq, end - sect))
+            break;
+        if ((head->type == ZTL_MPE_SNAP) != (sect == ztl_mpe_sect(zone)))
+            break;
+
+        st->nrec++;
+        switch (head->type) {
+            case ZTL_MPE_PAGE:
+                st->pg_addr[head->index] = sect + 1;
+                st->pg_rec[head->index]  = st->nrec;
+                break;
+            case ZTL_MPE_DELTA:
+                ret = ztl_mpe_add_replay(st, head);
+                if (ret)
+                    return ret;
+                break;
+            case ZTL_MPE_CKPT:
+                ret = ztl_mpe_io(st, XZTL_CMD_READ, sect + 1, head->nsec);
+                if (ret)
+                    return ret;
+                memcpy(st->pg_addr, st->buf,
+                       ztl_mpe_npgs() * sizeof(uint64_t));
+                ckpt = 1;
+
+                /* The header was overwritten by the table */
+                head->nsec = ztl_mpe_ckpt_sec();
+                break;
+        }
+    }
+
+    if (!ckpt)
+        return XZTL_ZTL_MPE_ERR;
+
+    st->zone = zone;
+    st->seq  = seq;
+    st->wptr = sect;
+    st->zend = end;
+
+    return XZTL_OK;
+}
+
+static void ztl_mpe_free(struct ztl_mpe_state *st) {
+    if (st->buf)
+        xztl_media_dma_free(st->buf);
+    free(st->page);
+    free(st->delta);
+    free(st->pg_addr);
+    free(st->pg_rec);
+    free(st->replay);
+}
+
+/* The zone metadata does not follow the writes of the log */
+static int ztl_mpe_zone_written(uint32_t zone, uint8_t *written) {
+    struct xnvme_znd_report *rep;
+    struct xztl_zn_mcmd      cmd;
+    int                      ret;
+
+    memset(&cmd, 0x0, sizeof(struct xztl_zn_mcmd));
+    cmd.opcode      = XZTL_ZONE_MGMT_RANGE;
+    cmd.addr.g.grp  = 0;
+    cmd.addr.g.zone = ZTL_METADATA_ZONES + ZTL_ZMD_CKPT_ZONES + zone;
+    cmd.nzones      = 1;
+
+    ret = xztl_media_submit_zn(&cmd);
+    if (ret)
+        return ret;
+
+    rep = (struct xnvme_znd_report *)cmd.opaque;
+    ret = (rep->nzones) ? XZTL_OK : XZTL_ZTL_MPE_ERR;
+    if (!ret)
+        *written = XNVME_ZND_REPORT_DESCR(rep, 0)->zs !=
+                   XNVME_SPEC_ZND_STATE_EMPTY;
+    xnvme_buf_virt_free(rep);
+
+    return ret;
+}
+
 static int ztl_mpe_load(void) {
+    struct ztl_mpe_state *st = ztl_mpe_st();
+    struct ztl_mpe_head  *head;
+    struct xztl_mgeo     *g;
+    struct xztl_core     *core;
+    uint64_t              seq[ZTL_MPE_ZONES], end[ZTL_MPE_ZONES];
+    uint8_t               found[ZTL_MPE_ZONES], written;
+    uint32_t              zn, zone, pg;
+    int                   ret;
+    get_xztl_core(&core);
+    g = &core->media->geo;
+
+    memset(st, 0x0, sizeof(struct ztl_mpe_state));
+    if (pthread_mutex_init(&st->mutex, NULL))
+        return XZTL_ZTL_MPE_ERR;
+
+    st->max_delta = (g->nbytes - sizeof(struct ztl_mpe_head)) /
+                    sizeof(struct ztl_mpe_delta);
+    st->buf       = xztl_media_dma_alloc(MAX_WRITE_NLB_NUM * g->nbytes);
+    st->page      = malloc(MAX(ZTL_MPE_PG_SEC, ztl_mpe_ckpt_sec()) * g->nbytes);
+    st->delta     = calloc(1, g->nbytes);
+    st->pg_addr   = calloc(ztl_mpe_npgs(), sizeof(uint64_t));
+    st->pg_rec    = calloc(ztl_mpe_npgs(), sizeof(uint64_t));
+    if (!st->buf || !st->page || !st->delta || !st->pg_addr || !st->pg_rec) {
+        ztl_mpe_free(st);
+        pthread_mutex_destroy(&st->mutex);
+        return XZTL_MEM;
+    }
+
+    head = (struct ztl_mpe_head *)st->buf;
+    for (zn = 0; zn < ZTL_MPE_ZONES; zn++) {
+        found[zn] = 0;
+        ret       = ztl_mpe_zone_written(zn, &written);
+        if (ret)
+            goto FREE;
+        if (!written)
+            continue;
+
+        ret = ztl_mpe_io(st, XZTL_CMD_READ, ztl_mpe_sect(zn), 1);
+        if (ret || head->magic != ZTL_MPE_MAGIC ||
+            head->format != ZTL_FORMAT_VERSION) {
+            log_erra("ztl_mpe_load: zone [%u] is not of format [%d], reset "
+                     "the device to format it\n",
+                     zn, ZTL_FORMAT_VERSION);
+            ret = XZTL_ZTL_FORMAT_ERR;
+            goto FREE;
+        }
+        if (head->type != ZTL_MPE_SNAP || head->zcap > g->sec_zn)
+            continue;
+
+        /* The log of a table of another size cannot be replayed */
+        if (head->npgs != ztl_mpe_npgs() || head->nbytes != g->nbytes) {
+            log_erra("ztl_mpe_load: zone [%u] table of [%u] pages, [%u] "
+                     "configured\n",
+                     zn, head->npgs, ztl_mpe_npgs());
+            ret = XZTL_ZTL_MPE_ERR;
+            goto FREE;
+        }
+
+        found[zn] = 1;
+        seq[zn]   = head->seq;
+        end[zn]   = ztl_mpe_sect(zn) + head->zcap;
+        st->seq_max = MAX(st->seq_max, head->seq);
+    }
+
+    /* A zone left without CKPT falls back to the previous */
+    while (1) {
+        zone = ZTL_MPE_ZONES;
+        for (zn = 0; zn < ZTL_MPE_ZONES; zn++) {
+            if (!found[zn])
+                continue;
+            if (zone == ZTL_MPE_ZONES || seq[zn] > seq[zone])
+                zone = zn;
+        }
+        if (zone == ZTL_MPE_ZONES)
+            break;
+
+        found[zone] = 0;
+        if (!ztl_mpe_scan(st, zone, seq[zone], end[zone]))
+            break;
+        log_erra("ztl_mpe_load: zone [%u] seq [%lu] not valid\n", zone,
+                 seq[zone]);
+    }
+
+    /* Nothing is kept in the previous zone if no zone is valid */
+    st->valid = 1;
+    if (zone == ZTL_MPE_ZONES) {
+        memset(st->pg_addr, 0x0, ztl_mpe_npgs() * sizeof(uint64_t));
+        st->nreplay = 0;
+        st->zone    = ZTL_MPE_ZONES - 1;
+        log_infoa("ztl_mpe_load: no mapping log");
+        return XZTL_OK;
+    }
+
+    for (pg = 0; pg < ztl()->smap.entries; pg++)
+        ztl_mpe_set_md(pg, st->pg_addr[pg]);
+    ztl()->smap.byte.magic = APP_MAGIC;
+
+    log_infoa("ztl_mpe_load: seq [%lu] zone [%u] records [%lu] upserts [%lu]",
+              st->seq, st->zone, st->nrec, st->nreplay);
+
     return XZTL_OK;
+
+FREE:
+    ztl_mpe_free(st);
+    pthread_mutex_destroy(&st->mutex);
+    memset(st, 0x0, sizeof(struct ztl_mpe_state));
+    return ret;
+}
+
+/* Applies the logged upserts that are newer than the copy of their page */
+static int ztl_mpe_replay(void) {
+    struct ztl_mpe_state  *st = ztl_mpe_st();
+    struct ztl_mpe_replay *rp;
+    uint64_t               rp_i, pg, old, napplied = 0;
+    int                    ret = XZTL_OK;
+
+    st->replaying = 1;
+    for (rp_i = 0; rp_i < st->nreplay; rp_i++) {
+        rp = &st->replay[rp_i];
+        pg = rp->id / ztl()->smap.ent_per_pg;
+        if (pg >= ztl_mpe_npgs() || rp->rec < st->pg_rec[pg])
+            continue;
+
+        ret = ztl()->map->upsert_fn(rp->id, rp->val, &old, 0);
+        if (ret)
+            break;
+        napplied++;
+    }
+    st->replaying = 0;
+
+    free(st->replay);
+    st->replay    = NULL;
+    st->nreplay   = 0;
+    st->replay_sz = 0;
+
+    if (ret)
+        log_erra("ztl_mpe_replay: err [%d]\n", ret);
+    else
+        log_infoa("ztl_mpe_replay: upserts applied [%lu]", napplied);
+
+    return ret;
 }
 
+/* Writes the pending upserts and the page table. The map calls it once the
+ * dirty pages are written */
 static int ztl_mpe_flush(void) {
+    struct ztl_mpe_state *st = ztl_mpe_st();
+    struct ztl_mpe_head   head;
+    struct xztl_core     *core;
+    int                   ret;
+    get_xztl_core(&core);
+
+    if (!st->buf)
+        return XZTL_ZTL_MPE_ERR;
+
+    pthread_mutex_lock(&st->mutex);
+    if (!st->changed) {
+        pthread_mutex_unlock(&st->mutex);
+        return XZTL_OK;
+    }
+
+    ret = ztl_mpe_put_delta(st);
+    if (!ret) {
+        memset(&head, 0x0, sizeof(struct ztl_mpe_head));
+        head.type   = ZTL_MPE_CKPT;
+        head.nsec   = ztl_mpe_ckpt_sec();
+        head.nbytes = core->media->geo.nbytes;
+
+        memset(st->page, 0x0, (uint64_t)head.nsec * head.nbytes);
+        memcpy(st->page, st->pg_addr, ztl_mpe_npgs() * sizeof(uint64_t));
+        ret = ztl_mpe_put(st, &head, sizeof(struct ztl_mpe_head), st->page,
+                          NULL);
+    }
+    if (!ret) {
+        st->valid   = 1;
+        st->changed = 0;
+        st->ndelta  = 0;
+    }
+    pthread_mutex_unlock(&st->mutex);
+
+    return ret;
+}
+
+static int ztl_mpe_switch(void) {
+    struct ztl_mpe_state        *st = ztl_mpe_st();
+    struct xnvme_spec_znd_descr *zinfo;
+    struct app_group            *grp;
+    struct ztl_mpe_head          head;
+    struct xztl_zn_mcmd          cmd;
+    struct xztl_core            *core;
+    uint64_t                     old_addr, sect;
+    uint32_t                     zone, pg;
+    int                          ret;
+    get_xztl_core(&core);
+
+    grp = ztl()->groups.get_fn(0);
+    if (!st->buf || !grp || !grp->zmd.report)
+        return XZTL_ZTL_MPE_ERR;
+
+    pthread_mutex_lock(&st->mutex);
+
+    /* The current zone has the only copy of the pages until its CKPT */
+    if (!st->valid) {
+        ret = XZTL_ZTL_MPE_ERR;
+        goto UNLOCK;
+    }
+
+    zone = (st->zone + 1) % ZTL_MPE_ZONES;
+
+    memset(&cmd, 0x0, sizeof(struct xztl_zn_mcmd));
+    cmd.opcode      = XZTL_ZONE_MGMT_RESET;
+    cmd.addr.g.grp  = 0;
+    cmd.addr.g.zone = ZTL_METADATA_ZONES + ZTL_ZMD_CKPT_ZONES + zone;
+    cmd.addr.g.sect = ztl_mpe_sect(zone);
+    cmd.nzones      = 1;
+
+    ret = xztl_media_submit_zn(&cmd);
+    if (ret) {
+        log_erra("ztl_mpe_switch: reset zone [%u] err [%d]\n", zone, ret);
+        ret = XZTL_ZTL_MPE_ERR;
+        goto UNLOCK;
+    }
+
+    zinfo = XNVME_ZND_REPORT_DESCR(grp->zmd.report, cmd.addr.g.zone);
+
+    st->valid   = 0;
+    st->changed = 1;
+    st->zone    = zone;
+    st->seq_max = st->seq_max + 1;
+    st->seq     = st->seq_max;
+    st->wptr    = ztl_mpe_sect(zone);
+    st->zend    = st->wptr + zinfo->zcap;
+    st->ndelta  = 0;
+
+    memset(&head, 0x0, sizeof(struct ztl_mpe_head));
+    head.type = ZTL_MPE_SNAP;
+    ret       = ztl_mpe_put(st, &head, sizeof(struct ztl_mpe_head), NULL, NULL);
+
+    for (pg = 0; !ret && pg < ztl_mpe_npgs(); pg++) {
+        old_addr = st->pg_addr[pg];
+        if (!old_addr)
+            continue;
+
+        ret = ztl_mpe_io(st, XZTL_CMD_READ, old_addr, ZTL_MPE_PG_SEC);
+        if (ret)
+            break;
+        memcpy(st->page, st->buf,
+               (uint64_t)ZTL_MPE_PG_SEC * core->media->geo.nbytes);
+
+        memset(&head, 0x0, sizeof(struct ztl_mpe_head));
+        head.type  = ZTL_MPE_PAGE;
+        head.index = pg;
+        head.nsec  = ZTL_MPE_PG_SEC;
+        ret = ztl_mpe_put(st, &head, sizeof(struct ztl_mpe_head), st->page,
+                          &sect);
+        if (!ret)
+            st->pg_addr[pg] = sect + 1;
+    }
+
+    if (ret)
+        log_erra("ztl_mpe_switch: seq [%lu] zone [%u] err [%d]\n", st->seq,
+                 zone, ret);
+    else
+        log_infoa("ztl_mpe_switch: seq [%lu] zone [%u] sectors [%lu]", st->seq,
+                  zone, st->wptr - ztl_mpe_sect(zone));
+
+UNLOCK:
+    pthread_mutex_unlock(&st->mutex);
+    return ret;
+}
+
+static int ztl_mpe_write(uint32_t index, const void *buf, uint64_t *addr) {
+    struct ztl_mpe_state *st = ztl_mpe_st();
+    struct app_map_entry  ent;
+    struct ztl_mpe_head   head;
+    uint64_t              sect;
+    int                   ret;
+
+    if (!st->buf || index >= ztl_mpe_npgs())
+        return XZTL_ZTL_MPE_ERR;
+
+    memset(&head, 0x0, sizeof(struct ztl_mpe_head));
+    head.type  = ZTL_MPE_PAGE;
+    head.index = index;
+    head.nsec  = ZTL_MPE_PG_SEC;
+
+    pthread_mutex_lock(&st->mutex);
+    ret = ztl_mpe_put(st, &head, sizeof(struct ztl_mpe_head), buf, &sect);
+    if (!ret) {
+        st->pg_addr[index] = sect + 1;
+        st->changed        = 1;
+    }
+    pthread_mutex_unlock(&st->mutex);
+
+    if (ret)
+        return ret;
+
+    ent.addr     = 0;
+    ent.g.offset = sect + 1;
+    ent.g.nsec   = ZTL_MPE_PG_SEC;
+    *addr        = ent.addr;
+
     return XZTL_OK;
 }
 
+static int ztl_mpe_read(uint64_t addr, void *buf) {
+    struct ztl_mpe_state *st = ztl_mpe_st();
+    struct app_map_entry  ent;
+    struct xztl_core     *core;
+    int                   ret;
+    get_xztl_core(&core);
+
+    if (!st->buf)
+        return XZTL_ZTL_MPE_ERR;
+
+    ent.addr = addr;
+
+    pthread_mutex_lock(&st->mutex);
+    ret = ztl_mpe_io(st, XZTL_CMD_READ, ent.g.offset, ZTL_MPE_PG_SEC);
+    if (!ret)
+        memcpy(buf, st->buf,
+               (uint64_t)ZTL_MPE_PG_SEC * core->media->geo.nbytes);
+    pthread_mutex_unlock(&st->mutex);
+
+    return ret;
+}
+
+/* Returns XZTL_ZTL_MD_WRITE_FULL when the map must checkpoint */
+static int ztl_mpe_log(uint64_t id, uint64_t val) {
+    struct ztl_mpe_state *st = ztl_mpe_st();
+    int                   ret = XZTL_OK;
+
+    if (!st->buf || st->replaying)
+        return XZTL_OK;
+
+    pthread_mutex_lock(&st->mutex);
+    if (st->delta->count == st->max_delta) {
+        ret = ztl_mpe_put_delta(st);
+        if (ret)
+            goto UNLOCK;
+    }
+
+    st->delta->delta[st->delta->count].id  = id;
+    st->delta->delta[st->delta->count].val = val;
+    st->delta->count++;
+    st->changed = 1;
+
+    if (st->ndelta >= ZTL_MPE_LOG_RECS)
+        ret = XZTL_ZTL_MD_WRITE_FULL;
+
+UNLOCK:
+    pthread_mutex_unlock(&st->mutex);
+    return ret;
+}
+
+/* Writes the pending delta record, upserts logged before the call survive a
+ * crash. Returns XZTL_ZTL_MD_WRITE_FULL when the map must checkpoint */
+static int ztl_mpe_commit(void) {
+    struct ztl_mpe_state *st = ztl_mpe_st();
+    int                   ret;
+
+    if (!st->buf || st->replaying)
+        return XZTL_OK;
+
+    pthread_mutex_lock(&st->mutex);
+    ret = ztl_mpe_put_delta(st);
+    if (!ret && st->ndelta >= ZTL_MPE_LOG_RECS)
+        ret = XZTL_ZTL_MD_WRITE_FULL;
+    pthread_mutex_unlock(&st->mutex);
+
+    return ret;
+}
+
+static void ztl_mpe_close(void) {
+    struct ztl_mpe_state *st = ztl_mpe_st();
+
+    if (!st->buf)
+        return;
+
+    log_infoa("ztl_mpe_close: seq [%lu] zone [%u] sectors [%lu]", st->seq,
+              st->zone, st->wptr - ztl_mpe_sect(st->zone));
+
+    ztl_mpe_free(st);
+    pthread_mutex_destroy(&st->mutex);
+    memset(st, 0x0, sizeof(struct ztl_mpe_state));
+}
+
 static struct map_md_addr *ztl_mpe_get(uint32_t index) {
-    /* TODO: In case we implement recovery at the ZTL:
-     *       If index > n_entries, increase size of table */
+    if (index >= ztl()->smap.entries)
+        return NULL;
 
-    return ((struct map_md_addr *)smap->tbl) + index;
+    return ((struct map_md_addr *)ztl()->smap.tbl) + index;
 }
 
 static void ztl_mpe_mark(uint32_t index) {
@@ -67,7 +819,14 @@ static struct app_mpe_mod ztl_mpe = {.mod_id    = LIBZTL_ZMD,
                                      .flush_fn  = ztl_mpe_flush,
                                      .load_fn   = ztl_mpe_load,
                                      .get_fn    = ztl_mpe_get,
-                                     .mark_fn   = ztl_mpe_mark};
+                                     .mark_fn   = ztl_mpe_mark,
+                                     .write_fn  = ztl_mpe_write,
+                                     .read_fn   = ztl_mpe_read,
+                                     .log_fn    = ztl_mpe_log,
+                                     .commit_fn = ztl_mpe_commit,
+                                     .switch_fn = ztl_mpe_switch,
+                                     .replay_fn = ztl_mpe_replay,
+                                     .close_fn  = ztl_mpe_close};
 
 void ztl_mpe_register(void) {
     ztl_mod_register(ZTLMOD_MPE, LIBZTL_MPE, &ztl_mpe);
@@ -21,15 +21,19 @@
 #include <libxnvme_znd.h>
 #include <stdlib.h>
 #include <sys/queue.h>
-#include <xztl.h>
+#include <xztl.h>
+
 #include <xztl-mods.h>
 #include <xztl-pro.h>
 #include <xztl-stats.h>
 #include <xztl-metadata.h>
 
-static struct ztl_pro_node_grp *_ztl_pro_grp_new_pro(int32_t  node_num,
-                                                     uint32_t entries) {
+static struct ztl_pro_node_grp *_ztl_pro_grp_new_pro(struct app_group *grp,
+                                                     int32_t  node_num,
+                                                     uint32_t entries,
+                                                     uint32_t id_base) {
     struct ztl_pro_node_grp *pro;
+    uint32_t                 node_i;
 
     pro = calloc(1, sizeof(struct ztl_pro_node_grp));
     if (!pro) {
@@ -37,13 +41,37 @@ static struct ztl_pro_node_grp *_ztl_pro_grp_new_pro(int32_t  node_num,
         return NULL;
     }
 
-    pro->nnodes = node_num;
-    pro->vnodes = calloc(node_num, sizeof(struct ztl_pro_node));
+    /* Slot nodes followed by the narrow nodes of each slot */
+    pro->nslots = node_num;
+    pro->nnodes = node_num * (1 + ZTL_PRO_NODE_SUBS);
+
+    /* Node ids of group N follow the last node of group N-1 */
+    pro->id_base = id_base;
+    pro->vnodes = calloc(pro->nnodes, sizeof(struct ztl_pro_node));
     if (!pro->vnodes) {
         log_err("Mem wrong: Calloc ztl_pro_node error!\n");
         goto free_pro;
     }
 
+    for (node_i = 0; node_i < pro->nnodes; node_i++) {
+        pro->vnodes[node_i].id     = pro->id_base + node_i;
+        pro->vnodes[node_i].grp    = grp;
+        pro->vnodes[node_i].level  = -1;
+        pro->vnodes[node_i].stripe = 1;
+        pro->vnodes[node_i].status = XZTL_ZMD_NODE_OFF;
+        pro->vnodes[node_i].slot   = (node_i < pro->nslots)
+                                         ? node_i
+                                         : (node_i - pro->nslots) /
+                                               ZTL_PRO_NODE_SUBS;
+    }
+
+    pro->slot_width = calloc(node_num, sizeof(uint8_t));
+    pro->slot_free  = calloc(node_num, sizeof(uint8_t));
+    if (!pro->slot_width || !pro->slot_free) {
+        log_err("Mem wrong: Calloc slot state error!\n");
+        goto free_nodes;
+    }
+
     pro->nzones = entries;
     pro->vzones = calloc(entries, sizeof(struct ztl_pro_zone));
     if (!pro->vzones) {
@@ -61,13 +89,20 @@ static struct ztl_pro_node_grp *_ztl_pro_grp_new_pro(int32_t  node_num,
     TAILQ_INIT(&pro->free_head);
     TAILQ_INIT(&pro->used_head);
     TAILQ_INIT(&pro->full_head);
+    TAILQ_INIT(&pro->dirty_head);
+    for (node_i = 0; node_i < ZTL_PRO_NODE_ORDERS; node_i++)
+        TAILQ_INIT(&pro->sfree_head[node_i]);
 
-    pro->nfree = 0;
+    pro->nfree  = 0;
+    pro->ndirty = 0;
+    pro->nreset = 0;
     return pro;
 
 free_all:
     free(pro->vzones);
 free_nodes:
+    free(pro->slot_width);
+    free(pro->slot_free);
     free(pro->vnodes);
 free_pro:
     free(pro);
@@ -81,25 +116,47 @@ static void _ztl_pro_grp_destroy_pro(struct ztl_pro_node_grp *pro) {
     pthread_spin_destroy(&pro->spin_used);
 
     free(pro->vzones);
+    free(pro->slot_width);
+    free(pro->slot_free);
     free(pro->vnodes);
 }
 
 int ztl_pro_grp_get(struct app_group *grp, struct app_pro_addr *ctx,
                     uint32_t num, int32_t node_id, uint32_t start) {
     struct ztl_pro_node_grp *pro  = (struct ztl_pro_node_grp *)grp->pro;
-    struct ztl_pro_node     *node = &pro->vnodes[node_id];
+    struct ztl_pro_node     *node = &pro->vnodes[node_id - pro->id_base];
     struct ztl_pro_zone     *zone;
 
-    uint64_t num_zn   = num / ZTL_PRO_ZONE_NUM_INNODE;
-    int      addition = num % ZTL_PRO_ZONE_NUM_INNODE;
-    int      zn_i     = start % ZTL_PRO_ZONE_NUM_INNODE;
+    /* Units of the node are striped over its zones 'stripe' units at a
+     * time. Address 0 is the zone of the first stripe unit touched */
+    uint32_t stripe = node->stripe;
+    uint64_t unit   = start / stripe;
+    uint64_t off    = start;
+    uint64_t end    = (uint64_t)start + num;
+    uint64_t run;
+    uint32_t zn_i, nzn;
+
+    nzn = (end - 1) / stripe - unit + 1;
+    if (nzn > node->nzones)
+        nzn = node->nzones;
+
+    for (zn_i = 0; zn_i < nzn; zn_i++) {
+        zone = node->vzones[(unit + zn_i) % node->nzones];
+        ctx->addr[ctx->naddr + zn_i].addr   = zone->addr.addr;
+        ctx->addr[ctx->naddr + zn_i].g.sect = zone->zmd_entry->wptr_inflight;
+        ctx->nsec[ctx->naddr + zn_i]        = 0;
+    }
 
-    while (num) {
-        int i                        = (addition == 0) ? 0 : 1;
-        zone                         = node->vzones[zn_i];
-        ctx->addr[ctx->naddr].addr   = zone->addr.addr;
-        ctx->addr[ctx->naddr].g.sect = zone->zmd_entry->wptr_inflight;
-        ctx->nsec[ctx->naddr]        = (num_zn + i) * ZTL_IO_SEC_MCMD;
+    while (off < end) {
+        run = stripe - off % stripe;
+        run = (run > end - off) ? end - off : run;
+        zn_i = (off / stripe - unit) % node->nzones;
+        ctx->nsec[ctx->naddr + zn_i] += run * ZTL_IO_SEC_MCMD;
+        off += run;
+    }
+
+    for (zn_i = 0; zn_i < nzn; zn_i++) {
+        zone = node->vzones[(unit + zn_i) % node->nzones];
         zone->zmd_entry->wptr_inflight += ctx->nsec[ctx->naddr];
 
         ZDEBUG(ZDEBUG_PRO,
@@ -109,12 +166,7 @@ int ztl_pro_grp_get(struct app_group *grp, struct app_pro_addr *ctx,
                zone->zmd_entry->wptr, zone->zmd_entry->wptr_inflight,
                ctx->nsec[ctx->naddr]);
 
-        zn_i = (zn_i + 1) % ZTL_PRO_ZONE_NUM_INNODE;
-        num -= (num_zn + i);
         ctx->naddr++;
-
-        if (addition)
-            addition--;
     }
 
     return XZTL_OK;
@@ -125,155 +177,438 @@ void ztl_pro_grp_free(struct app_group *grp, uint32_t zone_i, uint32_t nsec) {
     struct ztl_pro_node_grp *pro;
 
     pro  = (struct ztl_pro_node_grp *)grp->pro;
-    int     metadata_zone_num = get_metadata_zone_num();
-    zone = &(pro->vzones[zone_i - metadata_zone_num]);
+    zone = &(pro->vzones[zone_i - pro->rsvd]);
 
     /* Move the write pointer */
     /* A single thread touches the write pointer, no lock needed */
     zone->zmd_entry->wptr += nsec;
+    ztl()->zmd->mark_fn(grp, zone_i);
 
     ZDEBUG(ZDEBUG_PRO, "ztl_pro_grp_free: [%d/%d/0x%lx/0x%lx/0x%lx] ",
            zone->addr.g.grp, zone->addr.g.zone, (uint64_t)zone->addr.g.sect,
            zone->zmd_entry->wptr, zone->zmd_entry->wptr_inflight);
 }
 
+/* Keeps the level and the width of a node in the metadata of its zones, a
+ * negative level clears them. The zone metadata checkpoint persists them */
+void ztl_pro_grp_node_level(struct ztl_pro_node *node, int32_t level) {
+    struct app_zmd_entry *zmde;
+    uint32_t              zn_i;
+
+    node->level = level;
+    for (zn_i = 0; zn_i < node->nzones; zn_i++) {
+        zmde = node->vzones[zn_i]->zmd_entry;
+        if (level < 0) {
+            zmde->flags &= ~XZTL_ZMD_USED;
+            zmde->level = 0;
+            zmde->width = 0;
+        } else {
+            zmde->flags |= XZTL_ZMD_USED;
+            zmde->level = level;
+            zmde->width = node->nzones;
+        }
+        ztl()->zmd->mark_fn(node->grp, zmde->addr.g.zone);
+    }
+}
+
+static inline uint32_t _ztl_pro_grp_order(uint32_t width) {
+    return __builtin_ctz(width / ZTL_PRO_NODE_WIDTH_MIN);
+}
+
+/* Units of a node are striped evenly over its zones, every zone holds the
+ * units of the smallest one. Rounded to the widest stripe unit, so the last
+ * stripe of every zone is whole */
+static uint64_t _ztl_pro_node_capacity(struct ztl_pro_node *node) {
+    uint64_t zcap = UINT64_MAX;
+    uint32_t zn_i;
+
+    for (zn_i = 0; zn_i < node->nzones; zn_i++)
+        zcap = MIN(zcap, node->vzones[zn_i]->capacity / ZTL_IO_SEC_MCMD);
+    zcap -= zcap % ZTL_IO_STRIPE_MAX;
+
+    return zcap * node->nzones;
+}
+
+/* Loads the node state from the write pointers of its zones. Finished zones
+ * and written units past the node capacity make the node full */
+static void _ztl_pro_grp_node_load(struct ztl_pro_node *node) {
+    struct ztl_pro_zone *zone;
+    uint64_t             sec_num = 0;
+    uint32_t             zn_i, full = 0;
+
+    node->capacity = _ztl_pro_node_capacity(node);
+
+    for (zn_i = 0; zn_i < node->nzones; zn_i++) {
+        zone = node->vzones[zn_i];
+        if (zone->state == XNVME_SPEC_ZND_STATE_FULL ||
+            zone->zmd_entry->wptr >= zone->addr.g.sect + zone->capacity) {
+            sec_num += zone->capacity;
+            full++;
+        } else {
+            sec_num += zone->zmd_entry->wptr - zone->addr.g.sect;
+        }
+    }
+
+    node->optimal_write_sec_used = sec_num / ZTL_IO_SEC_MCMD;
+    if (!sec_num) {
+        node->status = XZTL_ZMD_NODE_FREE;
+    } else if (full == node->nzones ||
+               node->optimal_write_sec_used >= node->capacity) {
+        node->status                 = XZTL_ZMD_NODE_FULL;
+        node->optimal_write_sec_used = node->capacity;
+    } else {
+        node->status = XZTL_ZMD_NODE_USED;
+    }
+    node->optimal_write_sec_left =
+        node->capacity - node->optimal_write_sec_used;
+}
+
+/* Builds the narrow nodes of a slot from the zones of the slot node */
+static void _ztl_pro_grp_slot_subs(struct ztl_pro_node_grp *pro,
+                                   uint32_t slot, uint32_t width) {
+    struct ztl_pro_node *snode = &pro->vnodes[slot];
+    struct ztl_pro_node *node;
+    uint32_t             sub_i, zn_i;
+
+    for (sub_i = 0; sub_i < ZTL_PRO_ZONE_NUM_INNODE / width; sub_i++) {
+        node = &pro->vnodes[pro->nslots + slot * ZTL_PRO_NODE_SUBS +
+                            sub_i * (width / ZTL_PRO_NODE_WIDTH_MIN)];
+        node->nzones   = width;
+        node->level    = -1;
+        node->stripe   = 1;
+        node->nr_valid = 0;
+        for (zn_i = 0; zn_i < width; zn_i++)
+            node->vzones[zn_i] = snode->vzones[sub_i * width + zn_i];
+        node->capacity = _ztl_pro_node_capacity(node);
+    }
+}
+
+/* Splits a free slot in narrow free nodes, spin_free must be held */
+static void _ztl_pro_grp_split(struct ztl_pro_node_grp *pro, uint32_t slot,
+                               uint32_t width) {
+    struct ztl_pro_node *node;
+    uint32_t             sub_i, order = _ztl_pro_grp_order(width);
+
+    TAILQ_REMOVE(&pro->free_head, &pro->vnodes[slot], fentry);
+    pro->vnodes[slot].status = XZTL_ZMD_NODE_OFF;
+    ATOMIC_SUB(&pro->nfree, 1);
+
+    _ztl_pro_grp_slot_subs(pro, slot, width);
+    for (sub_i = 0; sub_i < ZTL_PRO_ZONE_NUM_INNODE / width; sub_i++) {
+        node = &pro->vnodes[pro->nslots + slot * ZTL_PRO_NODE_SUBS +
+                            sub_i * (width / ZTL_PRO_NODE_WIDTH_MIN)];
+        node->status                 = XZTL_ZMD_NODE_FREE;
+        node->optimal_write_sec_left = node->capacity;
+        node->optimal_write_sec_used = 0;
+        TAILQ_INSERT_TAIL(&pro->sfree_head[order], node, fentry);
+    }
+
+    pro->slot_width[slot] = width;
+    pro->slot_free[slot]  = ZTL_PRO_ZONE_NUM_INNODE / width;
+}
+
+/* Takes a free node of 'width' zones, spin_free must be held */
+static struct ztl_pro_node *_ztl_pro_grp_take(struct ztl_pro_node_grp *pro,
+                                              uint32_t width) {
+    struct ztl_pro_node *node;
+    uint32_t             order;
+
+    if (width == ZTL_PRO_ZONE_NUM_INNODE) {
+        node = TAILQ_FIRST(&pro->free_head);
+        if (node) {
+            TAILQ_REMOVE(&pro->free_head, node, fentry);
+            ATOMIC_SUB(&pro->nfree, 1);
+        }
+        return node;
+    }
+
+    order = _ztl_pro_grp_order(width);
+    node  = TAILQ_FIRST(&pro->sfree_head[order]);
+    if (!node) {
+        node = TAILQ_FIRST(&pro->free_head);
+        if (!node)
+            return NULL;
+        _ztl_pro_grp_split(pro, node->slot, width);
+        node = TAILQ_FIRST(&pro->sfree_head[order]);
+    }
+
+    TAILQ_REMOVE(&pro->sfree_head[order], node, fentry);
+    pro->slot_free[node->slot]--;
+
+    return node;
+}
+
 int ztl_pro_grp_get_node(struct ztl_queue_pool   *q,
-                         struct ztl_pro_node_grp *pro) {
+                         struct ztl_pro_node_grp *pro, uint32_t width) {
     if (!q->node || q->node->optimal_write_sec_left == 0) {
+        /* The full node may belong to another group than 'pro' */
         if (q->node) {
-            struct ztl_pro_node *tmp = &pro->vnodes[q->node->id];
-            pthread_spin_lock(&pro->spin_used);
-            TAILQ_REMOVE(&pro->used_head, tmp, fentry);
-            pthread_spin_unlock(&pro->spin_used);
-
-            pthread_spin_lock(&pro->spin_full);
-            TAILQ_INSERT_TAIL(&pro->full_head, tmp, fentry);
-            pthread_spin_unlock(&pro->spin_full);
+            struct ztl_pro_node     *tmp  = q->node;
+            struct ztl_pro_node_grp *npro = tmp->grp->pro;
+            pthread_spin_lock(&npro->spin_used);
+            TAILQ_REMOVE(&npro->used_head, tmp, fentry);
+            pthread_spin_unlock(&npro->spin_used);
+
+            /* A retired node is full before its last piece */
+            tmp->status = XZTL_ZMD_NODE_FULL;
+            tmp->owner  = NULL;
+
+            pthread_spin_lock(&npro->spin_full);
+            TAILQ_INSERT_TAIL(&npro->full_head, tmp, fentry);
+            pthread_spin_unlock(&npro->spin_full);
+            q->node = NULL;
         }
 
+        /* Take the node under a single lock, writer lanes race here */
         pthread_spin_lock(&pro->spin_free);
-        q->node = TAILQ_FIRST(&pro->free_head);
-
-        if (!q->node) {
-            log_erra("_ztl_io_get_node: error! No more nodes!");
-            pthread_spin_unlock(&pro->spin_free);
-            return XZTL_ZTL_PROV_ERR;
-        }
+        q->node = _ztl_pro_grp_take(pro, width);
         pthread_spin_unlock(&pro->spin_free);
 
-        pthread_spin_lock(&pro->spin_free);
-        TAILQ_REMOVE(&pro->free_head, q->node, fentry);
-        pthread_spin_unlock(&pro->spin_free);
+        if (!q->node)
+            return XZTL_ZTL_PROV_ERR;
 
         pthread_spin_lock(&pro->spin_used);
         TAILQ_INSERT_TAIL(&pro->used_head, q->node, fentry);
 
         q->node->status = XZTL_ZMD_NODE_USED;
+        q->node->stripe = q->stripe;
+        q->node->wstate = ZTL_PRO_NODE_WRITING;
+        q->node->owner  = q;
         pthread_spin_unlock(&pro->spin_used);
-        ATOMIC_SUB(&pro->nfree, 1);
     }
     return XZTL_OK;
 }
 
-int ztl_pro_grp_node_init(struct app_group *grp) {
-    struct xnvme_spec_znd_descr *zinfo;
-    struct xnvme_znd_report     *rep;
-    struct ztl_pro_zone         *zone;
-    struct app_zmd_entry        *zmde;
-    struct ztl_pro_node_grp     *pro;
+/* Returns a reset node to the free lists. A split slot whose narrow nodes
+ * are all free becomes a free slot node again */
+void ztl_pro_grp_put_node(struct ztl_pro_node_grp *pro,
+                          struct ztl_pro_node     *node) {
+    struct ztl_pro_node *snode = &pro->vnodes[node->slot];
+    struct ztl_pro_node *sub;
+    uint32_t             width, order, sub_i;
 
-    struct xztl_core *core;
-    get_xztl_core(&core);
+    pthread_spin_lock(&pro->spin_free);
 
-    int zone_i, node_i, zone_num_in_node;
+    if (node->nzones == ZTL_PRO_ZONE_NUM_INNODE) {
+        TAILQ_INSERT_TAIL(&pro->free_head, node, fentry);
+        ATOMIC_ADD(&pro->nfree, 1);
+        goto UNLOCK;
+    }
 
-    int     metadata_zone_num = get_metadata_zone_num();
-    int32_t node_num =
-        (grp->zmd.entries - metadata_zone_num) / ZTL_PRO_ZONE_NUM_INNODE;
+    width = node->nzones;
+    order = _ztl_pro_grp_order(width);
+    TAILQ_INSERT_TAIL(&pro->sfree_head[order], node, fentry);
 
-    pro = _ztl_pro_grp_new_pro(node_num, grp->zmd.entries);
-    if (!pro)
-        return XZTL_ZTL_PROV_ERR;
+    if (++pro->slot_free[node->slot] < ZTL_PRO_ZONE_NUM_INNODE / width)
+        goto UNLOCK;
 
-    grp->pro = pro;
-    rep      = grp->zmd.report;
-
-    node_i           = 0;
-    zone_num_in_node = 0;
-
-    int full_count = 0;
-    int sec_num    = 0;
-
-    for (zone_i = metadata_zone_num; zone_i < grp->zmd.entries; zone_i++) {
-        if (zone_num_in_node == ZTL_PRO_ZONE_NUM_INNODE) {
-            pro->vnodes[node_i].id       = node_i;
-            pro->vnodes[node_i].nr_valid = 0;
-            pro->vnodes[node_i].level    = -1;
-
-            if (full_count == ZTL_PRO_ZONE_NUM_INNODE) {
-                pro->vnodes[node_i].status                 = XZTL_ZMD_NODE_FULL;
-                pro->vnodes[node_i].optimal_write_sec_left = 0;
-                pro->vnodes[node_i].optimal_write_sec_used =
-                    ZTL_PRO_OPT_SEC_NUM_INNODE;
-                TAILQ_INSERT_TAIL(&pro->full_head, &pro->vnodes[node_i],
-                                  fentry);
-            } else if (sec_num == 0) {
-                pro->vnodes[node_i].status = XZTL_ZMD_NODE_FREE;
-                pro->vnodes[node_i].optimal_write_sec_left =
-                    ZTL_PRO_OPT_SEC_NUM_INNODE;
-                pro->vnodes[node_i].optimal_write_sec_used = 0;
-                TAILQ_INSERT_TAIL(&pro->free_head, &pro->vnodes[node_i],
-                                  fentry);
-                ATOMIC_ADD(&pro->nfree, 1);
-            } else {
-                pro->vnodes[node_i].status = XZTL_ZMD_NODE_USED;
-                pro->vnodes[node_i].optimal_write_sec_left =
-                    (ZTL_PRO_OPT_SEC_NUM_INNODE - sec_num / ZTL_IO_SEC_MCMD);
-                pro->vnodes[node_i].optimal_write_sec_used =
-                    sec_num / ZTL_IO_SEC_MCMD;
-                TAILQ_INSERT_TAIL(&pro->used_head, &pro->vnodes[node_i],
-                                  fentry);
-            }
-
-            node_i++;
-            zone_num_in_node = 0;
-            sec_num          = 0;
-
-            if (grp->zmd.entries - zone_i + 1 < ZTL_PRO_ZONE_NUM_INNODE) {
-                log_infoa("ztl_pro_grp_node_init: Left %d zones\n",
-                          grp->zmd.entries - zone_i + 1);
-                break;
-            }
+    for (sub_i = 0; sub_i < ZTL_PRO_ZONE_NUM_INNODE / width; sub_i++) {
+        sub = &pro->vnodes[pro->nslots + node->slot * ZTL_PRO_NODE_SUBS +
+                           sub_i * (width / ZTL_PRO_NODE_WIDTH_MIN)];
+        TAILQ_REMOVE(&pro->sfree_head[order], sub, fentry);
+        sub->status = XZTL_ZMD_NODE_OFF;
+    }
+
+    pro->slot_width[node->slot] = 0;
+    pro->slot_free[node->slot]  = 0;
+
+    snode->status                 = XZTL_ZMD_NODE_FREE;
+    snode->level                  = -1;
+    snode->nr_valid               = 0;
+    snode->optimal_write_sec_left = snode->capacity;
+    snode->optimal_write_sec_used = 0;
+    TAILQ_INSERT_TAIL(&pro->free_head, snode, fentry);
+    ATOMIC_ADD(&pro->nfree, 1);
+
+UNLOCK:
+    pthread_spin_unlock(&pro->spin_free);
+}
+
+/* A full node without valid data waits in the dirty list until it is reset.
+ * It stays in the full list, ztl_mgmt_node_reset takes it from there */
+void ztl_pro_grp_put_dirty(struct ztl_pro_node_grp *pro,
+                           struct ztl_pro_node     *node) {
+    pthread_spin_lock(&pro->spin_full);
+    TAILQ_INSERT_TAIL(&pro->dirty_head, node, dentry);
+    pro->ndirty++;
+    pthread_spin_unlock(&pro->spin_full);
+}
 
-            full_count = 0;
+struct ztl_pro_node *ztl_pro_grp_take_dirty(struct ztl_pro_node_grp *pro) {
+    struct ztl_pro_node *node;
+
+    pthread_spin_lock(&pro->spin_full);
+    node = TAILQ_FIRST(&pro->dirty_head);
+    if (node) {
+        TAILQ_REMOVE(&pro->dirty_head, node, dentry);
+        pro->ndirty--;
+    }
+    pthread_spin_unlock(&pro->spin_full);
+
+    return node;
+}
+
+/* Moves a node to the list of its status */
+static void _ztl_pro_grp_list(struct ztl_pro_node_grp *pro,
+                              struct ztl_pro_node *node, int insert) {
+    pthread_spinlock_t *spin;
+
+    switch (node->status) {
+        case XZTL_ZMD_NODE_FULL:
+            spin = &pro->spin_full;
+            pthread_spin_lock(spin);
+            if (insert)
+                TAILQ_INSERT_TAIL(&pro->full_head, node, fentry);
+            else
+                TAILQ_REMOVE(&pro->full_head, node, fentry);
+            break;
+        case XZTL_ZMD_NODE_USED:
+            spin = &pro->spin_used;
+            pthread_spin_lock(spin);
+            if (insert)
+                TAILQ_INSERT_TAIL(&pro->used_head, node, fentry);
+            else
+                TAILQ_REMOVE(&pro->used_head, node, fentry);
+            break;
+        default:
+            return;
+    }
+
+    pthread_spin_unlock(spin);
+}
+
+/* Narrow nodes are not known at startup, their slot is loaded as a single
+ * node. The first recovered mapping of a narrow node splits the slot again
+ * with the width kept in the metadata of the node zones, and rebuilds the
+ * state of each narrow node from its zones. A node whose zones do not hold
+ * its width cannot be rebuilt */
+int ztl_pro_grp_node_restore(struct ztl_pro_node_grp *pro, uint32_t node_id) {
+    struct ztl_pro_node  *snode, *node;
+    struct app_zmd_entry *zmde;
+    uint32_t              slot, sub, sub_i, width;
+
+    node_id -= pro->id_base;
+    if (node_id < pro->nslots) {
+        snode = &pro->vnodes[node_id];
+        if (snode->status == XZTL_ZMD_NODE_OFF)
+            return XZTL_OK;
+
+        width = snode->vzones[0]->zmd_entry->width;
+        if (width && width != ZTL_PRO_ZONE_NUM_INNODE)
+            goto WIDTH_ERR;
+        return XZTL_OK;
+    }
+
+    slot  = (node_id - pro->nslots) / ZTL_PRO_NODE_SUBS;
+    sub   = (node_id - pro->nslots) % ZTL_PRO_NODE_SUBS;
+    snode = &pro->vnodes[slot];
+    width = 0;
+
+    /* The zones of a slot with invalid metadata are not loaded */
+    if (snode->status == XZTL_ZMD_NODE_OFF && !pro->slot_width[slot])
+        goto WIDTH_ERR;
+
+    /* The first zone of a narrow node is 'sub' minimum widths in the slot */
+    zmde  = snode->vzones[sub * ZTL_PRO_NODE_WIDTH_MIN]->zmd_entry;
+    width = zmde->width;
+    if (width < ZTL_PRO_NODE_WIDTH_MIN || width >= ZTL_PRO_ZONE_NUM_INNODE ||
+        (width & (width - 1)) || sub % (width / ZTL_PRO_NODE_WIDTH_MIN))
+        goto WIDTH_ERR;
+
+    if (pro->slot_width[slot]) {
+        if (pro->slot_width[slot] != width)
+            goto WIDTH_ERR;
+        return XZTL_OK;
+    }
+
+    if (snode->status == XZTL_ZMD_NODE_FREE)
+        goto WIDTH_ERR;
+
+    /* The zones of the slot node were charged, see ztl_pro_budget_init */
+    _ztl_pro_grp_list(pro, snode, 0);
+    ztl_pro_node_inactive(snode);
+    snode->status = XZTL_ZMD_NODE_OFF;
+    _ztl_pro_grp_slot_subs(pro, slot, width);
+
+    pthread_spin_lock(&pro->spin_free);
+    pro->slot_width[slot] = width;
+    pro->slot_free[slot]  = 0;
+    pthread_spin_unlock(&pro->spin_free);
+
+    for (sub_i = 0; sub_i < ZTL_PRO_ZONE_NUM_INNODE / width; sub_i++) {
+        node = &pro->vnodes[pro->nslots + slot * ZTL_PRO_NODE_SUBS +
+                            sub_i * (width / ZTL_PRO_NODE_WIDTH_MIN)];
+
+        _ztl_pro_grp_node_load(node);
+        if (node->status == XZTL_ZMD_NODE_FREE) {
+            ztl_pro_grp_put_node(pro, node);
+            continue;
         }
 
-        zmde = ztl()->zmd->get_fn(grp, zone_i, 0);
+        zmde = node->vzones[0]->zmd_entry;
+        if (zmde->flags & XZTL_ZMD_USED)
+            node->level = zmde->level;
+        _ztl_pro_grp_list(pro, node, 1);
+
+        /* A full node releases its zones as when its writer is done */
+        ztl_pro_node_active(node);
+        if (node->status == XZTL_ZMD_NODE_FULL)
+            ztl()->pro->put_node_fn(node);
+    }
+
+    return XZTL_OK;
+
+WIDTH_ERR:
+    log_erra("ztl_pro_grp_node_restore: node [%u] zones do not hold its "
+             "width [%u]",
+             pro->id_base + node_id, width);
+    return XZTL_ZTL_PROV_ERR;
+}
+
+/* Loads a slot node from its zones, slot N holds the ZTL_PRO_ZONE_NUM_INNODE
+ * zones from the group 'rsvd' + N * ZTL_PRO_ZONE_NUM_INNODE. A zone with
+ * invalid metadata leaves the node OFF. Written nodes get back the level kept
+ * in the metadata of their first zone */
+static void _ztl_pro_grp_slot_load(struct app_group *grp, uint32_t slot) {
+    struct ztl_pro_node_grp     *pro  = (struct ztl_pro_node_grp *)grp->pro;
+    struct ztl_pro_node         *node = &pro->vnodes[slot];
+    struct xnvme_spec_znd_descr *zinfo;
+    struct ztl_pro_zone         *zone;
+    struct app_zmd_entry        *zmde;
+    uint32_t                     zn_i, zone_i;
+
+    node->nr_valid = 0;
+    node->level    = -1;
+    node->stripe   = 1;
+    node->nzones   = ZTL_PRO_ZONE_NUM_INNODE;
+
+    for (zn_i = 0; zn_i < ZTL_PRO_ZONE_NUM_INNODE; zn_i++) {
+        zone_i = pro->rsvd + slot * ZTL_PRO_ZONE_NUM_INNODE + zn_i;
+        zmde   = ztl()->zmd->get_fn(grp, zone_i, 0);
 
         if (zmde->addr.g.zone != zone_i || zmde->addr.g.grp != grp->id) {
             log_erra(
                 "ztl_pro_grp_node_init: zmd entry address does not match "
                 "[%d/%d] [%d/%d]",
                 zmde->addr.g.grp, zmde->addr.g.zone, grp->id, zone_i);
-            continue;
+            return;
         }
 
         if ((zmde->flags & XZTL_ZMD_RSVD) || !(zmde->flags & XZTL_ZMD_AVLB)) {
             log_infoa("ztl_pro_grp_node_init: flags [%x]\n", zmde->flags);
-            continue;
+            return;
         }
 
-        /* We are getting the full report here */
-        zinfo = XNVME_ZND_REPORT_DESCR(
-            rep, grp->id * core->media->geo.zn_grp + zone_i);
+        /* The group report is indexed by zone of the group */
+        zinfo = XNVME_ZND_REPORT_DESCR(grp->zmd.report, zone_i);
 
-        zone            = &pro->vzones[zone_i - metadata_zone_num];
+        zone            = &pro->vzones[zone_i - pro->rsvd];
         zone->addr.addr = zmde->addr.addr;
         zone->capacity  = zinfo->zcap;
         zone->state     = zinfo->zs;
         zone->zmd_entry = zmde;
         zone->lock      = 0;
-        pro->vnodes[node_i].vzones[zone_num_in_node++] = zone;
+        node->vzones[zn_i] = zone;
 
         switch (zinfo->zs) {
             case XNVME_SPEC_ZND_STATE_EMPTY:
@@ -297,13 +632,6 @@ int ztl_pro_grp_node_init(struct app_group *grp) {
             case XNVME_SPEC_ZND_STATE_CLOSED:
             case XNVME_SPEC_ZND_STATE_FULL:
 
-                if (zinfo->zs == XNVME_SPEC_ZND_STATE_FULL) {
-                    full_count++;
-                    sec_num += zinfo->zcap;
-                } else {
-                    sec_num += zinfo->wp - zone->addr.g.sect;
-                }
-
                 ZDEBUG(ZDEBUG_PRO_GRP,
                        " ztl_pro_grp_node_init: ZINFO NOT CORRECT [%d/%d] , "
                        "status [%d]\n",
@@ -314,12 +642,97 @@ int ztl_pro_grp_node_init(struct app_group *grp) {
                 log_infoa(
                     "ztl_pro_grp_node_init: Unknown zone condition. zone [%d], "
                     "zs [%d]",
-                    grp->id * core->media->geo.zn_grp + zone_i, zinfo->zs);
+                    zone_i, zinfo->zs);
         }
 
         zmde->wptr = zmde->wptr_inflight = zinfo->wp;
     }
-    log_infoa("ztl_pro_grp_node_init: Started. Group [%d].", grp->id);
+
+    _ztl_pro_grp_node_load(node);
+    if (!node->capacity) {
+        log_erra("ztl_pro_grp_node_init: node [%u] has no capacity",
+                 node->id);
+        node->status = XZTL_ZMD_NODE_OFF;
+        return;
+    }
+
+    zmde = node->vzones[0]->zmd_entry;
+    if (node->status != XZTL_ZMD_NODE_FREE && (zmde->flags & XZTL_ZMD_USED))
+        node->level = zmde->level;
+}
+
+static int _ztl_pro_grp_load_range(void *arg, uint64_t first, uint64_t last) {
+    uint64_t slot;
+
+    for (slot = first; slot < last; slot++)
+        _ztl_pro_grp_slot_load((struct app_group *)arg, slot);
+
+    return XZTL_OK;
+}
+
+/* Adds a loaded slot node to the list of its status */
+static void _ztl_pro_grp_node_add(struct ztl_pro_node_grp *pro,
+                                  struct ztl_pro_node     *node) {
+    if (node->status == XZTL_ZMD_NODE_OFF)
+        return;
+
+    if (node->status == XZTL_ZMD_NODE_FREE) {
+        TAILQ_INSERT_TAIL(&pro->free_head, node, fentry);
+        ATOMIC_ADD(&pro->nfree, 1);
+    } else {
+        _ztl_pro_grp_list(pro, node, 1);
+    }
+}
+
+/* Slots are loaded by the startup threads, the lists are built afterwards in
+ * slot order */
+int ztl_pro_grp_node_init(struct app_group *grp, uint32_t id_base) {
+    struct ztl_pro_node_grp *pro;
+    struct xztl_par          par;
+    struct timespec          ts;
+    uint64_t                 us_start, us_end;
+    uint32_t                 slot;
+    int                      ret;
+
+    int     metadata_zone_num = get_rsvd_zone_num(grp->id);
+    int32_t node_num =
+        (grp->zmd.entries - metadata_zone_num) / ZTL_PRO_ZONE_NUM_INNODE;
+    int32_t left = grp->zmd.entries - metadata_zone_num -
+                   node_num * ZTL_PRO_ZONE_NUM_INNODE;
+
+    pro = _ztl_pro_grp_new_pro(grp, node_num, grp->zmd.entries, id_base);
+    if (!pro)
+        return XZTL_ZTL_PROV_ERR;
+
+    pro->rsvd = metadata_zone_num;
+
+    grp->pro = pro;
+
+    if (left)
+        log_infoa("ztl_pro_grp_node_init: Left %d zones\n", left);
+
+    GET_MICROSECONDS(us_start, ts);
+
+    ret = xztl_par_start(&par, pro->nslots, ZTL_PRO_INIT_SLOTS,
+                         _ztl_pro_grp_load_range, grp);
+    if (!ret)
+        ret = xztl_par_join(&par);
+    if (ret) {
+        log_erra("ztl_pro_grp_node_init: slot load failed [%d]", ret);
+        _ztl_pro_grp_destroy_pro(pro);
+        free(pro);
+        grp->pro = NULL;
+        return XZTL_ZTL_PROV_ERR;
+    }
+
+    for (slot = 0; slot < pro->nslots; slot++)
+        _ztl_pro_grp_node_add(pro, &pro->vnodes[slot]);
+
+    GET_MICROSECONDS(us_end, ts);
+
+    log_infoa("ztl_pro_grp_node_init: Started. Group [%d] slots [%u] "
+              "threads [%u] [%lu us].",
+              grp->id, pro->nslots, par.nthreads, us_end - us_start);
     return XZTL_OK;
 }
 
@@ -17,16 +17,36 @@
  * limitations under the License.
 */
 
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <sys/queue.h>
+#include <unistd.h>
+#include <xztl-media.h>
 #include <xztl-mempool.h>
 #include <xztl.h>
 #include <xztl-pro.h>
 #include <xztl-metadata.h>
 
-extern uint16_t    app_ngrps;
-struct app_group **glist;
-static uint16_t    cur_grp[ZTL_PRO_TYPES];
+/* Open and active zones of a device. Writers making room serialize on
+ * 'mutex', counters are released without it */
+struct ztl_pro_budget {
+    uint32_t          max_open;   /* 0 is no limit */
+    uint32_t          max_active; /* 0 is no limit */
+    volatile uint32_t nopen;
+    volatile uint32_t nactive;
+    pthread_mutex_t   mutex;
+};
+
+struct ztl_pro_state {
+    struct app_group    **glist;
+    uint16_t              cur_grp[ZTL_PRO_TYPES];
+    struct ztl_pro_budget budget[XZTL_MEDIA_MAX_DEV];
+};
+
+static struct ztl_pro_state *ztl_pro_st(void) {
+    return xztl_instance_state(XZTL_STATE_PRO, sizeof(struct ztl_pro_state));
+}
 
 void ztl_pro_free(struct app_pro_addr *ctx) {
     uint32_t i;
@@ -34,20 +54,49 @@ void ztl_pro_free(struct app_pro_addr *ctx) {
     for (i = 0; i < ctx->naddr; i++)
         ztl_pro_grp_free(ctx->grp, ctx->addr[i].g.zone, ctx->nsec[i]);
 
-    /* We assume a single group for now */
     app_grp_ctx_sub(ctx->grp);
 }
 
+/* Node ids are laid out group after group from the 'id_base' of each group.
+ * Groups may have a different number of nodes, the group is the last one
+ * starting at or before the id */
+struct ztl_pro_node *ztl_pro_get_vnode(uint32_t node_id) {
+    struct app_group       **glist = ztl_pro_st()->glist;
+    struct ztl_pro_node_grp *pro;
+    uint32_t                 first = 0, last = ztl()->ngrps, mid;
+
+    while (last - first > 1) {
+        mid = first + (last - first) / 2;
+        pro = (struct ztl_pro_node_grp *)(glist[mid]->pro);
+        if (pro->id_base <= node_id)
+            first = mid;
+        else
+            last = mid;
+    }
+
+    pro = (struct ztl_pro_node_grp *)(glist[first]->pro);
+    if (node_id < pro->id_base || node_id - pro->id_base >= pro->nnodes) {
+        log_erra("ztl_pro_get_vnode: invalid node_id [%u]\n", node_id);
+        return NULL;
+    }
+
+    return &pro->vnodes[node_id - pro->id_base];
+}
+
 int ztl_pro_new(uint32_t num, int32_t node_id, struct app_pro_addr *ctx,
                 uint32_t start) {
-    struct app_group *grp;
-    int               ret;
+    struct ztl_pro_node *node;
+    struct app_group    *grp;
+    int                  ret;
 
     ZDEBUG(ZDEBUG_PRO, "ztl_pro_new: num [%d], start [%d], node_id [%d]", num,
            start, node_id);
 
-    /* For now, we consider a single group */
-    grp        = glist[0];
+    node = ztl_pro_get_vnode(node_id);
+    if (!node)
+        return XZTL_ZTL_PROV_ERR;
+
+    grp        = node->grp;
     ctx->naddr = 0;
 
     ret = ztl_pro_grp_get(grp, ctx, num, node_id, start);
@@ -62,17 +111,400 @@ int ztl_pro_new(uint32_t num, int32_t node_id, struct app_pro_addr *ctx,
     return ret;
 }
 
+/* Rotation slot to group. Consecutive slots alternate devices, so lanes and
+ * levels spread over all devices before using a second group of one */
+static uint16_t ztl_pro_rot_grp(uint32_t slot) {
+    uint16_t ndevs = xztl_media_ndevs();
+    uint16_t gpd   = ztl()->ngrps / ndevs;
+
+    slot %= ztl()->ngrps;
+
+    return (slot % ndevs) * gpd + (slot / ndevs) % gpd;
+}
+
+static struct ztl_pro_budget *ztl_pro_node_budget(struct ztl_pro_node *node) {
+    return &ztl_pro_st()->budget[xztl_media_grp_dev(node->grp->id)];
+}
+
+static int ztl_pro_budget_fits(struct ztl_pro_budget *b, uint32_t nopen,
+                               uint32_t nactive) {
+    return (!b->max_open || b->nopen + nopen <= b->max_open) &&
+           (!b->max_active || b->nactive + nactive <= b->max_active);
+}
+
+static void ztl_pro_budget_put(struct ztl_pro_budget *b, uint32_t width) {
+    ATOMIC_SUB(&b->nopen, width);
+    ATOMIC_SUB(&b->nactive, width);
+}
+
+/* The zones of the node are closed, they stay active */
+static void ztl_pro_node_closed(struct ztl_pro_node *node) {
+    if (__sync_bool_compare_and_swap(&node->zopen, 1, 0))
+        ATOMIC_SUB(&ztl_pro_node_budget(node)->nopen, node->nzones);
+}
+
+/* The zones of the node are full or empty. Called by the mgmt module after
+ * a finish or a reset, a node is released once */
+void ztl_pro_node_inactive(struct ztl_pro_node *node) {
+    ztl_pro_node_closed(node);
+    if (__sync_bool_compare_and_swap(&node->zactive, 1, 0))
+        ATOMIC_SUB(&ztl_pro_node_budget(node)->nactive, node->nzones);
+}
+
+/* The zones of a node restored in use are active, and open as far as we
+ * know. The node is idle until a writer takes it */
+void ztl_pro_node_active(struct ztl_pro_node *node) {
+    struct ztl_pro_budget *b = ztl_pro_node_budget(node);
+
+    node->wstate  = ZTL_PRO_NODE_IDLE;
+    node->owner   = NULL;
+    node->wtime   = 0;
+    node->zopen   = 1;
+    node->zactive = 1;
+    ATOMIC_ADD(&b->nopen, node->nzones);
+    ATOMIC_ADD(&b->nactive, node->nzones);
+}
+
+/* Claims an idle node of the device: the least recently written one holding
+ * open zones, or if 'open' is 0 the active one with the least space left,
+ * which wastes the least when finished. The node moves to 'wstate' */
+static struct ztl_pro_node *ztl_pro_idle_node(uint16_t dev, int open,
+                                              uint32_t wstate) {
+    struct ztl_pro_state    *st   = ztl_pro_st();
+    struct ztl_pro_node     *best = NULL, *node;
+    struct ztl_pro_node_grp *pro;
+    struct timespec          ts;
+    uint64_t                 now;
+    uint16_t                 grp_i;
+
+    GET_MICROSECONDS(now, ts);
+
+    for (grp_i = 0; grp_i < ztl()->ngrps; grp_i++) {
+        if (xztl_media_grp_dev(st->glist[grp_i]->id) != dev)
+            continue;
+
+        pro = (struct ztl_pro_node_grp *)(st->glist[grp_i]->pro);
+        pthread_spin_lock(&pro->spin_used);
+        TAILQ_FOREACH(node, &pro->used_head, fentry) {
+            if (node->wstate != ZTL_PRO_NODE_IDLE ||
+                !(open ? node->zopen : node->zactive) ||
+                now - node->wtime < ZTL_PRO_IDLE_US)
+                continue;
+            if (!best || (open ? node->wtime < best->wtime
+                               : node->optimal_write_sec_left <
+                                     best->optimal_write_sec_left))
+                best = node;
+        }
+        pthread_spin_unlock(&pro->spin_used);
+    }
+
+    if (best && !__sync_bool_compare_and_swap(&best->wstate,
+                                              ZTL_PRO_NODE_IDLE, wstate))
+        best = NULL;
+
+    return best;
+}
+
+/* Closes the zones of an idle node, its writer reopens them on the next
+ * piece. Returns 1 if open zones were released */
+static int ztl_pro_close_idle(uint16_t dev) {
+    struct ztl_pro_node *node;
+    int                  ret;
+
+    node = ztl_pro_idle_node(dev, 1, ZTL_PRO_NODE_CLOSING);
+    if (!node)
+        return 0;
+
+    ret = ztl()->mgmt->close_fn(node->grp, node, ZTL_MGMG_CLOSE_ZONE);
+    if (!ret)
+        ztl_pro_node_closed(node);
+
+    __sync_synchronize();
+    node->wstate = ZTL_PRO_NODE_IDLE;
+
+    return !ret;
+}
+
+/* Finishes an idle node, the rest of it is given up. Its writer moves it to
+ * the full list, nodes restored in use have no writer and move here.
+ * Returns 1 if active zones were released */
+static int ztl_pro_retire_idle(uint16_t dev) {
+    struct ztl_pro_node     *node;
+    struct ztl_pro_node_grp *pro;
+    int                      ret;
+
+    node = ztl_pro_idle_node(dev, 0, ZTL_PRO_NODE_RETIRING);
+    if (!node)
+        return 0;
+
+    /* The mgmt module releases the budget of the finished node */
+    ret = ztl()->mgmt->close_fn(node->grp, node, ZTL_MGMG_FULL_ZONE);
+    if (ret) {
+        __sync_synchronize();
+        node->wstate = ZTL_PRO_NODE_IDLE;
+        return 0;
+    }
+
+    node->optimal_write_sec_left = 0;
+    if (!node->owner) {
+        pro = (struct ztl_pro_node_grp *)(node->grp->pro);
+        pthread_spin_lock(&pro->spin_used);
+        TAILQ_REMOVE(&pro->used_head, node, fentry);
+        pthread_spin_unlock(&pro->spin_used);
+
+        node->status = XZTL_ZMD_NODE_FULL;
+        pthread_spin_lock(&pro->spin_full);
+        TAILQ_INSERT_TAIL(&pro->full_head, node, fentry);
+        pthread_spin_unlock(&pro->spin_full);
+    }
+
+    __sync_synchronize();
+    node->wstate = ZTL_PRO_NODE_RETIRED;
+
+    return 1;
+}
+
+/* Takes budget for a new node of up to 'width' zones and returns the width
+ * granted, or 0. Idle nodes are closed if only open zones are missing, the
+ * node is narrowed before finishing idle nodes, which gives up their space */
+static uint32_t ztl_pro_budget_get(uint16_t dev, uint32_t width) {
+    struct ztl_pro_budget *b = &ztl_pro_st()->budget[dev];
+
+    if (!b->max_open && !b->max_active) {
+        ATOMIC_ADD(&b->nopen, width);
+        ATOMIC_ADD(&b->nactive, width);
+        return width;
+    }
+
+    pthread_mutex_lock(&b->mutex);
+    while (!ztl_pro_budget_fits(b, width, width)) {
+        if (ztl_pro_budget_fits(b, 0, width) && ztl_pro_close_idle(dev))
+            continue;
+        if (width > ZTL_PRO_NODE_WIDTH_MIN) {
+            width /= 2;
+            continue;
+        }
+        if (!ztl_pro_retire_idle(dev)) {
+            width = 0;
+            break;
+        }
+    }
+
+    if (width) {
+        ATOMIC_ADD(&b->nopen, width);
+        ATOMIC_ADD(&b->nactive, width);
+    }
+    pthread_mutex_unlock(&b->mutex);
+
+    return width;
+}
+
+/* The writer takes its node back, after a close or a retire in progress.
+ * Returns XZTL_ZTL_PROV_FULL if the node was retired. Closed zones need
+ * open budget again, the next write reopens them */
+static int ztl_pro_node_hold(struct ztl_pro_node *node) {
+    struct ztl_pro_budget *b       = ztl_pro_node_budget(node);
+    uint16_t               dev     = xztl_media_grp_dev(node->grp->id);
+    uint32_t               wait_ms = 0;
+
+    while (!__sync_bool_compare_and_swap(&node->wstate, ZTL_PRO_NODE_IDLE,
+                                         ZTL_PRO_NODE_WRITING)) {
+        if (node->wstate == ZTL_PRO_NODE_RETIRED)
+            return XZTL_ZTL_PROV_FULL;
+        sched_yield();
+    }
+
+    while (!node->zopen) {
+        pthread_mutex_lock(&b->mutex);
+        while (!ztl_pro_budget_fits(b, node->nzones, 0) &&
+               ztl_pro_close_idle(dev)) {
+        }
+        if (ztl_pro_budget_fits(b, node->nzones, 0)) {
+            ATOMIC_ADD(&b->nopen, node->nzones);
+            node->zopen = 1;
+        }
+        pthread_mutex_unlock(&b->mutex);
+
+        if (node->zopen)
+            break;
+        if (wait_ms++ == ZTL_PRO_WAIT_MS) {
+            log_erra("ztl_pro_node_hold: No open zones for node [%u]",
+                     node->id);
+            __sync_synchronize();
+            node->wstate = ZTL_PRO_NODE_IDLE;
+            return XZTL_ZTL_PROV_ERR;
+        }
+        usleep(1000);
+    }
+
+    return XZTL_OK;
+}
+
+/* Takes a node of the group within the budget of its device. A node waiting
+ * for a lazy reset is reset in place if 'reclaim' is set */
+static int ztl_pro_take_node(struct ztl_queue_pool *q, struct app_group *grp,
+                             int reclaim, int *starved) {
+    uint16_t dev = xztl_media_grp_dev(grp->id);
+    uint32_t width;
+
+    width = ztl_pro_budget_get(dev, q->width);
+    if (!width) {
+        *starved = 1;
+        return XZTL_ZTL_PROV_ERR;
+    }
+
+    if (reclaim && ztl()->mgmt->reclaim_fn(grp) != XZTL_OK)
+        goto PUT;
+
+    /* A narrowed node may be narrower still if the wider ones are gone */
+    while (ztl_pro_grp_get_node(q, grp->pro, width) != XZTL_OK) {
+        if (width == q->width || width == ZTL_PRO_NODE_WIDTH_MIN)
+            goto PUT;
+        width /= 2;
+        ztl_pro_budget_put(&ztl_pro_st()->budget[dev], width);
+    }
+
+    q->node->zopen   = 1;
+    q->node->zactive = 1;
+    return XZTL_OK;
+
+PUT:
+
+    ztl_pro_budget_put(&ztl_pro_st()->budget[dev], width);
+
+    return XZTL_ZTL_PROV_ERR;
+}
+
+/* New nodes of a level rotate across the groups, so the lanes and levels
+ * write to all groups in parallel. Full groups are skipped. Opening a node
+ * waits while the open and active zones of the device are taken by nodes
+ * still in use, the current node is extended first */
 int ztl_pro_get_node(struct ztl_queue_pool *q) {
-    struct ztl_pro_node_grp *pro = (struct ztl_pro_node_grp *)(glist[0]->pro);
-    return ztl_pro_grp_get_node(q, pro);
+    struct ztl_pro_state *st = ztl_pro_st();
+    struct app_group     *grp;
+    uint16_t              grp_i, start;
+    uint32_t              wait_ms = 0;
+    int                   ret, starved;
+
+    if (q->node && q->node->optimal_write_sec_left) {
+        ret = ztl_pro_node_hold(q->node);
+        if (ret != XZTL_ZTL_PROV_FULL)
+            return ret;
+    }
+
+    do {
+        starved = 0;
+        start = __sync_fetch_and_add(&st->cur_grp[q->level], 1) %
+                ztl()->ngrps;
+        for (grp_i = 0; grp_i < ztl()->ngrps; grp_i++) {
+            grp = st->glist[ztl_pro_rot_grp(start + grp_i)];
+            if (ztl_pro_take_node(q, grp, 0, &starved) == XZTL_OK)
+                return XZTL_OK;
+        }
+
+        /* Nodes waiting for a lazy reset are reset in place instead */
+        for (grp_i = 0; grp_i < ztl()->ngrps; grp_i++) {
+            grp = st->glist[ztl_pro_rot_grp(start + grp_i)];
+            if (ztl_pro_take_node(q, grp, 1, &starved) == XZTL_OK)
+                return XZTL_OK;
+        }
+
+        if (starved)
+            usleep(1000);
+    } while (starved && wait_ms++ < ZTL_PRO_WAIT_MS);
+
+    if (starved) {
+        log_erra("ztl_pro_get_node: No open zones left. Level [%d]",
+                 q->level);
+        return XZTL_ZTL_PROV_ERR;
+    }
+
+    log_erra("ztl_pro_get_node: error! No more nodes! Level [%d]", q->level);
+
+    return XZTL_ZTL_PROV_ERR;
+}
+
+/* The writer is done with a piece of the node. A full node releases its
+ * zones once they are all written to capacity, or is finished in the
+ * background if the device limits open or active zones */
+void ztl_pro_put_node(struct ztl_pro_node *node) {
+    struct ztl_pro_budget *b = ztl_pro_node_budget(node);
+    struct ztl_pro_zone   *zone;
+    struct timespec        ts;
+    uint32_t               zn_i;
+
+    GET_MICROSECONDS(node->wtime, ts);
+
+    if (node->optimal_write_sec_left) {
+        __sync_synchronize();
+        node->wstate = ZTL_PRO_NODE_IDLE;
+        return;
+    }
+
+    for (zn_i = 0; zn_i < node->nzones; zn_i++) {
+        zone = node->vzones[zn_i];
+        if (zone->zmd_entry->wptr < zone->addr.g.sect + zone->capacity) {
+            if (b->max_open || b->max_active)
+                ztl()->mgmt->finish_fn(node->grp, node, ZTL_MGMG_FULL_ZONE);
+            return;
+        }
+    }
+
+    ztl_pro_node_inactive(node);
+}
+
+/* Nodes restored in use hold active zones, and open zones as far as we
+ * know. They are closed or retired when writers need the budget */
+static void ztl_pro_budget_init(void) {
+    struct ztl_pro_state    *st = ztl_pro_st();
+    struct ztl_pro_budget   *b;
+    struct ztl_pro_node_grp *pro;
+    struct ztl_pro_node     *node;
+    struct xztl_mgeo        *g;
+    uint32_t                 need;
+    uint16_t                 dev, grp_i;
+
+    for (dev = 0; dev < xztl_media_ndevs(); dev++) {
+        b             = &st->budget[dev];
+        g             = &xztl_media_get_dev(dev)->geo;
+        b->max_open   = g->max_open;
+        b->max_active = g->max_active;
+        b->nopen      = 0;
+        b->nactive    = 0;
+    }
+
+    for (grp_i = 0; grp_i < ztl()->ngrps; grp_i++) {
+        pro = (struct ztl_pro_node_grp *)(st->glist[grp_i]->pro);
+        TAILQ_FOREACH(node, &pro->used_head, fentry)
+            ztl_pro_node_active(node);
+    }
+
+    /* Every lane of every level may hold a node of the minimum width */
+    need = ZROCKS_LEVEL_NUM * xztl_config_get()->lanes * ZTL_PRO_NODE_WIDTH_MIN;
+    for (dev = 0; dev < xztl_media_ndevs(); dev++) {
+        b = &st->budget[dev];
+        if (!b->max_open && !b->max_active)
+            continue;
+
+        log_infoa("ztl-pro: Device [%u] zone budget. open [%u/%u], "
+                  "active [%u/%u]",
+                  dev, b->nopen, b->max_open, b->nactive, b->max_active);
+
+        if ((b->max_open && b->max_open < need) ||
+            (b->max_active && b->max_active < need))
+            log_infoa("ztl-pro: Device [%u] limits below [%u] zones, writers "
+                      "wait for each other",
+                      dev, need);
+    }
 }
 
 void ztl_pro_exit(void) {
-    int ret;
+    struct app_group **glist = ztl_pro_st()->glist;
+    int                ret, dev;
 
-    ret = ztl()->groups.get_list_fn(glist, app_ngrps);
-    if (ret != app_ngrps)
-        log_erra("ztl_pro_exit: Groups mismatch [%d,%d].", ret, app_ngrps);
+    ret = ztl()->groups.get_list_fn(glist, ztl()->ngrps);
+    if (ret != ztl()->ngrps)
+        log_erra("ztl_pro_exit: Groups mismatch [%d,%d].", ret, ztl()->ngrps);
 
     while (ret) {
         ret--;
@@ -80,40 +512,69 @@ void ztl_pro_exit(void) {
     }
     xztl_mempool_destroy(XZTL_NODE_MGMT_ENTRY, 0);
 
+    for (dev = 0; dev < xztl_media_ndevs(); dev++)
+        pthread_mutex_destroy(&ztl_pro_st()->budget[dev].mutex);
+
     free(glist);
+    ztl_pro_st()->glist = NULL;
     log_info("ztl-pro: Global provisioning stopped.");
 }
 
 int ztl_pro_init(void) {
-    int ret, grp_i = 0;
+    struct ztl_pro_state    *st = ztl_pro_st();
+    struct app_group       **glist;
+    struct ztl_pro_node_grp *pro;
+    uint32_t                 id_base;
+    int                      ret, grp_i = 0, dev = 0;
 
-    glist = calloc(app_ngrps, sizeof(struct app_group *));
+    glist = calloc(ztl()->ngrps, sizeof(struct app_group *));
     if (!glist) {
         log_err("ztl_pro_init: glist is NULL.\n");
         return XZTL_ZTL_GROUP_ERR;
     }
+    st->glist = glist;
 
-    ret = ztl()->groups.get_list_fn(glist, app_ngrps);
-    if (ret != app_ngrps) {
-        log_erra("ztl_pro_init: get_list_fn ret [%d] app_ngrps [%d] failed\n",
-                 ret, app_ngrps);
+    ret = ztl()->groups.get_list_fn(glist, ztl()->ngrps);
+    if (ret != ztl()->ngrps) {
+        log_erra("ztl_pro_init: get_list_fn ret [%d] ngrps [%d] failed\n",
+                 ret, ztl()->ngrps);
         goto FREE;
     }
     if (ztl_metadata_init(glist[0]))
         goto EXIT;
-    for (grp_i = 0; grp_i < app_ngrps; grp_i++) {
-        if (ztl_pro_grp_node_init(glist[grp_i])) {
+
+    /* Node ids of a group follow the nodes of the previous group */
+    for (grp_i = 0; grp_i < ztl()->ngrps; grp_i++) {
+        pro = (grp_i) ? (struct ztl_pro_node_grp *)glist[grp_i - 1]->pro
+                      : NULL;
+        id_base = (pro) ? pro->id_base + pro->nnodes : 0;
+
+        if (ztl_pro_grp_node_init(glist[grp_i], id_base)) {
             log_erra("ztl_pro_init: ztl_pro_grp_node_init failed grp_i [%d]\n",
                      grp_i);
             goto EXIT;
         }
     }
 
-    memset(cur_grp, 0x0, sizeof(uint16_t) * ZTL_PRO_TYPES);
+    for (dev = 0; dev < xztl_media_ndevs(); dev++) {
+        if (pthread_mutex_init(&st->budget[dev].mutex, NULL)) {
+            log_err("ztl_pro_init: budget mutex init failed.\n");
+            goto MUTEX;
+        }
+    }
+    ztl_pro_budget_init();
+
+    memset(st->cur_grp, 0x0, sizeof(uint16_t) * ZTL_PRO_TYPES);
     log_info("ztl_pro_init: Global provisioning started.");
 
     return XZTL_OK;
 
+MUTEX:
+    while (dev) {
+        dev--;
+        pthread_mutex_destroy(&st->budget[dev].mutex);
+    }
+
 EXIT:
     while (grp_i) {
         grp_i--;
@@ -122,16 +583,19 @@ EXIT:
 
 FREE:
     free(glist);
+    st->glist = NULL;
     return XZTL_ZTL_GROUP_ERR;
 }
 
-static struct app_pro_mod ztl_pro = {.mod_id      = LIBZTL_PRO,
-                                     .name        = "LIBZTL-PRO",
-                                     .init_fn     = ztl_pro_init,
-                                     .exit_fn     = ztl_pro_exit,
-                                     .new_fn      = ztl_pro_new,
-                                     .free_fn     = ztl_pro_free,
-                                     .get_node_fn = ztl_pro_get_node};
+static struct app_pro_mod ztl_pro = {.mod_id       = LIBZTL_PRO,
+                                     .name         = "LIBZTL-PRO",
+                                     .init_fn      = ztl_pro_init,
+                                     .exit_fn      = ztl_pro_exit,
+                                     .new_fn       = ztl_pro_new,
+                                     .free_fn      = ztl_pro_free,
+                                     .get_node_fn  = ztl_pro_get_node,
+                                     .get_vnode_fn = ztl_pro_get_vnode,
+                                     .put_node_fn  = ztl_pro_put_node};
 
 void ztl_pro_register(void) {
     ztl_mod_register(ZTLMOD_PRO, LIBZTL_PRO, &ztl_pro);
@@ -17,73 +17,945 @@
  * limitations under the License.
 */
 
+#include <libxnvme.h>
+#include <libxnvme_znd.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <xztl.h>
+#include <xztl-metadata.h>
 #include <xztl-pro.h>
 
-// extern uint16_t app_ngrps;
-static int ztl_zmd_create(struct app_group *grp) {
-    uint64_t              zn_i;
+/* Zone metadata checkpoint
+ *
+ * The table of every group is written as pages of packed entries to the
+ * checkpoint zones, which follow the file metadata zones of the first group.
+ * A checkpoint starts with a BASE record of each group, followed by DELTA
+ * records of the pages marked dirty in the tiny table. OPEN and CLEAN records
+ * tell whether the instance that wrote the checkpoint was closed. Only a clean
+ * checkpoint replaces the zone report at startup, a checkpoint left open is
+ * merged with the report. A record is a header sector followed by its pages,
+ * and the checkpoint moves to the next zone with a new BASE when full.
+ *
+ * Records carry ZTL_FORMAT_VERSION. A written checkpoint zone must start with
+ * a record of this format, other data in the zone (e.g. nodes of an older
+ * layout) fails the startup until the device is reset. */
+
+enum ztl_zmd_ckpt_type {
+    ZTL_ZMD_CKPT_BASE = 1,
+    ZTL_ZMD_CKPT_DELTA,
+    ZTL_ZMD_CKPT_OPEN,
+    ZTL_ZMD_CKPT_CLEAN
+};
+
+struct ztl_zmd_ckpt_head {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint32_t ngrps;
+    uint32_t zn_grp;
+    uint64_t sec_zn;
+    uint32_t nbytes;
+    uint32_t zcap; /* Capacity of the checkpoint zone */
+    uint32_t grp;
+    uint32_t npages;
+    uint32_t format;
+    uint32_t pages[]; /* Page ids of a DELTA record */
+} __attribute__((packed));
+
+struct ztl_zmd_ckpt_entry {
+    uint16_t flags;
+    uint16_t level;
+    uint8_t  zs;
+    uint8_t  width; /* Zones of the node, see app_zmd_entry */
+    uint8_t  rsv[2];
+    uint32_t zcap;
+    uint32_t wptr; /* Written sectors */
+} __attribute__((packed));
+
+struct ztl_zmd_state {
+    struct ztl_zmd_ckpt_entry *ckpt; /* Persisted pages of all groups */
+    uint8_t                   *buf;  /* DMA buffer, MAX_WRITE_NLB_NUM sectors */
+    uint32_t                   epp;  /* Entries per page */
+    uint32_t                   npages; /* Pages per group */
+    uint64_t                   seq;
+    uint64_t                   wptr; /* Next record */
+    uint64_t                   zend; /* Zero if records cannot be appended */
+    uint32_t                   zone;
+    uint8_t                    valid;
+    uint8_t                    clean;
+};
+
+/* The group report is filled chunk by chunk, the entries of a chunk are built
+ * as soon as its zones are fetched, see ztl_zmd_load_report */
+struct ztl_zmd_load {
+    struct app_group *grp;
+    pthread_mutex_t   mutex;
+    pthread_cond_t    cond;
+    uint64_t          fetched; /* Zones copied to the group report */
+    int               err;
+
+    struct ztl_zmd_ckpt_entry *ckpt; /* Checkpoint left open, or NULL */
+};
+
+static struct ztl_zmd_state *ztl_zmd_st(void) {
+    return xztl_instance_state(XZTL_STATE_ZMD, sizeof(struct ztl_zmd_state));
+}
+
+static struct ztl_zmd_ckpt_entry *ztl_zmd_ckpt_page(struct ztl_zmd_state *st,
+                                                    uint32_t grp, uint64_t pg) {
+    return st->ckpt + ((uint64_t)grp * st->npages + pg) * st->epp;
+}
+
+static uint64_t ztl_zmd_ckpt_sect(uint32_t zone) {
+    struct xztl_core *core;
+    get_xztl_core(&core);
+
+    return (uint64_t)(ZTL_METADATA_ZONES + zone) * core->media->geo.sec_zn;
+}
+
+static struct app_zmd_entry *ztl_zmd_entry_init(struct app_group *grp,
+                                                uint64_t          zn_i) {
     struct app_zmd_entry *zn;
-    struct app_zmd       *zmd = &grp->zmd;
     struct xztl_mgeo     *g;
     struct xztl_core     *core;
     get_xztl_core(&core);
     g = &core->media->geo;
 
-    for (zn_i = 0; zn_i < zmd->entries; zn_i++) {
-        zn = ((struct app_zmd_entry *)zmd->tbl) + zn_i;
-        memset(zn, 0x0, sizeof(struct app_zmd_entry));
-        zn->addr.addr   = 0;
-        zn->addr.g.grp  = grp->id;
-        zn->addr.g.zone = zn_i;
-        zn->addr.g.sect = (g->sec_grp * grp->id) + (g->sec_zn * zn_i);
+    zn = ((struct app_zmd_entry *)grp->zmd.tbl) + zn_i;
+    memset(zn, 0x0, sizeof(struct app_zmd_entry));
+    zn->addr.addr   = 0;
+    zn->addr.g.grp  = grp->id;
+    zn->addr.g.zone = zn_i;
+    zn->addr.g.sect = (g->sec_grp * grp->id) + (g->sec_zn * zn_i);
+
+    zn->flags |= XZTL_ZMD_AVLB;
+    if (!grp->id && zn_i >= ZTL_METADATA_ZONES &&
+        zn_i < ZTL_METADATA_ZONES + ZTL_ZMD_CKPT_ZONES + ZTL_MPE_ZONES)
+        zn->flags |= XZTL_ZMD_RSVD | XZTL_ZMD_META;
+    zn->level         = 0;
+    zn->wptr_inflight = zn->wptr = zn->addr.g.sect;
+
+    return zn;
+}
+
+// extern uint16_t app_ngrps;
+static int ztl_zmd_create(struct app_group *grp) {
+    uint64_t zn_i;
+
+    for (zn_i = 0; zn_i < grp->zmd.entries; zn_i++)
+        ztl_zmd_entry_init(grp, zn_i);
+
+    return XZTL_OK;
+}
+
+static int ztl_zmd_load_range(void *arg, uint64_t first, uint64_t last) {
+    struct ztl_zmd_load         *ld  = (struct ztl_zmd_load *)arg;
+    struct app_group            *grp = ld->grp;
+    struct xnvme_spec_znd_descr *zinfo;
+    struct app_zmd_entry        *zn;
+    uint64_t                     zn_i;
+    int                          err;
 
-        zn->flags |= XZTL_ZMD_AVLB;
-        zn->level         = 0;
-        zn->wptr_inflight = zn->wptr = zn->addr.g.sect;
+    pthread_mutex_lock(&ld->mutex);
+    while (ld->fetched < last && !ld->err)
+        pthread_cond_wait(&ld->cond, &ld->mutex);
+    err = ld->err;
+    pthread_mutex_unlock(&ld->mutex);
+
+    if (err)
+        return err;
+
+    for (zn_i = first; zn_i < last; zn_i++) {
+        zn    = ztl_zmd_entry_init(grp, zn_i);
+        zinfo = XNVME_ZND_REPORT_DESCR(grp->zmd.report, zn_i);
+        zn->wptr_inflight = zn->wptr = zinfo->wp;
+
+        /* Flags and level of zones reset since the checkpoint are stale */
+        if (ld->ckpt && zinfo->zs != XNVME_SPEC_ZND_STATE_EMPTY) {
+            zn->flags |= ld->ckpt[zn_i].flags;
+            zn->level = ld->ckpt[zn_i].level;
+            zn->width = ld->ckpt[zn_i].width;
+        }
     }
 
     return XZTL_OK;
 }
 
-static int ztl_zmd_load_report(struct app_group *grp) {
-    struct xztl_core *core;
+/* Copies the report of zones [first, first + nzones) to the group report */
+static int ztl_zmd_fetch(struct app_group *grp, uint64_t first,
+                         uint32_t nzones) {
+    struct xnvme_znd_report *rep;
+    struct xztl_zn_mcmd      cmd;
+    uint32_t                 zn_i;
+    int                      ret;
+
+    cmd.opcode      = XZTL_ZONE_MGMT_RANGE;
+    cmd.addr.addr   = 0;
+    cmd.addr.g.grp  = grp->id;
+    cmd.addr.g.zone = first;
+    cmd.nzones      = nzones;
+
+    ret = xztl_media_submit_zn(&cmd);
+    if (ret) {
+        log_erra("ztl_zmd_fetch: zmd err status [%d] zone [%lu]\n",
+                 cmd.status, first);
+        return ret;
+    }
+
+    rep = (struct xnvme_znd_report *)cmd.opaque;
+    if (rep->nzones < nzones) {
+        log_erra("ztl_zmd_fetch: short report [%lu/%u] zone [%lu]\n",
+                 (uint64_t)rep->nzones, nzones, first);
+        xnvme_buf_virt_free(rep);
+        return XZTL_ZTL_ZMD_REP;
+    }
+
+    for (zn_i = 0; zn_i < nzones; zn_i++)
+        memcpy(XNVME_ZND_REPORT_DESCR(grp->zmd.report, first + zn_i),
+               XNVME_ZND_REPORT_DESCR(rep, zn_i),
+               sizeof(struct xnvme_spec_znd_descr));
+    xnvme_buf_virt_free(rep);
+
+    return XZTL_OK;
+}
+
+/* The report is indexed by zone of the group, it is filled by the device
+ * report or by the checkpoint */
+static int ztl_zmd_report_alloc(struct app_group *grp) {
+    struct app_zmd          *zmd = &grp->zmd;
+    struct xnvme_znd_report *rep;
+    struct xztl_core        *core;
+    uint64_t                 entries_nbytes;
     get_xztl_core(&core);
-    struct xztl_zn_mcmd cmd;
+
+    entries_nbytes = zmd->entries * sizeof(struct xnvme_spec_znd_descr);
+
+    rep = xnvme_buf_virt_alloc(4096,
+                               sizeof(struct xnvme_znd_report) + entries_nbytes);
+    if (!rep)
+        return XZTL_MEM;
+    memset(rep, 0x0, sizeof(struct xnvme_znd_report) + entries_nbytes);
+
+    rep->zslba          = core->media->geo.sec_grp * grp->id;
+    rep->nzones         = zmd->entries;
+    rep->zelba          = rep->zslba +
+                          (rep->nzones - 1) * core->media->geo.sec_zn;
+    rep->zd_nbytes      = sizeof(struct xnvme_spec_znd_descr);
+    rep->zrent_nbytes   = sizeof(struct xnvme_spec_znd_descr);
+    rep->report_nbytes  = sizeof(struct xnvme_znd_report) + entries_nbytes;
+    rep->entries_nbytes = entries_nbytes;
+    zmd->report         = rep;
+
+    return XZTL_OK;
+}
+
+/* The report is fetched in chunks by the calling thread while the startup
+ * threads build the entries. Flags and levels come from ckpt if not NULL */
+static int ztl_zmd_load_report(struct app_group          *grp,
+                               struct ztl_zmd_ckpt_entry *ckpt) {
+    struct app_zmd     *zmd = &grp->zmd;
+    struct ztl_zmd_load ld;
+    struct xztl_par     par;
+    struct timespec     ts;
+    uint64_t            first, us_start, us_rep, us_end;
+    uint32_t            nzones;
+    int                 ret, pret;
+
+    ret = ztl_zmd_report_alloc(grp);
+    if (ret) {
+        log_erra("ztl_zmd_load_report: zmd err [%d]\n", ret);
+        return ret;
+    }
+
+    ld.grp     = grp;
+    ld.fetched = 0;
+    ld.err     = XZTL_OK;
+    ld.ckpt    = ckpt;
+    if (pthread_mutex_init(&ld.mutex, NULL)) {
+        ret = XZTL_MEM;
+        goto FREE;
+    }
+    if (pthread_cond_init(&ld.cond, NULL)) {
+        ret = XZTL_MEM;
+        goto MUTEX;
+    }
+
+    GET_MICROSECONDS(us_start, ts);
+
+    ret = xztl_par_start(&par, zmd->entries, ZTL_ZMD_REPORT_ZONES,
+                         ztl_zmd_load_range, &ld);
+    if (ret)
+        goto COND;
+
+    for (first = 0; first < zmd->entries; first += nzones) {
+        nzones = MIN(ZTL_ZMD_REPORT_ZONES, zmd->entries - first);
+        ret    = ztl_zmd_fetch(grp, first, nzones);
+
+        pthread_mutex_lock(&ld.mutex);
+        if (ret)
+            ld.err = ret;
+        else
+            ld.fetched = first + nzones;
+        pthread_cond_broadcast(&ld.cond);
+        pthread_mutex_unlock(&ld.mutex);
+
+        if (ret)
+            break;
+    }
+    GET_MICROSECONDS(us_rep, ts);
+
+    pret = xztl_par_join(&par);
+    GET_MICROSECONDS(us_end, ts);
+    if (!ret)
+        ret = pret;
+    if (ret)
+        goto COND;
+
+    pthread_cond_destroy(&ld.cond);
+    pthread_mutex_destroy(&ld.mutex);
+
+    log_infoa("ztl_zmd_load_report: Grp [%d] zones [%u] threads [%u] "
+              "report [%lu us] zmd [%lu us]",
+              grp->id, zmd->entries, par.nthreads, us_rep - us_start,
+              us_end - us_start);
+
+    return XZTL_OK;
+
+COND:
+    pthread_cond_destroy(&ld.cond);
+MUTEX:
+    pthread_mutex_destroy(&ld.mutex);
+FREE:
+    log_erra("ztl_zmd_load_report: zmd err [%d]\n", ret);
+    xnvme_buf_virt_free(zmd->report);
+    zmd->report = NULL;
+    return ret;
+}
+
+/* Synchronous checkpoint I/O, staged in the DMA buffer */
+static int ztl_zmd_ckpt_io(struct ztl_zmd_state *st, uint8_t opcode,
+                           uint64_t sect, void *data, uint32_t nsec) {
+    struct xztl_io_mcmd cmd;
+    struct xztl_core   *core;
+    uint8_t            *ptr = (uint8_t *)data;
+    uint64_t            len;
+    uint32_t            nlb;
     int                 ret;
+    get_xztl_core(&core);
 
-    cmd.opcode      = XZTL_ZONE_MGMT_REPORT;
-    cmd.addr.g.grp  = grp->id;
-    cmd.addr.g.zone = core->media->geo.zn_grp * grp->id * 1UL;
-    cmd.nzones      = core->media->geo.zn_grp;
+    while (nsec) {
+        nlb = MIN(nsec, MAX_WRITE_NLB_NUM);
+        len = (uint64_t)nlb * core->media->geo.nbytes;
+        if (opcode == XZTL_CMD_WRITE)
+            memcpy(st->buf, ptr, len);
+
+        memset(&cmd, 0x0, sizeof(struct xztl_io_mcmd));
+        cmd.opcode         = opcode;
+        cmd.naddr          = 1;
+        cmd.synch          = 1;
+        cmd.addr[0].g.sect = sect;
+        cmd.nsec[0]        = nlb;
+        cmd.prp[0]         = (uint64_t)st->buf;
+
+        ret = xztl_media_submit_io(&cmd);
+        if (ret) {
+            log_erra("ztl_zmd_ckpt_io: opcode [%d] sect [%lu] err [%d]\n",
+                     opcode, sect, ret);
+            return XZTL_ZTL_ZMD_CKPT;
+        }
+
+        if (opcode == XZTL_CMD_READ)
+            memcpy(ptr, st->buf, len);
+
+        ptr += len;
+        sect += nlb;
+        nsec -= nlb;
+    }
+
+    return XZTL_OK;
+}
+
+static int ztl_zmd_ckpt_head_ok(struct ztl_zmd_ckpt_head *head) {
+    struct xztl_mgeo *g;
+    struct xztl_core *core;
+    get_xztl_core(&core);
+    g = &core->media->geo;
+
+    return head->magic == ZTL_ZMD_CKPT_MAGIC &&
+           head->format == ZTL_FORMAT_VERSION && head->ngrps == g->ngrps &&
+           head->zn_grp == g->zn_grp && head->sec_zn == g->sec_zn &&
+           head->nbytes == g->nbytes && head->zcap <= g->sec_zn;
+}
+
+static uint32_t ztl_zmd_ckpt_maxids(void) {
+    struct xztl_core *core;
+    get_xztl_core(&core);
+
+    return (core->media->geo.nbytes - sizeof(struct ztl_zmd_ckpt_head)) /
+           sizeof(uint32_t);
+}
+
+/* Reads the pages of a record into the checkpoint */
+static int ztl_zmd_ckpt_replay(struct ztl_zmd_state     *st,
+                               struct ztl_zmd_ckpt_head *head, uint64_t sect) {
+    struct xztl_core *core;
+    uint8_t          *data;
+    uint32_t          pg_i;
+    int               ret;
+    get_xztl_core(&core);
+
+    if (head->type == ZTL_ZMD_CKPT_OPEN || head->type == ZTL_ZMD_CKPT_CLEAN)
+        return (head->npages) ? XZTL_ZTL_ZMD_CKPT : XZTL_OK;
+
+    if (head->grp >= core->media->geo.ngrps)
+        return XZTL_ZTL_ZMD_CKPT;
+
+    if (head->type == ZTL_ZMD_CKPT_BASE) {
+        if (head->npages != st->npages)
+            return XZTL_ZTL_ZMD_CKPT;
+        return ztl_zmd_ckpt_io(st, XZTL_CMD_READ, sect + 1,
+                               ztl_zmd_ckpt_page(st, head->grp, 0),
+                               head->npages);
+    }
+
+    if (head->type != ZTL_ZMD_CKPT_DELTA ||
+        head->npages > ztl_zmd_ckpt_maxids())
+        return XZTL_ZTL_ZMD_CKPT;
+
+    for (pg_i = 0; pg_i < head->npages; pg_i++) {
+        if (head->pages[pg_i] >= st->npages)
+            return XZTL_ZTL_ZMD_CKPT;
+    }
+
+    data = malloc((uint64_t)head->npages * core->media->geo.nbytes);
+    if (!data)
+        return XZTL_MEM;
+
+    ret = ztl_zmd_ckpt_io(st, XZTL_CMD_READ, sect + 1, data, head->npages);
+    for (pg_i = 0; !ret && pg_i < head->npages; pg_i++)
+        memcpy(ztl_zmd_ckpt_page(st, head->grp, head->pages[pg_i]),
+               data + (uint64_t)pg_i * core->media->geo.nbytes,
+               core->media->geo.nbytes);
+
+    free(data);
+    return ret;
+}
+
+/* Replays the records of a checkpoint zone. The checkpoint is complete if it
+ * holds a BASE record of each group */
+static int ztl_zmd_ckpt_read_zone(struct ztl_zmd_state     *st,
+                                  struct ztl_zmd_ckpt_head *head,
+                                  uint32_t zone, uint64_t seq, uint64_t end) {
+    struct xztl_core *core;
+    uint64_t          sect;
+    uint32_t          nbase = 0;
+    int               ret;
+    get_xztl_core(&core);
+
+    st->clean = 0;
+    for (sect = ztl_zmd_ckpt_sect(zone); sect < end;
+         sect += 1 + head->npages) {
+        ret = ztl_zmd_ckpt_io(st, XZTL_CMD_READ, sect, head, 1);
+        if (ret)
+            return ret;
+
+        if (!ztl_zmd_ckpt_head_ok(head) || head->seq != seq ||
+            head->npages >= end - sect)
+            break;
+
+        ret = ztl_zmd_ckpt_replay(st, head, sect);
+        if (ret)
+            return ret;
+
+        if (head->type == ZTL_ZMD_CKPT_BASE)
+            nbase++;
+        st->clean = (head->type == ZTL_ZMD_CKPT_CLEAN);
+    }
+
+    if (nbase < core->media->geo.ngrps)
+        return XZTL_ZTL_ZMD_CKPT;
+
+    st->zone = zone;
+    st->seq  = seq;
+    st->wptr = sect;
+    st->zend = end;
+
+    return XZTL_OK;
+}
+
+/* Loads the newest complete checkpoint */
+static int ztl_zmd_ckpt_read(struct ztl_zmd_state *st) {
+    struct ztl_zmd_ckpt_head *head;
+    struct xztl_core         *core;
+    uint64_t                  seq[ZTL_ZMD_CKPT_ZONES];
+    uint64_t                  end[ZTL_ZMD_CKPT_ZONES];
+    uint8_t                   found[ZTL_ZMD_CKPT_ZONES];
+    uint32_t                  zn, zone;
+    int                       ret = XZTL_ZTL_ZMD_CKPT;
+    get_xztl_core(&core);
+
+    head = calloc(1, core->media->geo.nbytes);
+    if (!head)
+        return XZTL_MEM;
+
+    for (zn = 0; zn < ZTL_ZMD_CKPT_ZONES; zn++) {
+        found[zn] = 0;
+        if (ztl_zmd_ckpt_io(st, XZTL_CMD_READ, ztl_zmd_ckpt_sect(zn), head, 1))
+            continue;
+
+        if (ztl_zmd_ckpt_head_ok(head) && head->type == ZTL_ZMD_CKPT_BASE &&
+            !head->grp) {
+            found[zn] = 1;
+            seq[zn]   = head->seq;
+            end[zn]   = ztl_zmd_ckpt_sect(zn) + head->zcap;
+        }
+    }
+
+    /* A checkpoint interrupted while written falls back to the previous */
+    while (1) {
+        zone = ZTL_ZMD_CKPT_ZONES;
+        for (zn = 0; zn < ZTL_ZMD_CKPT_ZONES; zn++) {
+            if (!found[zn])
+                continue;
+            if (zone == ZTL_ZMD_CKPT_ZONES || seq[zn] > seq[zone])
+                zone = zn;
+        }
+        if (zone == ZTL_ZMD_CKPT_ZONES)
+            break;
+
+        found[zone] = 0;
+        ret = ztl_zmd_ckpt_read_zone(st, head, zone, seq[zone], end[zone]);
+        if (!ret) {
+            st->valid = 1;
+            break;
+        }
+        log_erra("ztl_zmd_ckpt_read: zone [%u] seq [%lu] err [%d]\n", zone,
+                 seq[zone], ret);
+    }
+
+    free(head);
+    if (!st->valid)
+        st->clean = 0;
+
+    return (st->valid) ? XZTL_OK : ret;
+}
+
+static void ztl_zmd_ckpt_free(struct ztl_zmd_state *st) {
+    free(st->ckpt);
+    if (st->buf)
+        xztl_media_dma_free(st->buf);
+    memset(st, 0x0, sizeof(struct ztl_zmd_state));
+}
+
+/* Appends a record, the pages are taken from the checkpoint of the group */
+static int ztl_zmd_ckpt_put(struct ztl_zmd_state *st, uint32_t type,
+                            uint32_t grp, const uint32_t *pages,
+                            uint32_t npages) {
+    struct ztl_zmd_ckpt_head *head;
+    struct xztl_mgeo         *g;
+    struct xztl_core         *core;
+    uint8_t                  *rec;
+    uint32_t                  pg_i, pg;
+    int                       ret;
+    get_xztl_core(&core);
+    g = &core->media->geo;
+
+    if (!st->zend || npages >= st->zend - st->wptr)
+        return XZTL_ZTL_MD_WRITE_FULL;
+
+    rec = calloc(1 + npages, g->nbytes);
+    if (!rec)
+        return XZTL_MEM;
+
+    head         = (struct ztl_zmd_ckpt_head *)rec;
+    head->magic  = ZTL_ZMD_CKPT_MAGIC;
+    head->type   = type;
+    head->seq    = st->seq;
+    head->ngrps  = g->ngrps;
+    head->zn_grp = g->zn_grp;
+    head->sec_zn = g->sec_zn;
+    head->nbytes = g->nbytes;
+    head->zcap   = st->zend - ztl_zmd_ckpt_sect(st->zone);
+    head->grp    = grp;
+    head->npages = npages;
+    head->format = ZTL_FORMAT_VERSION;
+
+    for (pg_i = 0; pg_i < npages; pg_i++) {
+        pg = (pages) ? pages[pg_i] : pg_i;
+        if (pages)
+            head->pages[pg_i] = pg;
+        memcpy(rec + (uint64_t)(1 + pg_i) * g->nbytes,
+               ztl_zmd_ckpt_page(st, grp, pg), g->nbytes);
+    }
+
+    ret = ztl_zmd_ckpt_io(st, XZTL_CMD_WRITE, st->wptr, rec, 1 + npages);
+    free(rec);
+    if (ret) {
+        /* The zone write pointer is unknown, next records start a new BASE */
+        st->zend = 0;
+        return ret;
+    }
+
+    st->wptr += 1 + npages;
+
+    return XZTL_OK;
+}
+
+/* Copies a page of the table to the checkpoint */
+static void ztl_zmd_ckpt_build(struct ztl_zmd_state *st, struct app_group *grp,
+                               uint64_t pg) {
+    struct ztl_zmd_ckpt_entry   *ent = ztl_zmd_ckpt_page(st, grp->id, pg);
+    struct xnvme_spec_znd_descr *zinfo;
+    struct app_zmd_entry        *zmde;
+    uint64_t                     zn_i;
+    uint32_t                     ent_i;
+
+    memset(ent, 0x0, (uint64_t)st->epp * sizeof(struct ztl_zmd_ckpt_entry));
+
+    for (ent_i = 0; ent_i < st->epp; ent_i++) {
+        zn_i = pg * st->epp + ent_i;
+        if (zn_i >= grp->zmd.entries)
+            break;
+
+        zmde  = ((struct app_zmd_entry *)grp->zmd.tbl) + zn_i;
+        zinfo = XNVME_ZND_REPORT_DESCR(grp->zmd.report, zn_i);
+
+        ent[ent_i].flags = zmde->flags;
+        ent[ent_i].level = zmde->level;
+        ent[ent_i].width = zmde->width;
+        ent[ent_i].zcap  = zinfo->zcap;
+        ent[ent_i].wptr  = zmde->wptr - zmde->addr.g.sect;
+
+        if (zinfo->zs == XNVME_SPEC_ZND_STATE_OFFLINE ||
+            zinfo->zs == XNVME_SPEC_ZND_STATE_RONLY)
+            ent[ent_i].zs = zinfo->zs;
+        else if (!ent[ent_i].wptr)
+            ent[ent_i].zs = XNVME_SPEC_ZND_STATE_EMPTY;
+        else if (ent[ent_i].wptr >= ent[ent_i].zcap)
+            ent[ent_i].zs = XNVME_SPEC_ZND_STATE_FULL;
+        else
+            ent[ent_i].zs = XNVME_SPEC_ZND_STATE_CLOSED;
+    }
+}
+
+/* Starts a checkpoint in the next zone with a BASE record of each group */
+static int ztl_zmd_ckpt_base(struct ztl_zmd_state *st) {
+    struct xnvme_spec_znd_descr *zinfo;
+    struct app_group            *grp;
+    struct xztl_zn_mcmd          cmd;
+    struct xztl_core            *core;
+    uint64_t                     pg;
+    uint32_t                     zone, grp_i;
+    int                          ret;
+    get_xztl_core(&core);
+
+    grp = ztl()->groups.get_fn(0);
+    if (!grp || !grp->zmd.report)
+        return XZTL_ZTL_ZMD_CKPT;
+
+    st->valid = 0;
+    zone      = (st->zone + 1) % ZTL_ZMD_CKPT_ZONES;
+
+    memset(&cmd, 0x0, sizeof(struct xztl_zn_mcmd));
+    cmd.opcode      = XZTL_ZONE_MGMT_RESET;
+    cmd.addr.g.grp  = 0;
+    cmd.addr.g.zone = ZTL_METADATA_ZONES + zone;
+    cmd.addr.g.sect = ztl_zmd_ckpt_sect(zone);
+    cmd.nzones      = 1;
 
     ret = xztl_media_submit_zn(&cmd);
-    if (!ret) {
-        grp->zmd.report = (struct xnvme_znd_report *)cmd.opaque;
+    if (ret) {
+        log_erra("ztl_zmd_ckpt_base: reset zone [%u] err [%d]\n", zone, ret);
+        return XZTL_ZTL_ZMD_CKPT;
+    }
+
+    zinfo = XNVME_ZND_REPORT_DESCR(grp->zmd.report, ZTL_METADATA_ZONES + zone);
+
+    st->zone = zone;
+    st->seq++;
+    st->wptr = ztl_zmd_ckpt_sect(zone);
+    st->zend = st->wptr + zinfo->zcap;
+
+    for (grp_i = 0; grp_i < core->media->geo.ngrps; grp_i++) {
+        grp = ztl()->groups.get_fn(grp_i);
+        if (!grp) {
+            ret = XZTL_ZTL_GROUP_ERR;
+            break;
+        }
+
+        for (pg = 0; pg < st->npages; pg++) {
+            if (grp->zmd.tiny.dirty)
+                grp->zmd.tiny.dirty[pg] = 0;
+            ztl_zmd_ckpt_build(st, grp, pg);
+        }
+
+        ret = ztl_zmd_ckpt_put(st, ZTL_ZMD_CKPT_BASE, grp_i, NULL,
+                               st->npages);
+        if (ret)
+            break;
     }
 
     if (ret) {
-        log_erra("ztl_zmd_load_report: zmd err status [%d]\n", cmd.status);
+        log_erra("ztl_zmd_ckpt_base: seq [%lu] err [%d]\n", st->seq, ret);
+        return XZTL_ZTL_ZMD_CKPT;
+    }
+
+    st->valid = 1;
+    log_infoa("ztl_zmd_ckpt_base: seq [%lu] zone [%u] sectors [%lu]",
+              st->seq, zone, st->wptr - ztl_zmd_ckpt_sect(zone));
+
+    return XZTL_OK;
+}
+
+/* The checkpoint of all groups is read by the first group */
+static int ztl_zmd_ckpt_open(void) {
+    struct ztl_zmd_state *st = ztl_zmd_st();
+    struct xztl_mgeo     *g;
+    struct xztl_core     *core;
+    int                   ret;
+    get_xztl_core(&core);
+    g = &core->media->geo;
+
+    ztl_zmd_ckpt_free(st);
+
+    st->epp    = g->nbytes / sizeof(struct ztl_zmd_ckpt_entry);
+    st->npages = (g->zn_grp + st->epp - 1) / st->epp;
+    st->zone   = ZTL_ZMD_CKPT_ZONES - 1;
+    st->ckpt   = calloc((uint64_t)g->ngrps * st->npages * st->epp,
+                        sizeof(struct ztl_zmd_ckpt_entry));
+    st->buf    = xztl_media_dma_alloc(MAX_WRITE_NLB_NUM * g->nbytes);
+    if (!st->ckpt || !st->buf) {
+        ztl_zmd_ckpt_free(st);
+        return XZTL_MEM;
+    }
+
+    ret = ztl_zmd_ckpt_read(st);
+    if (ret)
+        log_infoa("ztl_zmd_ckpt_open: no checkpoint [%d]", ret);
+
+    /* A crash from here leaves the checkpoint open */
+    if (st->clean && ztl_zmd_ckpt_put(st, ZTL_ZMD_CKPT_OPEN, 0, NULL, 0))
+        st->clean = 0;
+
+    log_infoa("ztl_zmd_ckpt_open: seq [%lu] valid [%d] clean [%d]", st->seq,
+              st->valid, st->clean);
+
+    return XZTL_OK;
+}
+
+/* Builds the entries and the report of the group from a clean checkpoint */
+static int ztl_zmd_load_ckpt(struct app_group *grp) {
+    struct ztl_zmd_state        *st = ztl_zmd_st();
+    struct ztl_zmd_ckpt_entry   *ckpt;
+    struct xnvme_spec_znd_descr *zinfo;
+    struct app_zmd_entry        *zn;
+    uint64_t                     zn_i;
+    int                          ret;
+
+    ret = ztl_zmd_report_alloc(grp);
+    if (ret)
+        return ret;
+
+    ckpt = ztl_zmd_ckpt_page(st, grp->id, 0);
+    for (zn_i = 0; zn_i < grp->zmd.entries; zn_i++) {
+        zn = ztl_zmd_entry_init(grp, zn_i);
+        zn->flags |= ckpt[zn_i].flags;
+        zn->level         = ckpt[zn_i].level;
+        zn->width         = ckpt[zn_i].width;
+        zn->wptr_inflight = zn->wptr = zn->addr.g.sect + ckpt[zn_i].wptr;
+
+        zinfo        = XNVME_ZND_REPORT_DESCR(grp->zmd.report, zn_i);
+        zinfo->zt    = XNVME_SPEC_ZND_TYPE_SEQWR;
+        zinfo->zs    = ckpt[zn_i].zs;
+        zinfo->zcap  = ckpt[zn_i].zcap;
+        zinfo->zslba = zn->addr.g.sect;
+        zinfo->wp    = zn->wptr;
     }
 
+    log_infoa("ztl_zmd_load_ckpt: Grp [%d] zones [%u] seq [%lu]", grp->id,
+              grp->zmd.entries, st->seq);
+
+    return XZTL_OK;
+}
+
+/* Written checkpoint zones must start with a record of ZTL_FORMAT_VERSION.
+ * Records of the reserved zones are written without the table, their state
+ * is fetched from the device */
+static int ztl_zmd_format_check(struct app_group *grp) {
+    struct ztl_zmd_ckpt_head    *head;
+    struct xnvme_spec_znd_descr *zinfo;
+    struct app_zmd_entry        *zmde;
+    struct xztl_io_mcmd          cmd;
+    struct xztl_core            *core;
+    uint32_t                     zn;
+    int                          ret;
+    get_xztl_core(&core);
+
+    ret = ztl_zmd_fetch(grp, ZTL_METADATA_ZONES,
+                        ZTL_ZMD_CKPT_ZONES + ZTL_MPE_ZONES);
+    if (ret)
+        return ret;
+
+    for (zn = ZTL_METADATA_ZONES;
+         zn < ZTL_METADATA_ZONES + ZTL_ZMD_CKPT_ZONES + ZTL_MPE_ZONES; zn++) {
+        zinfo = XNVME_ZND_REPORT_DESCR(grp->zmd.report, zn);
+        zmde  = ((struct app_zmd_entry *)grp->zmd.tbl) + zn;
+        zmde->wptr_inflight = zmde->wptr = zinfo->wp;
+    }
+
+    head = xztl_media_dma_alloc(core->media->geo.nbytes);
+    if (!head)
+        return XZTL_MEM;
+
+    for (zn = 0; zn < ZTL_ZMD_CKPT_ZONES; zn++) {
+        zinfo =
+            XNVME_ZND_REPORT_DESCR(grp->zmd.report, ZTL_METADATA_ZONES + zn);
+        if (zinfo->zs == XNVME_SPEC_ZND_STATE_EMPTY)
+            continue;
+
+        memset(&cmd, 0x0, sizeof(struct xztl_io_mcmd));
+        cmd.opcode         = XZTL_CMD_READ;
+        cmd.naddr          = 1;
+        cmd.synch          = 1;
+        cmd.addr[0].g.sect = ztl_zmd_ckpt_sect(zn);
+        cmd.nsec[0]        = 1;
+        cmd.prp[0]         = (uint64_t)head;
+
+        if (xztl_media_submit_io(&cmd) || head->magic != ZTL_ZMD_CKPT_MAGIC ||
+            head->format != ZTL_FORMAT_VERSION) {
+            log_erra("ztl_zmd_format_check: zone [%u] is not of format [%d], "
+                     "reset the device to format it\n",
+                     ZTL_METADATA_ZONES + zn, ZTL_FORMAT_VERSION);
+            ret = XZTL_ZTL_FORMAT_ERR;
+            break;
+        }
+    }
+
+    xztl_media_dma_free(head);
+
     return ret;
 }
 
 static int ztl_zmd_load(struct app_group *grp) {
-    if (ztl_zmd_load_report(grp))
+    struct ztl_zmd_state *st   = ztl_zmd_st();
+    struct app_tiny_tbl  *tiny = &grp->zmd.tiny;
+    struct xztl_core     *core;
+    int                   ret;
+    get_xztl_core(&core);
+
+    if (!grp->id && ztl_zmd_ckpt_open())
+        log_erra("ztl_zmd_load: zone metadata checkpoint disabled\n");
+
+    /* Dirty pages are pages of the checkpoint */
+    grp->zmd.ent_per_pg =
+        core->media->geo.nbytes / sizeof(struct ztl_zmd_ckpt_entry);
+
+    if (st->ckpt) {
+        tiny->entries  = st->npages;
+        tiny->entry_sz = sizeof(uint8_t);
+        tiny->dirty    = calloc(st->npages, sizeof(uint8_t));
+        if (!tiny->dirty)
+            return XZTL_MEM;
+    }
+
+    if (st->valid && st->clean) {
+        ret = ztl_zmd_load_ckpt(grp);
+    } else {
+        ret = ztl_zmd_load_report(
+            grp, (st->valid) ? ztl_zmd_ckpt_page(st, grp->id, 0) : NULL);
+
+        /* The table differs from the checkpoint until the next flush */
+        if (!ret && tiny->dirty)
+            memset(tiny->dirty, 1, tiny->entries);
+    }
+    if (ret)
         return XZTL_ZTL_ZMD_REP;
 
-    /* Set byte for table creation */
+    if (!grp->id) {
+        ret = ztl_zmd_format_check(grp);
+        if (ret) {
+            xnvme_buf_virt_free(grp->zmd.report);
+            grp->zmd.report = NULL;
+            ztl_zmd_ckpt_free(st);
+            return ret;
+        }
+    }
+
+    /* The table is built from the report or the checkpoint */
     grp->zmd.byte.magic = APP_MAGIC;
 
     return XZTL_OK;
 }
 
+/* Writes the dirty pages of the group. The first flush, or a flush to a full
+ * checkpoint zone, starts a new checkpoint */
 static int ztl_zmd_flush(struct app_group *grp) {
-    return XZTL_OK;
+    struct ztl_zmd_state *st   = ztl_zmd_st();
+    struct app_tiny_tbl  *tiny = &grp->zmd.tiny;
+    uint32_t             *pages, npages = 0, pg_i, cnt, maxids;
+    uint64_t              pg;
+    int                   ret = XZTL_OK;
+
+    if (!st->ckpt || !tiny->dirty)
+        return XZTL_ZTL_ZMD_CKPT;
+
+    if (!st->valid)
+        return ztl_zmd_ckpt_base(st);
+
+    pages = malloc(tiny->entries * sizeof(uint32_t));
+    if (!pages)
+        return XZTL_MEM;
+
+    /* Cleared first, pages marked while copied are written again later */
+    for (pg = 0; pg < tiny->entries; pg++) {
+        if (!tiny->dirty[pg])
+            continue;
+        tiny->dirty[pg] = 0;
+        ztl_zmd_ckpt_build(st, grp, pg);
+        pages[npages++] = pg;
+    }
+
+    maxids = ztl_zmd_ckpt_maxids();
+    for (pg_i = 0; pg_i < npages; pg_i += cnt) {
+        cnt = MIN(maxids, npages - pg_i);
+        ret = ztl_zmd_ckpt_put(st, ZTL_ZMD_CKPT_DELTA, grp->id, pages + pg_i,
+                               cnt);
+        if (ret) {
+            /* The new BASE also holds the pages not written */
+            ret = ztl_zmd_ckpt_base(st);
+            break;
+        }
+    }
+
+    free(pages);
+    return ret;
+}
+
+/* Marks the checkpoint as closed, groups must be flushed before */
+static int ztl_zmd_close(void) {
+    struct ztl_zmd_state *st  = ztl_zmd_st();
+    int                   ret = XZTL_ZTL_ZMD_CKPT;
+
+    if (!st->ckpt)
+        return XZTL_OK;
+
+    if (st->valid) {
+        ret = ztl_zmd_ckpt_put(st, ZTL_ZMD_CKPT_CLEAN, 0, NULL, 0);
+        if (ret && !ztl_zmd_ckpt_base(st))
+            ret = ztl_zmd_ckpt_put(st, ZTL_ZMD_CKPT_CLEAN, 0, NULL, 0);
+    }
+
+    if (ret)
+        log_erra("ztl_zmd_close: checkpoint left open. err [%d]\n", ret);
+    else
+        log_infoa("ztl_zmd_close: checkpoint seq [%lu] closed. sectors [%lu]",
+                  st->seq, st->wptr - ztl_zmd_ckpt_sect(st->zone));
+
+    ztl_zmd_ckpt_free(st);
+
+    return ret;
 }
 
 static struct app_zmd_entry *ztl_zmd_get(struct app_group *grp, uint64_t zone,
@@ -102,6 +974,11 @@ static struct app_zmd_entry *ztl_zmd_get(struct app_group *grp, uint64_t zone,
 }
 
 static void ztl_zmd_mark(struct app_group *grp, uint64_t index) {
+    struct app_tiny_tbl *tiny = &grp->zmd.tiny;
+    uint64_t             pg   = index / grp->zmd.ent_per_pg;
+
+    if (tiny->dirty && pg < tiny->entries && !tiny->dirty[pg])
+        tiny->dirty[pg] = 1;
 }
 
 static void ztl_zmd_invalidate(struct app_group *grp, struct xztl_maddr *addr,
@@ -115,7 +992,8 @@ static struct app_zmd_mod ztl_zmd = {.mod_id        = LIBZTL_ZMD,
                                      .load_fn       = ztl_zmd_load,
                                      .get_fn        = ztl_zmd_get,
                                      .invalidate_fn = ztl_zmd_invalidate,
-                                     .mark_fn       = ztl_zmd_mark};
+                                     .mark_fn       = ztl_zmd_mark,
+                                     .close_fn      = ztl_zmd_close};
 
 void ztl_zmd_register(void) {
     ztl_mod_register(ZTLMOD_ZMD, LIBZTL_ZMD, &ztl_zmd);
@@ -27,16 +27,8 @@
 #include <xztl.h>
 #include <xztl-metadata.h>
 
-struct app_global __ztl;
-static uint8_t    gl_fn; /* Positive if function has been called */
-
-uint16_t app_ngrps;
-
-static uint8_t app_modset_libztl[APP_MOD_COUNT] = {0, 0, 0, 0, 0,
-                                                   0, 0, 0, 0, 0};
-
 inline struct app_global *ztl(void) {
-    return &__ztl;
+    return xztl_instance_state(XZTL_STATE_ZTL, sizeof(struct app_global));
 }
 
 static int app_init_map_lock(struct app_mpe *mpe) {
@@ -81,46 +73,62 @@ static void app_exit_map_lock(struct app_mpe *mpe) {
 }
 
 static int app_mpe_init(void) {
-    struct app_mpe   *mpe;
-    struct xztl_mgeo *g;
-    struct xztl_core *core;
-    int               ret;
+    const struct xztl_config *cfg = xztl_config_get();
+    struct app_mpe           *mpe;
+    struct xztl_mgeo         *g;
+    struct xztl_core         *core;
+    uint32_t                  max_pgs;
+    int                       ret;
     get_xztl_core(&core);
     mpe = &ztl()->smap;
     g   = &core->media->geo;
 
+    /* The table fills the mapping log zones unless 'map_table' is set */
+    max_pgs = ztl_mpe_max_pages();
+    if (!max_pgs || cfg->map_table > max_pgs || cfg->map_pages >
+        ((cfg->map_table) ? cfg->map_table : max_pgs)) {
+        log_erra("app_mpe_init: map_pages [%u] map_table [%u] log zones hold "
+                 "[%u] pages\n",
+                 cfg->map_pages, cfg->map_table, max_pgs);
+        return XZTL_ZTL_MAP_ERR;
+    }
+
     mpe->entry_sz   = sizeof(struct app_map_entry);
     mpe->ent_per_pg = (ZTL_MPE_PG_SEC * g->nbytes) / mpe->entry_sz;
-    mpe->entries    = ZTL_MPE_CPGS;
+    mpe->entries    = (cfg->map_table) ? cfg->map_table : max_pgs;
 
-    mpe->tbl = calloc(ZTL_MPE_CPGS, mpe->entry_sz);
+    mpe->tbl = calloc(mpe->entries, mpe->entry_sz);
     if (!mpe->tbl) {
         log_err("app_mpe_init: mpe->tbl is NULL \n");
         return XZTL_ZTL_MAP_ERR;
     }
 
-    mpe->byte.magic = APP_MAGIC;
+    mpe->byte.magic = 0;
 
     if (app_init_map_lock(mpe))
         goto FREE;
 
-    /* Create and flush mpe table if it does not exist */
-    if (mpe->byte.magic == APP_MAGIC) {
+    ret = ztl()->mpe->load_fn();
+    if (ret) {
+        log_erra("app_mpe_init: load_fn failed ret [%d]\n", ret);
+        goto LOCK;
+    }
+
+    /* Create the mpe table if it was not loaded */
+    if (mpe->byte.magic != APP_MAGIC) {
         ret = ztl()->mpe->create_fn();
         if (ret) {
-            log_erra(
-                "app_mpe_init: pthread_mcreate_fnutex_init failed ret [%d]\n",
-                ret);
-            goto LOCK;
+            log_erra("app_mpe_init: create_fn failed ret [%d]\n", ret);
+            goto CLOSE;
         }
     }
 
-    /* TODO: Setup tiny table if we implement recovery at the ZTL */
-
     log_info("app_mpe_init: Persistent Mapping started.");
 
     return XZTL_OK;
 
+CLOSE:
+    ztl()->mpe->close_fn();
 LOCK:
     app_exit_map_lock(mpe);
 FREE:
@@ -131,6 +139,7 @@ FREE:
 }
 
 static void app_mpe_exit(void) {
+    ztl()->mpe->close_fn();
     app_exit_map_lock(&ztl()->smap);
 
     free(ztl()->smap.tbl);
@@ -265,7 +274,7 @@ int ztl_mod_register(uint8_t modtype, uint8_t modid, void *mod) {
     }
 
     ztl()->mod_list[modtype][modid] = mod;
-    app_modset_libztl[modtype]      = modid;
+    ztl()->modset[modtype]          = modid;
 
     log_infoa(
         "ztl_mod_register: "
@@ -287,12 +296,11 @@ void ztl_exit(void) {
 int ztl_init(void) {
     int ret, ngrps;
 
-    gl_fn     = 0;
-    app_ngrps = 0;
+    ztl()->ngrps = 0;
 
     ztl_grp_register();
     log_info("ztl: Starting...");
-    if (ztl_mod_set(app_modset_libztl)) {
+    if (ztl_mod_set(ztl()->modset)) {
         log_err("ztl_init: ztl_mod_set err\n");
         return XZTL_ZTL_MOD_ERR;
     }
@@ -303,7 +311,7 @@ int ztl_init(void) {
         return XZTL_ZTL_GROUP_ERR;
     }
 
-    app_ngrps = ngrps;
+    ztl()->ngrps = ngrps;
 
     ret = app_global_init();
     if (ret) {
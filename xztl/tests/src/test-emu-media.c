@@ -0,0 +1,554 @@
+/* xZTL: Zone Translation Layer User-space Library
+ *
+ * Copyright 2019 Samsung Electronics
+ *
+ * Written by Ivan L. Picoli <i.picoli@samsung.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <libxnvme_spec.h>
+#include <libxnvme_znd.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <xztl-media.h>
+#include <xztl.h>
+
+#include "CUnit/Basic.h"
+
+#define TEST_EMU_DEV   "emu:nzone=16,zcap=4096,zsze=8192,wlat=20,mor=2,mar=3"
+#define TEST_EMU_NSEC  16
+#define TEST_EMU_ZONE  3
+
+static const char *devname = TEST_EMU_DEV;
+
+static void cunit_emu_assert_ptr(char *fn, void *ptr) {
+    CU_ASSERT((uint64_t)ptr != 0);
+    if (!ptr)
+        printf("\n %s: ptr %p\n", fn, ptr);
+}
+
+static void cunit_emu_assert_int(char *fn, uint64_t status) {
+    CU_ASSERT(status == 0);
+    if (status)
+        printf("\n %s: %lx\n", fn, status);
+}
+
+static void cunit_emu_assert_int_equal(char *fn, int value, int expected) {
+    CU_ASSERT_EQUAL(value, expected);
+    if (value != expected)
+        printf("\n %s: value %d != expected %d\n", fn, value, expected);
+}
+
+static int cunit_emu_media_init(void) {
+    return 0;
+}
+
+static int cunit_emu_media_exit(void) {
+    return 0;
+}
+
+static struct xnvme_spec_znd_descr test_emu_zone_info(uint32_t zone) {
+    struct xnvme_spec_znd_descr zinfo;
+    struct xnvme_znd_report    *rep;
+    struct xztl_zn_mcmd         cmd;
+
+    memset(&zinfo, 0x0, sizeof(zinfo));
+
+    cmd.opcode = XZTL_ZONE_MGMT_REPORT;
+    cmd.nzones = 1;
+    if (xztl_media_submit_zn(&cmd))
+        return zinfo;
+
+    rep   = (struct xnvme_znd_report *)cmd.opaque;
+    zinfo = *XNVME_ZND_REPORT_DESCR(rep, zone);
+    xnvme_buf_virt_free(rep);
+
+    return zinfo;
+}
+
+/* First descriptor of a two zone range report */
+static struct xnvme_spec_znd_descr test_emu_zone_range(uint16_t grp,
+                                                       uint32_t zone) {
+    struct xnvme_spec_znd_descr zinfo;
+    struct xnvme_znd_report    *rep;
+    struct xztl_zn_mcmd         cmd;
+
+    memset(&zinfo, 0x0, sizeof(zinfo));
+
+    cmd.opcode      = XZTL_ZONE_MGMT_RANGE;
+    cmd.addr.addr   = 0;
+    cmd.addr.g.grp  = grp;
+    cmd.addr.g.zone = zone;
+    cmd.nzones      = 2;
+    if (xztl_media_submit_zn(&cmd))
+        return zinfo;
+
+    rep = (struct xnvme_znd_report *)cmd.opaque;
+    CU_ASSERT(rep->nzones == 2);
+    zinfo = *XNVME_ZND_REPORT_DESCR(rep, 0);
+    xnvme_buf_virt_free(rep);
+
+    return zinfo;
+}
+
+static int test_emu_zone_op(uint8_t op, uint32_t zone) {
+    struct xztl_zn_mcmd cmd;
+
+    cmd.opcode      = op;
+    cmd.addr.addr   = 0;
+    cmd.addr.g.zone = zone;
+    cmd.nzones      = 1;
+
+    return xztl_media_submit_zn(&cmd);
+}
+
+static int test_emu_io_synch(uint8_t opcode, uint64_t sect, void *buf) {
+    struct xztl_io_mcmd cmd;
+
+    memset(&cmd, 0x0, sizeof(cmd));
+    cmd.opcode         = opcode;
+    cmd.synch          = 1;
+    cmd.naddr          = 1;
+    cmd.nsec[0]        = TEST_EMU_NSEC;
+    cmd.addr[0].g.sect = sect;
+    cmd.prp[0]         = (uint64_t)buf;
+
+    return xztl_media_submit_io(&cmd);
+}
+
+static void test_emu_media_register(void) {
+    cunit_emu_assert_int_equal("emu_media_register:prefix",
+                               emu_media_register("/dev/ng0n1"),
+                               ZND_MEDIA_NODEVICE);
+    cunit_emu_assert_int_equal("emu_media_register:option",
+                               emu_media_register("emu:nzone=4,foo=1"),
+                               ZND_MEDIA_NODEVICE);
+    cunit_emu_assert_int_equal("emu_media_register:geo",
+                               emu_media_register("emu:zcap=64,zsze=32"),
+                               ZND_MEDIA_NOGEO);
+
+    cunit_emu_assert_int("emu_media_register", emu_media_register(devname));
+}
+
+static void test_emu_media_init(void) {
+    cunit_emu_assert_int("xztl_media_init", xztl_media_init());
+}
+
+static void test_emu_report(void) {
+    struct xnvme_spec_znd_descr zinfo;
+    struct xztl_core           *core;
+    get_xztl_core(&core);
+
+    zinfo = test_emu_zone_info(TEST_EMU_ZONE);
+
+    cunit_emu_assert_int_equal("report:zs", zinfo.zs,
+                               XNVME_SPEC_ZND_STATE_EMPTY);
+    cunit_emu_assert_int_equal("report:zslba", zinfo.zslba,
+                               TEST_EMU_ZONE * core->media->geo.sec_zn);
+    cunit_emu_assert_int_equal("report:wp", zinfo.wp, zinfo.zslba);
+    cunit_emu_assert_int_equal("report:zcap", zinfo.zcap, 4096);
+
+    zinfo = test_emu_zone_range(0, TEST_EMU_ZONE);
+    cunit_emu_assert_int_equal("report:range:zslba", zinfo.zslba,
+                               TEST_EMU_ZONE * core->media->geo.sec_zn);
+    cunit_emu_assert_int_equal("report:range:zcap", zinfo.zcap, 4096);
+}
+
+static void test_emu_write_read(void) {
+    struct xnvme_spec_znd_descr zinfo;
+    struct xztl_core           *core;
+    uint64_t                    zslba;
+    size_t                      bytes;
+    char                       *wbuf, *rbuf;
+    get_xztl_core(&core);
+
+    bytes = TEST_EMU_NSEC * core->media->geo.nbytes;
+    zslba = TEST_EMU_ZONE * core->media->geo.sec_zn;
+
+    wbuf = xztl_media_dma_alloc(bytes);
+    rbuf = xztl_media_dma_alloc(bytes);
+    cunit_emu_assert_ptr("xztl_media_dma_alloc", wbuf);
+    cunit_emu_assert_ptr("xztl_media_dma_alloc", rbuf);
+    if (!wbuf || !rbuf)
+        goto FREE;
+
+    memset(wbuf, 0xab, bytes);
+
+    cunit_emu_assert_int("write:wp",
+                         test_emu_io_synch(XZTL_CMD_WRITE, zslba, wbuf));
+    CU_ASSERT(test_emu_io_synch(XZTL_CMD_WRITE, zslba, wbuf) != 0);
+
+    zinfo = test_emu_zone_info(TEST_EMU_ZONE);
+    cunit_emu_assert_int_equal("write:zs", zinfo.zs,
+                               XNVME_SPEC_ZND_STATE_IOPEN);
+    cunit_emu_assert_int_equal("write:wp", zinfo.wp, zslba + TEST_EMU_NSEC);
+
+    memset(rbuf, 0x0, bytes);
+    cunit_emu_assert_int("read", test_emu_io_synch(XZTL_CMD_READ, zslba, rbuf));
+    CU_ASSERT(memcmp(wbuf, rbuf, bytes) == 0);
+
+    /* Above the write pointer data reads as zeroes */
+    memset(wbuf, 0x0, bytes);
+    cunit_emu_assert_int("read:wp",
+                         test_emu_io_synch(XZTL_CMD_READ,
+                                           zslba + TEST_EMU_NSEC, rbuf));
+    CU_ASSERT(memcmp(wbuf, rbuf, bytes) == 0);
+
+FREE:
+    xztl_media_dma_free(wbuf);
+    xztl_media_dma_free(rbuf);
+}
+
+static volatile int outstanding;
+
+static void test_emu_append_callback(void *arg) {
+    outstanding--;
+}
+
+static void test_emu_append_asynch(void) {
+    struct xztl_mthread_ctx *tctx;
+    struct xztl_io_mcmd      cmd;
+    struct xztl_misc_cmd     misc;
+    struct xztl_core        *core;
+    uint64_t                 zslba;
+    char                    *wbuf;
+    get_xztl_core(&core);
+
+    zslba = TEST_EMU_ZONE * core->media->geo.sec_zn;
+
+    tctx = xztl_ctx_media_init(8);
+    cunit_emu_assert_ptr("xztl_ctx_media_init", tctx);
+    if (!tctx)
+        return;
+
+    wbuf = xztl_media_dma_alloc(TEST_EMU_NSEC * core->media->geo.nbytes);
+    cunit_emu_assert_ptr("xztl_media_dma_alloc", wbuf);
+    if (!wbuf)
+        goto CTX;
+
+    memset(&cmd, 0x0, sizeof(cmd));
+    cmd.opcode         = XZTL_ZONE_APPEND;
+    cmd.naddr          = 1;
+    cmd.nsec[0]        = TEST_EMU_NSEC;
+    cmd.addr[0].g.zone = TEST_EMU_ZONE;
+    cmd.prp[0]         = (uint64_t)wbuf;
+    cmd.callback       = test_emu_append_callback;
+    cmd.async_ctx      = tctx;
+
+    outstanding = 1;
+    cunit_emu_assert_int("xztl_media_submit_io", xztl_media_submit_io(&cmd));
+
+    misc.opcode         = XZTL_MISC_ASYNCH_OUTS;
+    misc.asynch.ctx_ptr = tctx;
+    cunit_emu_assert_int("xztl_media_submit_misc:outs",
+                         xztl_media_submit_misc(&misc));
+    cunit_emu_assert_int_equal("outs", misc.asynch.count, 1);
+
+    misc.opcode = XZTL_MISC_ASYNCH_DRAIN;
+    cunit_emu_assert_int("xztl_media_submit_misc:drain",
+                         xztl_media_submit_misc(&misc));
+    cunit_emu_assert_int_equal("outstanding", outstanding, 0);
+    cunit_emu_assert_int("append:status", cmd.status);
+
+    /* The previous test left the write pointer after 16 sectors */
+    cunit_emu_assert_int_equal("append:paddr", cmd.paddr[0],
+                               zslba + TEST_EMU_NSEC);
+
+    xztl_media_dma_free(wbuf);
+CTX:
+    cunit_emu_assert_int("xztl_ctx_media_exit", xztl_ctx_media_exit(tctx));
+}
+
+static void test_emu_op_cl_fi_re(void) {
+    struct xnvme_spec_znd_descr zinfo;
+
+    cunit_emu_assert_int("close",
+                         test_emu_zone_op(XZTL_ZONE_MGMT_CLOSE, TEST_EMU_ZONE));
+    zinfo = test_emu_zone_info(TEST_EMU_ZONE);
+    cunit_emu_assert_int_equal("close:zs", zinfo.zs,
+                               XNVME_SPEC_ZND_STATE_CLOSED);
+
+    cunit_emu_assert_int("open",
+                         test_emu_zone_op(XZTL_ZONE_MGMT_OPEN, TEST_EMU_ZONE));
+    zinfo = test_emu_zone_info(TEST_EMU_ZONE);
+    cunit_emu_assert_int_equal("open:zs", zinfo.zs,
+                               XNVME_SPEC_ZND_STATE_EOPEN);
+
+    cunit_emu_assert_int("finish",
+                         test_emu_zone_op(XZTL_ZONE_MGMT_FINISH, TEST_EMU_ZONE));
+    zinfo = test_emu_zone_info(TEST_EMU_ZONE);
+    cunit_emu_assert_int_equal("finish:zs", zinfo.zs,
+                               XNVME_SPEC_ZND_STATE_FULL);
+    cunit_emu_assert_int_equal("finish:wp", zinfo.wp,
+                               zinfo.zslba + zinfo.zcap);
+    CU_ASSERT(test_emu_zone_op(XZTL_ZONE_MGMT_OPEN, TEST_EMU_ZONE) != 0);
+
+    cunit_emu_assert_int("reset",
+                         test_emu_zone_op(XZTL_ZONE_MGMT_RESET, TEST_EMU_ZONE));
+    zinfo = test_emu_zone_info(TEST_EMU_ZONE);
+    cunit_emu_assert_int_equal("reset:zs", zinfo.zs,
+                               XNVME_SPEC_ZND_STATE_EMPTY);
+    cunit_emu_assert_int_equal("reset:wp", zinfo.wp, zinfo.zslba);
+}
+
+/* Zone commands of a batch are in flight together and complete by a poke */
+static int test_emu_zone_op_asynch(struct xztl_mthread_ctx *tctx, uint8_t op,
+                                   uint32_t zone, uint32_t nzones) {
+    struct xztl_zn_mcmd  cmd[TEST_EMU_NSEC];
+    struct xztl_misc_cmd misc;
+    uint32_t             zn_i;
+    int                  ret = 0;
+
+    outstanding = nzones;
+    for (zn_i = 0; zn_i < nzones; zn_i++) {
+        memset(&cmd[zn_i], 0x0, sizeof(struct xztl_zn_mcmd));
+        cmd[zn_i].opcode      = op;
+        cmd[zn_i].addr.g.zone = zone + zn_i;
+        cmd[zn_i].nzones      = 1;
+        cmd[zn_i].callback    = test_emu_append_callback;
+        cmd[zn_i].async_ctx   = tctx;
+        ret |= xztl_media_submit_zn_async(&cmd[zn_i]);
+    }
+
+    misc.opcode         = XZTL_MISC_ASYNCH_OUTS;
+    misc.asynch.ctx_ptr = tctx;
+    ret |= xztl_media_submit_misc(&misc);
+    cunit_emu_assert_int_equal("zone_async:outs", misc.asynch.count, nzones);
+
+    misc.opcode = XZTL_MISC_ASYNCH_DRAIN;
+    ret |= xztl_media_submit_misc(&misc);
+    cunit_emu_assert_int_equal("zone_async:outstanding", outstanding, 0);
+
+    for (zn_i = 0; zn_i < nzones; zn_i++) ret |= cmd[zn_i].status;
+
+    return ret;
+}
+
+static void test_emu_zone_asynch(void) {
+    struct xnvme_spec_znd_descr zinfo;
+    struct xztl_mthread_ctx    *tctx;
+    uint32_t                    zn;
+
+    tctx = xztl_ctx_media_init(TEST_EMU_NSEC);
+    cunit_emu_assert_ptr("xztl_ctx_media_init", tctx);
+    if (!tctx)
+        return;
+
+    cunit_emu_assert_int("finish:async",
+                         test_emu_zone_op_asynch(tctx, XZTL_ZONE_MGMT_FINISH,
+                                                 TEST_EMU_ZONE, 4));
+    for (zn = TEST_EMU_ZONE; zn < TEST_EMU_ZONE + 4; zn++) {
+        zinfo = test_emu_zone_info(zn);
+        cunit_emu_assert_int_equal("finish:async:zs", zinfo.zs,
+                                   XNVME_SPEC_ZND_STATE_FULL);
+    }
+
+    cunit_emu_assert_int("reset:async",
+                         test_emu_zone_op_asynch(tctx, XZTL_ZONE_MGMT_RESET,
+                                                 TEST_EMU_ZONE, 4));
+    for (zn = TEST_EMU_ZONE; zn < TEST_EMU_ZONE + 4; zn++) {
+        zinfo = test_emu_zone_info(zn);
+        cunit_emu_assert_int_equal("reset:async:zs", zinfo.zs,
+                                   XNVME_SPEC_ZND_STATE_EMPTY);
+        cunit_emu_assert_int_equal("reset:async:wp", zinfo.wp, zinfo.zslba);
+    }
+
+    cunit_emu_assert_int("xztl_ctx_media_exit", xztl_ctx_media_exit(tctx));
+}
+
+/* Writing or opening a zone over the open or active limit fails, closed
+ * zones stay active until they are finished or reset */
+static void test_emu_zone_limits(void) {
+    struct xztl_media *dev = xztl_media_get_dev(0);
+    uint64_t           sec_zn;
+    uint32_t           zn;
+    char              *wbuf;
+
+    cunit_emu_assert_int_equal("limits:max_open", dev->geo.max_open, 2);
+    cunit_emu_assert_int_equal("limits:max_active", dev->geo.max_active, 3);
+
+    sec_zn = dev->geo.sec_zn;
+    wbuf   = xztl_media_dma_alloc(TEST_EMU_NSEC * dev->geo.nbytes);
+    cunit_emu_assert_ptr("xztl_media_dma_alloc", wbuf);
+    if (!wbuf)
+        return;
+    memset(wbuf, 0xef, TEST_EMU_NSEC * dev->geo.nbytes);
+
+    cunit_emu_assert_int("limits:write:0",
+                         test_emu_io_synch(XZTL_CMD_WRITE, 0, wbuf));
+    cunit_emu_assert_int("limits:write:1",
+                         test_emu_io_synch(XZTL_CMD_WRITE, sec_zn, wbuf));
+    CU_ASSERT(test_emu_io_synch(XZTL_CMD_WRITE, 2 * sec_zn, wbuf) != 0);
+
+    /* A closed zone frees an open zone, it stays active */
+    cunit_emu_assert_int("limits:close",
+                         test_emu_zone_op(XZTL_ZONE_MGMT_CLOSE, 0));
+    cunit_emu_assert_int("limits:write:2",
+                         test_emu_io_synch(XZTL_CMD_WRITE, 2 * sec_zn, wbuf));
+    CU_ASSERT(test_emu_io_synch(XZTL_CMD_WRITE, TEST_EMU_NSEC, wbuf) != 0);
+    CU_ASSERT(test_emu_zone_op(XZTL_ZONE_MGMT_CLOSE, 1) == 0);
+    CU_ASSERT(test_emu_zone_op(XZTL_ZONE_MGMT_OPEN, 4) != 0);
+
+    /* A full zone frees both */
+    cunit_emu_assert_int("limits:finish",
+                         test_emu_zone_op(XZTL_ZONE_MGMT_FINISH, 1));
+    cunit_emu_assert_int("limits:open",
+                         test_emu_zone_op(XZTL_ZONE_MGMT_OPEN, 4));
+    CU_ASSERT(test_emu_zone_op(XZTL_ZONE_MGMT_OPEN, 5) != 0);
+
+    for (zn = 0; zn < 5; zn++)
+        cunit_emu_assert_int("limits:reset",
+                             test_emu_zone_op(XZTL_ZONE_MGMT_RESET, zn));
+    cunit_emu_assert_int("limits:write:5",
+                         test_emu_io_synch(XZTL_CMD_WRITE, 5 * sec_zn, wbuf));
+    cunit_emu_assert_int("limits:reset:5",
+                         test_emu_zone_op(XZTL_ZONE_MGMT_RESET, 5));
+
+    xztl_media_dma_free(wbuf);
+}
+
+/* A second device follows the groups and sectors of the first one */
+static void test_emu_stack(void) {
+    struct xnvme_spec_znd_descr zinfo;
+    struct xztl_mthread_ctx    *tctx;
+    struct xztl_io_mcmd         cmd;
+    struct xztl_misc_cmd        misc;
+    struct xztl_core           *core;
+    struct xztl_media          *dev;
+    uint64_t                    zslba;
+    char                       *wbuf;
+    get_xztl_core(&core);
+
+    cunit_emu_assert_int("emu_media_register:stack",
+                         emu_media_register(devname));
+    cunit_emu_assert_int_equal("xztl_media_ndevs", xztl_media_ndevs(), 2);
+
+    dev = xztl_media_get_dev(1);
+    cunit_emu_assert_ptr("xztl_media_get_dev", dev);
+    if (!dev)
+        return;
+
+    cunit_emu_assert_int_equal("stack:ngrps", core->media->geo.ngrps,
+                               2 * dev->geo.ngrps);
+    cunit_emu_assert_int_equal("stack:grp_dev",
+                               xztl_media_grp_dev(dev->grp_base), 1);
+    CU_ASSERT(dev->sec_base == xztl_media_get_dev(0)->geo.sec_dev);
+
+    zslba = dev->sec_base + TEST_EMU_ZONE * dev->geo.sec_zn;
+
+    wbuf = xztl_media_dma_alloc(TEST_EMU_NSEC * dev->geo.nbytes);
+    cunit_emu_assert_ptr("xztl_media_dma_alloc", wbuf);
+    if (!wbuf)
+        return;
+    memset(wbuf, 0xcd, TEST_EMU_NSEC * dev->geo.nbytes);
+
+    cunit_emu_assert_int("stack:write",
+                         test_emu_io_synch(XZTL_CMD_WRITE, zslba, wbuf));
+
+    /* The stacked report is indexed by stacked zone */
+    zinfo = test_emu_zone_info(dev->geo.zn_dev + TEST_EMU_ZONE);
+    CU_ASSERT(zinfo.zslba == zslba);
+    CU_ASSERT(zinfo.wp == zslba + TEST_EMU_NSEC);
+
+    /* Range reports are rebased to the stacked sector space too */
+    zinfo = test_emu_zone_range(dev->grp_base, TEST_EMU_ZONE);
+    CU_ASSERT(zinfo.zslba == zslba);
+    CU_ASSERT(zinfo.wp == zslba + TEST_EMU_NSEC);
+
+    tctx = xztl_ctx_media_init_dev(1, 8);
+    cunit_emu_assert_ptr("xztl_ctx_media_init_dev", tctx);
+    if (!tctx)
+        goto FREE;
+
+    memset(&cmd, 0x0, sizeof(cmd));
+    cmd.opcode         = XZTL_ZONE_APPEND;
+    cmd.naddr          = 1;
+    cmd.nsec[0]        = TEST_EMU_NSEC;
+    cmd.addr[0].g.grp  = dev->grp_base;
+    cmd.addr[0].g.zone = TEST_EMU_ZONE;
+    cmd.prp[0]         = (uint64_t)wbuf;
+    cmd.callback       = test_emu_append_callback;
+    cmd.async_ctx      = tctx;
+
+    outstanding = 1;
+    cunit_emu_assert_int("stack:append", xztl_media_submit_io(&cmd));
+
+    misc.opcode         = XZTL_MISC_ASYNCH_DRAIN;
+    misc.asynch.ctx_ptr = tctx;
+    cunit_emu_assert_int("xztl_media_submit_misc:drain",
+                         xztl_media_submit_misc(&misc));
+    cunit_emu_assert_int_equal("outstanding", outstanding, 0);
+    CU_ASSERT(cmd.paddr[0] == zslba + TEST_EMU_NSEC);
+
+    cunit_emu_assert_int("xztl_ctx_media_exit", xztl_ctx_media_exit(tctx));
+FREE:
+    xztl_media_dma_free(wbuf);
+}
+
+static void test_emu_media_exit(void) {
+    cunit_emu_assert_int("xztl_media_exit", xztl_media_exit());
+}
+
+int main(int argc, const char **argv) {
+    int failed;
+
+    if (argc > 1)
+        devname = argv[1];
+
+    printf("Device: %s\n", devname);
+
+    CU_pSuite pSuite = NULL;
+
+    if (CUE_SUCCESS != CU_initialize_registry())
+        return CU_get_error();
+
+    pSuite = CU_add_suite("Suite_emu_media", cunit_emu_media_init,
+                          cunit_emu_media_exit);
+    if (pSuite == NULL) {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if ((CU_add_test(pSuite, "Set the emulated media layer",
+                     test_emu_media_register) == NULL) ||
+        (CU_add_test(pSuite, "Initialize media", test_emu_media_init) ==
+         NULL) ||
+        (CU_add_test(pSuite, "Get/Check zone report", test_emu_report) ==
+         NULL) ||
+        (CU_add_test(pSuite, "Write/Read 16 sectors to a zone",
+                     test_emu_write_read) == NULL) ||
+        (CU_add_test(pSuite, "Asynchronous append to a zone",
+                     test_emu_append_asynch) == NULL) ||
+        (CU_add_test(pSuite, "Open/Close/Finish/Reset a zone",
+                     test_emu_op_cl_fi_re) == NULL) ||
+        (CU_add_test(pSuite, "Asynchronous Finish/Reset of zones",
+                     test_emu_zone_asynch) == NULL) ||
+        (CU_add_test(pSuite, "Open/active zone limits",
+                     test_emu_zone_limits) == NULL) ||
+        (CU_add_test(pSuite, "Stack a second device", test_emu_stack) ==
+         NULL) ||
+        (CU_add_test(pSuite, "Close media", test_emu_media_exit) == NULL)) {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    CU_basic_set_mode(CU_BRM_VERBOSE);
+    CU_basic_run_tests();
+
+    failed = CU_get_number_of_tests_failed();
+    CU_cleanup_registry();
+
+    return failed;
+}
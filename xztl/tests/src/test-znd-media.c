@@ -381,6 +381,8 @@ static void test_znd_asynch_ctx(void) {
     struct xztl_mthread_ctx tctx;
     int                     ret;
 
+    memset(&tctx, 0x0, sizeof(tctx));
+
     cmd.opcode       = XZTL_MISC_ASYNCH_INIT;
     cmd.asynch.depth = 128;
 
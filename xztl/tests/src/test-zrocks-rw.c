@@ -49,13 +49,16 @@ static const char **devname;
 static uint64_t buffer_sz = WRITE_TBUFFER_SZ;
 static uint64_t nwrites   = WRITE_COUNT;
 static uint32_t nthreads  = READ_NTHREADS;
+static uint32_t nlanes    = 0;
+static uint32_t stripe_kb = 0;
+static uint32_t nzones    = 0;
 
 struct tparams {
     void  *buf;
     size_t size;
     int    waiting;
 
-    struct zrocks_map maps[2];
+    struct zrocks_map maps[ZROCKS_MAX_PIECES];
     uint16_t          map_len;
     int               level;
 };
@@ -83,7 +86,22 @@ static int cunit_zrocksrw_exit(void) {
 }
 
 static void test_zrocksrw_init(void) {
-    int ret;
+    int ret, level;
+
+    for (level = 0; nlanes && level < ZROCKS_LEVEL_NUM; level++) {
+        ret = zrocks_set_write_lanes(level, nlanes);
+        cunit_zrocksrw_assert_int("zrocks_set_write_lanes", ret);
+    }
+
+    for (level = 0; stripe_kb && level < ZROCKS_LEVEL_NUM; level++) {
+        ret = zrocks_set_stripe_unit(level, stripe_kb * 1024);
+        cunit_zrocksrw_assert_int("zrocks_set_stripe_unit", ret);
+    }
+
+    for (level = 0; nzones && level < ZROCKS_LEVEL_NUM; level++) {
+        ret = zrocks_set_node_width(level, nzones);
+        cunit_zrocksrw_assert_int("zrocks_set_node_width", ret);
+    }
 
     ret = zrocks_init(*devname);
     cunit_zrocksrw_assert_int("zrocks_init", ret);
@@ -380,7 +398,8 @@ int main(int argc, const char **argv) {
     if (argc < 2 || !memcmp(argv[1], "--help\0", strlen(argv[1]))) {
         printf(
             " Usage: zrocks-test-rw <DEV_PATH> <NUM_THREADS> "
-            "<BUFFER_SIZE_IN_MB> <NUM_OF_BUFFERS>\n");
+            "<BUFFER_SIZE_IN_MB> <NUM_OF_BUFFERS> [WRITE_LANES] [STRIPE_KB] "
+            "[NODE_ZONES]\n");
         printf("\n   e.g.: test-zrocks-rw liou:/dev/nvme0n2 8 2 1024\n");
         printf("         This command uses 8 threads to read data and\n");
         printf("         writes 2 GB to the device\n");
@@ -406,6 +425,20 @@ int main(int argc, const char **argv) {
         nwrites   = 1UL * atoi(argv[4]);
     }
 
+    if (argc >= 6) {
+        nlanes = 1UL * atoi(argv[5]);
+        if (!nlanes || nlanes > ZTL_IO_LANE_MAX) {
+            printf("Error: write lanes must be 1 to %d.", ZTL_IO_LANE_MAX);
+            return failed;
+        }
+    }
+
+    if (argc >= 7)
+        stripe_kb = 1UL * atoi(argv[6]);
+
+    if (argc >= 8)
+        nzones = 1UL * atoi(argv[7]);
+
     if (nwrites <= 0) {
         return failed;
     }
@@ -17,10 +17,15 @@
  * limitations under the License.
 */
 
+#include <libxnvme_znd.h>
 #include <omp.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <xztl.h>
+#include <xztl-metadata.h>
+#include <xztl-mods.h>
+#include <xztl-pro.h>
 #include <libzrocks.h>
 
 #include "CUnit/Basic.h"
@@ -34,10 +39,51 @@
 /* Object Size */
 #define TEST_BUFFER_SZ (1024 * 1024 * 16) /* 16 MB */
 
+/* Number of in-flight asynchronous writes and their size */
+#define TEST_ASYNC_WRITES 8
+#define TEST_ASYNC_SZ     (1024 * 1024) /* 1 MB */
+
+/* Extent size of batched reads */
+#define TEST_BATCH_EXT_SZ (1024 * 64) /* 64 KB */
+
+/* Level written with a larger stripe unit */
+#define TEST_STRIPE_LEVEL 2
+#define TEST_STRIPE_SZ    (1024 * 128) /* 128 KB */
+
+/* Level written to narrow nodes */
+#define TEST_WIDTH_LEVEL 3
+#define TEST_WIDTH_ZONES 8
+
+/* Mapping pages upserted through a cache of TEST_MAP_CACHE pages */
+#define TEST_MAP_PGS   16
+#define TEST_MAP_CACHE 2
+#define TEST_MAP_DEV   "emu:nzone=400#map_pages=2"
+
+/* Groups of 128 zones, only group 0 loses zones to the metadata */
+#define TEST_GRP_DEV "emu:nzone=256,ngrp=2"
+
+/* Device with data of another layout in the empty reserved zones, the second
+ * zone of the checkpoint and of the mapping log */
+#define TEST_FMT_DEV      "emu:nzone=256"
+#define TEST_FMT_CKPT_ZN  (ZTL_METADATA_ZONES + 1)
+#define TEST_FMT_MPE_ZN   (ZTL_METADATA_ZONES + ZTL_ZMD_CKPT_ZONES + 1)
+
+/* Every Nth append of the emulator completes after the next one. A 1 MB
+ * write to 8 zones puts 4 appends in flight per zone: 31 swaps the last two
+ * appends of a zone, 2 swaps appends of every zone in an irregular order */
+#define TEST_SWAP_DEV   "emu:nzone=256,swap=%u"
+#define TEST_SWAP_SPLIT 31
+#define TEST_SWAP_MANY  2
+
+/* The second device of the list is refused by the emulator */
+#define TEST_RETRY_DEV "emu:nzone=256"
+#define TEST_BAD_DEV   TEST_RETRY_DEV XZTL_MEDIA_DEV_SEP "emu:nzone=0"
+
 static uint8_t *wbuf[TEST_N_BUFFERS];
 static uint8_t *rbuf[TEST_N_BUFFERS];
 
 static const char **devname;
+static const char  *ctxname; /* Device of the second instance */
 
 static void cunit_zrocks_assert_ptr(char *fn, void *ptr) {
     CU_ASSERT((uint64_t)ptr != 0);
@@ -62,6 +108,12 @@ static int cunit_zrocks_exit(void) {
 static void test_zrocks_init(void) {
     int ret;
 
+    ret = zrocks_set_stripe_unit(TEST_STRIPE_LEVEL, TEST_STRIPE_SZ);
+    cunit_zrocks_assert_int("zrocks_set_stripe_unit", ret);
+
+    ret = zrocks_set_node_width(TEST_WIDTH_LEVEL, TEST_WIDTH_ZONES);
+    cunit_zrocks_assert_int("zrocks_set_node_width", ret);
+
     ret = zrocks_init(*devname);
     cunit_zrocks_assert_int("zrocks_init", ret);
 }
@@ -159,6 +211,843 @@ static void test_zrocks_read(void) {
     }
 }
 
+/* Allocates the write and read buffers of TEST_ASYNC_SZ bytes */
+static int test_zrocks_bufs_alloc(uint8_t **buf, uint8_t **rbuf) {
+    *buf  = xztl_media_dma_alloc(TEST_ASYNC_SZ);
+    *rbuf = xztl_media_dma_alloc(TEST_ASYNC_SZ);
+    cunit_zrocks_assert_ptr("xztl_media_dma_alloc", *buf);
+    cunit_zrocks_assert_ptr("xztl_media_dma_alloc", *rbuf);
+
+    return (*buf && *rbuf) ? XZTL_OK : XZTL_MEM;
+}
+
+static void test_zrocks_bufs_free(uint8_t *buf, uint8_t *rbuf) {
+    if (rbuf)
+        xztl_media_dma_free(rbuf);
+    if (buf)
+        xztl_media_dma_free(buf);
+}
+
+static void test_zrocks_bufs_fill(uint8_t *buf, uint8_t seed) {
+    uint64_t off;
+
+    for (off = 0; off < TEST_ASYNC_SZ; off++) buf[off] = (off + seed) % 251;
+}
+
+static uint64_t test_zrocks_map_off(const struct zrocks_map *map) {
+    return map->g.start * ZNS_ALIGMENT * ZTL_IO_SEC_MCMD;
+}
+
+static uint64_t test_zrocks_map_size(const struct zrocks_map *map) {
+    return map->g.num * ZNS_ALIGMENT * ZTL_IO_SEC_MCMD - map->g.padding;
+}
+
+/* Reads the pieces of a write back to back and compares them with the
+ * 'size' bytes written from 'buf' */
+static int test_zrocks_read_maps(struct zrocks_ctx       *ctx,
+                                 const struct zrocks_map *maps,
+                                 uint16_t pieces, const uint8_t *buf,
+                                 uint8_t *rbuf, uint64_t size) {
+    uint64_t piece_sz, done = 0;
+    int      p_i, ret;
+
+    memset(rbuf, 0x0, size);
+    for (p_i = 0; p_i < pieces; p_i++) {
+        piece_sz = test_zrocks_map_size(&maps[p_i]);
+
+        ret = zrocks_ctx_read(ctx, maps[p_i].g.node_id,
+                              test_zrocks_map_off(&maps[p_i]), rbuf + done,
+                              piece_sz, false);
+        cunit_zrocks_assert_int("zrocks_ctx_read", ret);
+        if (ret)
+            return ret;
+        done += piece_sz;
+    }
+    CU_ASSERT(done == size);
+
+    return (done == size) ? memcmp(buf, rbuf, size) : XZTL_ZROCKS_READ_ERR;
+}
+
+static volatile uint32_t async_cb_count;
+
+static void test_zrocks_async_cb(void *ctx, int status, struct zrocks_map *maps,
+                                 uint16_t pieces) {
+    CU_ASSERT(ctx != NULL);
+    CU_ASSERT(status == 0);
+    CU_ASSERT(pieces > 0 && pieces <= ZROCKS_MAX_PIECES);
+    __sync_fetch_and_add(&async_cb_count, 1);
+}
+
+static void test_zrocks_async_write(void) {
+    struct zrocks_wreq *req[TEST_ASYNC_WRITES];
+    struct zrocks_map   maps[TEST_ASYNC_WRITES][ZROCKS_MAX_PIECES];
+    uint16_t            pieces[TEST_ASYNC_WRITES];
+    uint8_t            *buf[TEST_ASYNC_WRITES], *rbuf;
+    int                 wr_i, ret;
+
+    async_cb_count = 0;
+
+    rbuf = xztl_media_dma_alloc(TEST_ASYNC_SZ);
+    cunit_zrocks_assert_ptr("xztl_media_dma_alloc", rbuf);
+    if (!rbuf)
+        return;
+
+    /* Keep all writes in flight at the same time */
+    for (wr_i = 0; wr_i < TEST_ASYNC_WRITES; wr_i++) {
+        buf[wr_i] = xztl_media_dma_alloc(TEST_ASYNC_SZ);
+        cunit_zrocks_assert_ptr("xztl_media_dma_alloc", buf[wr_i]);
+        req[wr_i] = NULL;
+        if (!buf[wr_i])
+            continue;
+
+        memset(buf[wr_i], 0xa0 + wr_i, TEST_ASYNC_SZ);
+        req[wr_i] = zrocks_write_async(buf[wr_i], TEST_ASYNC_SZ, 0,
+                                       test_zrocks_async_cb, buf[wr_i], false);
+        cunit_zrocks_assert_ptr("zrocks_write_async", req[wr_i]);
+    }
+
+    for (wr_i = 0; wr_i < TEST_ASYNC_WRITES; wr_i++) {
+        if (!req[wr_i])
+            continue;
+
+        ret = zrocks_write_wait(req[wr_i], maps[wr_i], &pieces[wr_i]);
+        cunit_zrocks_assert_int("zrocks_write_wait", ret);
+        if (ret)
+            continue;
+
+        cunit_zrocks_assert_int(
+            "zrocks_read:check",
+            test_zrocks_read_maps(NULL, maps[wr_i], pieces[wr_i], buf[wr_i],
+                                  rbuf, TEST_ASYNC_SZ));
+    }
+
+    CU_ASSERT(async_cb_count == TEST_ASYNC_WRITES);
+
+    for (wr_i = 0; wr_i < TEST_ASYNC_WRITES; wr_i++) {
+        if (buf[wr_i])
+            xztl_media_dma_free(buf[wr_i]);
+    }
+    xztl_media_dma_free(rbuf);
+}
+
+static void test_zrocks_append_write(void) {
+    zrocks_set_append(true);
+    test_zrocks_async_write();
+    zrocks_set_append(false);
+}
+
+static void test_zrocks_read_batch(void) {
+    struct zrocks_read_req *reqs;
+    struct zrocks_map       maps[ZROCKS_MAX_PIECES];
+    uint8_t                *buf, *rbuf;
+    uint64_t                off, piece_sz, poff, boff, len;
+    uint16_t                pieces;
+    uint32_t                nreq, req_i;
+    int                     p_i, ret;
+
+    reqs = calloc(TEST_ASYNC_SZ / TEST_BATCH_EXT_SZ + ZROCKS_MAX_PIECES + 1,
+                  sizeof(struct zrocks_read_req));
+    cunit_zrocks_assert_ptr("calloc", reqs);
+    if (test_zrocks_bufs_alloc(&buf, &rbuf) || !reqs)
+        goto FREE;
+
+    test_zrocks_bufs_fill(buf, 0);
+
+    ret = zrocks_write(buf, TEST_ASYNC_SZ, 1, maps, &pieces, false);
+    cunit_zrocks_assert_int("zrocks_write", ret);
+    if (ret)
+        goto FREE;
+
+    /* Split each piece in extents, the first one is not sector aligned */
+    memset(rbuf, 0x0, TEST_ASYNC_SZ);
+    nreq = 0;
+    boff = 0;
+    for (p_i = 0; p_i < pieces; p_i++) {
+        off      = test_zrocks_map_off(&maps[p_i]);
+        piece_sz = test_zrocks_map_size(&maps[p_i]);
+
+        for (poff = 0; poff < piece_sz; poff += len) {
+            len = (poff) ? TEST_BATCH_EXT_SZ : 1000;
+            len = (piece_sz - poff < len) ? piece_sz - poff : len;
+
+            reqs[nreq].node_id = maps[p_i].g.node_id;
+            reqs[nreq].offset  = off + poff;
+            reqs[nreq].buf     = rbuf + boff;
+            reqs[nreq].size    = len;
+            reqs[nreq].status  = -1;
+            nreq++;
+            boff += len;
+        }
+    }
+
+    ret = zrocks_read_batch(reqs, nreq, false);
+    cunit_zrocks_assert_int("zrocks_read_batch", ret);
+
+    for (req_i = 0; req_i < nreq; req_i++)
+        cunit_zrocks_assert_int("zrocks_read_batch:status", reqs[req_i].status);
+
+    CU_ASSERT(boff == TEST_ASYNC_SZ);
+    cunit_zrocks_assert_int("zrocks_read_batch:check",
+                            memcmp(buf, rbuf, TEST_ASYNC_SZ));
+
+FREE:
+    free(reqs);
+    test_zrocks_bufs_free(buf, rbuf);
+}
+
+static void test_zrocks_stripe_unit(void) {
+    struct zrocks_map maps[ZROCKS_MAX_PIECES];
+    uint64_t          rd_off[4] = {0, 4000, 131000, 300001};
+    size_t            rd_sz[4]  = {4096, 200000, 9000, 500000};
+    uint8_t          *buf, *rbuf;
+    uint64_t          off;
+    uint16_t          pieces;
+    int               p_i, rd_i, ret;
+
+    if (test_zrocks_bufs_alloc(&buf, &rbuf))
+        goto FREE;
+
+    test_zrocks_bufs_fill(buf, 0);
+
+    ret = zrocks_write(buf, TEST_ASYNC_SZ - 1000, TEST_STRIPE_LEVEL, maps,
+                       &pieces, false);
+    cunit_zrocks_assert_int("zrocks_write", ret);
+    if (ret)
+        goto FREE;
+
+    /* Whole pieces and reads crossing stripe units of the first piece */
+    for (p_i = 0; p_i < pieces; p_i++)
+        CU_ASSERT((1U << maps[p_i].g.stripe) * ZNS_ALIGMENT * ZTL_IO_SEC_MCMD ==
+                  TEST_STRIPE_SZ);
+
+    cunit_zrocks_assert_int("zrocks_read:check",
+                            test_zrocks_read_maps(NULL, maps, pieces, buf, rbuf,
+                                                  TEST_ASYNC_SZ - 1000));
+
+    off = test_zrocks_map_off(&maps[0]);
+    for (rd_i = 0; pieces == 1 && rd_i < 4; rd_i++) {
+        memset(rbuf, 0x0, rd_sz[rd_i]);
+        ret = zrocks_read(maps[0].g.node_id, off + rd_off[rd_i], rbuf,
+                          rd_sz[rd_i], false);
+        cunit_zrocks_assert_int("zrocks_read", ret);
+        cunit_zrocks_assert_int("zrocks_read:check",
+                                memcmp(buf + rd_off[rd_i], rbuf, rd_sz[rd_i]));
+    }
+
+FREE:
+    test_zrocks_bufs_free(buf, rbuf);
+}
+
+/* The narrow id of a free slot that was not split, no zone holds its width */
+static int test_zrocks_node_unsplit(struct ztl_pro_node_grp *pro,
+                                    struct zrocks_map       *map) {
+    uint32_t slot;
+
+    for (slot = 0; slot < pro->nslots; slot++) {
+        if (pro->vnodes[slot].status == XZTL_ZMD_NODE_FREE &&
+            !pro->slot_width[slot])
+            break;
+    }
+    if (slot == pro->nslots)
+        return -1;
+
+    memset(map, 0x0, sizeof(struct zrocks_map));
+    map->g.node_id = pro->id_base + pro->nslots + slot * ZTL_PRO_NODE_SUBS;
+    map->g.num     = 1;
+
+    return 0;
+}
+
+static void test_zrocks_node_width(void) {
+    struct zrocks_map    maps[ZROCKS_MAX_PIECES], unsplit;
+    struct ztl_pro_node *node;
+    uint8_t             *buf, *rbuf;
+    uint32_t             nfree;
+    uint16_t             pieces;
+    int                  wr_i, ret;
+
+    if (test_zrocks_bufs_alloc(&buf, &rbuf))
+        goto FREE;
+
+    /* Narrow nodes of the level share a single split node */
+    nfree = zrocks_gc_get_free_nodes_num();
+    for (wr_i = 0; wr_i < 2; wr_i++) {
+        test_zrocks_bufs_fill(buf, wr_i);
+
+        /* 1 MB wraps several times around the zones of a narrow node */
+        ret = zrocks_write(buf, TEST_ASYNC_SZ, TEST_WIDTH_LEVEL, maps, &pieces,
+                           false);
+        cunit_zrocks_assert_int("zrocks_write", ret);
+        if (ret)
+            goto FREE;
+
+        cunit_zrocks_assert_int("zrocks_read:check",
+                                test_zrocks_read_maps(NULL, maps, pieces, buf,
+                                                      rbuf, TEST_ASYNC_SZ));
+    }
+    CU_ASSERT(nfree - zrocks_gc_get_free_nodes_num() == 1);
+
+    /* Zones keep the width of their node, a recovered map restores it */
+    node = ztl()->pro->get_vnode_fn(maps[0].g.node_id);
+    cunit_zrocks_assert_ptr("get_vnode_fn", node);
+    if (!node)
+        goto FREE;
+    CU_ASSERT(node->vzones[0]->zmd_entry->width == TEST_WIDTH_ZONES);
+    CU_ASSERT(zrocks_node_set_map(&maps[0], TEST_WIDTH_LEVEL) == 0);
+
+    /* A narrow node of unknown width is refused, not dropped */
+    if (!test_zrocks_node_unsplit(node->grp->pro, &unsplit))
+        CU_ASSERT(zrocks_node_set_map(&unsplit, TEST_WIDTH_LEVEL) != 0);
+
+FREE:
+    test_zrocks_bufs_free(buf, rbuf);
+}
+
+/* Reordered appends are mapped where they completed, or written again when
+ * they need more than ZROCKS_MAX_PIECES pieces */
+static void test_zrocks_swap_write(uint32_t swap, uint8_t *buf, uint8_t *rbuf) {
+    struct zrocks_map  maps[ZROCKS_MAX_PIECES];
+    struct zrocks_ctx *ctx;
+    char               dev[64];
+    uint16_t           pieces;
+    int                ret;
+
+    ctx = zrocks_ctx_new();
+    cunit_zrocks_assert_ptr("zrocks_ctx_new", ctx);
+    if (!ctx)
+        return;
+
+    ret = zrocks_ctx_set_node_width(ctx, TEST_WIDTH_LEVEL, TEST_WIDTH_ZONES);
+    cunit_zrocks_assert_int("zrocks_ctx_set_node_width", ret);
+
+    snprintf(dev, sizeof(dev), TEST_SWAP_DEV, swap);
+    ret = zrocks_ctx_init(ctx, dev);
+    cunit_zrocks_assert_int("zrocks_ctx_init", ret);
+    if (ret)
+        goto FREE_CTX;
+
+    zrocks_ctx_set_append(ctx, true);
+    test_zrocks_bufs_fill(buf, swap);
+
+    ret = zrocks_ctx_write(ctx, buf, TEST_ASYNC_SZ, TEST_WIDTH_LEVEL, maps,
+                           &pieces, false);
+    cunit_zrocks_assert_int("zrocks_ctx_write", ret);
+    if (ret)
+        goto EXIT;
+
+    if (swap == TEST_SWAP_SPLIT)
+        CU_ASSERT(pieces > 1 && pieces <= ZROCKS_MAX_PIECES);
+    else
+        CU_ASSERT(pieces == 1);
+
+    cunit_zrocks_assert_int("zrocks_swap:check",
+                            test_zrocks_read_maps(ctx, maps, pieces, buf, rbuf,
+                                                  TEST_ASYNC_SZ));
+
+EXIT:
+    ret = zrocks_ctx_exit(ctx);
+    cunit_zrocks_assert_int("zrocks_ctx_exit", ret);
+FREE_CTX:
+    zrocks_ctx_free(ctx);
+}
+
+static void test_zrocks_append_reorder(void) {
+    uint8_t *buf, *rbuf;
+
+    if (test_zrocks_bufs_alloc(&buf, &rbuf))
+        goto FREE;
+
+    test_zrocks_swap_write(TEST_SWAP_SPLIT, buf, rbuf);
+    test_zrocks_swap_write(TEST_SWAP_MANY, buf, rbuf);
+
+FREE:
+    test_zrocks_bufs_free(buf, rbuf);
+}
+
+/* Writes the same level in two instances and reads both back */
+static int test_zrocks_ctx_rw(struct zrocks_ctx *ctx, uint8_t *buf,
+                              uint8_t *rbuf, uint8_t seed) {
+    struct zrocks_map maps[ZROCKS_MAX_PIECES];
+    uint16_t          pieces;
+    int               ret;
+
+    test_zrocks_bufs_fill(buf, seed);
+
+    ret = zrocks_ctx_write(ctx, buf, TEST_ASYNC_SZ, 0, maps, &pieces, false);
+    cunit_zrocks_assert_int("zrocks_ctx_write", ret);
+    if (ret)
+        return ret;
+
+    return test_zrocks_read_maps(ctx, maps, pieces, buf, rbuf, TEST_ASYNC_SZ);
+}
+
+static void test_zrocks_config(void) {
+    struct xztl_config cfg;
+
+    /* The default instance runs with the options given to zrocks_init */
+    CU_ASSERT(xztl_config_check(xztl_config_get()) == XZTL_OK);
+
+    xztl_config_default(&cfg);
+    CU_ASSERT(xztl_config_parse(&cfg, "qdepth=256,levels=2,write_core=-1") ==
+              XZTL_OK);
+    CU_ASSERT(cfg.qdepth == 256 && cfg.levels == 2);
+    CU_ASSERT(cfg.write_core == XZTL_WRITE_CORE_NONE);
+    CU_ASSERT(cfg.lanes == ZTL_IO_LANE_NUM);
+    CU_ASSERT(xztl_config_check(&cfg) == XZTL_OK);
+
+    CU_ASSERT(xztl_config_parse(&cfg, "qdepth") == XZTL_CONFIG_ERR);
+    CU_ASSERT(xztl_config_parse(&cfg, "depth=8") == XZTL_CONFIG_ERR);
+    CU_ASSERT(xztl_config_parse(&cfg, "lanes=two") == XZTL_CONFIG_ERR);
+
+    CU_ASSERT(xztl_config_parse(&cfg, "mgmt_workers=4") == XZTL_OK);
+    CU_ASSERT(cfg.mgmt_workers == 4 && xztl_config_check(&cfg) == XZTL_OK);
+    cfg.mgmt_workers = ZTL_MGMT_WORKERS_MAX + 1;
+    CU_ASSERT(xztl_config_check(&cfg) == XZTL_CONFIG_ERR);
+    cfg.mgmt_workers = ZTL_MGMT_WORKERS;
+
+    /* Zero resets trimmed nodes right away */
+    CU_ASSERT(xztl_config_parse(&cfg, "reset_target=0") == XZTL_OK);
+    CU_ASSERT(cfg.reset_target == 0 && xztl_config_check(&cfg) == XZTL_OK);
+
+    CU_ASSERT(xztl_config_parse(&cfg, "init_threads=4") == XZTL_OK);
+    CU_ASSERT(cfg.init_threads == 4 && xztl_config_check(&cfg) == XZTL_OK);
+    cfg.init_threads = XZTL_INIT_THREADS_MAX + 1;
+    CU_ASSERT(xztl_config_check(&cfg) == XZTL_CONFIG_ERR);
+    cfg.init_threads = XZTL_INIT_THREADS;
+
+    CU_ASSERT(cfg.map_pages == ZTL_MAP_CACHE_PGS);
+    CU_ASSERT(xztl_config_parse(&cfg, "map_pages=0") == XZTL_OK);
+    CU_ASSERT(xztl_config_check(&cfg) == XZTL_CONFIG_ERR);
+    cfg.map_pages = ZTL_MAP_CACHE_PGS;
+
+    /* The cache is smaller than the table */
+    CU_ASSERT(cfg.map_table == 0);
+    CU_ASSERT(xztl_config_parse(&cfg, "map_table=4096") == XZTL_OK);
+    CU_ASSERT(cfg.map_table == 4096 && xztl_config_check(&cfg) == XZTL_OK);
+    cfg.map_pages = cfg.map_table + 1;
+    CU_ASSERT(xztl_config_check(&cfg) == XZTL_CONFIG_ERR);
+    cfg.map_pages = ZTL_MAP_CACHE_PGS;
+    cfg.map_table = 0;
+
+    cfg.qdepth = 100;
+    CU_ASSERT(xztl_config_check(&cfg) == XZTL_CONFIG_ERR);
+    cfg.qdepth = 128;
+    cfg.levels = ZROCKS_LEVEL_NUM + 1;
+    CU_ASSERT(xztl_config_check(&cfg) == XZTL_CONFIG_ERR);
+}
+
+static void test_zrocks_ctx(void) {
+    struct xztl_config cfg;
+    struct zrocks_ctx *ctx, *prev;
+    uint8_t           *buf, *rbuf;
+    uint32_t           nfree, ctx_nfree;
+    int                ret;
+
+    if (!ctxname) {
+        printf("\n Second device not given, skipped.\n");
+        return;
+    }
+
+    ctx = zrocks_ctx_new();
+    cunit_zrocks_assert_ptr("zrocks_ctx_new", ctx);
+    if (!ctx)
+        return;
+
+    /* The context runs with its own configuration */
+    xztl_config_default(&cfg);
+    cfg.levels = 2;
+
+    ret = zrocks_ctx_set_write_lanes(ctx, 0, 1);
+    cunit_zrocks_assert_int("zrocks_ctx_set_write_lanes", ret);
+
+    prev = zrocks_ctx_bind(ctx);
+    CU_ASSERT(prev == NULL);
+    ret = xztl_config_set(&cfg);
+    cunit_zrocks_assert_int("xztl_config_set", ret);
+    zrocks_ctx_bind(prev);
+    CU_ASSERT(xztl_config_get()->levels != cfg.levels);
+
+    ret = zrocks_ctx_init(ctx, ctxname);
+    cunit_zrocks_assert_int("zrocks_ctx_init", ret);
+    if (ret)
+        goto FREE_CTX;
+
+    if (test_zrocks_bufs_alloc(&buf, &rbuf))
+        goto EXIT;
+
+    /* Nodes taken by the context are not taken from the default instance */
+    nfree = zrocks_gc_get_free_nodes_num();
+
+    cunit_zrocks_assert_int("zrocks_ctx:check",
+                            test_zrocks_ctx_rw(ctx, buf, rbuf, 0x3));
+    CU_ASSERT(nfree == zrocks_gc_get_free_nodes_num());
+    ctx_nfree = zrocks_ctx_gc_get_free_nodes_num(ctx);
+    CU_ASSERT(ctx_nfree < zrocks_ctx_gc_get_nodes_num(ctx));
+
+    /* The functions without a context ignore the thread binding */
+    prev = zrocks_ctx_bind(ctx);
+    CU_ASSERT(prev == NULL);
+    CU_ASSERT(xztl_config_get()->levels == cfg.levels);
+    cunit_zrocks_assert_int("zrocks_default:check",
+                            test_zrocks_ctx_rw(NULL, buf, rbuf, 0x5));
+    zrocks_ctx_bind(prev);
+
+    CU_ASSERT(ctx_nfree == zrocks_ctx_gc_get_free_nodes_num(ctx));
+
+EXIT:
+    test_zrocks_bufs_free(buf, rbuf);
+
+    ret = zrocks_ctx_exit(ctx);
+    cunit_zrocks_assert_int("zrocks_ctx_exit", ret);
+FREE_CTX:
+    zrocks_ctx_free(ctx);
+}
+
+/* The table loaded from a clean checkpoint matches the live table */
+static void test_zrocks_zmd_ckpt(void) {
+    struct app_group            *grp, tmp;
+    struct app_zmd_entry        *zn, *tzn;
+    struct xnvme_spec_znd_descr *zinfo, *tzinfo;
+    uint64_t                     zn_i;
+    uint16_t                     grp_i;
+
+    for (grp_i = 0; (grp = ztl()->groups.get_fn(grp_i)); grp_i++)
+        CU_ASSERT(ztl()->zmd->flush_fn(grp) == XZTL_OK);
+    CU_ASSERT(ztl()->zmd->close_fn() == XZTL_OK);
+
+    grp = ztl()->groups.get_fn(0);
+    if (!grp) {
+        CU_FAIL("test_zrocks_zmd_ckpt: no group");
+        return;
+    }
+
+    memset(&tmp, 0x0, sizeof(struct app_group));
+    tmp.zmd.entries  = grp->zmd.entries;
+    tmp.zmd.entry_sz = grp->zmd.entry_sz;
+    tmp.zmd.tbl      = calloc(tmp.zmd.entries, tmp.zmd.entry_sz);
+    cunit_zrocks_assert_ptr("test_zrocks_zmd_ckpt", tmp.zmd.tbl);
+    if (!tmp.zmd.tbl)
+        return;
+
+    /* Reopens the checkpoint used by the instance */
+    if (ztl()->zmd->load_fn(&tmp) != XZTL_OK) {
+        CU_FAIL("test_zrocks_zmd_ckpt: load_fn");
+        free(tmp.zmd.tiny.dirty);
+        free(tmp.zmd.tbl);
+        return;
+    }
+    CU_ASSERT(tmp.zmd.byte.magic == APP_MAGIC);
+
+    for (zn_i = 0; zn_i < grp->zmd.entries; zn_i++) {
+        zn     = ztl()->zmd->get_fn(grp, zn_i, 0);
+        tzn    = ztl()->zmd->get_fn(&tmp, zn_i, 0);
+        zinfo  = XNVME_ZND_REPORT_DESCR(grp->zmd.report, zn_i);
+        tzinfo = XNVME_ZND_REPORT_DESCR(tmp.zmd.report, zn_i);
+
+        /* Reserved zones are written since, see ztl_zmd_format_check */
+        if (zn->flags & XZTL_ZMD_RSVD) {
+            CU_ASSERT(tzn->flags == zn->flags && tzinfo->wp == tzn->wptr);
+            continue;
+        }
+
+        CU_ASSERT(tzn->wptr == zn->wptr && tzn->flags == zn->flags);
+        CU_ASSERT(tzn->level == zn->level && tzn->width == zn->width);
+        CU_ASSERT(tzinfo->zcap == zinfo->zcap && tzinfo->wp == zn->wptr);
+    }
+
+    xnvme_buf_virt_free(tmp.zmd.report);
+    free(tmp.zmd.tiny.dirty);
+    free(tmp.zmd.tbl);
+}
+
+/* Entries point to 'id + seq' */
+static int test_zrocks_map_check(uint64_t ent_per_pg, uint64_t seq) {
+    struct app_map_entry ent;
+    uint64_t             id;
+    uint32_t             pg, ent_i;
+    int                  err = 0;
+
+    for (pg = 0; pg < TEST_MAP_PGS; pg++) {
+        for (ent_i = 0; ent_i < 4; ent_i++) {
+            id       = pg * ent_per_pg + ent_i * 7;
+            ent.addr = ztl()->map->read_fn(id);
+            if (ent.g.offset != id + seq || ent.g.nsec != 1)
+                err++;
+        }
+    }
+
+    return err;
+}
+
+static void test_zrocks_map_upsert(struct zrocks_ctx *ctx, uint64_t ent_per_pg,
+                                   uint64_t seq) {
+    struct app_map_entry ent;
+    uint64_t             id, old;
+    uint32_t             pg, ent_i;
+    int                  ret;
+
+    /* Threads share the cached pages, evictions race with the upserts */
+#pragma omp parallel for private(ent_i, id, ent, old, ret)
+    for (pg = 0; pg < TEST_MAP_PGS; pg++) {
+        zrocks_ctx_bind(ctx);
+        for (ent_i = 0; ent_i < 4; ent_i++) {
+            id           = pg * ent_per_pg + ent_i * 7;
+            ent.addr     = 0;
+            ent.g.offset = id + seq;
+            ent.g.nsec   = 1;
+
+            ret = ztl()->map->upsert_fn(id, ent.addr, &old, 0);
+            cunit_zrocks_assert_int("upsert_fn", ret);
+        }
+    }
+}
+
+/* Pages evicted from a small mapping cache are read back from the log */
+static void test_zrocks_map(void) {
+    struct zrocks_ctx *ctx;
+    uint64_t           ent_per_pg;
+    int                ret;
+
+    ctx = zrocks_ctx_new();
+    cunit_zrocks_assert_ptr("zrocks_ctx_new", ctx);
+    if (!ctx)
+        return;
+
+    ret = zrocks_ctx_init(ctx, TEST_MAP_DEV);
+    cunit_zrocks_assert_int("zrocks_ctx_init", ret);
+    if (ret)
+        goto FREE_CTX;
+
+    zrocks_ctx_bind(ctx);
+    CU_ASSERT(xztl_config_get()->map_pages == TEST_MAP_CACHE);
+
+    ent_per_pg = ztl()->smap.ent_per_pg;
+    test_zrocks_map_upsert(ctx, ent_per_pg, 1);
+
+    cunit_zrocks_assert_int("map:check", test_zrocks_map_check(ent_per_pg, 1));
+
+    /* Out of the pages of the mapping table */
+    CU_ASSERT(ztl()->mpe->get_fn(ztl()->smap.entries) == NULL);
+    CU_ASSERT(ztl()->smap.entries == ztl_mpe_max_pages());
+
+    ztl()->map->persist_fn();
+    cunit_zrocks_assert_int("map:persist",
+                            test_zrocks_map_check(ent_per_pg, 1));
+
+    /* Restarted modules load the pages from the mapping log */
+    ztl()->map->exit_fn();
+    ztl()->mpe->close_fn();
+    ret = ztl()->mpe->load_fn();
+    cunit_zrocks_assert_int("load_fn", ret);
+    ret = ztl()->map->init_fn();
+    cunit_zrocks_assert_int("init_fn", ret);
+    cunit_zrocks_assert_int("map:load", test_zrocks_map_check(ent_per_pg, 1));
+
+    /* Committed upserts survive a crash that loses the cached pages, the
+     * log is closed before the map can write anything */
+    test_zrocks_map_upsert(ctx, ent_per_pg, 2);
+    ret = ztl()->map->commit_fn();
+    cunit_zrocks_assert_int("commit_fn", ret);
+    ztl()->mpe->close_fn();
+    ztl()->map->exit_fn();
+    ret = ztl()->mpe->load_fn();
+    cunit_zrocks_assert_int("load_fn", ret);
+    ret = ztl()->map->init_fn();
+    cunit_zrocks_assert_int("init_fn", ret);
+    cunit_zrocks_assert_int("map:commit", test_zrocks_map_check(ent_per_pg, 2));
+    zrocks_ctx_bind(NULL);
+
+    ret = zrocks_ctx_exit(ctx);
+    cunit_zrocks_assert_int("zrocks_ctx_exit", ret);
+FREE_CTX:
+    zrocks_ctx_free(ctx);
+}
+
+/* Node ids of a group follow the last node of the previous group */
+static void test_zrocks_node_ids(void) {
+    struct zrocks_ctx       *ctx;
+    struct app_group        *grp;
+    struct ztl_pro_node_grp *pro = NULL, *pro0 = NULL;
+    uint32_t                 id_base = 0, *invalid;
+    uint16_t                 grp_i;
+    int                      ret;
+
+    ctx = zrocks_ctx_new();
+    cunit_zrocks_assert_ptr("zrocks_ctx_new", ctx);
+    if (!ctx)
+        return;
+
+    ret = zrocks_ctx_init(ctx, TEST_GRP_DEV);
+    cunit_zrocks_assert_int("zrocks_ctx_init", ret);
+    if (ret)
+        goto FREE_CTX;
+
+    zrocks_ctx_bind(ctx);
+    for (grp_i = 0; (grp = ztl()->groups.get_fn(grp_i)); grp_i++) {
+        pro = (struct ztl_pro_node_grp *)grp->pro;
+        if (!grp_i)
+            pro0 = pro;
+
+        CU_ASSERT(pro->rsvd == get_rsvd_zone_num(grp_i));
+        CU_ASSERT(pro->id_base == id_base);
+        CU_ASSERT(ztl()->pro->get_vnode_fn(id_base) == &pro->vnodes[0]);
+        CU_ASSERT(ztl()->pro->get_vnode_fn(id_base + pro->nnodes - 1) ==
+                  &pro->vnodes[pro->nnodes - 1]);
+        id_base += pro->nnodes;
+    }
+
+    CU_ASSERT(grp_i == 2);
+    CU_ASSERT(pro0 && pro->nslots > pro0->nslots);
+    CU_ASSERT(ztl()->pro->get_vnode_fn(id_base) == NULL);
+    CU_ASSERT(zrocks_ctx_gc_get_nodes_num(ctx) == id_base);
+
+    invalid = calloc(id_base, sizeof(uint32_t));
+    cunit_zrocks_assert_ptr("calloc", invalid);
+    if (invalid) {
+        CU_ASSERT(zrocks_ctx_gc_get_full_nodes(ctx, invalid, id_base) ==
+                  XZTL_OK);
+        CU_ASSERT(zrocks_ctx_gc_get_full_nodes(ctx, invalid, id_base - 1) !=
+                  XZTL_OK);
+        free(invalid);
+    }
+    zrocks_ctx_bind(NULL);
+
+    ret = zrocks_ctx_exit(ctx);
+    cunit_zrocks_assert_int("zrocks_ctx_exit", ret);
+FREE_CTX:
+    zrocks_ctx_free(ctx);
+}
+
+/* Writes the first sector of a zone of the first group, or resets it */
+static int test_zrocks_fmt_zone(uint32_t zone, uint8_t reset) {
+    struct xztl_io_mcmd cmd;
+    struct xztl_zn_mcmd zcmd;
+    struct xztl_core   *core;
+    uint8_t            *buf;
+    int                 ret;
+    get_xztl_core(&core);
+
+    if (reset) {
+        memset(&zcmd, 0x0, sizeof(struct xztl_zn_mcmd));
+        zcmd.opcode      = XZTL_ZONE_MGMT_RESET;
+        zcmd.addr.g.zone = zone;
+        zcmd.addr.g.sect = (uint64_t)zone * core->media->geo.sec_zn;
+        zcmd.nzones      = 1;
+        return xztl_media_submit_zn(&zcmd);
+    }
+
+    buf = xztl_media_dma_alloc(core->media->geo.nbytes);
+    if (!buf)
+        return XZTL_MEM;
+    memset(buf, 0xab, core->media->geo.nbytes);
+
+    memset(&cmd, 0x0, sizeof(struct xztl_io_mcmd));
+    cmd.opcode         = XZTL_CMD_WRITE;
+    cmd.naddr          = 1;
+    cmd.synch          = 1;
+    cmd.addr[0].g.sect = (uint64_t)zone * core->media->geo.sec_zn;
+    cmd.nsec[0]        = 1;
+    cmd.prp[0]         = (uint64_t)buf;
+
+    ret = xztl_media_submit_io(&cmd);
+    xztl_media_dma_free(buf);
+
+    return ret;
+}
+
+/* Reserved zones holding data of another layout fail the startup */
+static void test_zrocks_format(void) {
+    struct zrocks_ctx *ctx;
+    struct app_group  *grp, tmp;
+    int                ret;
+
+    ctx = zrocks_ctx_new();
+    cunit_zrocks_assert_ptr("zrocks_ctx_new", ctx);
+    if (!ctx)
+        return;
+
+    ret = zrocks_ctx_init(ctx, TEST_FMT_DEV);
+    cunit_zrocks_assert_int("zrocks_ctx_init", ret);
+    if (ret)
+        goto FREE_CTX;
+
+    zrocks_ctx_bind(ctx);
+    grp = ztl()->groups.get_fn(0);
+
+    memset(&tmp, 0x0, sizeof(struct app_group));
+    tmp.zmd.entries  = grp->zmd.entries;
+    tmp.zmd.entry_sz = grp->zmd.entry_sz;
+    tmp.zmd.tbl      = calloc(tmp.zmd.entries, tmp.zmd.entry_sz);
+    cunit_zrocks_assert_ptr("calloc", tmp.zmd.tbl);
+
+    /* Zone metadata checkpoint */
+    cunit_zrocks_assert_int("fmt:ckpt",
+                            test_zrocks_fmt_zone(TEST_FMT_CKPT_ZN, 0));
+    if (tmp.zmd.tbl) {
+        CU_ASSERT(ztl()->zmd->load_fn(&tmp) == XZTL_ZTL_FORMAT_ERR);
+        CU_ASSERT(tmp.zmd.report == NULL);
+        free(tmp.zmd.tiny.dirty);
+        tmp.zmd.tiny.dirty = NULL;
+
+        cunit_zrocks_assert_int("fmt:reset",
+                                test_zrocks_fmt_zone(TEST_FMT_CKPT_ZN, 1));
+        CU_ASSERT(ztl()->zmd->load_fn(&tmp) == XZTL_OK);
+        xnvme_buf_virt_free(tmp.zmd.report);
+        free(tmp.zmd.tiny.dirty);
+        free(tmp.zmd.tbl);
+    }
+
+    /* Mapping log */
+    ztl()->map->exit_fn();
+    ztl()->mpe->close_fn();
+    cunit_zrocks_assert_int("fmt:mpe",
+                            test_zrocks_fmt_zone(TEST_FMT_MPE_ZN, 0));
+    CU_ASSERT(ztl()->mpe->load_fn() == XZTL_ZTL_FORMAT_ERR);
+
+    cunit_zrocks_assert_int("fmt:reset",
+                            test_zrocks_fmt_zone(TEST_FMT_MPE_ZN, 1));
+    ret = ztl()->mpe->load_fn();
+    cunit_zrocks_assert_int("load_fn", ret);
+    ret = ztl()->map->init_fn();
+    cunit_zrocks_assert_int("init_fn", ret);
+    zrocks_ctx_bind(NULL);
+
+    ret = zrocks_ctx_exit(ctx);
+    cunit_zrocks_assert_int("zrocks_ctx_exit", ret);
+FREE_CTX:
+    zrocks_ctx_free(ctx);
+}
+
+/* A failed startup releases the devices registered before the failure */
+static void test_zrocks_init_retry(void) {
+    struct zrocks_ctx *ctx, *prev;
+    int                ret;
+
+    ctx = zrocks_ctx_new();
+    cunit_zrocks_assert_ptr("zrocks_ctx_new", ctx);
+    if (!ctx)
+        return;
+
+    CU_ASSERT(zrocks_ctx_init(ctx, TEST_BAD_DEV) != XZTL_OK);
+    prev = zrocks_ctx_bind(ctx);
+    CU_ASSERT(xztl_media_ndevs() == 0);
+    zrocks_ctx_bind(prev);
+
+    ret = zrocks_ctx_init(ctx, TEST_RETRY_DEV);
+    cunit_zrocks_assert_int("zrocks_ctx_init", ret);
+    if (ret)
+        goto FREE_CTX;
+
+    prev = zrocks_ctx_bind(ctx);
+    CU_ASSERT(xztl_media_ndevs() == 1);
+    zrocks_ctx_bind(prev);
+
+    ret = zrocks_ctx_exit(ctx);
+    cunit_zrocks_assert_int("zrocks_ctx_exit", ret);
+FREE_CTX:
+    zrocks_ctx_free(ctx);
+}
+
 static void test_zrocks_random_read(void) {
     uint64_t id;
     uint64_t random_off[4] = {63, 24567, 175678, 267192};
@@ -204,6 +1093,57 @@ static void test_zrocks_random_read(void) {
     for (int i = 0; i < TEST_N_BUFFERS; i++) xztl_media_dma_free(wbuf[i]);
 }
 
+/* A replaced object reads the new data, a deleted one is not found */
+static void test_zrocks_delete(void) {
+    uint64_t id;
+    size_t   size;
+    uint8_t *wb, *rb;
+    int      ret;
+
+    id   = TEST_RANDOM_ID;
+    size = 1024 * 256 + 100;
+
+    wb = xztl_media_dma_alloc(size);
+    rb = xztl_media_dma_alloc(size);
+    cunit_zrocks_assert_ptr("xztl_media_dma_alloc", wb);
+    cunit_zrocks_assert_ptr("xztl_media_dma_alloc", rb);
+    if (!wb || !rb)
+        goto FREE;
+
+    memset(wb, 0xab, size);
+    memset(rb, 0x0, size);
+
+    ret = zrocks_new(id, wb, size, 0);
+    cunit_zrocks_assert_int("zrocks_new", ret);
+
+    ret = zrocks_read_obj(id, 0, rb, size);
+    cunit_zrocks_assert_int("zrocks_read_obj", ret);
+    cunit_zrocks_assert_int("zrocks_read_obj:check", memcmp(wb, rb, size));
+
+    /* Reads past the end of the new object */
+    CU_ASSERT(zrocks_read_obj(id, size - 50, rb, 100) != XZTL_OK);
+
+    /* A shorter rewrite replaces the whole object */
+    memset(wb, 0xcd, size / 2);
+    ret = zrocks_new(id, wb, size / 2, 0);
+    cunit_zrocks_assert_int("zrocks_new", ret);
+    ret = zrocks_read_obj(id, 0, rb, size / 2);
+    cunit_zrocks_assert_int("zrocks_read_obj", ret);
+    cunit_zrocks_assert_int("zrocks_read_obj:check",
+                            memcmp(wb, rb, size / 2));
+    CU_ASSERT(zrocks_read_obj(id, size / 2 - 50, rb, 100) != XZTL_OK);
+
+    ret = zrocks_delete(id);
+    cunit_zrocks_assert_int("zrocks_delete", ret);
+    CU_ASSERT(zrocks_read_obj(id, 0, rb, size) != XZTL_OK);
+
+FREE:
+    if (wb)
+        xztl_media_dma_free(wb);
+    if (rb)
+        xztl_media_dma_free(rb);
+}
+
 int main(int argc, const char **argv) {
     int failed;
 
@@ -215,6 +1155,12 @@ int main(int argc, const char **argv) {
     devname = &argv[1];
     printf("Device: %s\n", *devname);
 
+    /* Emulated devices are not shared, the second instance may reuse them */
+    if (argc > 2)
+        ctxname = argv[2];
+    else if (!strncmp(*devname, XZTL_EMU_PREFIX, strlen(XZTL_EMU_PREFIX)))
+        ctxname = *devname;
+
     CU_pSuite pSuite = NULL;
 
     if (CUE_SUCCESS != CU_initialize_registry())
@@ -231,6 +1177,29 @@ int main(int argc, const char **argv) {
         (CU_add_test(pSuite, "ZRocks Read", test_zrocks_read) == NULL) ||
         (CU_add_test(pSuite, "ZRocks Random Read", test_zrocks_random_read) ==
          NULL) ||
+        (CU_add_test(pSuite, "ZRocks Delete", test_zrocks_delete) == NULL) ||
+        (CU_add_test(pSuite, "ZRocks Async Write", test_zrocks_async_write) ==
+         NULL) ||
+        (CU_add_test(pSuite, "ZRocks Append Write", test_zrocks_append_write) ==
+         NULL) ||
+        (CU_add_test(pSuite, "ZRocks Read Batch", test_zrocks_read_batch) ==
+         NULL) ||
+        (CU_add_test(pSuite, "ZRocks Stripe Unit", test_zrocks_stripe_unit) ==
+         NULL) ||
+        (CU_add_test(pSuite, "ZRocks Append Reorder",
+                     test_zrocks_append_reorder) == NULL) ||
+        (CU_add_test(pSuite, "ZRocks Node Width", test_zrocks_node_width) ==
+         NULL) ||
+        (CU_add_test(pSuite, "ZRocks Config", test_zrocks_config) == NULL) ||
+        (CU_add_test(pSuite, "ZRocks Context", test_zrocks_ctx) == NULL) ||
+        (CU_add_test(pSuite, "ZRocks ZMD Checkpoint", test_zrocks_zmd_ckpt) ==
+         NULL) ||
+        (CU_add_test(pSuite, "ZRocks Map", test_zrocks_map) == NULL) ||
+        (CU_add_test(pSuite, "ZRocks Node Ids", test_zrocks_node_ids) ==
+         NULL) ||
+        (CU_add_test(pSuite, "ZRocks Format", test_zrocks_format) == NULL) ||
+        (CU_add_test(pSuite, "ZRocks Init Retry", test_zrocks_init_retry) ==
+         NULL) ||
         (CU_add_test(pSuite, "Close ZRocks", test_zrocks_exit) == NULL)) {
         CU_cleanup_registry();
         return CU_get_error();
@@ -43,6 +43,11 @@ extern "C" {
 /* Media minimum/maximum read/write size in sectors */
 #define ZTL_IO_SEC_MCMD 8
 
+/* Maximum number of mapping pieces created by a single write. A write takes
+ * a piece per node, and more if zone appends complete out of order. Same as
+ * XZTL_WIO_MAX_PIECES */
+#define ZROCKS_MAX_PIECES 8
+
 struct zrocks_map {
     union {
         struct {
@@ -55,8 +60,10 @@ struct zrocks_map {
 
             /* Offset in node(media maximum write size in sectors: 8 or 16) */
             uint64_t num     : 11;
-            uint64_t padding : 16; // 64k
-            uint64_t reserve : 1;
+            uint64_t padding : 15; // 32k
+
+            /* Log2 of the node stripe unit in ZTL_IO_SEC_MCMD units */
+            uint64_t stripe : 2;
         } g;
 
         uint64_t addr;
@@ -69,12 +76,65 @@ struct zrocks_map {
  * @param dev_name URI provided by the user
  * 	 	   e.g. PCIe:    pci:0000:03:00.0?nsid=2
  * 	 	   	Fabrics: fab:172.20.0.100:4420?nsid=2
+ * 	 	   Several URIs separated by ';' stack devices of the same
+ * 	 	   geometry, nodes are spread over all of them
  *
  * @return Returns zero if the calls succeed, or a negative value
  * 	   if the call fails
  */
 int zrocks_init(const char *dev_name);
 
+/**
+ * Set the number of concurrent writer lanes of a level. Each lane has its
+ * own writer thread and writes to its own node. Must be called before
+ * 'zrocks_init'
+ *
+ * @param level LSM-Tree level
+ * @param lanes Number of lanes, from 1 to ZTL_IO_LANE_MAX
+ *
+ * @return Returns zero if the calls succeed, or a negative value
+ * 	   if the call fails
+ */
+int zrocks_set_write_lanes(int level, uint32_t lanes);
+
+/**
+ * Set the stripe unit of a level, the amount of contiguous data written to a
+ * zone before moving to the next zone of the node. Larger units turn large
+ * writes and reads into fewer, larger media commands. The unit is capped to
+ * the device maximum data transfer size. Must be called before 'zrocks_init'
+ *
+ * @param level LSM-Tree level
+ * @param bytes Power of two multiple of ZNS_ALIGMENT * ZTL_IO_SEC_MCMD, up to
+ *              ZTL_IO_STRIPE_MAX units
+ *
+ * @return Returns zero if the calls succeed, or a negative value
+ * 	   if the call fails
+ */
+int zrocks_set_stripe_unit(int level, uint32_t bytes);
+
+/**
+ * Set the number of zones a node of a level spans. Narrow nodes are reclaimed
+ * with fewer zone resets and suit small, short-lived files, wide nodes give
+ * more parallelism to large sequential files. The width must not change
+ * between runs on the same device, recovery rebuilds the nodes from it.
+ * Must be called before 'zrocks_init'
+ *
+ * @param level LSM-Tree level
+ * @param zones Power of two from 8 to 64 zones
+ *
+ * @return Returns zero if the calls succeed, or a negative value
+ * 	   if the call fails
+ */
+int zrocks_set_node_width(int level, uint32_t zones);
+
+/**
+ * Select the write mode of new writes. Zone append keeps several commands
+ * in flight per zone, regular writes keep one
+ *
+ * @param append True for zone append, false for regular writes
+ */
+void zrocks_set_append(bool append);
+
 /**
  * Close zrocks library
  *
@@ -83,6 +143,60 @@ int zrocks_init(const char *dev_name);
  */
 int zrocks_exit(void);
 
+/* >>> INSTANCE FUNCTIONS
+ * >>> A context is an independent zrocks instance with its own devices,
+ *     writer threads and memory pools. Each function has a 'zrocks_ctx_'
+ *     variant taking the context as first argument, see CONTEXT FUNCTIONS.
+ *     The functions without a context act on the default instance.
+ */
+
+struct zrocks_ctx;
+
+/**
+ * Create a context, it is started by 'zrocks_ctx_init'
+ *
+ * @return Returns the new context, or NULL if the call fails
+ */
+struct zrocks_ctx *zrocks_ctx_new(void);
+
+/**
+ * Free a context closed by 'zrocks_ctx_exit'
+ *
+ * @param ctx Context created by 'zrocks_ctx_new'
+ */
+void zrocks_ctx_free(struct zrocks_ctx *ctx);
+
+/**
+ * Bind a context to the calling thread. Only needed to call the xztl
+ * functions directly, the zrocks functions never depend on the binding
+ *
+ * @param ctx Context, or NULL for the default instance
+ *
+ * @return Returns the context bound before the call
+ */
+struct zrocks_ctx *zrocks_ctx_bind(struct zrocks_ctx *ctx);
+
+/**
+ * Initialize a context, see 'zrocks_init'
+ *
+ * @param ctx Context created by 'zrocks_ctx_new'
+ * @param dev_name URI of the devices of the context
+ *
+ * @return Returns zero if the calls succeed, or a negative value
+ * 	   if the call fails
+ */
+int zrocks_ctx_init(struct zrocks_ctx *ctx, const char *dev_name);
+
+/**
+ * Close a context, see 'zrocks_exit'
+ *
+ * @param ctx Context started by 'zrocks_ctx_init'
+ *
+ * @return Returns zero if the calls succeed, or a negative value
+ * 	   if the call fails
+ */
+int zrocks_ctx_exit(struct zrocks_ctx *ctx);
+
 /**
  * Allocate an aligned buffer for I/O
  *
@@ -107,7 +221,9 @@ void zrocks_free(void *ptr);
  */
 
 /**
- * Creates a new variable-sized object belonging to a certain LSM-Tree level
+ * Creates a new variable-sized object belonging to a certain LSM-Tree level.
+ * The object pieces are kept in the ZTL mapping table, an existing object
+ * with the same ID is replaced and its pieces are trimmed
  *
  * @param id Object ID
  * @param buf Pointer to a buffer containing data to be written
@@ -120,7 +236,7 @@ void zrocks_free(void *ptr);
 int zrocks_new(uint64_t id, void *buf, size_t size, uint16_t level);
 
 /**
- * Delete an object
+ * Delete an object and trim its pieces
  *
  * @param id Object ID to be deleted
  *
@@ -163,7 +279,7 @@ int zrocks_trim(struct zrocks_map *map, bool is_gc);
  * @param buf Pointer to the data
  * @param size Data size
  * @param level LSM-Tree level
- * @param map Pointer to an array of zrocks_map entries. This list is
+ * @param map Pointer to an array of ZROCKS_MAX_PIECES entries. This list is
  * 	      filled by the ZTL and contains the physical addresses
  * 	      of the locations where data was written. Depending on the
  * 	      zone size and how the data striping is performed, we write
@@ -178,8 +294,68 @@ int zrocks_trim(struct zrocks_map *map, bool is_gc);
 int zrocks_write(void *buf, size_t size, int level, struct zrocks_map maps[],
                  uint16_t *pieces, bool is_gc);
 
+/* Handle of an asynchronous write, see 'zrocks_write_async' */
+struct zrocks_wreq;
+
+/**
+ * Completion callback of an asynchronous write. It is called by the ZTL
+ * writer thread, so it must not block.
+ *
+ * @param ctx Opaque pointer provided to 'zrocks_write_async'
+ * @param status Zero if the write succeeded, or an error code if it failed
+ * @param maps Mapping pieces created by the write
+ * @param pieces Number of mapping pieces
+ */
+typedef void(zrocks_write_cb)(void *ctx, int status, struct zrocks_map *maps,
+                              uint16_t pieces);
+
+/**
+ * Queue a write to ZNS device without waiting for its completion. Several
+ * writes may be in flight at the same time, 'buf' must not be modified or
+ * freed until the write completes.
+ *
+ * @param buf Pointer to the data
+ * @param size Data size
+ * @param level LSM-Tree level
+ * @param cb Completion callback, may be NULL
+ * @param ctx Opaque pointer given back to 'cb'
+ *
+ * @return Returns a handle to the request, or NULL if the call fails. The
+ * 	   handle must be released by calling 'zrocks_write_wait'.
+ */
+struct zrocks_wreq *zrocks_write_async(void *buf, size_t size, int level,
+                                       zrocks_write_cb *cb, void *ctx,
+                                       bool is_gc);
+
 /**
- * Read from the ZNS drive using physical offsets
+ * Check if an asynchronous write has completed
+ *
+ * @param req Handle returned by 'zrocks_write_async'
+ *
+ * @return Returns 1 if the write has completed (the callback has returned),
+ * 	   or zero otherwise
+ */
+int zrocks_write_poll(struct zrocks_wreq *req);
+
+/**
+ * Wait for an asynchronous write and release its handle
+ *
+ * @param req Handle returned by 'zrocks_write_async'
+ * @param maps Array of ZROCKS_MAX_PIECES entries filled with the mapping
+ * 	       pieces, may be NULL
+ * @param pieces Filled with the number of mapping pieces, may be NULL
+ *
+ * @return Returns zero if the write succeeded, or an error code
+ *      if the write failed
+ */
+int zrocks_write_wait(struct zrocks_wreq *req, struct zrocks_map maps[],
+                      uint16_t *pieces);
+
+/**
+ * Read from the ZNS drive using physical offsets. Whole sectors are read
+ * straight into 'buf' if every device accepts it as a DMA target: any
+ * sector aligned buffer on kernel backends, only 'zrocks_alloc' memory on
+ * SPDK. Other buffers are filled through the read bounce buffers
  *
  * @offset - Offset in bytes within the ZNS device
  * @buf - Pointer to a buffer where data must be copied into
@@ -191,6 +367,29 @@ int zrocks_write(void *buf, size_t size, int level, struct zrocks_map maps[],
 int zrocks_read(uint32_t node_id, uint64_t offset, void *buf, uint64_t size,
                 bool is_gc);
 
+/* Extent of a batched read, see 'zrocks_read_batch' */
+struct zrocks_read_req {
+    uint32_t node_id;
+    uint64_t offset; /* Offset in bytes within the node */
+    void    *buf;
+    uint64_t size;
+    int      status; /* Filled by 'zrocks_read_batch' */
+};
+
+/**
+ * Read a vector of extents from the ZNS drive. Extents may belong to
+ * different nodes. Media commands of all extents are submitted together
+ * and completed by a single wait, instead of one cycle per 'zrocks_read'.
+ *
+ * @reqs  - Array of extents, the status of each one is filled
+ * @count - Number of extents
+ *
+ * @return Returns zero if all reads succeed, or a negative value
+ *      if any read fails
+ */
+int zrocks_read_batch(struct zrocks_read_req *reqs, uint32_t count,
+                      bool is_gc);
+
 /**
  * Get metadata zone's start lba from the ZNS device
  *
@@ -227,7 +426,18 @@ int zrocks_write_file_metadata(const unsigned char *buf, uint32_t length);
 
 int zrocks_node_finish(uint32_t node_id);
 
-void zrocks_node_set(int32_t node_id, int32_t level, int32_t num);
+/**
+ * Restore a node from a recovered mapping piece. Narrow nodes are rebuilt
+ * with the width kept in the metadata of their zones
+ *
+ * @return Returns zero if the calls succeed, or a negative value if the
+ *         node cannot be rebuilt. The device must not be used then, the
+ *         data of the piece would be lost
+ */
+int zrocks_node_set(int32_t node_id, int32_t level, int32_t num);
+
+/* Same as zrocks_node_set, also restores the node stripe unit of the map */
+int zrocks_node_set_map(const struct zrocks_map *map, int32_t level);
 
 void zrocks_clear_invalid_nodes(void);
 
@@ -240,7 +450,8 @@ void zrocks_clear_invalid_nodes(void);
 uint32_t zrocks_gc_get_nodes_num(void);
 
 /**
- * Get free nodes number from free list.
+ * Get free nodes number from free list. Nodes waiting for a lazy reset
+ * are counted as free.
  * 
  * @param[in]   void  
  * @return      Free nodes number
@@ -248,12 +459,77 @@ uint32_t zrocks_gc_get_nodes_num(void);
 uint32_t zrocks_gc_get_free_nodes_num(void);
 
 /**
- * Scan full node list and get nodes' invalid percent.
+ * Scan full node list and get nodes' invalid percent. Entries are indexed
+ * by device wide node id, the ids of all groups span
+ * [0, zrocks_gc_get_nodes_num()).
  * 
  * @param[out]   uint32_t invalid_percent[]
- * @return      void
+ * @param[in]    nnodes  Entries of invalid_percent, at least
+ *                       zrocks_gc_get_nodes_num()
+ * @return      Zero, or non-zero if the buffer is too short. Nodes
+ *              beyond 'nnodes' are skipped
  */
-void zrocks_gc_get_full_nodes(uint32_t invalid_percent[]);
+int zrocks_gc_get_full_nodes(uint32_t invalid_percent[], uint32_t nnodes);
+
+/* >>> CONTEXT FUNCTIONS
+ * >>> Same as the functions without 'ctx_', on the instance of 'ctx'. A NULL
+ *     context selects the default instance. The settings functions must be
+ *     called before 'zrocks_ctx_init'.
+ */
+
+int zrocks_ctx_set_write_lanes(struct zrocks_ctx *ctx, int level,
+                               uint32_t lanes);
+int zrocks_ctx_set_stripe_unit(struct zrocks_ctx *ctx, int level,
+                               uint32_t bytes);
+int zrocks_ctx_set_node_width(struct zrocks_ctx *ctx, int level,
+                              uint32_t zones);
+void zrocks_ctx_set_append(struct zrocks_ctx *ctx, bool append);
+
+void *zrocks_ctx_alloc(struct zrocks_ctx *ctx, size_t size);
+void  zrocks_ctx_free_buf(struct zrocks_ctx *ctx, void *ptr);
+
+int zrocks_ctx_new_obj(struct zrocks_ctx *ctx, uint64_t id, void *buf,
+                       size_t size, uint16_t level);
+int zrocks_ctx_delete(struct zrocks_ctx *ctx, uint64_t id);
+int zrocks_ctx_read_obj(struct zrocks_ctx *ctx, uint64_t id, uint64_t offset,
+                        void *buf, size_t size);
+
+int zrocks_ctx_trim(struct zrocks_ctx *ctx, struct zrocks_map *map,
+                    bool is_gc);
+int zrocks_ctx_write(struct zrocks_ctx *ctx, void *buf, size_t size,
+                     int level, struct zrocks_map maps[], uint16_t *pieces,
+                     bool is_gc);
+struct zrocks_wreq *zrocks_ctx_write_async(struct zrocks_ctx *ctx, void *buf,
+                                           size_t size, int level,
+                                           zrocks_write_cb *cb, void *cb_ctx,
+                                           bool is_gc);
+int zrocks_ctx_read(struct zrocks_ctx *ctx, uint32_t node_id, uint64_t offset,
+                    void *buf, uint64_t size, bool is_gc);
+int zrocks_ctx_read_batch(struct zrocks_ctx *ctx, struct zrocks_read_req *reqs,
+                          uint32_t count, bool is_gc);
+
+uint64_t zrocks_ctx_get_metadata_slba(struct zrocks_ctx *ctx);
+void     zrocks_ctx_get_metadata_slbas(struct zrocks_ctx *ctx, uint64_t *slbas,
+                                       uint8_t *num);
+void     zrocks_ctx_switch_zone(struct zrocks_ctx *ctx, uint64_t slbas);
+int      zrocks_ctx_read_metadata(struct zrocks_ctx *ctx, uint64_t slba,
+                                  unsigned char *buf, uint32_t length);
+int      zrocks_ctx_write_file_metadata(struct zrocks_ctx   *ctx,
+                                        const unsigned char *buf,
+                                        uint32_t             length);
+
+int  zrocks_ctx_node_finish(struct zrocks_ctx *ctx, uint32_t node_id);
+int  zrocks_ctx_node_set(struct zrocks_ctx *ctx, int32_t node_id,
+                         int32_t level, int32_t num);
+int  zrocks_ctx_node_set_map(struct zrocks_ctx       *ctx,
+                             const struct zrocks_map *map, int32_t level);
+void zrocks_ctx_clear_invalid_nodes(struct zrocks_ctx *ctx);
+
+uint32_t zrocks_ctx_gc_get_nodes_num(struct zrocks_ctx *ctx);
+uint32_t zrocks_ctx_gc_get_free_nodes_num(struct zrocks_ctx *ctx);
+int      zrocks_ctx_gc_get_full_nodes(struct zrocks_ctx *ctx,
+                                      uint32_t          invalid_percent[],
+                                      uint32_t          nnodes);
 
 #ifdef __cplusplus
 };  // closing brace for extern "C"
@@ -23,49 +23,99 @@
 #include <omp.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <xztl-media.h>
 #include <xztl-mempool.h>
+#include <xztl-metadata.h>
 #include <xztl.h>
 #include <xztl-mods.h>
 #include <xztl-pro.h>
 #include <xztl-stats.h>
 
 #define ZROCKS_DEBUG       0
-#define ZROCKS_BUF_ENTS    1024
 #define ZROCKS_MAX_READ_SZ (256 * ZNS_ALIGMENT) /* 512 KB */
 
-extern struct znd_media zndmedia;
+/* User commands per batched read and number of concurrent batches */
+#define ZROCKS_READ_BATCH_SZ   16
+#define ZROCKS_READ_BATCH_ENTS 32
+
 #define ZROCKS_READ_MAX_RETRY 3
 
-void *zrocks_alloc(size_t size) {
+static int _zrocks_trim(struct zrocks_map *map, bool is_gc);
+static int _zrocks_read_batch(struct zrocks_read_req *reqs, uint32_t count,
+                              bool is_gc);
+
+static void *_zrocks_alloc(size_t size) {
     return xztl_media_dma_alloc(size);
 }
 
-void zrocks_free(void *ptr) {
+static void _zrocks_free(void *ptr) {
     xztl_media_dma_free(ptr);
 }
 
-int zrocks_new(uint64_t id, void *buf, size_t size, uint16_t level) {
-    // struct xztl_io_ucmd ucmd;
-    // int                 ret;
+struct zrocks_wreq {
+    struct xztl_io_ucmd ucmd;
+    zrocks_write_cb    *cb;
+    void               *ctx;
+    size_t              size;
+    bool                is_gc;
+    bool                alloc;
+    int                 status;
+    uint16_t            pieces;
+    struct zrocks_map   maps[ZROCKS_MAX_PIECES];
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    volatile uint8_t    done;
+};
 
-    if (ZROCKS_DEBUG)
-        log_infoa("zrocks_new: ID [%lu], level [%d], size [%lu]\n", id, level,
-                  size);
+/* Called by the ZTL writer thread when all media commands completed */
+static void zrocks_write_callback(void *arg) {
+    struct xztl_io_ucmd *ucmd = (struct xztl_io_ucmd *)arg;
+    struct zrocks_wreq  *req  = (struct zrocks_wreq *)ucmd;
+    int                  i;
+
+    for (i = 0; i < ucmd->pieces; i++) {
+        req->maps[i].addr      = 0;
+        req->maps[i].g.node_id = ucmd->node_id[i];
+        req->maps[i].g.start   = ucmd->start[i];
+        req->maps[i].g.num     = ucmd->num[i];
+        req->maps[i].g.stripe  = __builtin_ctz(ucmd->stripe[i]);
+        if (i < ucmd->pieces - 1) {
+            req->maps[i].g.padding = 0;
+        } else {
+            req->maps[i].g.padding = ucmd->size - req->size;
+        }
+    }
 
-    // ucmd.app_md = 0;
-    // ret = __zrocks_write(&ucmd, id, buf, size, level);
+    req->pieces = ucmd->pieces;
+    req->status = (ucmd->status) ? XZTL_ZROCKS_WRITE_ERR : XZTL_OK;
 
-    // return (!ret) ? ucmd.status : ret;
-    return XZTL_OK;
+    if (!req->status) {
+        if (req->is_gc) {
+            xztl_stats_inc(XZTL_STATS_APPEND_BYTES_GC, req->size);
+            xztl_stats_inc(XZTL_STATS_APPEND_GC_CMD, 1);
+        } else {
+            xztl_stats_inc(XZTL_STATS_APPEND_BYTES_U, req->size);
+            xztl_stats_inc(XZTL_STATS_APPEND_UCMD, 1);
+        }
+        xztl_stats_inc(XZTL_STATS_APPEND_BYTES, ucmd->size);
+    }
+
+    if (req->cb)
+        req->cb(req->ctx, req->status, req->maps, req->pieces);
+
+    /* The waiter may release the request right after the signal */
+    pthread_mutex_lock(&req->mutex);
+    req->done = 1;
+    pthread_cond_signal(&req->cond);
+    pthread_mutex_unlock(&req->mutex);
 }
 
-int zrocks_write(void *buf, size_t size, int level, struct zrocks_map maps[],
-                 uint16_t *pieces, bool is_gc) {
-    struct xztl_io_ucmd ucmd;
-    uint32_t            misalign;
-    size_t              new_sz, alignment;
-    int                 i;
+static void zrocks_write_submit(struct zrocks_wreq *req, void *buf,
+                                size_t size, int level) {
+    struct xztl_io_ucmd *ucmd = &req->ucmd;
+    uint32_t             misalign, levels;
+    size_t               new_sz, alignment;
 
     if (level < 0) {
         level = 0;
@@ -75,7 +125,8 @@ int zrocks_write(void *buf, size_t size, int level, struct zrocks_map maps[],
     alignment = ZNS_ALIGMENT * ZTL_IO_SEC_MCMD;
     misalign  = size % alignment;
     new_sz    = (misalign != 0) ? size + (alignment - misalign) : size;
-    level     = (level >= ZROCKS_LEVEL_NUM) ? (ZROCKS_LEVEL_NUM - 1) : level;
+    levels    = xztl_config_get()->levels;
+    level     = (level >= levels) ? (levels - 1) : level;
 
     if (ZROCKS_DEBUG)
         log_infoa(
@@ -83,69 +134,311 @@ int zrocks_write(void *buf, size_t size, int level, struct zrocks_map maps[],
             "[%lu], misalign [%d]\n",
             level, size, new_sz, alignment, misalign);
 
-    ucmd.app_md    = 1;
-    ucmd.prov_type = level;
-    ucmd.id        = XZTL_CMD_WRITE;
-    ucmd.buf       = buf;
-    ucmd.size      = new_sz;
-    ucmd.status    = 0;
-    ucmd.completed = 0;
-    ucmd.callback  = NULL;
-    ucmd.prov      = NULL;
-    ucmd.pieces    = 0;
+    req->size   = size;
+    req->status = 0;
+    req->pieces = 0;
+    req->done   = 0;
 
-    ztl()->io->submit_fn(&ucmd);
+    ucmd->app_md    = 1;
+    ucmd->prov_type = level;
+    ucmd->id        = XZTL_CMD_WRITE;
+    ucmd->buf       = buf;
+    ucmd->size      = new_sz;
+    ucmd->status    = 0;
+    ucmd->completed = 0;
+    ucmd->callback  = zrocks_write_callback;
+    ucmd->prov      = NULL;
+    ucmd->pieces    = 0;
 
-    /* Wait for asynchronous command */
-    while (!ucmd.completed) {
-        usleep(1);
+    ztl()->io->submit_fn(ucmd);
+}
+
+static struct zrocks_wreq *_zrocks_write_async(void *buf, size_t size,
+                                               int level, zrocks_write_cb *cb,
+                                               void *ctx, bool is_gc) {
+    struct zrocks_wreq *req;
+
+    req = malloc(sizeof(struct zrocks_wreq));
+    if (!req) {
+        log_err("zrocks_write_async: request allocation failed.\n");
+        return NULL;
     }
 
-    for (i = 0; i < ucmd.pieces; i++) {
-        maps[i].g.node_id = ucmd.node_id[i];
-        maps[i].g.start   = ucmd.start[i];
-        maps[i].g.num     = ucmd.num[i];
-        if (i < ucmd.pieces - 1) {
-            maps[i].g.padding = 0;
-        } else {
-            maps[i].g.padding = new_sz - size;
+    req->cb    = cb;
+    req->ctx   = ctx;
+    req->is_gc = is_gc;
+    req->alloc = true;
+
+    if (pthread_mutex_init(&req->mutex, NULL))
+        goto FREE;
+
+    if (pthread_cond_init(&req->cond, NULL))
+        goto MUTEX;
+
+    zrocks_write_submit(req, buf, size, level);
+
+    return req;
+
+MUTEX:
+    pthread_mutex_destroy(&req->mutex);
+FREE:
+    free(req);
+    log_err("zrocks_write_async: request initialization failed.\n");
+    return NULL;
+}
+
+int zrocks_write_poll(struct zrocks_wreq *req) {
+    return req->done;
+}
+
+int zrocks_write_wait(struct zrocks_wreq *req, struct zrocks_map maps[],
+                      uint16_t *pieces) {
+    int status, i;
+
+    pthread_mutex_lock(&req->mutex);
+    while (!req->done)
+        pthread_cond_wait(&req->cond, &req->mutex);
+    pthread_mutex_unlock(&req->mutex);
+
+    if (maps) {
+        for (i = 0; i < req->pieces; i++)
+            maps[i] = req->maps[i];
+    }
+    if (pieces)
+        *pieces = req->pieces;
+
+    status = req->status;
+
+    pthread_cond_destroy(&req->cond);
+    pthread_mutex_destroy(&req->mutex);
+    if (req->alloc)
+        free(req);
+
+    return status;
+}
+
+static int _zrocks_write(void *buf, size_t size, int level,
+                         struct zrocks_map maps[], uint16_t *pieces,
+                         bool is_gc) {
+    struct zrocks_wreq req;
+
+    req.cb    = NULL;
+    req.ctx   = NULL;
+    req.is_gc = is_gc;
+    req.alloc = false;
+
+    if (pthread_mutex_init(&req.mutex, NULL)) {
+        log_err("zrocks_write: request mutex initialization failed.\n");
+        return XZTL_ZROCKS_WRITE_ERR;
+    }
+
+    if (pthread_cond_init(&req.cond, NULL)) {
+        log_err("zrocks_write: request condition initialization failed.\n");
+        pthread_mutex_destroy(&req.mutex);
+        return XZTL_ZROCKS_WRITE_ERR;
+    }
+
+    zrocks_write_submit(&req, buf, size, level);
+
+    return zrocks_write_wait(&req, maps, pieces);
+}
+
+/* Bytes of user data held by a mapping piece */
+static uint64_t zrocks_map_bytes(const struct zrocks_map *map) {
+    return (uint64_t)map->g.num * ZNS_ALIGMENT * ZTL_IO_SEC_MCMD -
+           map->g.padding;
+}
+
+/* Pieces of an object take ZROCKS_MAX_PIECES consecutive mapping entries
+ * starting at 'id * ZROCKS_MAX_PIECES', unused entries are zero */
+static int zrocks_obj_get(uint64_t id, struct zrocks_map maps[],
+                          uint16_t *pieces, uint64_t *size) {
+    uint64_t val;
+    uint16_t i;
+
+    if (id >= AND64 / ZROCKS_MAX_PIECES)
+        return XZTL_ZROCKS_READ_ERR;
+
+    *pieces = 0;
+    *size   = 0;
+    for (i = 0; i < ZROCKS_MAX_PIECES; i++) {
+        val = ztl()->map->read_fn(id * ZROCKS_MAX_PIECES + i);
+        if (val == AND64)
+            return XZTL_ZROCKS_READ_ERR;
+        if (!val)
+            break;
+
+        maps[i].addr = val;
+        *size += zrocks_map_bytes(&maps[i]);
+        (*pieces)++;
+    }
+
+    return (*pieces) ? XZTL_OK : XZTL_ZROCKS_READ_ERR;
+}
+
+/* Points the mapping entries of an object to new pieces. The pieces it
+ * replaces are trimmed once every entry is updated and committed to the
+ * mapping log, a failure restores the entries already updated and leaves
+ * the previous object intact */
+static int zrocks_obj_set(uint64_t id, struct zrocks_map maps[],
+                          uint16_t pieces) {
+    struct zrocks_map old[ZROCKS_MAX_PIECES];
+    uint64_t          val, cur;
+    uint16_t          i, set;
+    int               ret = XZTL_OK;
+
+    for (set = 0; set < ZROCKS_MAX_PIECES; set++) {
+        val           = (set < pieces) ? maps[set].addr : 0;
+        old[set].addr    = 0;
+
+        /* Entries past the end of both objects are already zero */
+        if (!val) {
+            cur = ztl()->map->read_fn(id * ZROCKS_MAX_PIECES + set);
+            if (cur == AND64) {
+                ret = XZTL_ZTL_MAP_ERR;
+                break;
+            }
+            if (!cur)
+                continue;
         }
+
+        ret = ztl()->map->upsert_fn(id * ZROCKS_MAX_PIECES + set, val,
+                                    &old[set].addr, 0);
+        if (ret)
+            break;
     }
 
-    *pieces = ucmd.pieces;
+    /* The old pieces are reused only once the new mapping is durable */
+    if (!ret)
+        ret = ztl()->map->commit_fn();
 
-    if (is_gc) {
-        xztl_stats_inc(XZTL_STATS_APPEND_BYTES_GC, size);
-        xztl_stats_inc(XZTL_STATS_APPEND_GC_CMD, 1);
-    } else {
-        xztl_stats_inc(XZTL_STATS_APPEND_BYTES_U, size);
-        xztl_stats_inc(XZTL_STATS_APPEND_UCMD, 1);
+    if (ret) {
+        log_erra("zrocks_obj_set: mapping err ID [%lu] piece [%d] ret [%d]\n",
+                 id, set, ret);
+
+        for (i = 0; i < set; i++) {
+            val = (i < pieces) ? maps[i].addr : 0;
+            if (old[i].addr == val)
+                continue;
+
+            if (ztl()->map->upsert_fn(id * ZROCKS_MAX_PIECES + i,
+                                      old[i].addr, &cur, 0))
+                log_erra("zrocks_obj_set: restore err ID [%lu] piece [%d]\n",
+                         id, i);
+        }
+        return ret;
     }
-    xztl_stats_inc(XZTL_STATS_APPEND_BYTES, new_sz);
 
+    for (i = 0; i < ZROCKS_MAX_PIECES; i++) {
+        if (old[i].addr)
+            _zrocks_trim(&old[i], false);
+    }
 
     return XZTL_OK;
 }
 
-int zrocks_read_obj(uint64_t id, uint64_t offset, void *buf, size_t size) {
-    uint64_t objsec_off;
+static int _zrocks_new(uint64_t id, void *buf, size_t size, uint16_t level) {
+    struct zrocks_map maps[ZROCKS_MAX_PIECES];
+    uint16_t          pieces, i;
+    int               ret;
+
+    if (ZROCKS_DEBUG)
+        log_infoa("zrocks_new: ID [%lu], level [%d], size [%lu]\n", id, level,
+                  size);
+
+    if (id >= AND64 / ZROCKS_MAX_PIECES)
+        return XZTL_ZROCKS_WRITE_ERR;
+
+    ret = _zrocks_write(buf, size, level, maps, &pieces, false);
+    if (ret)
+        return ret;
+
+    ret = zrocks_obj_set(id, maps, pieces);
+    if (ret) {
+        log_erra("zrocks_new: mapping err ID [%lu], ret [%d]\n", id, ret);
+
+        /* The new pieces are not mapped, their nodes can be reclaimed */
+        for (i = 0; i < pieces; i++) _zrocks_trim(&maps[i], false);
+        return XZTL_ZROCKS_WRITE_ERR;
+    }
+
+    return XZTL_OK;
+}
+
+static int _zrocks_read_obj(uint64_t id, uint64_t offset, void *buf,
+                            size_t size) {
+    struct zrocks_map      maps[ZROCKS_MAX_PIECES];
+    struct zrocks_read_req reqs[ZROCKS_READ_BATCH_SZ];
+    uint64_t               obj_sz, piece_off, len;
+    uint32_t               nreq;
+    uint16_t               pieces, i;
+    size_t                 left;
+    int                    ret;
 
     if (ZROCKS_DEBUG)
         log_infoa("zrocks_read_obj: ID [%lu], off [%lu], size [%lu]\n", id,
                   offset, size);
 
-    /* This assumes a single zone offset per object */
-    objsec_off = ztl()->map->read_fn(id);
+    ret = zrocks_obj_get(id, maps, &pieces, &obj_sz);
+    if (ret) {
+        log_erra("zrocks_read_obj: object not found ID [%lu]\n", id);
+        return XZTL_ZROCKS_READ_ERR;
+    }
+
+    if (offset > obj_sz || size > obj_sz - offset) {
+        log_erra("zrocks_read_obj: ID [%lu] off [%lu] size [%lu] beyond "
+                 "object size [%lu]\n",
+                 id, offset, size, obj_sz);
+        return XZTL_ZROCKS_READ_ERR;
+    }
 
-    if (ZROCKS_DEBUG)
-        log_infoa("zrocks_read_obj: objsec_off [%lx], userbytes_off [%lu]\n",
-                  objsec_off, offset);
+    /* Translates the object offset into a piece and an offset within it */
+    piece_off = offset;
+    for (i = 0; i < pieces && piece_off >= zrocks_map_bytes(&maps[i]); i++)
+        piece_off -= zrocks_map_bytes(&maps[i]);
+
+    /* One read per piece, split by the read buffer size */
+    nreq = 0;
+    left = size;
+    while (left) {
+        len = zrocks_map_bytes(&maps[i]) - piece_off;
+        len = MIN(len, left);
+        len = MIN(len, ZROCKS_MAX_READ_SZ);
+
+        reqs[nreq].node_id = maps[i].g.node_id;
+        reqs[nreq].offset =
+            (uint64_t)maps[i].g.start * ZNS_ALIGMENT * ZTL_IO_SEC_MCMD +
+            piece_off;
+        reqs[nreq].buf    = (char *)buf + (size - left);
+        reqs[nreq].size   = len;
+        reqs[nreq].status = 0;
+        nreq++;
+
+        if (ZROCKS_DEBUG)
+            log_infoa("zrocks_read_obj: piece [%d] node [%d] off [%lu] size "
+                      "[%lu]\n",
+                      i, maps[i].g.node_id, piece_off, len);
+
+        left -= len;
+        piece_off += len;
+        if (piece_off == zrocks_map_bytes(&maps[i])) {
+            piece_off = 0;
+            i++;
+        }
+
+        if (nreq == ZROCKS_READ_BATCH_SZ || !left) {
+            ret = _zrocks_read_batch(reqs, nreq, false);
+            if (ret)
+                return XZTL_ZROCKS_READ_ERR;
+            nreq = 0;
+        }
+    }
 
     return XZTL_OK;
 }
 
-int zrocks_read(uint32_t node_id, uint64_t offset, void *buf, uint64_t size,
-                    bool is_gc) {
+static int _zrocks_read(uint32_t node_id, uint64_t offset, void *buf,
+                        uint64_t size, bool is_gc) {
     int                 ret;
     struct xztl_io_ucmd ucmd;
 
@@ -200,18 +493,96 @@ READ_FAIL:
     return XZTL_OK;
 }
 
-int zrocks_delete(uint64_t id) {
-    uint64_t old;
+static int _zrocks_read_batch(struct zrocks_read_req *reqs, uint32_t count,
+                              bool is_gc) {
+    struct xztl_mp_entry   *mp_entry;
+    struct xztl_io_ucmd    *ucmds, *ucmd;
+    struct zrocks_read_req *req;
+    uint32_t                done, batch, i;
+    int                     ret = XZTL_OK;
+
+    mp_entry = xztl_mempool_get(ZROCKS_READ_BATCH, 0);
+    if (!mp_entry) {
+        log_err("zrocks_read_batch: xztl_mempool_get failed.\n");
+        return XZTL_ZROCKS_READ_ERR;
+    }
+    ucmds = (struct xztl_io_ucmd *)mp_entry->opaque;
+
+    for (done = 0; done < count; done += batch) {
+        batch = MIN(count - done, ZROCKS_READ_BATCH_SZ);
+
+        for (i = 0; i < batch; i++) {
+            req  = &reqs[done + i];
+            ucmd = &ucmds[i];
+
+            ucmd->id         = XZTL_CMD_READ;
+            ucmd->buf        = req->buf;
+            ucmd->size       = req->size;
+            ucmd->offset     = req->offset;
+            ucmd->status     = 0;
+            ucmd->callback   = NULL;
+            ucmd->prov       = NULL;
+            ucmd->completed  = 0;
+            ucmd->ncb        = 0;
+            ucmd->node_id[0] = req->node_id;
+
+            if (ZROCKS_DEBUG)
+                log_infoa(
+                    "zrocks_read_batch: node [%d] off [%lu], size [%lu],\n",
+                    req->node_id, req->offset, req->size);
+        }
+
+        ztl()->io->read_batch_fn(ucmds, batch);
 
-    return ztl()->map->upsert_fn(id, 0, &old, 0);
+        for (i = 0; i < batch; i++) {
+            req  = &reqs[done + i];
+            ucmd = &ucmds[i];
+
+            /* Failed extents go through the single read retries */
+            if (ucmd->status || !ucmd->completed) {
+                log_erra(
+                    "zrocks_read_batch: read failed. node [%d] off [%lu], "
+                    "sz [%lu] status[%d]\n",
+                    req->node_id, req->offset, req->size, ucmd->status);
+                req->status = _zrocks_read(req->node_id, req->offset,
+                                           req->buf, req->size, is_gc);
+                if (req->status)
+                    ret = XZTL_ZROCKS_READ_ERR;
+                continue;
+            }
+
+            req->status = XZTL_OK;
+            if (is_gc) {
+                xztl_stats_inc(XZTL_STATS_READ_BYTES_GC, req->size);
+                xztl_stats_inc(XZTL_STATS_READ_GC_CMD, 1);
+            } else {
+                xztl_stats_inc(XZTL_STATS_READ_BYTES_U, req->size);
+                xztl_stats_inc(XZTL_STATS_READ_UCMD, 1);
+            }
+        }
+    }
+
+    xztl_mempool_put(mp_entry, ZROCKS_READ_BATCH, 0);
+
+    return ret;
 }
 
-int zrocks_trim(struct zrocks_map *map, bool is_gc) {
-    struct app_group        *grp      = ztl()->groups.get_fn(0);
-    struct ztl_pro_node_grp *node_grp = grp->pro;
-    struct ztl_pro_node     *node =
-        (struct ztl_pro_node *)(&node_grp->vnodes[map->g.node_id]);
-    int ret = XZTL_OK;
+static int _zrocks_delete(uint64_t id) {
+    if (ZROCKS_DEBUG)
+        log_infoa("zrocks_delete: ID [%lu]\n", id);
+
+    if (id >= AND64 / ZROCKS_MAX_PIECES)
+        return XZTL_ZROCKS_WRITE_ERR;
+
+    return zrocks_obj_set(id, NULL, 0);
+}
+
+static int _zrocks_trim(struct zrocks_map *map, bool is_gc) {
+    struct ztl_pro_node *node = ztl()->pro->get_vnode_fn(map->g.node_id);
+    int                  ret  = XZTL_OK;
+
+    if (!node)
+        return XZTL_ZTL_PROV_ERR;
 
     if (ZROCKS_DEBUG)
         log_infoa("zrocks_trim: node ID [%u]\n", node->id);
@@ -225,7 +596,7 @@ int zrocks_trim(struct zrocks_map *map, bool is_gc) {
         log_infoa("zrocks_trim - %d : node ID [%u] need to reset\n", is_gc, node->id);
 
         node->status = XZTL_ZMD_NODE_RESET;
-        ret = ztl()->mgmt->reset_fn(grp, node, ZTL_MGMG_RESET_ZONE);
+        ret = ztl()->mgmt->reset_fn(node->grp, node, ZTL_MGMG_RESET_ZONE);
         if (ret) {
             log_erra("zrocks_trim - %d : node ID [%u], ret [%d]\n", is_gc, node->id, ret);
         }
@@ -234,23 +605,53 @@ int zrocks_trim(struct zrocks_map *map, bool is_gc) {
     return ret;
 }
 
-void zrocks_node_set(int32_t node_id, int32_t level, int32_t num) {
-    ztl()->io->nodeset_fn(node_id, level, num);
+static int _zrocks_node_set(int32_t node_id, int32_t level, int32_t num) {
+    return ztl()->io->nodeset_fn(node_id, level, num, 0);
 }
 
-int zrocks_exit(void) {
+static int _zrocks_node_set_map(const struct zrocks_map *map, int32_t level) {
+    return ztl()->io->nodeset_fn(map->g.node_id, level, map->g.num,
+                                 1U << map->g.stripe);
+}
+
+static int _zrocks_set_write_lanes(int level, uint32_t lanes) {
+    return ztl_io_set_lanes(level, lanes);
+}
+
+static int _zrocks_set_stripe_unit(int level, uint32_t bytes) {
+    uint32_t unit = ZNS_ALIGMENT * ZTL_IO_SEC_MCMD;
+
+    if (!bytes || bytes % unit) {
+        log_erra("zrocks_set_stripe_unit: err bytes [%u] not aligned to [%u]\n",
+                 bytes, unit);
+        return XZTL_ZTL_IO_ERR;
+    }
+
+    return ztl_io_set_stripe(level, bytes / unit);
+}
+
+static int _zrocks_set_node_width(int level, uint32_t zones) {
+    return ztl_io_set_width(level, zones);
+}
+
+static void _zrocks_set_append(bool append) {
+    ztl_io_set_append(append);
+}
+
+static int _zrocks_exit(void) {
+    xztl_mempool_destroy(ZROCKS_READ_BATCH, 0);
     xztl_mempool_destroy(ZROCKS_MEMORY, 0);
     return xztl_exit();
 }
 
-int zrocks_node_finish(uint32_t node_id) {
-    struct app_group        *grp      = ztl()->groups.get_fn(0);
-    struct ztl_pro_node_grp *node_grp = grp->pro;
-    struct ztl_pro_node     *node =
-        (struct ztl_pro_node *)(&node_grp->vnodes[node_id]);
-    int ret;
+static int _zrocks_node_finish(uint32_t node_id) {
+    struct ztl_pro_node *node = ztl()->pro->get_vnode_fn(node_id);
+    int                  ret;
+
+    if (!node)
+        return XZTL_ZTL_PROV_ERR;
 
-    ret = ztl()->mgmt->finish_fn(grp, node, ZTL_MGMG_FULL_ZONE);
+    ret = ztl()->mgmt->finish_fn(node->grp, node, ZTL_MGMG_FULL_ZONE);
     if (ret) {
         log_erra("zrocks_node_finish: err node ID [%u], ret [%d]\n", node_id,
                  ret);
@@ -259,46 +660,89 @@ int zrocks_node_finish(uint32_t node_id) {
     return ret;
 }
 
-void zrocks_clear_invalid_nodes() {
-    struct app_group *grp = ztl()->groups.get_fn(0);
-    ztl()->mgmt->clear_fn(grp);
+static void _zrocks_clear_invalid_nodes(void) {
+    struct app_group *grp;
+    uint16_t          grp_i;
+
+    for (grp_i = 0; (grp = ztl()->groups.get_fn(grp_i)); grp_i++)
+        ztl()->mgmt->clear_fn(grp);
 }
 
-uint32_t zrocks_gc_get_nodes_num() {
-    /* Get node numbers of zns ssd */
-    struct app_group        *grp      = ztl()->groups.get_fn(0);
-    struct ztl_pro_node_grp *node_grp = grp->pro;
-    return node_grp->nnodes;
+static uint32_t _zrocks_gc_get_nodes_num(void) {
+    /* Get node numbers of zns ssd, node ids span all the groups */
+    struct app_group        *grp;
+    struct ztl_pro_node_grp *node_grp;
+    uint32_t                 nnodes = 0;
+    uint16_t                 grp_i;
+
+    for (grp_i = 0; (grp = ztl()->groups.get_fn(grp_i)); grp_i++) {
+        node_grp = grp->pro;
+        nnodes += node_grp->nnodes;
+    }
+    return nnodes;
 }
 
-uint32_t zrocks_gc_get_free_nodes_num() {
-    /* Get free node numbers from free list */
-    struct app_group        *grp      = ztl()->groups.get_fn(0);
-    struct ztl_pro_node_grp *node_grp = grp->pro;
-    return node_grp->nfree;
+static uint32_t _zrocks_gc_get_free_nodes_num(void) {
+    /* Get free node numbers from free list. Dirty nodes are free once the
+     * lazy reset gets to them */
+    struct app_group        *grp;
+    struct ztl_pro_node_grp *node_grp;
+    uint32_t                 nfree = 0;
+    uint16_t                 grp_i;
+
+    for (grp_i = 0; (grp = ztl()->groups.get_fn(grp_i)); grp_i++) {
+        node_grp = grp->pro;
+        nfree += node_grp->nfree + node_grp->ndirty + node_grp->nreset;
+    }
+    return nfree;
 }
 
-void zrocks_gc_get_full_nodes(uint32_t invalid_percent[]) {
+static int _zrocks_gc_get_full_nodes(uint32_t invalid_percent[],
+                                     uint32_t nnodes) {
     struct ztl_pro_node     *node;
-    struct app_group        *grp      = ztl()->groups.get_fn(0);
-    struct ztl_pro_node_grp *node_grp = grp->pro;
+    struct app_group        *grp;
+    struct ztl_pro_node_grp *node_grp;
+    uint16_t                 grp_i;
+    int                      ret = XZTL_OK;
+
+    /* The array is indexed by device wide node id */
+    if (nnodes < _zrocks_gc_get_nodes_num()) {
+        log_erra("zrocks_gc_get_full_nodes: buffer [%u] < nodes [%u]\n",
+                 nnodes, _zrocks_gc_get_nodes_num());
+        ret = XZTL_ZTL_PROV_ERR;
+    }
 
-    pthread_spin_lock(&node_grp->spin_full);
+    for (grp_i = 0; (grp = ztl()->groups.get_fn(grp_i)); grp_i++) {
+        node_grp = grp->pro;
+        pthread_spin_lock(&node_grp->spin_full);
 
-    TAILQ_FOREACH(node, &node_grp->full_head, fentry) {
-        if (node->level >= 1 && node->status == XZTL_ZMD_NODE_FULL) {/* sst nodes*/
-            invalid_percent[node->id] = 100  - (100 * node->nr_valid) / ZTL_PRO_OPT_SEC_NUM_INNODE;
+        TAILQ_FOREACH(node, &node_grp->full_head, fentry) {
+            if (node->id >= nnodes)
+                continue;
+            if (node->level >= 1 && node->status == XZTL_ZMD_NODE_FULL) {/* sst nodes*/
+                invalid_percent[node->id] = 100  - (100 * node->nr_valid) / node->capacity;
+            }
         }
+
+        pthread_spin_unlock(&node_grp->spin_full);
     }
 
-    pthread_spin_unlock(&node_grp->spin_full);
+    return ret;
 }
 
-int zrocks_init(const char *dev_name) {
+/* Adds libznd media layer, or the emulated media for 'emu:' names. Called
+ * for every device of the list given to zrocks_init */
+static int zrocks_media_register(const char *dev_name) {
+    if (!strncmp(dev_name, XZTL_EMU_PREFIX, strlen(XZTL_EMU_PREFIX)))
+        return emu_media_register(dev_name);
+
+    return znd_media_register(dev_name);
+}
+
+static int _zrocks_init(const char *dev_name) {
     int ret;
 
-    /* Add libznd media layer */
-    xztl_add_media(znd_media_register);
+    xztl_add_media(zrocks_media_register);
 
     /* Add the ZTL modules */
     ztl_zmd_register();
@@ -316,13 +760,339 @@ int zrocks_init(const char *dev_name) {
         return XZTL_ZROCKS_INIT_ERR;
     }
 
-    ret = xztl_mempool_create(ZROCKS_MEMORY, 0, ZROCKS_BUF_ENTS,
-                              ZROCKS_MAX_READ_SZ, zrocks_alloc, zrocks_free);
+    ret = xztl_mempool_create(ZROCKS_MEMORY, 0, xztl_config_get()->buf_ents,
+                              ZROCKS_MAX_READ_SZ, _zrocks_alloc, _zrocks_free);
     if (ret) {
         log_erra("zrocks_init: err xztl_mempool_create failed, ret [%d]\n",
                  ret);
         xztl_exit();
+        return ret;
+    }
+
+    ret = xztl_mempool_create(
+        ZROCKS_READ_BATCH, 0, ZROCKS_READ_BATCH_ENTS,
+        sizeof(struct xztl_io_ucmd) * ZROCKS_READ_BATCH_SZ, NULL, NULL);
+    if (ret) {
+        log_erra("zrocks_init: err read batch mempool failed, ret [%d]\n",
+                 ret);
+        xztl_mempool_destroy(ZROCKS_MEMORY, 0);
+        xztl_exit();
     }
 
     return ret;
 }
+
+struct zrocks_ctx {
+    struct xztl_instance *inst;
+};
+
+static __thread struct zrocks_ctx *zrocks_cur;
+
+/* Calls the function on the instance of 'ctx', NULL is the default instance.
+ * The context bound to the calling thread is restored after the call */
+#define ZROCKS_CTX_CALL(ctx, type, call)                 \
+    do {                                                 \
+        struct zrocks_ctx *prev_ = zrocks_ctx_bind(ctx); \
+        type               ret_  = (call);               \
+                                                         \
+        zrocks_ctx_bind(prev_);                          \
+        return ret_;                                     \
+    } while (0)
+
+#define ZROCKS_CTX_CALL_VOID(ctx, call)                  \
+    do {                                                 \
+        struct zrocks_ctx *prev_ = zrocks_ctx_bind(ctx); \
+                                                         \
+        (call);                                          \
+        zrocks_ctx_bind(prev_);                          \
+    } while (0)
+
+struct zrocks_ctx *zrocks_ctx_new(void) {
+    struct zrocks_ctx *ctx;
+
+    ctx = calloc(1, sizeof(struct zrocks_ctx));
+    if (!ctx)
+        return NULL;
+
+    ctx->inst = xztl_instance_new();
+    if (!ctx->inst) {
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void zrocks_ctx_free(struct zrocks_ctx *ctx) {
+    if (!ctx)
+        return;
+
+    xztl_instance_free(ctx->inst);
+    free(ctx);
+}
+
+struct zrocks_ctx *zrocks_ctx_bind(struct zrocks_ctx *ctx) {
+    struct zrocks_ctx *prev = zrocks_cur;
+
+    zrocks_cur = ctx;
+    xztl_instance_bind((ctx) ? ctx->inst : NULL);
+
+    return prev;
+}
+
+int zrocks_ctx_init(struct zrocks_ctx *ctx, const char *dev_name) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_init(dev_name));
+}
+
+int zrocks_ctx_exit(struct zrocks_ctx *ctx) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_exit());
+}
+
+int zrocks_ctx_set_write_lanes(struct zrocks_ctx *ctx, int level,
+                               uint32_t lanes) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_set_write_lanes(level, lanes));
+}
+
+int zrocks_ctx_set_stripe_unit(struct zrocks_ctx *ctx, int level,
+                               uint32_t bytes) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_set_stripe_unit(level, bytes));
+}
+
+int zrocks_ctx_set_node_width(struct zrocks_ctx *ctx, int level,
+                              uint32_t zones) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_set_node_width(level, zones));
+}
+
+void zrocks_ctx_set_append(struct zrocks_ctx *ctx, bool append) {
+    ZROCKS_CTX_CALL_VOID(ctx, _zrocks_set_append(append));
+}
+
+void *zrocks_ctx_alloc(struct zrocks_ctx *ctx, size_t size) {
+    ZROCKS_CTX_CALL(ctx, void *, _zrocks_alloc(size));
+}
+
+void zrocks_ctx_free_buf(struct zrocks_ctx *ctx, void *ptr) {
+    ZROCKS_CTX_CALL_VOID(ctx, _zrocks_free(ptr));
+}
+
+int zrocks_ctx_new_obj(struct zrocks_ctx *ctx, uint64_t id, void *buf,
+                       size_t size, uint16_t level) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_new(id, buf, size, level));
+}
+
+int zrocks_ctx_delete(struct zrocks_ctx *ctx, uint64_t id) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_delete(id));
+}
+
+int zrocks_ctx_read_obj(struct zrocks_ctx *ctx, uint64_t id, uint64_t offset,
+                        void *buf, size_t size) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_read_obj(id, offset, buf, size));
+}
+
+int zrocks_ctx_trim(struct zrocks_ctx *ctx, struct zrocks_map *map,
+                    bool is_gc) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_trim(map, is_gc));
+}
+
+int zrocks_ctx_write(struct zrocks_ctx *ctx, void *buf, size_t size,
+                     int level, struct zrocks_map maps[], uint16_t *pieces,
+                     bool is_gc) {
+    ZROCKS_CTX_CALL(ctx, int,
+                    _zrocks_write(buf, size, level, maps, pieces, is_gc));
+}
+
+struct zrocks_wreq *zrocks_ctx_write_async(struct zrocks_ctx *ctx, void *buf,
+                                           size_t size, int level,
+                                           zrocks_write_cb *cb, void *cb_ctx,
+                                           bool is_gc) {
+    ZROCKS_CTX_CALL(
+        ctx, struct zrocks_wreq *,
+        _zrocks_write_async(buf, size, level, cb, cb_ctx, is_gc));
+}
+
+int zrocks_ctx_read(struct zrocks_ctx *ctx, uint32_t node_id, uint64_t offset,
+                    void *buf, uint64_t size, bool is_gc) {
+    ZROCKS_CTX_CALL(ctx, int,
+                    _zrocks_read(node_id, offset, buf, size, is_gc));
+}
+
+int zrocks_ctx_read_batch(struct zrocks_ctx *ctx, struct zrocks_read_req *reqs,
+                          uint32_t count, bool is_gc) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_read_batch(reqs, count, is_gc));
+}
+
+uint64_t zrocks_ctx_get_metadata_slba(struct zrocks_ctx *ctx) {
+    ZROCKS_CTX_CALL(ctx, uint64_t, ztl_metadata_get_slba());
+}
+
+void zrocks_ctx_get_metadata_slbas(struct zrocks_ctx *ctx, uint64_t *slbas,
+                                   uint8_t *num) {
+    ZROCKS_CTX_CALL_VOID(ctx, ztl_metadata_get_slbas(slbas, num));
+}
+
+void zrocks_ctx_switch_zone(struct zrocks_ctx *ctx, uint64_t slbas) {
+    ZROCKS_CTX_CALL_VOID(ctx, ztl_metadata_switch_zone(slbas));
+}
+
+int zrocks_ctx_read_metadata(struct zrocks_ctx *ctx, uint64_t slba,
+                             unsigned char *buf, uint32_t length) {
+    ZROCKS_CTX_CALL(ctx, int, ztl_metadata_read(slba, buf, length));
+}
+
+int zrocks_ctx_write_file_metadata(struct zrocks_ctx   *ctx,
+                                   const unsigned char *buf,
+                                   uint32_t             length) {
+    ZROCKS_CTX_CALL(ctx, int, ztl_metadata_write(buf, length));
+}
+
+int zrocks_ctx_node_finish(struct zrocks_ctx *ctx, uint32_t node_id) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_node_finish(node_id));
+}
+
+int zrocks_ctx_node_set(struct zrocks_ctx *ctx, int32_t node_id,
+                        int32_t level, int32_t num) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_node_set(node_id, level, num));
+}
+
+int zrocks_ctx_node_set_map(struct zrocks_ctx       *ctx,
+                            const struct zrocks_map *map, int32_t level) {
+    ZROCKS_CTX_CALL(ctx, int, _zrocks_node_set_map(map, level));
+}
+
+void zrocks_ctx_clear_invalid_nodes(struct zrocks_ctx *ctx) {
+    ZROCKS_CTX_CALL_VOID(ctx, _zrocks_clear_invalid_nodes());
+}
+
+uint32_t zrocks_ctx_gc_get_nodes_num(struct zrocks_ctx *ctx) {
+    ZROCKS_CTX_CALL(ctx, uint32_t, _zrocks_gc_get_nodes_num());
+}
+
+uint32_t zrocks_ctx_gc_get_free_nodes_num(struct zrocks_ctx *ctx) {
+    ZROCKS_CTX_CALL(ctx, uint32_t, _zrocks_gc_get_free_nodes_num());
+}
+
+int zrocks_ctx_gc_get_full_nodes(struct zrocks_ctx *ctx,
+                                 uint32_t invalid_percent[], uint32_t nnodes) {
+    ZROCKS_CTX_CALL(ctx, int,
+                    _zrocks_gc_get_full_nodes(invalid_percent, nnodes));
+}
+
+/* The functions without a context act on the default instance, whatever the
+ * context bound to the calling thread */
+
+int zrocks_init(const char *dev_name) {
+    return zrocks_ctx_init(NULL, dev_name);
+}
+
+int zrocks_exit(void) {
+    return zrocks_ctx_exit(NULL);
+}
+
+int zrocks_set_write_lanes(int level, uint32_t lanes) {
+    return zrocks_ctx_set_write_lanes(NULL, level, lanes);
+}
+
+int zrocks_set_stripe_unit(int level, uint32_t bytes) {
+    return zrocks_ctx_set_stripe_unit(NULL, level, bytes);
+}
+
+int zrocks_set_node_width(int level, uint32_t zones) {
+    return zrocks_ctx_set_node_width(NULL, level, zones);
+}
+
+void zrocks_set_append(bool append) {
+    zrocks_ctx_set_append(NULL, append);
+}
+
+void *zrocks_alloc(size_t size) {
+    return zrocks_ctx_alloc(NULL, size);
+}
+
+void zrocks_free(void *ptr) {
+    zrocks_ctx_free_buf(NULL, ptr);
+}
+
+int zrocks_new(uint64_t id, void *buf, size_t size, uint16_t level) {
+    return zrocks_ctx_new_obj(NULL, id, buf, size, level);
+}
+
+int zrocks_delete(uint64_t id) {
+    return zrocks_ctx_delete(NULL, id);
+}
+
+int zrocks_read_obj(uint64_t id, uint64_t offset, void *buf, size_t size) {
+    return zrocks_ctx_read_obj(NULL, id, offset, buf, size);
+}
+
+int zrocks_trim(struct zrocks_map *map, bool is_gc) {
+    return zrocks_ctx_trim(NULL, map, is_gc);
+}
+
+int zrocks_write(void *buf, size_t size, int level, struct zrocks_map maps[],
+                 uint16_t *pieces, bool is_gc) {
+    return zrocks_ctx_write(NULL, buf, size, level, maps, pieces, is_gc);
+}
+
+struct zrocks_wreq *zrocks_write_async(void *buf, size_t size, int level,
+                                       zrocks_write_cb *cb, void *ctx,
+                                       bool is_gc) {
+    return zrocks_ctx_write_async(NULL, buf, size, level, cb, ctx, is_gc);
+}
+
+int zrocks_read(uint32_t node_id, uint64_t offset, void *buf, uint64_t size,
+                bool is_gc) {
+    return zrocks_ctx_read(NULL, node_id, offset, buf, size, is_gc);
+}
+
+int zrocks_read_batch(struct zrocks_read_req *reqs, uint32_t count,
+                      bool is_gc) {
+    return zrocks_ctx_read_batch(NULL, reqs, count, is_gc);
+}
+
+uint64_t zrocks_get_metadata_slba(void) {
+    return zrocks_ctx_get_metadata_slba(NULL);
+}
+
+void zrocks_get_metadata_slbas(uint64_t *slbas, uint8_t *num) {
+    zrocks_ctx_get_metadata_slbas(NULL, slbas, num);
+}
+
+void zrocks_switch_zone(uint64_t slbas) {
+    zrocks_ctx_switch_zone(NULL, slbas);
+}
+
+int zrocks_read_metadata(uint64_t slba, unsigned char *buf, uint32_t length) {
+    return zrocks_ctx_read_metadata(NULL, slba, buf, length);
+}
+
+int zrocks_write_file_metadata(const unsigned char *buf, uint32_t length) {
+    return zrocks_ctx_write_file_metadata(NULL, buf, length);
+}
+
+int zrocks_node_finish(uint32_t node_id) {
+    return zrocks_ctx_node_finish(NULL, node_id);
+}
+
+int zrocks_node_set(int32_t node_id, int32_t level, int32_t num) {
+    return zrocks_ctx_node_set(NULL, node_id, level, num);
+}
+
+int zrocks_node_set_map(const struct zrocks_map *map, int32_t level) {
+    return zrocks_ctx_node_set_map(NULL, map, level);
+}
+
+void zrocks_clear_invalid_nodes(void) {
+    zrocks_ctx_clear_invalid_nodes(NULL);
+}
+
+uint32_t zrocks_gc_get_nodes_num(void) {
+    return zrocks_ctx_gc_get_nodes_num(NULL);
+}
+
+uint32_t zrocks_gc_get_free_nodes_num(void) {
+    return zrocks_ctx_gc_get_free_nodes_num(NULL);
+}
+
+int zrocks_gc_get_full_nodes(uint32_t invalid_percent[], uint32_t nnodes) {
+    return zrocks_ctx_gc_get_full_nodes(NULL, invalid_percent, nnodes);
+}